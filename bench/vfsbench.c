@@ -0,0 +1,363 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "../src/vfs.h"
+#include "../src/log.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define LOOKUP_SIBLINGS 16
+#define DELETE_FANOUT   10
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct sample {
+   uint64_t ops, ns, cycles;
+};
+
+struct rw_thread {
+   pthread_t thread;
+   vfsn_t *node;
+   int write_pct;
+   uint64_t ops;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static FILE *json;
+static int json_first = 1;
+static pthread_barrier_t rw_barrier;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void print_usage(void)
+{
+   puts("usage: vfsbench [-N max dir entries] [-L max depth] [-T max threads]\n"
+        "                [-D max delete nodes] [-n ops per thread] [-w write percent]\n"
+        "                [-s data size] [-b create|lookup|rw|delete] [-o json]");
+}
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc();
+#else
+   return now_ns();
+#endif
+}
+
+static void sample_start(struct sample *s)
+{
+   s->ns = now_ns();
+   s->cycles = cycles();
+}
+
+static void sample_stop(struct sample *s, uint64_t ops)
+{
+   s->cycles = cycles() - s->cycles;
+   s->ns = now_ns() - s->ns;
+   s->ops = ops;
+}
+
+static void report(char *bench, char *param, long value, int threads, struct sample *s, double speedup)
+{
+   double ns_op = s->ops ? (double)s->ns / s->ops : 0;
+   double cycles_op = s->ops ? (double)s->cycles / s->ops : 0;
+   double mops = s->ns ? s->ops * 1e3 / s->ns : 0;
+
+   printf("%-14s %-8s %8li %7i %12llu %12.1f %12.1f %10.3f", bench, param, value, threads,
+      (unsigned long long)s->ops, ns_op, cycles_op, mops);
+   if (speedup > 0)
+      printf(" %8.2fx", speedup);
+   printf("\n");
+
+   if (json) {
+      fprintf(json, "%s    { \"bench\": \"%s\", \"%s\": %li, \"threads\": %i, \"ops\": %llu, "
+         "\"ns_per_op\": %.2f, \"cycles_per_op\": %.2f, \"mops\": %.4f, \"speedup\": %.3f }",
+         json_first ? "" : ",\n", bench, param, value, threads, (unsigned long long)s->ops,
+         ns_op, cycles_op, mops, speedup);
+      json_first = 0;
+   }
+}
+
+static void print_header(char *title)
+{
+   printf("\n%s\n", title);
+   printf("%-14s %-8s %8s %7s %12s %12s %12s %10s %9s\n", "bench", "param", "value", "threads",
+      "ops", "ns/op", "cycles/op", "Mops/s", "scaling");
+}
+
+static void node_name(char *buf, size_t size, char *prefix, long index)
+{
+   snprintf(buf, size, "%s%li", prefix, index);
+}
+
+/*
+ * Resolves name within dir the same way the protocol layer walks paths.
+ */
+static vfsn_t* lookup_child(vfsn_t *dir, char *name)
+{
+   vfsn_t *node = vfs_open(dir);
+   return vfs_lookup(&node, name);
+}
+
+static void bench_create(long max)
+{
+   print_header("vfs_create into a directory of n entries (cost of the last 10%)");
+   for (long n = 10; n <= max; n *= 10) {
+      vfsn_t *root = vfs_create(NULL, "/", VFS_DIR);
+      char name[32];
+      long warm = n - n / 10;
+
+      for (long i = 0; i < warm; i++) {
+         node_name(name, sizeof(name), "f", i);
+         vfs_close(vfs_create(root, name, VFS_FILE));
+      }
+
+      struct sample s;
+      sample_start(&s);
+      for (long i = warm; i < n; i++) {
+         node_name(name, sizeof(name), "f", i);
+         vfs_close(vfs_create(root, name, VFS_FILE));
+      }
+      sample_stop(&s, n - warm);
+      report("create", "entries", n, 1, &s, 0);
+
+      vfs_delete(root);
+      vfs_close(root);
+   }
+}
+
+static void bench_lookup(int max_depth, long ops)
+{
+   print_header("path lookup at depth d with 16 siblings per level");
+   for (int depth = 1; depth <= max_depth; depth *= 2) {
+      vfsn_t *root = vfs_create(NULL, "/", VFS_DIR);
+      vfsn_t *dir = vfs_open(root);
+      char name[32];
+
+      // the searched entry is always the last sibling
+      for (int d = 0; d < depth; d++) {
+         vfsn_t *next = NULL;
+         for (int i = 0; i < LOOKUP_SIBLINGS; i++) {
+            node_name(name, sizeof(name), "d", i);
+            vfsn_t *node = vfs_create(dir, name, VFS_DIR);
+            if (i == LOOKUP_SIBLINGS - 1)
+               next = node;
+            else
+               vfs_close(node);
+         }
+         vfs_close(dir);
+         dir = next;
+      }
+      vfs_close(dir);
+
+      node_name(name, sizeof(name), "d", LOOKUP_SIBLINGS - 1);
+      struct sample s;
+      sample_start(&s);
+      for (long i = 0; i < ops; i++) {
+         vfsn_t *node = vfs_open(root);
+         for (int d = 0; node && d < depth; d++) {
+            vfsn_t *child = lookup_child(node, name);
+            vfs_close(node);
+            node = child;
+         }
+         vfs_close(node);
+      }
+      sample_stop(&s, ops);
+      report("lookup", "depth", depth, 1, &s, 0);
+
+      vfs_delete(root);
+      vfs_close(root);
+   }
+}
+
+static void* rw_worker(void *data)
+{
+   struct rw_thread *t = data;
+   uint64_t rng = (uintptr_t)t | 1;
+   size_t size = vfs_size(t->node);
+   char buf[size + 1];
+   memset(buf, 'x', size);
+
+   pthread_barrier_wait(&rw_barrier);
+   for (uint64_t i = 0; i < t->ops; i++) {
+      rng ^= rng << 13;
+      rng ^= rng >> 7;
+      rng ^= rng << 17;
+      if ((int)(rng % 100) < t->write_pct)
+         vfs_write(t->node, buf, size);
+      else
+         vfs_read(t->node, buf, size);
+   }
+   return NULL;
+}
+
+static void bench_rw(int max_threads, long ops, int write_pct, int size)
+{
+   char *modes[] = { "shared", "disjoint" };
+   char data[size + 1];
+   memset(data, 'x', size);
+
+   char title[128];
+   snprintf(title, sizeof(title), "concurrent vfs_read/vfs_write, %i%% writes of %i bytes", write_pct, size);
+   print_header(title);
+   for (int mode = 0; mode < 2; mode++) {
+      double base = 0;
+      for (int threads = 1; threads <= max_threads; threads *= 2) {
+         vfsn_t *root = vfs_create(NULL, "/", VFS_DIR);
+         struct rw_thread t[threads];
+         char name[32];
+
+         for (int i = 0; i < threads; i++) {
+            t[i].ops = ops;
+            t[i].write_pct = write_pct;
+            if (mode == 0 && i > 0) {
+               t[i].node = vfs_open(t[0].node);
+               continue;
+            }
+            node_name(name, sizeof(name), "f", i);
+            t[i].node = vfs_create(root, name, VFS_FILE);
+            vfs_write(t[i].node, data, size);
+         }
+
+         pthread_barrier_init(&rw_barrier, NULL, threads + 1);
+         for (int i = 0; i < threads; i++)
+            pthread_create(&t[i].thread, NULL, rw_worker, &t[i]);
+
+         // cycles per op are wall clock cycles divided by the ops of all threads
+         struct sample total;
+         pthread_barrier_wait(&rw_barrier);
+         sample_start(&total);
+         for (int i = 0; i < threads; i++)
+            pthread_join(t[i].thread, NULL);
+         sample_stop(&total, ops * threads);
+         for (int i = 0; i < threads; i++)
+            vfs_close(t[i].node);
+         pthread_barrier_destroy(&rw_barrier);
+
+         double mops = total.ops * 1e3 / total.ns;
+         if (threads == 1)
+            base = mops;
+         report("rw", modes[mode], threads, threads, &total, mops / base);
+
+         vfs_delete(root);
+         vfs_close(root);
+      }
+   }
+}
+
+static long build_tree(vfsn_t *dir, int depth, long budget)
+{
+   long created = 0;
+   char name[32];
+   for (int i = 0; i < DELETE_FANOUT && created < budget; i++) {
+      node_name(name, sizeof(name), depth > 0 ? "d" : "f", i);
+      vfsn_t *node = vfs_create(dir, name, depth > 0 ? VFS_DIR : VFS_FILE);
+      created++;
+      if (depth > 0)
+         created += build_tree(node, depth - 1, budget - created);
+      vfs_close(node);
+   }
+   return created;
+}
+
+static void bench_delete(long max)
+{
+   print_header("recursive vfs_delete of a subtree with n nodes (fanout 10)");
+   for (long n = 10, depth = 0; n <= max; n *= 10, depth++) {
+      vfsn_t *root = vfs_create(NULL, "/", VFS_DIR);
+      vfsn_t *sub = vfs_create(root, "sub", VFS_DIR);
+      long nodes = build_tree(sub, depth, n) + 1;
+
+      struct sample s;
+      sample_start(&s);
+      vfs_delete(sub);
+      vfs_close(sub);
+      sample_stop(&s, nodes);
+      report("delete", "nodes", nodes, 1, &s, 0);
+
+      vfs_delete(root);
+      vfs_close(root);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIN
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+   long max_entries = 10000, max_delete = 100000, ops = 200000;
+   int max_depth = 64, max_threads = 64, write_pct = 10, size = 64;
+   char *only = NULL, *output = NULL;
+
+   int c;
+   while((c = getopt(argc, argv, "N:L:T:D:n:w:s:b:o:")) != -1) {
+      switch(c) {
+         case 'N': max_entries = atol(optarg); break;
+         case 'L': max_depth = atoi(optarg); break;
+         case 'T': max_threads = atoi(optarg); break;
+         case 'D': max_delete = atol(optarg); break;
+         case 'n': ops = atol(optarg); break;
+         case 'w': write_pct = atoi(optarg); break;
+         case 's': size = atoi(optarg); break;
+         case 'b': only = optarg; break;
+         case 'o': output = optarg; break;
+         default: print_usage(); return 1;
+      }
+   }
+   if (ops < 1 || size < 1 || max_threads < 1) {
+      print_usage();
+      return 1;
+   }
+
+   log_set(STDERR_FILENO);
+   log_level_set(LOG_ERR);
+
+   if (output) {
+      json = strcmp(output, "-") == 0 ? stdout : fopen(output, "w");
+      if (!json) {
+         fprintf(stderr, "cannot open '%s'\n", output);
+         return 1;
+      }
+      fprintf(json, "{\n  \"results\": [\n");
+   }
+
+   if (!only || strcmp(only, "create") == 0)
+      bench_create(max_entries);
+   if (!only || strcmp(only, "lookup") == 0)
+      bench_lookup(max_depth, ops / 10);
+   if (!only || strcmp(only, "rw") == 0)
+      bench_rw(max_threads, ops, write_pct, size);
+   if (!only || strcmp(only, "delete") == 0)
+      bench_delete(max_delete);
+
+   if (json) {
+      fprintf(json, "\n  ]\n}\n");
+      if (json != stdout)
+         fclose(json);
+   }
+   return 0;
+}
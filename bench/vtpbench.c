@@ -0,0 +1,833 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define HIST_SUB_BITS 4
+#define HIST_SIZE     (64 << HIST_SUB_BITS)
+#define MAX_DEPTH     1024
+#define SETUP_BATCH   64
+#define LS_PAGE       100
+#define BATCH_FILES   32
+
+enum { OP_READ, OP_UPDATE, OP_CREATE, OP_LS, OP_LOOKUP, OP_MGET, OP_MPUT, OP_COUNT };
+
+static char *op_names[] = { "read", "update", "create", "ls", "lookup", "mget", "mput" };
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct hist {
+   uint64_t count, sum, max;
+   uint64_t buckets[HIST_SIZE];
+};
+
+struct workload {
+   char *name;
+   char *mix;
+   int files;
+   int size;
+   int levels;
+};
+
+struct conn {
+   int fd, id, welcomed;
+   char *rbuf;
+   size_t rlen, rsize;
+   char *wbuf;
+   size_t woff, wlen, wsize;
+   int head, tail, outstanding;
+   struct { int op; uint64_t start; } queue[MAX_DEPTH];
+   uint64_t seq;
+};
+
+struct worker {
+   pthread_t thread;
+   struct conn *conns;
+   int nconns;
+   uint64_t rng;
+   uint64_t sent;
+   uint64_t ops, errors, bytes_out, bytes_in;
+   struct hist total, per_op[OP_COUNT];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static struct workload workloads[] = {
+   { "read",    "read:90,update:10", 1000,    128,  1 },
+   { "create",  "create:100",        0,       128,  1 },
+   { "deep",    "lookup:50,read:50", 1,       64,   32 },
+   { "stream",  "read:50,update:50", 16,      1<<20, 1 },
+   { "hugedir", "lookup:90,ls:10",   100000,  16,   1 },
+   { "batch",   "mget:90,mput:10",   10000,   64,   1 },
+   { }
+};
+
+static char *host = "127.0.0.1";
+static char *unix_path;
+static int port = 8000;
+static int nconns = 8, nthreads = 1, depth = 1, keep = 0;
+static double rate = 0, duration = 10, warmup = 1;
+static int mix[OP_COUNT];
+static int mix_total;
+static struct workload wl;
+static char base[64];
+static char deep_path[4096];
+static char *payload;
+static volatile int running = 1;
+static uint64_t t_begin, t_measure, t_end;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void print_usage(void)
+{
+   puts("usage: vtpbench [-a host] [-p port] [-u unix socket] [-c connections] [-t threads]\n"
+        "                [-d pipeline depth] [-w read|create|deep|stream|hugedir] [-m op:weight,...]\n"
+        "                [-r rate] [-D seconds] [-W warmup] [-n files] [-s size] [-L levels]\n"
+        "                [-o json] [-b baseline.json] [-x tolerance%] [-k]\n"
+        "ops: read update create ls lookup mget mput");
+}
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t *state)
+{
+   uint64_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   return *state = x;
+}
+
+static void hist_add(struct hist *h, uint64_t value)
+{
+   int index = value;
+   if (value >= (1 << HIST_SUB_BITS)) {
+      int msb = 63 - __builtin_clzll(value);
+      int sub = (value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+      index = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+   }
+   h->buckets[index]++;
+   h->count++;
+   h->sum += value;
+   if (value > h->max)
+      h->max = value;
+}
+
+static uint64_t hist_value(int index)
+{
+   if (index < (1 << HIST_SUB_BITS))
+      return index;
+   int msb = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+   uint64_t sub = index & ((1 << HIST_SUB_BITS) - 1);
+   uint64_t low = (1ull << msb) | (sub << (msb - HIST_SUB_BITS));
+   return low + (1ull << (msb - HIST_SUB_BITS)) / 2;
+}
+
+static void hist_merge(struct hist *to, struct hist *from)
+{
+   for (int i = 0; i < HIST_SIZE; i++)
+      to->buckets[i] += from->buckets[i];
+   to->count += from->count;
+   to->sum += from->sum;
+   if (from->max > to->max)
+      to->max = from->max;
+}
+
+static double hist_percentile(struct hist *h, double p)
+{
+   if (!h->count)
+      return 0;
+   uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+   if (rank < 1)
+      rank = 1;
+   uint64_t seen = 0;
+   for (int i = 0; i < HIST_SIZE; i++) {
+      seen += h->buckets[i];
+      if (seen >= rank) {
+         uint64_t value = hist_value(i);
+         return (value > h->max ? h->max : value) / 1000.0;
+      }
+   }
+   return h->max / 1000.0;
+}
+
+static int parse_mix(char *spec)
+{
+   memset(mix, 0, sizeof(mix));
+   mix_total = 0;
+   char *copy = strdup(spec), *saveptr;
+   for (char *tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+      char *colon = strchr(tok, ':');
+      int weight = colon ? atoi(colon + 1) : 1;
+      if (colon)
+         *colon = '\0';
+      int op;
+      for (op = 0; op < OP_COUNT; op++) {
+         if (strcmp(op_names[op], tok) == 0)
+            break;
+      }
+      if (op == OP_COUNT || weight < 0) {
+         fprintf(stderr, "unknown op '%s'\n", tok);
+         free(copy);
+         return 1;
+      }
+      mix[op] += weight;
+      mix_total += weight;
+   }
+   free(copy);
+   return mix_total <= 0;
+}
+
+static int bench_connect(void)
+{
+   if (unix_path) {
+      struct sockaddr_un addr = { .sun_family = AF_UNIX };
+      strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+         close(fd);
+         fd = -1;
+      }
+      return fd;
+   }
+
+   struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+   char service[16];
+   snprintf(service, sizeof(service), "%i", port);
+   if (getaddrinfo(host, service, &hints, &res) != 0)
+      return -1;
+
+   int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+   if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+   }
+   freeaddrinfo(res);
+
+   int one = 1;
+   if (fd >= 0)
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   return fd;
+}
+
+static void buf_append(char **buf, size_t *len, size_t *size, const void *data, size_t n)
+{
+   if (*len + n > *size) {
+      size_t newsize = *size ? *size : 4096;
+      while (newsize < *len + n)
+         newsize *= 2;
+      *buf = realloc(*buf, newsize);
+      *size = newsize;
+   }
+   memcpy(*buf + *len, data, n);
+   *len += n;
+}
+
+/*
+ * Returns the number of bytes of the single response item in buf or 0 if it
+ * is incomplete. File contents are skipped by their announced size.
+ */
+static size_t parse_item(char *buf, size_t len, int *error)
+{
+   size_t pos = 0;
+   char *nl = memchr(buf, '\n', len);
+   if (!nl)
+      return 0;
+
+   if (len > 12 && strncmp(buf, "FILECONTENT ", 12) == 0) {
+      // header ends with size and version
+      char *space = nl;
+      for (int fields = 0; fields < 2; fields++) {
+         space--;
+         while (space > buf && *space != ' ')
+            space--;
+      }
+      pos = (nl - buf) + 1 + strtoul(space + 1, NULL, 10) + 1;
+   } else if (len > 4 && strncmp(buf, "ACK ", 4) == 0) {
+      long lines = strtol(buf + 4, NULL, 10);
+      pos = (nl - buf) + 1;
+      while (lines-- > 0) {
+         nl = memchr(buf + pos, '\n', len - pos);
+         if (!nl)
+            return 0;
+         pos = (nl - buf) + 1;
+      }
+   } else {
+      pos = (nl - buf) + 1;
+      *error |= strncmp(buf, "NOSUCH", 6) == 0 || strncmp(buf, "INVALIDCMD", 10) == 0
+         || strncmp(buf, "FILEEXISTS", 10) == 0 || strncmp(buf, "NOMEMORY", 8) == 0;
+   }
+   return pos <= len ? pos : 0;
+}
+
+/*
+ * Returns the number of bytes of the first complete response in buf or 0 if
+ * the response is incomplete. Responses are terminated by the prompt, batch
+ * responses consist of the announced number of items.
+ */
+static size_t parse_response(char *buf, size_t len, int *error)
+{
+   size_t pos = 0, item;
+   char *nl = memchr(buf, '\n', len);
+   if (!nl)
+      return 0;
+
+   *error = 0;
+   if (len > 6 && strncmp(buf, "BATCH ", 6) == 0) {
+      long items = strtol(buf + 6, NULL, 10);
+      pos = (nl - buf) + 1;
+      while (items-- > 0) {
+         if (!(item = parse_item(buf + pos, len - pos, error)))
+            return 0;
+         pos += item;
+      }
+   } else if (!(pos = parse_item(buf, len, error))) {
+      return 0;
+   }
+
+   if (pos + 2 > len)
+      return 0;
+   return pos + 2;
+}
+
+static void conn_command(struct conn *c, int op, uint64_t r)
+{
+   char cmd[4096 + 64];
+   int len = 0, size = wl.size;
+   int file = wl.files > 0 ? r % wl.files : 0;
+
+   switch (op) {
+      case OP_READ:
+         if (wl.levels > 1)
+            len = snprintf(cmd, sizeof(cmd), "cat %s/f\n", deep_path);
+         else
+            len = snprintf(cmd, sizeof(cmd), "cat %s/f%i\n", base, file);
+         break;
+      case OP_UPDATE:
+         if (wl.levels > 1)
+            len = snprintf(cmd, sizeof(cmd), "update %s/f %i\n", deep_path, size);
+         else
+            len = snprintf(cmd, sizeof(cmd), "update %s/f%i %i\n", base, file, size);
+         break;
+      case OP_CREATE:
+         len = snprintf(cmd, sizeof(cmd), "create %s/c%i-%llu %i\n", base, c->id,
+            (unsigned long long)c->seq++, size);
+         break;
+      case OP_LS:
+         // one page behind a random entry
+         if (wl.files > 0)
+            len = snprintf(cmd, sizeof(cmd), "ls %s --limit %i --after f%i\n", base, LS_PAGE, file);
+         else
+            len = snprintf(cmd, sizeof(cmd), "ls %s --limit %i\n", base, LS_PAGE);
+         break;
+      case OP_LOOKUP:
+         if (wl.levels > 1)
+            len = snprintf(cmd, sizeof(cmd), "type %s\n", deep_path);
+         else
+            len = snprintf(cmd, sizeof(cmd), "type %s/f%i\n", base, file);
+         break;
+      case OP_MGET:
+         len = snprintf(cmd, sizeof(cmd), "mget");
+         for (int i = 0; i < BATCH_FILES; i++)
+            len += snprintf(cmd + len, sizeof(cmd) - len, " %s/f%i", base, (file + i) % wl.files);
+         len += snprintf(cmd + len, sizeof(cmd) - len, "\n");
+         break;
+      case OP_MPUT:
+         len = snprintf(cmd, sizeof(cmd), "mput %i", BATCH_FILES * size);
+         for (int i = 0; i < BATCH_FILES; i++)
+            len += snprintf(cmd + len, sizeof(cmd) - len, " %s/f%i %i", base, (file + i) % wl.files, size);
+         len += snprintf(cmd + len, sizeof(cmd) - len, "\n");
+         break;
+      default:
+         return;
+   }
+   buf_append(&c->wbuf, &c->wlen, &c->wsize, cmd, len);
+   if (op == OP_UPDATE || op == OP_CREATE)
+      buf_append(&c->wbuf, &c->wlen, &c->wsize, payload, size);
+   for (int i = 0; op == OP_MPUT && i < BATCH_FILES; i++)
+      buf_append(&c->wbuf, &c->wlen, &c->wsize, payload, size);
+}
+
+static int pick_op(uint64_t *rng)
+{
+   int r = rnd(rng) % mix_total;
+   for (int op = 0; op < OP_COUNT; op++) {
+      if (r < mix[op])
+         return op;
+      r -= mix[op];
+   }
+   return 0;
+}
+
+static void conn_submit(struct worker *w, struct conn *c, uint64_t start)
+{
+   int op = pick_op(&w->rng);
+   conn_command(c, op, rnd(&w->rng));
+   c->queue[c->tail].op = op;
+   c->queue[c->tail].start = start;
+   c->tail = (c->tail + 1) % MAX_DEPTH;
+   c->outstanding++;
+   w->sent++;
+}
+
+static int conn_flush(struct worker *w, struct conn *c)
+{
+   while (c->woff < c->wlen) {
+      ssize_t len = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL|MSG_DONTWAIT);
+      if (len < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         return -1;
+      }
+      c->woff += len;
+      w->bytes_out += len;
+   }
+   c->woff = c->wlen = 0;
+   return 0;
+}
+
+static int conn_receive(struct worker *w, struct conn *c)
+{
+   if (c->rsize - c->rlen < 65536) {
+      c->rsize = c->rsize ? c->rsize * 2 : 65536;
+      c->rbuf = realloc(c->rbuf, c->rsize);
+   }
+   ssize_t len = recv(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen, MSG_DONTWAIT);
+   if (len == 0)
+      return -1;
+   if (len < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+   c->rlen += len;
+   w->bytes_in += len;
+
+   // complete responses
+   size_t pos = 0, consumed;
+   int error;
+   uint64_t now = now_ns();
+   while ((consumed = parse_response(c->rbuf + pos, c->rlen - pos, &error)) > 0) {
+      pos += consumed;
+      if (!c->welcomed) {
+         c->welcomed = 1;
+         continue;
+      }
+      if (!c->outstanding)
+         break;
+
+      int op = c->queue[c->head].op;
+      uint64_t start = c->queue[c->head].start;
+      c->head = (c->head + 1) % MAX_DEPTH;
+      c->outstanding--;
+
+      if (start >= t_measure && now <= t_end) {
+         w->ops++;
+         w->errors += error;
+         hist_add(&w->total, now - start);
+         hist_add(&w->per_op[op], now - start);
+      }
+   }
+   memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+   c->rlen -= pos;
+   return 0;
+}
+
+static void* worker_run(void *data)
+{
+   struct worker *w = data;
+   struct pollfd pfds[w->nconns];
+   double interval = rate > 0 ? 1e9 * nthreads / rate : 0;
+   uint64_t next = t_begin;
+
+   while (running) {
+      uint64_t now = now_ns();
+      if (now >= t_end)
+         break;
+
+      // issue new requests
+      for (int i = 0; i < w->nconns; i++) {
+         struct conn *c = &w->conns[i];
+         while (c->welcomed && c->outstanding < depth) {
+            if (interval > 0) {
+               // open loop: latency counts from the intended send time
+               if (next > now)
+                  break;
+               conn_submit(w, c, next);
+               next = t_begin + (uint64_t)(interval * w->sent);
+            } else {
+               conn_submit(w, c, now);
+            }
+         }
+         if (conn_flush(w, c))
+            running = 0;
+         pfds[i].fd = c->fd;
+         pfds[i].events = POLLIN | (c->wlen ? POLLOUT : 0);
+      }
+
+      // wait for responses or the next open loop request
+      int timeout = 100;
+      if (interval > 0) {
+         now = now_ns();
+         timeout = next > now ? (next - now) / 1000000 : 0;
+         if (timeout > 100)
+            timeout = 100;
+      }
+      if (poll(pfds, w->nconns, timeout) < 0 && errno != EINTR)
+         break;
+
+      for (int i = 0; i < w->nconns; i++) {
+         if (pfds[i].revents & (POLLIN|POLLERR|POLLHUP)) {
+            if (conn_receive(w, &w->conns[i])) {
+               fprintf(stderr, "connection %i closed by server\n", w->conns[i].id);
+               running = 0;
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Executes commands synchronously in batches, used to prepare the data set.
+ */
+static int setup_exec(int fd, char *cmds, size_t len, int count)
+{
+   if (send(fd, cmds, len, MSG_NOSIGNAL) != len)
+      return 1;
+
+   char *buf = NULL;
+   size_t blen = 0, bsize = 0;
+   int error;
+   while (count > 0) {
+      char tmp[65536];
+      ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+      if (n <= 0) {
+         free(buf);
+         return 1;
+      }
+      buf_append(&buf, &blen, &bsize, tmp, n);
+      size_t consumed;
+      while (count > 0 && (consumed = parse_response(buf, blen, &error)) > 0) {
+         memmove(buf, buf + consumed, blen - consumed);
+         blen -= consumed;
+         count--;
+      }
+   }
+   free(buf);
+   return 0;
+}
+
+static int setup(void)
+{
+   int fd = bench_connect();
+   if (fd < 0)
+      return 1;
+
+   char *cmds = NULL;
+   size_t len = 0, size = 0;
+   char line[4096 + 64];
+   int n, count = 1;
+
+   // welcome message
+   if (setup_exec(fd, "", 0, 1))
+      return 1;
+
+   n = snprintf(line, sizeof(line), "mkdir %s\n", base);
+   buf_append(&cmds, &len, &size, line, n);
+   if (wl.levels > 1) {
+      strcpy(deep_path, base);
+      for (int i = 1; i < wl.levels; i++) {
+         n = strlen(deep_path);
+         snprintf(deep_path + n, sizeof(deep_path) - n, "/d%i", i);
+         n = snprintf(line, sizeof(line), "mkdir %s\n", deep_path);
+         buf_append(&cmds, &len, &size, line, n);
+         count++;
+      }
+      n = snprintf(line, sizeof(line), "create %s/f %i\n", deep_path, wl.size);
+      buf_append(&cmds, &len, &size, line, n);
+      buf_append(&cmds, &len, &size, payload, wl.size);
+      count++;
+   }
+   if (setup_exec(fd, cmds, len, count))
+      return 1;
+
+   // files are created in pipelined batches
+   for (int i = 0; wl.levels <= 1 && i < wl.files; ) {
+      len = count = 0;
+      for (; i < wl.files && count < SETUP_BATCH; i++, count++) {
+         n = snprintf(line, sizeof(line), "create %s/f%i %i\n", base, i, wl.size);
+         buf_append(&cmds, &len, &size, line, n);
+         buf_append(&cmds, &len, &size, payload, wl.size);
+      }
+      if (setup_exec(fd, cmds, len, count))
+         return 1;
+   }
+
+   free(cmds);
+   close(fd);
+   return 0;
+}
+
+static void cleanup(void)
+{
+   int fd = bench_connect();
+   if (fd < 0)
+      return;
+   char line[128];
+   int n = snprintf(line, sizeof(line), "rm %s\n", base);
+   setup_exec(fd, "", 0, 1);
+   setup_exec(fd, line, n, 1);
+   close(fd);
+}
+
+static void print_latency(FILE *f, struct hist *h, char *indent)
+{
+   fprintf(f, "%s\"mean\": %.2f,\n", indent, h->count ? h->sum / 1000.0 / h->count : 0.0);
+   fprintf(f, "%s\"p50\": %.2f,\n", indent, hist_percentile(h, 50));
+   fprintf(f, "%s\"p90\": %.2f,\n", indent, hist_percentile(h, 90));
+   fprintf(f, "%s\"p99\": %.2f,\n", indent, hist_percentile(h, 99));
+   fprintf(f, "%s\"p999\": %.2f,\n", indent, hist_percentile(h, 99.9));
+   fprintf(f, "%s\"max\": %.2f\n", indent, h->max / 1000.0);
+}
+
+static void print_json(FILE *f, struct worker *sum, double elapsed)
+{
+   fprintf(f, "{\n");
+   fprintf(f, "  \"workload\": \"%s\",\n", wl.name);
+   fprintf(f, "  \"mode\": \"%s\",\n", rate > 0 ? "open" : "closed");
+   fprintf(f, "  \"connections\": %i,\n", nconns);
+   fprintf(f, "  \"threads\": %i,\n", nthreads);
+   fprintf(f, "  \"depth\": %i,\n", depth);
+   fprintf(f, "  \"rate\": %.0f,\n", rate);
+   fprintf(f, "  \"size\": %i,\n", wl.size);
+   fprintf(f, "  \"files\": %i,\n", wl.files);
+   fprintf(f, "  \"duration\": %.3f,\n", elapsed);
+   fprintf(f, "  \"ops\": %llu,\n", (unsigned long long)sum->ops);
+   fprintf(f, "  \"errors\": %llu,\n", (unsigned long long)sum->errors);
+   fprintf(f, "  \"throughput\": %.2f,\n", sum->ops / elapsed);
+   fprintf(f, "  \"bytes_sent\": %llu,\n", (unsigned long long)sum->bytes_out);
+   fprintf(f, "  \"bytes_received\": %llu,\n", (unsigned long long)sum->bytes_in);
+   fprintf(f, "  \"latency_us\": {\n");
+   print_latency(f, &sum->total, "    ");
+   fprintf(f, "  },\n");
+   fprintf(f, "  \"per_op\": {\n");
+   int first = 1;
+   for (int op = 0; op < OP_COUNT; op++) {
+      if (!sum->per_op[op].count)
+         continue;
+      fprintf(f, "%s    \"%s\": {\n", first ? "" : ",\n", op_names[op]);
+      fprintf(f, "      \"ops\": %llu,\n", (unsigned long long)sum->per_op[op].count);
+      print_latency(f, &sum->per_op[op], "      ");
+      fprintf(f, "    }");
+      first = 0;
+   }
+   fprintf(f, "\n  }\n}\n");
+}
+
+static void print_summary(struct worker *sum, double elapsed)
+{
+   printf("workload %s, %s loop, %i connections, %i threads, depth %i\n", wl.name,
+      rate > 0 ? "open" : "closed", nconns, nthreads, depth);
+   printf("%llu ops in %.2fs: %.0f ops/s, %llu errors, %.2f MB/s out, %.2f MB/s in\n",
+      (unsigned long long)sum->ops, elapsed, sum->ops / elapsed, (unsigned long long)sum->errors,
+      sum->bytes_out / elapsed / 1e6, sum->bytes_in / elapsed / 1e6);
+   printf("%-8s %10s %10s %10s %10s %10s %10s\n", "op", "ops", "p50us", "p90us", "p99us", "p999us", "maxus");
+   for (int op = -1; op < OP_COUNT; op++) {
+      struct hist *h = op < 0 ? &sum->total : &sum->per_op[op];
+      if (!h->count)
+         continue;
+      printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op < 0 ? "all" : op_names[op],
+         (unsigned long long)h->count, hist_percentile(h, 50), hist_percentile(h, 90),
+         hist_percentile(h, 99), hist_percentile(h, 99.9), h->max / 1000.0);
+   }
+}
+
+static double json_number(char *json, char *key, char *after)
+{
+   char pattern[64];
+   char *start = after ? strstr(json, after) : json;
+   snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+   char *found = start ? strstr(start, pattern) : NULL;
+   return found ? strtod(found + strlen(pattern), NULL) : -1;
+}
+
+/*
+ * Compares throughput and p99 latency against a previous json result. Returns
+ * 1 if one of them regressed by more than tolerance percent.
+ */
+static int compare_baseline(char *file, struct worker *sum, double elapsed, double tolerance)
+{
+   FILE *f = fopen(file, "r");
+   if (!f) {
+      fprintf(stderr, "cannot open baseline '%s'\n", file);
+      return 1;
+   }
+   char json[16384];
+   size_t n = fread(json, 1, sizeof(json) - 1, f);
+   json[n] = '\0';
+   fclose(f);
+
+   double old_tp = json_number(json, "throughput", NULL);
+   double old_p99 = json_number(json, "p99", "\"latency_us\"");
+   double tp = sum->ops / elapsed, p99 = hist_percentile(&sum->total, 99);
+   int regressed = 0;
+
+   printf("baseline: %.0f ops/s -> %.0f ops/s, p99 %.1fus -> %.1fus\n", old_tp, tp, old_p99, p99);
+   if (old_tp > 0 && tp < old_tp * (1 - tolerance / 100)) {
+      printf("REGRESSION throughput dropped by %.1f%%\n", 100 * (1 - tp / old_tp));
+      regressed = 1;
+   }
+   if (old_p99 > 0 && p99 > old_p99 * (1 + tolerance / 100)) {
+      printf("REGRESSION p99 latency grew by %.1f%%\n", 100 * (p99 / old_p99 - 1));
+      regressed = 1;
+   }
+   return regressed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIN
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+   char *workload = "read", *mixspec = NULL, *json = NULL, *baseline = NULL;
+   int files = -1, size = -1, levels = -1;
+   double tolerance = 10;
+
+   int c;
+   while((c = getopt(argc, argv, "a:p:u:c:t:d:w:m:r:D:W:n:s:L:o:b:x:k")) != -1) {
+      switch(c) {
+         case 'a': host = optarg; break;
+         case 'p': port = atoi(optarg); break;
+         case 'u': unix_path = optarg; break;
+         case 'c': nconns = atoi(optarg); break;
+         case 't': nthreads = atoi(optarg); break;
+         case 'd': depth = atoi(optarg); break;
+         case 'w': workload = optarg; break;
+         case 'm': mixspec = optarg; break;
+         case 'r': rate = atof(optarg); break;
+         case 'D': duration = atof(optarg); break;
+         case 'W': warmup = atof(optarg); break;
+         case 'n': files = atoi(optarg); break;
+         case 's': size = atoi(optarg); break;
+         case 'L': levels = atoi(optarg); break;
+         case 'o': json = optarg; break;
+         case 'b': baseline = optarg; break;
+         case 'x': tolerance = atof(optarg); break;
+         case 'k': keep = 1; break;
+         default: print_usage(); return 1;
+      }
+   }
+
+   // select workload
+   struct workload *it;
+   for (it = workloads; it->name && strcmp(it->name, workload) != 0; it++);
+   if (!it->name || nconns < 1 || nthreads < 1 || depth < 1 || depth > MAX_DEPTH) {
+      print_usage();
+      return 1;
+   }
+   wl = *it;
+   if (files >= 0) wl.files = files;
+   if (size >= 0) wl.size = size;
+   if (levels > 0) wl.levels = levels;
+   if (nthreads > nconns) nthreads = nconns;
+   if (parse_mix(mixspec ? mixspec : wl.mix) || (wl.files == 0 && (mix[OP_READ] || mix[OP_UPDATE] || mix[OP_LOOKUP]
+         || mix[OP_MGET] || mix[OP_MPUT]))) {
+      fprintf(stderr, "invalid op mix for workload %s\n", wl.name);
+      return 1;
+   }
+
+   payload = malloc(wl.size + 1);
+   memset(payload, 'x', wl.size);
+   snprintf(base, sizeof(base), "/vtpbench-%i", getpid());
+
+   // prepare data set
+   if (setup()) {
+      fprintf(stderr, "cannot prepare data set on %s:%i\n", host, port);
+      return 1;
+   }
+
+   // open connections
+   struct worker workers[nthreads];
+   struct conn *conns = calloc(nconns, sizeof(struct conn));
+   memset(workers, 0, sizeof(workers));
+   for (int i = 0; i < nconns; i++) {
+      conns[i].id = i;
+      conns[i].fd = bench_connect();
+      if (conns[i].fd < 0) {
+         fprintf(stderr, "cannot connect to %s:%i\n", host, port);
+         return 1;
+      }
+   }
+   for (int i = 0, first = 0; i < nthreads; i++) {
+      int count = nconns / nthreads + (i < nconns % nthreads);
+      workers[i].conns = &conns[first];
+      workers[i].nconns = count;
+      workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+      first += count;
+   }
+
+   // run
+   t_begin = now_ns();
+   t_measure = t_begin + (uint64_t)(warmup * 1e9);
+   t_end = t_measure + (uint64_t)(duration * 1e9);
+   for (int i = 0; i < nthreads; i++)
+      pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+   for (int i = 0; i < nthreads; i++)
+      pthread_join(workers[i].thread, NULL);
+   double elapsed = (now_ns() < t_end ? now_ns() - t_measure : t_end - t_measure) / 1e9;
+   if (elapsed <= 0)
+      elapsed = 1e-9;
+
+   // aggregate
+   struct worker *sum = calloc(1, sizeof(struct worker));
+   for (int i = 0; i < nthreads; i++) {
+      sum->ops += workers[i].ops;
+      sum->errors += workers[i].errors;
+      sum->bytes_out += workers[i].bytes_out;
+      sum->bytes_in += workers[i].bytes_in;
+      hist_merge(&sum->total, &workers[i].total);
+      for (int op = 0; op < OP_COUNT; op++)
+         hist_merge(&sum->per_op[op], &workers[i].per_op[op]);
+   }
+   for (int i = 0; i < nconns; i++)
+      close(conns[i].fd);
+
+   // report
+   print_summary(sum, elapsed);
+   if (json) {
+      FILE *f = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+      if (f) {
+         print_json(f, sum, elapsed);
+         if (f != stdout)
+            fclose(f);
+      }
+   }
+   int retval = baseline ? compare_baseline(baseline, sum, elapsed, tolerance) : 0;
+
+   if (!keep)
+      cleanup();
+   return retval ? 2 : 0;
+}
@@ -0,0 +1,320 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "libvtp.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define HIST_SUB_BITS 4
+#define HIST_SIZE     (64 << HIST_SUB_BITS)
+#define MAX_DEPTH     1024
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct hist {
+   uint64_t count, sum, max;
+   uint64_t buckets[HIST_SIZE];
+};
+
+struct worker;
+
+// connection of a worker, replies arrive in order of the start times
+struct slot {
+   vtpc_conn_t *conn;
+   struct worker *w;
+   uint64_t starts[MAX_DEPTH];
+   int head, tail;
+};
+
+struct worker {
+   pthread_t thread;
+   struct slot *slots;
+   int nslots;
+   uint64_t rng;
+   uint64_t ops, errors, bytes;
+   struct hist hist;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static char *target = "127.0.0.1:8000";
+static int nconns = 8, nthreads = 2, depth = 16, files = 1000, size = 128, reads = 90, keep = 0;
+static double duration = 5;
+static char base[64];
+static char *payload;
+static vtpc_pool_t *pool;
+static volatile int running = 1;
+static uint64_t t_end;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void print_usage(void)
+{
+   puts("usage: vtpload [-a host:port|unix socket] [-c connections] [-t threads] [-d pipeline depth]\n"
+        "               [-n files] [-s size] [-r read percent] [-D seconds] [-k]");
+}
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t *state)
+{
+   uint64_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   return *state = x;
+}
+
+static void hist_add(struct hist *h, uint64_t value)
+{
+   int index = value;
+   if (value >= (1 << HIST_SUB_BITS)) {
+      int msb = 63 - __builtin_clzll(value);
+      int sub = (value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+      index = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+   }
+   h->buckets[index]++;
+   h->count++;
+   h->sum += value;
+   if (value > h->max)
+      h->max = value;
+}
+
+static double hist_percentile(struct hist *h, double p)
+{
+   uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5), seen = 0;
+   for (int i = 0; i < HIST_SIZE && h->count; i++) {
+      seen += h->buckets[i];
+      if (seen >= rank && seen) {
+         if (i < (1 << HIST_SUB_BITS))
+            return i / 1000.0;
+         int msb = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+         uint64_t value = (1ull << msb) | ((uint64_t)(i & ((1 << HIST_SUB_BITS) - 1)) << (msb - HIST_SUB_BITS));
+         return (value > h->max ? h->max : value) / 1000.0;
+      }
+   }
+   return h->max / 1000.0;
+}
+
+static void slot_done(void *ctx, vtpc_reply_t *reply);
+
+static int slot_submit(struct slot *s)
+{
+   char cmd[128];
+   int file = rnd(&s->w->rng) % files;
+   int read = (int)(rnd(&s->w->rng) % 100) < reads;
+   if (read)
+      snprintf(cmd, sizeof(cmd), "cat %s/f%i", base, file);
+   else
+      snprintf(cmd, sizeof(cmd), "update %s/f%i %i", base, file, size);
+
+   s->starts[s->tail] = now_ns();
+   s->tail = (s->tail + 1) % MAX_DEPTH;
+   return vtpc_submit(s->conn, cmd, read ? NULL : payload, read ? 0 : size, slot_done, s);
+}
+
+static void slot_done(void *ctx, vtpc_reply_t *reply)
+{
+   struct slot *s = ctx;
+   struct worker *w = s->w;
+   uint64_t now = now_ns();
+   hist_add(&w->hist, now - s->starts[s->head]);
+   s->head = (s->head + 1) % MAX_DEPTH;
+
+   // reads must return the whole file
+   w->ops++;
+   w->bytes += reply->len;
+   if (reply->status || (reply->content && reply->size != (size_t)size))
+      w->errors++;
+
+   // closed loop, every reply issues the next command
+   if (running && reply->status != VTPC_CLOSED && now < t_end)
+      slot_submit(s);
+}
+
+static void* worker_run(void *data)
+{
+   struct worker *w = data;
+   struct pollfd pfds[w->nslots];
+
+   for (int i = 0; i < w->nslots; i++) {
+      for (int j = 0; j < depth; j++)
+         slot_submit(&w->slots[i]);
+   }
+
+   int active = w->nslots;
+   while (active) {
+      for (int i = 0; i < w->nslots; i++) {
+         pfds[i].fd = vtpc_pending(w->slots[i].conn) ? vtpc_fd(w->slots[i].conn) : -1;
+         pfds[i].events = vtpc_want(w->slots[i].conn);
+      }
+      if (poll(pfds, w->nslots, 100) < 0 && errno != EINTR)
+         break;
+
+      active = 0;
+      for (int i = 0; i < w->nslots; i++) {
+         if (pfds[i].fd < 0)
+            continue;
+         if (vtpc_process(w->slots[i].conn, pfds[i].revents)) {
+            fprintf(stderr, "connection closed by server\n");
+            running = 0;
+         }
+         active += vtpc_pending(w->slots[i].conn) > 0;
+      }
+   }
+   return NULL;
+}
+
+static void setup_done(void *ctx, vtpc_reply_t *reply)
+{
+   int *errors = ctx;
+   *errors += reply->status != VTPC_OK;
+}
+
+/*
+ * Creates the files in one pipelined burst.
+ */
+static int setup(void)
+{
+   vtpc_conn_t *c = vtpc_pool_get(pool);
+   if (!c)
+      return 1;
+
+   char cmd[128];
+   int errors = 0;
+   snprintf(cmd, sizeof(cmd), "mkdir %s", base);
+   vtpc_submit(c, cmd, NULL, 0, setup_done, &errors);
+   for (int i = 0; i < files; i++) {
+      snprintf(cmd, sizeof(cmd), "create %s/f%i %i", base, i, size);
+      vtpc_submit(c, cmd, payload, size, setup_done, &errors);
+   }
+   int failed = vtpc_wait(c) || errors;
+   vtpc_pool_put(pool, c);
+   return failed;
+}
+
+static void cleanup(void)
+{
+   vtpc_conn_t *c = vtpc_pool_get(pool);
+   if (!c)
+      return;
+
+   char cmd[128];
+   snprintf(cmd, sizeof(cmd), "rm %s", base);
+   vtpc_reply_free(vtpc_exec(c, cmd, NULL, 0));
+   vtpc_pool_put(pool, c);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIN
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+   int c;
+   while((c = getopt(argc, argv, "a:c:t:d:n:s:r:D:k")) != -1) {
+      switch(c) {
+         case 'a': target = optarg; break;
+         case 'c': nconns = atoi(optarg); break;
+         case 't': nthreads = atoi(optarg); break;
+         case 'd': depth = atoi(optarg); break;
+         case 'n': files = atoi(optarg); break;
+         case 's': size = atoi(optarg); break;
+         case 'r': reads = atoi(optarg); break;
+         case 'D': duration = atof(optarg); break;
+         case 'k': keep = 1; break;
+         default: print_usage(); return 1;
+      }
+   }
+   if (nconns < 1 || nthreads < 1 || depth < 1 || depth >= MAX_DEPTH || files < 1 || size < 0) {
+      print_usage();
+      return 1;
+   }
+   if (nthreads > nconns)
+      nthreads = nconns;
+
+   payload = malloc(size + 1);
+   memset(payload, 'x', size);
+   snprintf(base, sizeof(base), "/vtpload-%i", getpid());
+
+   // prepare data set
+   pool = vtpc_pool_new(target, nconns);
+   if (!pool || setup()) {
+      fprintf(stderr, "cannot prepare data set on %s\n", target);
+      return 1;
+   }
+
+   // every worker takes its connections from the pool
+   struct worker workers[nthreads];
+   struct slot *slots = calloc(nconns, sizeof(struct slot));
+   memset(workers, 0, sizeof(workers));
+   for (int i = 0, first = 0; i < nthreads; i++) {
+      workers[i].slots = &slots[first];
+      workers[i].nslots = nconns / nthreads + (i < nconns % nthreads);
+      workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+      for (int j = 0; j < workers[i].nslots; j++) {
+         slots[first + j].w = &workers[i];
+         if (!(slots[first + j].conn = vtpc_pool_get(pool))) {
+            fprintf(stderr, "cannot connect to %s\n", target);
+            return 1;
+         }
+      }
+      first += workers[i].nslots;
+   }
+
+   // run
+   uint64_t t_begin = now_ns();
+   t_end = t_begin + (uint64_t)(duration * 1e9);
+   for (int i = 0; i < nthreads; i++)
+      pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+   for (int i = 0; i < nthreads; i++)
+      pthread_join(workers[i].thread, NULL);
+   double elapsed = (now_ns() - t_begin) / 1e9;
+   for (int i = 0; i < nconns; i++)
+      vtpc_pool_put(pool, slots[i].conn);
+
+   // report
+   struct hist *sum = calloc(1, sizeof(struct hist));
+   uint64_t ops = 0, errors = 0, bytes = 0;
+   for (int i = 0; i < nthreads; i++) {
+      ops += workers[i].ops;
+      errors += workers[i].errors;
+      bytes += workers[i].bytes;
+      for (int j = 0; j < HIST_SIZE; j++)
+         sum->buckets[j] += workers[i].hist.buckets[j];
+      sum->count += workers[i].hist.count;
+      sum->sum += workers[i].hist.sum;
+      if (workers[i].hist.max > sum->max)
+         sum->max = workers[i].hist.max;
+   }
+   printf("%i connections, %i threads, depth %i, %i%% reads of %i byte files\n",
+      nconns, nthreads, depth, reads, size);
+   printf("%llu ops in %.2fs: %.0f ops/s, %llu errors, %.2f MB/s in\n", (unsigned long long)ops,
+      elapsed, ops / elapsed, (unsigned long long)errors, bytes / elapsed / 1e6);
+   printf("latency us: p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+      hist_percentile(sum, 50), hist_percentile(sum, 90), hist_percentile(sum, 99),
+      hist_percentile(sum, 99.9), sum->max / 1000.0);
+
+   if (!keep)
+      cleanup();
+   vtpc_pool_free(pool);
+   return errors ? 2 : 0;
+}
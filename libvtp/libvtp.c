@@ -0,0 +1,759 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "libvtp.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define VTPC_READ_SIZE (64 << 10)
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct vtpc_req {
+   vtpc_done_t done;
+   void *ctx;
+};
+
+struct vtpc_conn {
+   int fd, broken;
+
+   // session state which makes the connection unfit for reuse
+   int dirty, txn, watching;
+
+   // received data, scan is the line of the current reply parsed next
+   char *in;
+   size_t in_len, in_size, scan;
+
+   // data not yet sent
+   char *out;
+   size_t out_off, out_len, out_size;
+
+   // ring of commands waiting for their reply
+   struct vtpc_req *reqs;
+   int head, count, size;
+
+   // descriptors received for FILEFD replies
+   int fds[VTPC_PASSFDS];
+   int nfds;
+
+   vtpc_event_t event;
+   void *event_ctx;
+
+   // next idle connection of a pool
+   vtpc_conn_t *next;
+};
+
+struct vtpc_pool {
+   char *target;
+   int max, open;
+   pthread_mutex_t lock;
+   pthread_cond_t returned;
+   vtpc_conn_t *idle;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+// codes of failed commands
+static char *vtpc_errors[] = {
+   "NOSUCHFILE", "NOSUCHDIR", "NOSUCHCMD", "NOSUCHWATCH", "NOSUCHTENANT",
+   "INVALIDCMD", "INVALIDMOVE", "FILEEXISTS", "NOMEMORY", "NOTSUPPORTED",
+   "TOOMANYFDS", "CONFLICT", "NOTXN", "INTXN", "TXNFULL", "READONLY",
+   "DEFAULTTENANT", "ROOTDIR", "QUOTA", "BUSY", "BADARCHIVE", NULL
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static int vtpc_open_unix(const char *path)
+{
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+   }
+   strcpy(addr.sun_path, path);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      close(fd);
+      fd = -1;
+   }
+   return fd;
+}
+
+static int vtpc_open_tcp(const char *target)
+{
+   // the port follows the last colon, brackets enclose ipv6 addresses
+   char host[256];
+   const char *colon = strrchr(target, ':');
+   size_t len = colon ? (size_t)(colon - target) : 0;
+   if (!colon || len >= sizeof(host)) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (len >= 2 && target[0] == '[' && target[len - 1] == ']') {
+      target++;
+      len -= 2;
+   }
+   memcpy(host, target, len);
+   host[len] = '\0';
+
+   struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+   if (getaddrinfo(len ? host : NULL, colon + 1, &hints, &res)) {
+      errno = EHOSTUNREACH;
+      return -1;
+   }
+
+   int fd = -1;
+   for (struct addrinfo *it = res; it && fd < 0; it = it->ai_next) {
+      fd = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC, it->ai_protocol);
+      if (fd >= 0 && connect(fd, it->ai_addr, it->ai_addrlen)) {
+         close(fd);
+         fd = -1;
+      }
+   }
+   freeaddrinfo(res);
+
+   int one = 1;
+   if (fd >= 0)
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   return fd;
+}
+
+static int vtpc_is_error(const char *code)
+{
+   for (char **it = vtpc_errors; *it; it++) {
+      if (strcmp(*it, code) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+/*
+ * Returns the content size announced by the FILECONTENT header line at buf,
+ * which ends with size and version, and stores the version. CHUNK lines of
+ * streamed replies announce just a size. Returns -1 if the line is no such
+ * header.
+ */
+static long vtpc_content_size(const char *buf, size_t line, unsigned long *version)
+{
+   if (line > 6 && strncmp(buf, "CHUNK ", 6) == 0) {
+      char *num;
+      long size = strtol(buf + 6, &num, 10);
+      if (num != buf + line || size < 0)
+         return -1;
+      if (version)
+         *version = 0;
+      return size;
+   }
+   if (line < 12 || strncmp(buf, "FILECONTENT ", 12))
+      return -1;
+
+   // the name may contain spaces, so the numbers are taken from the end
+   const char *end = buf + line, *space = end;
+   for (int fields = 0; fields < 2; fields++) {
+      space--;
+      while (space > buf && *space != ' ')
+         space--;
+   }
+   char *num;
+   long size = strtol(space + 1, &num, 10);
+   if (num == space + 1 || *num != ' ' || size < 0)
+      return -1;
+   if (version)
+      *version = strtoul(num + 1, NULL, 10);
+   return size;
+}
+
+/*
+ * Parses the reply of len bytes at data.
+ */
+static void vtpc_parse(const char *data, size_t len, vtpc_reply_t *r)
+{
+   memset(r, 0, sizeof(*r));
+   r->data = data;
+   r->len = len;
+   r->fd = -1;
+
+   const char *nl = memchr(data, '\n', len);
+   size_t line = nl ? (size_t)(nl - data) : len;
+
+   // codes are upper case words, other replies like listings have none
+   size_t code = 0;
+   while (code < line && code < sizeof(r->code) - 1 && isupper((unsigned char)data[code]))
+      code++;
+   if (code && (code == line || data[code] == ' ')) {
+      memcpy(r->code, data, code);
+      r->code[code] = '\0';
+   }
+
+   // streamed replies end with their status after the frames
+   if (strcmp(r->code, "CHUNK") == 0) {
+      const char *chunk;
+      size_t off = 0, next, chunk_size;
+      while ((next = vtpc_chunk(r, off, &chunk, &chunk_size)))
+         off = next;
+      for (code = 0; off + code < len && code < sizeof(r->code) - 1
+            && isupper((unsigned char)data[off + code]); code++)
+         r->code[code] = data[off + code];
+      r->code[code] = '\0';
+      r->status = vtpc_is_error(r->code) ? VTPC_ERROR : VTPC_OK;
+      return;
+   }
+
+   long size = vtpc_content_size(data, line, &r->version);
+   if (size >= 0 && line + 1 + size <= len) {
+      r->content = data + line + 1;
+      r->size = size;
+   } else if (strcmp(r->code, "BATCH") == 0) {
+      r->items = atoi(data + 6);
+   }
+   r->status = vtpc_is_error(r->code) ? VTPC_ERROR : VTPC_OK;
+}
+
+/*
+ * Returns the length of the reply at buf including the prompt or 0 if it is
+ * incomplete. Lines are scanned only once, contents are skipped by their
+ * announced size, so they may contain anything.
+ */
+static size_t vtpc_frame(vtpc_conn_t *c, const char *buf, size_t len)
+{
+   size_t pos = c->scan;
+   while (pos < len) {
+      if (buf[pos] == '>') {
+         if (pos + 1 == len)
+            break;
+         if (buf[pos + 1] == ' ') {
+            c->scan = 0;
+            return pos + 2;
+         }
+      }
+
+      const char *nl = memchr(buf + pos, '\n', len - pos);
+      if (!nl)
+         break;
+      size_t next = nl - buf + 1;
+      long size = vtpc_content_size(buf + pos, nl - buf - pos, NULL);
+      if (size >= 0 && (next += size + 1) > len)
+         break;
+      pos = next;
+   }
+   c->scan = pos;
+   return 0;
+}
+
+static int vtpc_reserve(char **buf, size_t *size, size_t needed)
+{
+   if (needed <= *size)
+      return 0;
+
+   size_t new_size = *size ? *size : 4096;
+   while (new_size < needed)
+      new_size *= 2;
+   char *new_buf = realloc(*buf, new_size);
+   if (!new_buf)
+      return -1;
+   *buf = new_buf;
+   *size = new_size;
+   return 0;
+}
+
+static int vtpc_push(vtpc_conn_t *c, vtpc_done_t done, void *ctx)
+{
+   if (c->count == c->size) {
+      int size = c->size ? c->size * 2 : 64;
+      struct vtpc_req *reqs = malloc(size * sizeof(struct vtpc_req));
+      if (!reqs)
+         return -1;
+      for (int i = 0; i < c->count; i++)
+         reqs[i] = c->reqs[(c->head + i) % c->size];
+      free(c->reqs);
+      c->reqs = reqs;
+      c->head = 0;
+      c->size = size;
+   }
+   c->reqs[(c->head + c->count) % c->size] = (struct vtpc_req){ done, ctx };
+   c->count++;
+   return 0;
+}
+
+static struct vtpc_req vtpc_pop(vtpc_conn_t *c)
+{
+   struct vtpc_req req = c->reqs[c->head];
+   c->head = (c->head + 1) % c->size;
+   c->count--;
+   return req;
+}
+
+static void vtpc_complete(struct vtpc_req req, vtpc_reply_t *reply)
+{
+   if (req.done)
+      req.done(req.ctx, reply);
+   else if (reply->fd >= 0)
+      close(reply->fd);
+}
+
+/*
+ * Marks the connection as broken and completes all outstanding commands
+ * with VTPC_CLOSED.
+ */
+static void vtpc_fail(vtpc_conn_t *c)
+{
+   if (c->broken)
+      return;
+   c->broken = 1;
+   c->out_off = c->out_len = 0;
+   for (int i = 0; i < c->nfds; i++)
+      close(c->fds[i]);
+   c->nfds = 0;
+
+   vtpc_reply_t reply = { .status = VTPC_CLOSED, .fd = -1 };
+   while (c->count)
+      vtpc_complete(vtpc_pop(c), &reply);
+}
+
+static int vtpc_flush(vtpc_conn_t *c)
+{
+   while (c->out_off < c->out_len) {
+      ssize_t len = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (len < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+         return -1;
+      }
+      c->out_off += len;
+   }
+   c->out_off = c->out_len = 0;
+   return 0;
+}
+
+/*
+ * Receives available data along with passed descriptors. Returns -1 once the
+ * connection is closed.
+ */
+static int vtpc_receive(vtpc_conn_t *c)
+{
+   if (vtpc_reserve(&c->in, &c->in_size, c->in_len + VTPC_READ_SIZE))
+      return -1;
+
+   char control[CMSG_SPACE(sizeof(int) * VTPC_PASSFDS)];
+   struct iovec iov = { .iov_base = c->in + c->in_len, .iov_len = c->in_size - c->in_len };
+   struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control)
+   };
+   ssize_t len = recvmsg(c->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+   if (len < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : -1;
+   if (len == 0)
+      return -1;
+   c->in_len += len;
+
+   for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+         continue;
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (int i = 0; i < count; i++) {
+         int fd;
+         memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+         if (c->nfds < VTPC_PASSFDS)
+            c->fds[c->nfds++] = fd;
+         else
+            close(fd);
+      }
+   }
+   return 0;
+}
+
+/*
+ * Completes the commands whose replies were received. Returns -1 on replies
+ * nobody waits for.
+ */
+static int vtpc_dispatch(vtpc_conn_t *c)
+{
+   size_t pos = 0;
+   int retval = 0;
+   while (pos < c->in_len && !retval) {
+      char *buf = c->in + pos;
+      size_t len = c->in_len - pos;
+
+      // events of watches come between replies
+      if (c->watching && c->scan == 0 && len >= 6 && strncmp(buf, "EVENT ", 6) == 0) {
+         char *nl = memchr(buf, '\n', len);
+         if (!nl)
+            break;
+         pos += nl - buf + 1;
+         *nl = '\0';
+         char *path = strchr(buf + 6, ' ');
+         if (path)
+            *path++ = '\0';
+         if (c->event)
+            c->event(c->event_ctx, buf + 6, path ? path : "/");
+         continue;
+      }
+
+      size_t size = vtpc_frame(c, buf, len);
+      if (!size)
+         break;
+      pos += size;
+      if (!c->count) {
+         retval = -1;
+         break;
+      }
+
+      vtpc_reply_t reply;
+      vtpc_parse(buf, size - 2, &reply);
+      if (strcmp(reply.code, "FILEFD") == 0 && c->nfds) {
+         reply.fd = c->fds[0];
+         memmove(c->fds, c->fds + 1, --c->nfds * sizeof(int));
+      }
+      vtpc_complete(vtpc_pop(c), &reply);
+   }
+
+   memmove(c->in, c->in + pos, c->in_len - pos);
+   c->in_len -= pos;
+   return retval;
+}
+
+static void vtpc_copy(void *ctx, vtpc_reply_t *reply)
+{
+   vtpc_reply_t **copy = ctx;
+   *copy = malloc(sizeof(vtpc_reply_t) + reply->len + 1);
+   if (!*copy) {
+      if (reply->fd >= 0)
+         close(reply->fd);
+      return;
+   }
+
+   // data is kept right behind the reply
+   char *data = (char*)(*copy + 1);
+   memcpy(*copy, reply, sizeof(vtpc_reply_t));
+   if (reply->len)
+      memcpy(data, reply->data, reply->len);
+   data[reply->len] = '\0';
+   (*copy)->data = data;
+   if (reply->content)
+      (*copy)->content = data + (reply->content - reply->data);
+}
+
+/*
+ * Returns whether an idle connection received something, which is either
+ * the close of the server or garbage.
+ */
+static int vtpc_stale(vtpc_conn_t *c)
+{
+   struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+   return c->broken || poll(&pfd, 1, 0) != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+vtpc_conn_t* vtpc_connect(const char *target)
+{
+   vtpc_conn_t *c = calloc(1, sizeof(vtpc_conn_t));
+   if (!c)
+      return NULL;
+
+   c->fd = *target == '/' ? vtpc_open_unix(target) : vtpc_open_tcp(target);
+   if (c->fd < 0) {
+      free(c);
+      return NULL;
+   }
+   fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+   // the welcome is answered like a command, busy servers close instead
+   vtpc_reply_t *welcome = NULL;
+   if (vtpc_push(c, vtpc_copy, &welcome) || vtpc_wait(c) || !welcome || welcome->status) {
+      int error = c->broken ? ECONNREFUSED : ENOMEM;
+      vtpc_reply_free(welcome);
+      vtpc_close(c);
+      errno = error;
+      return NULL;
+   }
+   vtpc_reply_free(welcome);
+   return c;
+}
+
+void vtpc_close(vtpc_conn_t *c)
+{
+   if (!c)
+      return;
+   vtpc_fail(c);
+   close(c->fd);
+   free(c->in);
+   free(c->out);
+   free(c->reqs);
+   free(c);
+}
+
+void vtpc_on_event(vtpc_conn_t *c, vtpc_event_t fn, void *ctx)
+{
+   c->event = fn;
+   c->event_ctx = ctx;
+}
+
+int vtpc_submit(vtpc_conn_t *c, const char *cmd, const void *payload, size_t len,
+   vtpc_done_t done, void *ctx)
+{
+   size_t cmd_len = strlen(cmd);
+   if (c->broken || memchr(cmd, '\n', cmd_len)) {
+      errno = c->broken ? ECONNRESET : EINVAL;
+      return -1;
+   }
+   if (vtpc_reserve(&c->out, &c->out_size, c->out_len + cmd_len + 1 + len)
+         || vtpc_push(c, done, ctx))
+      return -1;
+
+   memcpy(c->out + c->out_len, cmd, cmd_len);
+   c->out[c->out_len + cmd_len] = '\n';
+   if (len)
+      memcpy(c->out + c->out_len + cmd_len + 1, payload, len);
+   c->out_len += cmd_len + 1 + len;
+
+   // remember what changes the session
+   size_t word = strcspn(cmd, " \t");
+   if ((word == 2 && strncasecmp(cmd, "cd", 2) == 0) || (word == 3 && strncasecmp(cmd, "use", 3) == 0))
+      c->dirty = 1;
+   else if (word == 5 && strncasecmp(cmd, "watch", 5) == 0)
+      c->dirty = c->watching = 1;
+   else if (word == 5 && strncasecmp(cmd, "begin", 5) == 0)
+      c->txn = 1;
+   else if ((word == 6 && strncasecmp(cmd, "commit", 6) == 0) || (word == 5 && strncasecmp(cmd, "abort", 5) == 0))
+      c->txn = 0;
+   return 0;
+}
+
+int vtpc_pending(vtpc_conn_t *c)
+{
+   return c->count;
+}
+
+int vtpc_fd(vtpc_conn_t *c)
+{
+   return c->fd;
+}
+
+short vtpc_want(vtpc_conn_t *c)
+{
+   if (c->broken)
+      return 0;
+   return POLLIN | (c->out_off < c->out_len ? POLLOUT : 0);
+}
+
+int vtpc_process(vtpc_conn_t *c, short revents)
+{
+   if (c->broken)
+      return -1;
+
+   int failed = vtpc_flush(c);
+   if (!failed && (revents & (POLLIN | POLLERR | POLLHUP))) {
+      // read until the socket is drained, replies complete on the way
+      int received = 0;
+      while (!failed && !(received = vtpc_receive(c)))
+         failed = vtpc_dispatch(c);
+      failed |= received < 0;
+   }
+   if (failed)
+      vtpc_fail(c);
+   return c->broken ? -1 : 0;
+}
+
+int vtpc_poll(vtpc_conn_t *c, int timeout)
+{
+   if (c->broken)
+      return -1;
+
+   struct pollfd pfd = { .fd = c->fd, .events = vtpc_want(c) };
+   int ready = poll(&pfd, 1, timeout);
+   if (ready < 0 && errno != EINTR) {
+      vtpc_fail(c);
+      return -1;
+   }
+   return vtpc_process(c, ready > 0 ? pfd.revents : 0);
+}
+
+int vtpc_wait(vtpc_conn_t *c)
+{
+   while (c->count) {
+      if (vtpc_poll(c, -1))
+         return -1;
+   }
+   return c->broken ? -1 : 0;
+}
+
+vtpc_reply_t* vtpc_exec(vtpc_conn_t *c, const char *cmd, const void *payload, size_t len)
+{
+   vtpc_reply_t *reply = NULL;
+   if (vtpc_submit(c, cmd, payload, len, vtpc_copy, &reply) == 0) {
+      while (c->count && !reply)
+         vtpc_poll(c, -1);
+      return reply;
+   }
+
+   // submitting fails on broken connections or memory shortage
+   if (!c->broken)
+      return NULL;
+   reply = calloc(1, sizeof(vtpc_reply_t));
+   if (reply) {
+      reply->status = VTPC_CLOSED;
+      reply->fd = -1;
+   }
+   return reply;
+}
+
+void vtpc_reply_free(vtpc_reply_t *reply)
+{
+   free(reply);
+}
+
+size_t vtpc_item(const vtpc_reply_t *batch, size_t off, vtpc_reply_t *item)
+{
+   if (strcmp(batch->code, "BATCH"))
+      return 0;
+
+   // the first item follows the header line
+   if (!off) {
+      const char *nl = memchr(batch->data, '\n', batch->len);
+      off = nl ? (size_t)(nl - batch->data) + 1 : batch->len;
+   }
+   if (off >= batch->len)
+      return 0;
+
+   const char *data = batch->data + off;
+   size_t left = batch->len - off;
+   const char *nl = memchr(data, '\n', left);
+   if (!nl)
+      return 0;
+   size_t len = nl - data + 1;
+   long size = vtpc_content_size(data, nl - data, NULL);
+   if (size >= 0)
+      len += size + 1;
+   if (len > left)
+      return 0;
+
+   vtpc_parse(data, len, item);
+   return off + len;
+}
+
+size_t vtpc_chunk(const vtpc_reply_t *reply, size_t off, const char **data, size_t *size)
+{
+   if (off >= reply->len)
+      return 0;
+
+   const char *buf = reply->data + off;
+   size_t left = reply->len - off;
+   const char *nl = memchr(buf, '\n', left);
+   if (!nl || strncmp(buf, "CHUNK ", nl - buf < 6 ? nl - buf : 6))
+      return 0;
+   long chunk = vtpc_content_size(buf, nl - buf, NULL);
+   size_t len = nl - buf + 1 + chunk + 1;
+   if (chunk < 0 || len > left)
+      return 0;
+
+   *data = nl + 1;
+   *size = chunk;
+   return off + len;
+}
+
+vtpc_pool_t* vtpc_pool_new(const char *target, int max)
+{
+   vtpc_pool_t *pool = calloc(1, sizeof(vtpc_pool_t));
+   if (!pool || !(pool->target = strdup(target))) {
+      free(pool);
+      return NULL;
+   }
+   pool->max = max > 0 ? max : 1;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->returned, NULL);
+   return pool;
+}
+
+vtpc_conn_t* vtpc_pool_get(vtpc_pool_t *pool)
+{
+   pthread_mutex_lock(&pool->lock);
+   for (;;) {
+      // most recently used connections first, they are warm
+      while (pool->idle) {
+         vtpc_conn_t *c = pool->idle;
+         pool->idle = c->next;
+         c->next = NULL;
+         if (!vtpc_stale(c)) {
+            pthread_mutex_unlock(&pool->lock);
+            return c;
+         }
+         vtpc_close(c);
+         pool->open--;
+      }
+      if (pool->open < pool->max)
+         break;
+      pthread_cond_wait(&pool->returned, &pool->lock);
+   }
+   pool->open++;
+   pthread_mutex_unlock(&pool->lock);
+
+   vtpc_conn_t *c = vtpc_connect(pool->target);
+   if (!c) {
+      pthread_mutex_lock(&pool->lock);
+      pool->open--;
+      pthread_cond_signal(&pool->returned);
+      pthread_mutex_unlock(&pool->lock);
+   }
+   return c;
+}
+
+void vtpc_pool_put(vtpc_pool_t *pool, vtpc_conn_t *c)
+{
+   vtpc_wait(c);
+   int reuse = !c->broken && !c->dirty && !c->txn;
+   if (!reuse) {
+      vtpc_close(c);
+      c = NULL;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   if (c) {
+      c->next = pool->idle;
+      pool->idle = c;
+   } else {
+      pool->open--;
+   }
+   pthread_cond_signal(&pool->returned);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void vtpc_pool_free(vtpc_pool_t *pool)
+{
+   if (!pool)
+      return;
+   while (pool->idle) {
+      vtpc_conn_t *c = pool->idle;
+      pool->idle = c->next;
+      vtpc_close(c);
+   }
+   pthread_mutex_destroy(&pool->lock);
+   pthread_cond_destroy(&pool->returned);
+   free(pool->target);
+   free(pool);
+}
@@ -0,0 +1,146 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef LIBVTP
+#define LIBVTP
+
+#include <stddef.h>
+
+// status of a reply
+#define VTPC_OK      0
+#define VTPC_ERROR   1    // the server answered with an error code
+#define VTPC_CLOSED -1    // the connection broke before the reply arrived
+
+// descriptors passed with FILEFD replies which were not yet claimed
+#define VTPC_PASSFDS 16
+
+typedef struct vtpc_conn vtpc_conn_t;
+typedef struct vtpc_pool vtpc_pool_t;
+
+/*
+ * Reply to one command. Data points into the receive buffer of the
+ * connection and is only valid while the completion callback runs, unless
+ * the reply was returned by vtpc_exec.
+ */
+typedef struct vtpc_reply {
+   int status;
+   char code[24];          // first word of the reply like FILECREATED, or empty,
+                           // streamed replies take the word of their last line
+   const char *data;       // whole reply without the prompt
+   size_t len;
+
+   // content of FILECONTENT replies
+   const char *content;
+   size_t size;
+   unsigned long version;
+
+   int items;              // number of items of BATCH replies
+   int fd;                 // descriptor of FILEFD replies, owned by the callback
+} vtpc_reply_t;
+
+typedef void (*vtpc_done_t)(void *ctx, vtpc_reply_t *reply);
+typedef void (*vtpc_event_t)(void *ctx, const char *event, const char *path);
+
+/*
+ * Connects to target, which is either host:port or the path of a unix
+ * socket, and waits for the welcome of the server. Returns NULL on failure
+ * with errno set.
+ */
+vtpc_conn_t* vtpc_connect(const char *target);
+
+/*
+ * Completes outstanding commands with VTPC_CLOSED and closes the connection.
+ */
+void vtpc_close(vtpc_conn_t *c);
+
+/*
+ * Delivers EVENT lines of watch commands to fn.
+ */
+void vtpc_on_event(vtpc_conn_t *c, vtpc_event_t fn, void *ctx);
+
+/*
+ * Queues the command line cmd, which must not contain a newline, followed by
+ * len bytes of payload. Commands are pipelined, done gets called in order of
+ * submission once the reply arrived. Done may submit further commands, but
+ * must neither wait on nor close the connection. Returns 0 on success.
+ */
+int vtpc_submit(vtpc_conn_t *c, const char *cmd, const void *payload, size_t len,
+   vtpc_done_t done, void *ctx);
+
+/*
+ * Returns the number of commands waiting for their reply.
+ */
+int vtpc_pending(vtpc_conn_t *c);
+
+/*
+ * Returns the socket and the poll events the connection waits for, so it can
+ * be driven by the event loop of the caller.
+ */
+int vtpc_fd(vtpc_conn_t *c);
+short vtpc_want(vtpc_conn_t *c);
+
+/*
+ * Sends and receives as much as possible without blocking and completes all
+ * commands whose reply arrived. Returns -1 once the connection is broken.
+ */
+int vtpc_process(vtpc_conn_t *c, short revents);
+
+/*
+ * Waits up to timeout ms for the connection and processes it.
+ */
+int vtpc_poll(vtpc_conn_t *c, int timeout);
+
+/*
+ * Processes the connection until all commands are completed.
+ */
+int vtpc_wait(vtpc_conn_t *c);
+
+/*
+ * Executes a command synchronously. Commands submitted before complete first.
+ * The reply is a copy which must be freed with vtpc_reply_free. Returns NULL
+ * on memory shortage.
+ */
+vtpc_reply_t* vtpc_exec(vtpc_conn_t *c, const char *cmd, const void *payload, size_t len);
+
+void vtpc_reply_free(vtpc_reply_t *reply);
+
+/*
+ * Parses the item of a BATCH reply which starts at off, where 0 is the first
+ * item. Returns the offset of the next item or 0 if there is none.
+ */
+size_t vtpc_item(const vtpc_reply_t *batch, size_t off, vtpc_reply_t *item);
+
+/*
+ * Returns the data of the CHUNK frame of a streamed reply like the archive of
+ * export which starts at off, where 0 is the first frame, in data and size.
+ * Returns the offset of the next frame or 0 if there is none.
+ */
+size_t vtpc_chunk(const vtpc_reply_t *reply, size_t off, const char **data, size_t *size);
+
+/*
+ * Creates a pool of up to max connections to target.
+ */
+vtpc_pool_t* vtpc_pool_new(const char *target, int max);
+
+/*
+ * Takes an idle connection of the pool or opens a new one. Waits for a
+ * returned connection if max are in use. Returns NULL if no connection can
+ * be opened.
+ */
+vtpc_conn_t* vtpc_pool_get(vtpc_pool_t *pool);
+
+/*
+ * Returns a connection to the pool once its commands are completed.
+ * Connections which broke or changed their session with cd, use, watch or an
+ * open transaction are closed instead.
+ */
+void vtpc_pool_put(vtpc_pool_t *pool, vtpc_conn_t *c);
+
+/*
+ * Closes the idle connections and frees the pool. All connections must have
+ * been returned.
+ */
+void vtpc_pool_free(vtpc_pool_t *pool);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "fair.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static long long fair_ops_rate = 0, fair_bytes_rate = 0;
+
+// statistics
+static long long fair_ops = 0, fair_cost = 0, fair_bytes = 0;
+static long long fair_yields = 0, fair_throttles = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void fair_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "fair.rate_ops", fair_ops_rate);
+   emit(ctx, "fair.rate_bytes", fair_bytes_rate);
+   emit(ctx, "fair.ops", __atomic_load_n(&fair_ops, __ATOMIC_RELAXED));
+   emit(ctx, "fair.cost", __atomic_load_n(&fair_cost, __ATOMIC_RELAXED));
+   emit(ctx, "fair.bytes", __atomic_load_n(&fair_bytes, __ATOMIC_RELAXED));
+   emit(ctx, "fair.yields", __atomic_load_n(&fair_yields, __ATOMIC_RELAXED));
+   emit(ctx, "fair.throttled", __atomic_load_n(&fair_throttles, __ATOMIC_RELAXED));
+}
+
+static void fair_swap(fair_queue_t *q, int a, int b)
+{
+   fair_client_t *tmp = q->heap[a];
+   q->heap[a] = q->heap[b];
+   q->heap[b] = tmp;
+   q->heap[a]->index = a;
+   q->heap[b]->index = b;
+}
+
+static void fair_up(fair_queue_t *q, int i)
+{
+   while (i > 0 && q->heap[(i - 1) / 2]->vtime > q->heap[i]->vtime) {
+      fair_swap(q, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+   }
+}
+
+static void fair_down(fair_queue_t *q, int i)
+{
+   while (1) {
+      int min = i, left = 2 * i + 1, right = left + 1;
+      if (left < q->len && q->heap[left]->vtime < q->heap[min]->vtime)
+         min = left;
+      if (right < q->len && q->heap[right]->vtime < q->heap[min]->vtime)
+         min = right;
+      if (min == i)
+         return;
+      fair_swap(q, i, min);
+      i = min;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+void fair_init(long long ops_rate, long long bytes_rate)
+{
+   fair_ops_rate = ops_rate;
+   fair_bytes_rate = bytes_rate;
+   stats_register(fair_stats, NULL);
+}
+
+void fair_client_init(fair_client_t *c)
+{
+   memset(c, 0, sizeof(*c));
+   c->index = -1;
+
+   // full buckets allow a burst of one second
+   c->ops = fair_ops_rate;
+   c->bytes = fair_bytes_rate;
+   c->refilled = fair_now();
+}
+
+uint64_t fair_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t fair_delay(fair_client_t *c)
+{
+   if (!fair_ops_rate && !fair_bytes_rate)
+      return 0;
+
+   uint64_t now = fair_now();
+   double elapsed = (now - c->refilled) / 1e9, delay = 0;
+   c->refilled = now;
+
+   // a command needs a whole token, bytes are charged afterwards and may
+   // leave a debt which has to be paid off first
+   if (fair_ops_rate) {
+      c->ops += elapsed * fair_ops_rate;
+      if (c->ops > fair_ops_rate)
+         c->ops = fair_ops_rate;
+      if (c->ops < 1)
+         delay = (1 - c->ops) / fair_ops_rate;
+   }
+   if (fair_bytes_rate) {
+      c->bytes += elapsed * fair_bytes_rate;
+      if (c->bytes > fair_bytes_rate)
+         c->bytes = fair_bytes_rate;
+      if (c->bytes < 0 && -c->bytes / fair_bytes_rate > delay)
+         delay = -c->bytes / fair_bytes_rate;
+   }
+   return delay > 0 ? (uint64_t)(delay * 1e9) + 1 : 0;
+}
+
+void fair_charge(fair_client_t *c, double share, long cost, size_t bytes)
+{
+   c->vtime += cost / (share > 0 ? share : 1);
+   c->ops -= 1;
+   c->bytes -= bytes;
+
+   __atomic_add_fetch(&fair_ops, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&fair_cost, cost, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&fair_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void fair_yielded(int reason)
+{
+   __atomic_add_fetch(reason == FAIR_THROTTLED ? &fair_throttles : &fair_yields, 1, __ATOMIC_RELAXED);
+}
+
+int fair_push(fair_queue_t *q, fair_client_t *c)
+{
+   if (c->index >= 0)
+      return 0;
+   if (q->len == q->size) {
+      int size = q->size ? q->size * 2 : 64;
+      fair_client_t **heap = realloc(q->heap, size * sizeof(fair_client_t*));
+      if (!heap)
+         return 1;
+      q->heap = heap;
+      q->size = size;
+   }
+
+   if (c->vtime < q->vtime)
+      c->vtime = q->vtime;
+   c->index = q->len;
+   q->heap[q->len++] = c;
+   fair_up(q, c->index);
+   return 0;
+}
+
+fair_client_t* fair_pop(fair_queue_t *q)
+{
+   if (!q->len)
+      return NULL;
+
+   fair_client_t *c = q->heap[0];
+   fair_remove(q, c);
+   if (c->vtime > q->vtime)
+      q->vtime = c->vtime;
+   return c;
+}
+
+void fair_remove(fair_queue_t *q, fair_client_t *c)
+{
+   int i = c->index;
+   if (i < 0)
+      return;
+
+   c->index = -1;
+   if (i == --q->len)
+      return;
+   fair_client_t *last = q->heap[q->len];
+   q->heap[i] = last;
+   last->index = i;
+   fair_up(q, i);
+   fair_down(q, last->index);
+}
+
+void fair_queue_free(fair_queue_t *q)
+{
+   free(q->heap);
+   memset(q, 0, sizeof(*q));
+}
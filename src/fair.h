@@ -0,0 +1,94 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef FAIR
+#define FAIR
+
+#include <stddef.h>
+#include <stdint.h>
+
+// cost a session may use in one turn before others get theirs
+#define FAIR_QUANTUM 16
+
+// every moved KiB of payload or output costs as much as a simple command
+#define FAIR_BYTE_SHIFT 10
+
+// reasons to give up a turn
+#define FAIR_YIELD     1
+#define FAIR_THROTTLED 2
+
+/*
+ * Scheduler state of a session. Sessions with the least virtual time run
+ * first, the virtual time grows by the cost of executed commands divided by
+ * the share of the session.
+ */
+typedef struct fair_client {
+   double vtime;
+   int index;                 // position in a run queue or -1
+
+   // token buckets of the rate limits
+   double ops, bytes;
+   uint64_t refilled;
+} fair_client_t;
+
+/*
+ * Run queue ordered by virtual time.
+ */
+typedef struct fair_queue {
+   fair_client_t **heap;
+   int len, size;
+   double vtime;              // virtual time of the last client taken out
+} fair_queue_t;
+
+/*
+ * Sets the rate limits of every session in commands and bytes per second,
+ * 0 for no limit, and registers the statistics.
+ */
+void fair_init(long long ops_rate, long long bytes_rate);
+
+void fair_client_init(fair_client_t *c);
+
+/*
+ * Returns the monotonic clock in ns.
+ */
+uint64_t fair_now(void);
+
+/*
+ * Refills the token buckets of c and returns the ns until c may execute its
+ * next command, 0 if it may right away.
+ */
+uint64_t fair_delay(fair_client_t *c);
+
+/*
+ * Accounts a command of given cost which moved bytes to c. Share is the part
+ * of the server the session is entitled to.
+ */
+void fair_charge(fair_client_t *c, double share, long cost, size_t bytes);
+
+/*
+ * Counts a turn given up for reason.
+ */
+void fair_yielded(int reason);
+
+/*
+ * Adds c to q unless it is queued already. Clients which were idle start at
+ * the virtual time of q, so they cannot save up service. Returns 0 on
+ * success.
+ */
+int fair_push(fair_queue_t *q, fair_client_t *c);
+
+/*
+ * Takes the client with the least virtual time out of q. Returns NULL if q
+ * is empty.
+ */
+fair_client_t* fair_pop(fair_queue_t *q);
+
+/*
+ * Removes c from q if it is queued.
+ */
+void fair_remove(fair_queue_t *q, fair_client_t *c);
+
+void fair_queue_free(fair_queue_t *q);
+
+#endif
@@ -0,0 +1,819 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "http.h"
+#include "log.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define HTTP_GET    1
+#define HTTP_HEAD   2
+#define HTTP_PUT    3
+#define HTTP_DELETE 4
+
+// states of a chunked body
+#define HTTP_CHUNK_SIZE    0
+#define HTTP_CHUNK_DATA    1
+#define HTTP_CHUNK_END     2
+#define HTTP_CHUNK_TRAILER 3
+#define HTTP_CHUNK_DONE    4
+
+// longest chunk size or trailer line
+#define HTTP_LINE_MAX 1024
+
+// reads of a file which changed in between are repeated that often
+#define HTTP_READ_RETRIES 16
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+// request being received, offsets are relative to its start in the input
+struct http {
+   int parsed;          // request line and headers are complete
+   size_t head;         // their length
+   int method, minor;
+   char *path;
+   int keepalive, expect, continued;
+   long long length;    // content length or -1 if none was sent
+   int chunked;
+   char range[64], if_match[64], if_none_match[64];
+
+   // chunked body, decoded in place right behind the head
+   int chunk;
+   size_t raw, decoded, left;
+};
+
+// status of the response code of a vtp command
+struct http_status {
+   char *code;
+   int status;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static pthread_once_t http_once = PTHREAD_ONCE_INIT;
+static long long http_requests = 0, http_errors = 0;
+
+static struct http_status http_statuses[] = {
+   { "FILECREATED", 201 },
+   { "UPDATED", 204 },
+   { "DELETED", 204 },
+   { "CONFLICT", 412 },
+   { "READONLY", 403 },
+   { "ROOTDIR", 403 },
+   { "QUOTA", 507 },
+   { "NOMEMORY", 503 },
+   { "NOSUCHTENANT", 404 },
+   { "NOSUCHFILE", 404 },
+   { "NOSUCHDIR", 409 },
+   { "FILEEXISTS", 409 },
+   { NULL, 500 }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void http_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "http.requests", __atomic_load_n(&http_requests, __ATOMIC_RELAXED));
+   emit(ctx, "http.errors", __atomic_load_n(&http_errors, __ATOMIC_RELAXED));
+}
+
+static void http_setup(void)
+{
+   stats_register(http_stats, NULL);
+}
+
+static void http_reset(struct http *h)
+{
+   free(h->path);
+   memset(h, 0, sizeof(*h));
+   h->length = -1;
+}
+
+static const char* http_reason(int status)
+{
+   switch (status) {
+      case 100: return "Continue";
+      case 200: return "OK";
+      case 201: return "Created";
+      case 204: return "No Content";
+      case 206: return "Partial Content";
+      case 304: return "Not Modified";
+      case 400: return "Bad Request";
+      case 403: return "Forbidden";
+      case 404: return "Not Found";
+      case 405: return "Method Not Allowed";
+      case 409: return "Conflict";
+      case 411: return "Length Required";
+      case 412: return "Precondition Failed";
+      case 413: return "Payload Too Large";
+      case 416: return "Range Not Satisfiable";
+      case 431: return "Request Header Fields Too Large";
+      case 501: return "Not Implemented";
+      case 503: return "Service Unavailable";
+      case 505: return "HTTP Version Not Supported";
+      case 507: return "Insufficient Storage";
+      default: return "Internal Server Error";
+   }
+}
+
+/*
+ * Maps the response of a vtp command to a status.
+ */
+static int http_status(const char *msg)
+{
+   struct http_status *it = http_statuses;
+   size_t len = msg ? strcspn(msg, " ") : 0;
+   while (it->code && (strlen(it->code) != len || strncmp(it->code, msg, len)))
+      it++;
+   return it->status;
+}
+
+/*
+ * Writes status line and headers of a response whose body has length bytes.
+ * Extra holds further header lines. Returns -1 on memory shortage.
+ */
+static int http_head(vtp_session_t *s, int status, size_t length, const char *extra)
+{
+   struct http *h = s->http;
+   if (status >= 400)
+      __atomic_add_fetch(&http_errors, 1, __ATOMIC_RELAXED);
+
+   // persistent connections are the default since http/1.1
+   const char *conn = !h->keepalive ? "Connection: close\r\n"
+      : h->minor == 0 ? "Connection: keep-alive\r\n" : "";
+   if (status == 204 || status == 304)
+      return vtp_write(s, "HTTP/1.1 %i %s\r\n%s%s\r\n", status, http_reason(status), extra, conn);
+   return vtp_write(s, "HTTP/1.1 %i %s\r\nContent-Length: %zu\r\n%s%s\r\n",
+      status, http_reason(status), length, extra, conn);
+}
+
+/*
+ * Writes a response which carries its reason as body.
+ */
+static int http_reply(vtp_session_t *s, int status, const char *extra)
+{
+   if (status == 204 || status == 304)
+      return http_head(s, status, 0, extra);
+
+   const char *reason = http_reason(status);
+   char headers[256];
+   snprintf(headers, sizeof(headers), "Content-Type: text/plain\r\n%s", extra);
+   if (http_head(s, status, strlen(reason) + 1, headers) < 0)
+      return -1;
+   if (s->http->method == HTTP_HEAD)
+      return 0;
+   return vtp_write(s, "%s\n", reason);
+}
+
+/*
+ * Answers a request which cannot be read to its end and closes the
+ * connection afterwards.
+ */
+static void http_fail(vtp_session_t *s, int status)
+{
+   s->http->keepalive = 0;
+   http_reply(s, status, "");
+   s->closed = 1;
+}
+
+/*
+ * Returns whether the comma separated list of entity tags contains etag.
+ * Weak tags compare like strong ones, "*" matches everything.
+ */
+static int http_match(const char *list, const char *etag)
+{
+   size_t len = strlen(etag);
+   for (const char *it = list; *it; ) {
+      it += strspn(it, " \t,");
+      size_t size = strcspn(it, ",");
+      while (size && (it[size - 1] == ' ' || it[size - 1] == '\t'))
+         size--;
+      if (size == 1 && *it == '*')
+         return 1;
+      if (size > 2 && strncmp(it, "W/", 2) == 0) {
+         it += 2;
+         size -= 2;
+      }
+      if (size == len && strncmp(it, etag, len) == 0)
+         return 1;
+      it += strcspn(it, ",");
+   }
+   return 0;
+}
+
+/*
+ * Returns whether the comma separated list of tokens contains token.
+ */
+static int http_token(const char *list, const char *token)
+{
+   size_t len = strlen(token);
+   for (const char *it = list; *it; it += strcspn(it, ",")) {
+      it += strspn(it, " \t,");
+      size_t size = strcspn(it, ", \t");
+      if (size == len && strncasecmp(it, token, len) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+/*
+ * Stores a header value for later use. Values which do not fit are replaced
+ * by an entity tag nothing matches.
+ */
+static void http_keep(char *dst, size_t size, const char *value)
+{
+   if (strlen(value) < size)
+      strcpy(dst, value);
+   else
+      strcpy(dst, "\"\"");
+}
+
+/*
+ * Decodes the path of a request target in place and drops query and
+ * fragment. Returns 0 on success.
+ */
+static int http_decode(char *target)
+{
+   // absolute form names the host first
+   if (strncasecmp(target, "http://", 7) == 0) {
+      char *path = strchr(target + 7, '/');
+      memmove(target, path ? path : "/", strlen(path ? path : "/") + 1);
+   }
+   if (*target != '/')
+      return 1;
+
+   char *out = target;
+   for (char *it = target; *it && *it != '?' && *it != '#'; it++) {
+      if (*it != '%') {
+         *out++ = *it;
+         continue;
+      }
+      if (!isxdigit((unsigned char)it[1]) || !isxdigit((unsigned char)it[2]))
+         return 1;
+      char hex[3] = { it[1], it[2], '\0' };
+      char c = strtol(hex, NULL, 16);
+      if (!c)
+         return 1;
+      *out++ = c;
+      it += 2;
+   }
+   *out = '\0';
+   return 0;
+}
+
+/*
+ * Returns the length of the head at req including the empty line which ends
+ * it, or 0 if it is incomplete.
+ */
+static size_t http_head_len(const char *req, size_t len)
+{
+   const char *end = req + len;
+   for (const char *it = req; (it = memchr(it, '\n', end - it)); ) {
+      it++;
+      if (it < end && *it == '\n')
+         return it + 1 - req;
+      if (it + 1 < end && it[0] == '\r' && it[1] == '\n')
+         return it + 2 - req;
+   }
+   return 0;
+}
+
+/*
+ * Parses request line and headers of the head of length len at req, which
+ * gets modified. Returns 0 on success or the status of the error.
+ */
+static int http_parse(struct http *h, char *req, size_t len)
+{
+   char *end = memchr(req, '\n', len);
+   char *last = req + len;
+   *end = '\0';
+   if (end > req && end[-1] == '\r')
+      end[-1] = '\0';
+
+   // method target version
+   char *target = strchr(req, ' ');
+   char *version = target ? strchr(target + 1, ' ') : NULL;
+   if (!version)
+      return 400;
+   *target++ = '\0';
+   *version++ = '\0';
+   if (strncmp(version, "HTTP/", 5))
+      return 400;
+   if (strncmp(version, "HTTP/1.", 7) || !isdigit((unsigned char)version[7]) || version[8])
+      return 505;
+   h->minor = version[7] - '0';
+   h->keepalive = h->minor > 0;
+
+   if (strcmp(req, "GET") == 0)
+      h->method = HTTP_GET;
+   else if (strcmp(req, "HEAD") == 0)
+      h->method = HTTP_HEAD;
+   else if (strcmp(req, "PUT") == 0)
+      h->method = HTTP_PUT;
+   else if (strcmp(req, "DELETE") == 0)
+      h->method = HTTP_DELETE;
+
+   if (http_decode(target))
+      return 400;
+   if (!(h->path = strdup(target)))
+      return 500;
+
+   for (char *line = end + 1; line < last; line = end + 1) {
+      end = memchr(line, '\n', last - line);
+      *end = '\0';
+      if (end > line && end[-1] == '\r')
+         end[-1] = '\0';
+      if (!*line)
+         break;
+
+      char *value = strchr(line, ':');
+      if (!value || value == line)
+         return 400;
+      *value++ = '\0';
+      value += strspn(value, " \t");
+      for (char *tail = value + strlen(value); tail > value && (tail[-1] == ' ' || tail[-1] == '\t'); )
+         *--tail = '\0';
+
+      if (strcasecmp(line, "Content-Length") == 0) {
+         char *num;
+         errno = 0;
+         long long length = strtoll(value, &num, 10);
+         if (!isdigit((unsigned char)*value) || *num || errno || (h->length >= 0 && h->length != length))
+            return 400;
+         h->length = length;
+      } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+         if (strcasecmp(value, "chunked"))
+            return 501;
+         h->chunked = 1;
+      } else if (strcasecmp(line, "Connection") == 0) {
+         if (http_token(value, "close"))
+            h->keepalive = 0;
+         else if (http_token(value, "keep-alive"))
+            h->keepalive = 1;
+      } else if (strcasecmp(line, "Expect") == 0) {
+         h->expect = strcasecmp(value, "100-continue") == 0;
+      } else if (strcasecmp(line, "Range") == 0) {
+         http_keep(h->range, sizeof(h->range), value);
+      } else if (strcasecmp(line, "If-Match") == 0) {
+         http_keep(h->if_match, sizeof(h->if_match), value);
+      } else if (strcasecmp(line, "If-None-Match") == 0) {
+         http_keep(h->if_none_match, sizeof(h->if_none_match), value);
+      }
+   }
+
+   // both framings at once could smuggle a request past a proxy
+   if (h->chunked && h->length >= 0)
+      return 400;
+   return 0;
+}
+
+/*
+ * Decodes the chunked body of the request at req with avail bytes received
+ * so far. Decoded data is moved right behind the head, so it needs no buffer
+ * of its own. Returns 1 once the body is complete, 0 if more is needed, -1 on
+ * syntax errors and -2 if the body is too large.
+ */
+static int http_dechunk(struct http *h, char *req, size_t avail)
+{
+   if (!h->raw)
+      h->raw = h->head;
+
+   while (h->chunk != HTTP_CHUNK_DONE) {
+      char *it = req + h->raw;
+      size_t left = avail - h->raw;
+
+      if (h->chunk == HTTP_CHUNK_DATA) {
+         size_t len = left < h->left ? left : h->left;
+         memmove(req + h->head + h->decoded, it, len);
+         h->decoded += len;
+         h->raw += len;
+         h->left -= len;
+         if (h->left)
+            return 0;
+         h->chunk = HTTP_CHUNK_END;
+         continue;
+      }
+
+      char *nl = memchr(it, '\n', left);
+      if (!nl)
+         return left > HTTP_LINE_MAX ? -1 : 0;
+      size_t line = nl - it - (nl > it && nl[-1] == '\r');
+      h->raw += nl - it + 1;
+
+      if (h->chunk == HTTP_CHUNK_END) {
+         if (line)
+            return -1;
+         h->chunk = HTTP_CHUNK_SIZE;
+      } else if (h->chunk == HTTP_CHUNK_TRAILER) {
+         if (!line)
+            h->chunk = HTTP_CHUNK_DONE;
+      } else {
+         // size in hex, extensions are ignored
+         if (!isxdigit((unsigned char)*it))
+            return -1;
+         char *end;
+         errno = 0;
+         unsigned long long size = strtoull(it, &end, 16);
+         if (errno || (end < nl && !strchr(";\r \t", *end)))
+            return -1;
+         if (size > HTTP_BODY_MAX || h->decoded + size > HTTP_BODY_MAX)
+            return -2;
+         h->left = size;
+         h->chunk = size ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+      }
+   }
+   return 1;
+}
+
+/*
+ * Parses the range header for a content of size bytes. Returns 1 for a
+ * satisfiable range from first of count bytes, -1 for an unsatisfiable one
+ * and 0 if the whole content is sent, which includes multiple ranges.
+ */
+static int http_range(const char *range, size_t size, size_t *first, size_t *count)
+{
+   if (strncmp(range, "bytes=", 6) || strchr(range, ','))
+      return 0;
+
+   const char *it = range + 6;
+   char *end;
+   unsigned long long from, to;
+   if (*it == '-') {
+      // last bytes of the content
+      if (!isdigit((unsigned char)it[1]))
+         return 0;
+      unsigned long long suffix = strtoull(it + 1, &end, 10);
+      if (*end)
+         return 0;
+      if (!suffix || !size)
+         return -1;
+      from = suffix < size ? size - suffix : 0;
+      to = size - 1;
+   } else {
+      if (!isdigit((unsigned char)*it))
+         return 0;
+      from = strtoull(it, &end, 10);
+      if (*end != '-')
+         return 0;
+      it = end + 1;
+      to = ~0ull;
+      if (*it) {
+         if (!isdigit((unsigned char)*it))
+            return 0;
+         to = strtoull(it, &end, 10);
+         if (*end || to < from)
+            return 0;
+      }
+      if (from >= size)
+         return -1;
+      if (to >= size)
+         to = size - 1;
+   }
+   *first = from;
+   *count = to - from + 1;
+   return 1;
+}
+
+static void http_etag(char *etag, size_t size, unsigned long version)
+{
+   snprintf(etag, size, "\"%lu\"", version);
+}
+
+/*
+ * Answers with the content of a file or the requested range of it. The
+ * content is read straight into the output buffer, which is sent as is.
+ */
+static int http_file(vtp_session_t *s, vfsn_t *node)
+{
+   struct http *h = s->http;
+   for (int attempt = 0; attempt < HTTP_READ_RETRIES; attempt++) {
+      vfs_stat_t st;
+      vfs_stat(node, &st);
+      char etag[32], extra[256];
+      http_etag(etag, sizeof(etag), st.version);
+      int len = snprintf(extra, sizeof(extra), "ETag: %s\r\n", etag);
+      if (*h->if_none_match && http_match(h->if_none_match, etag))
+         return http_head(s, 304, 0, extra);
+
+      size_t first = 0, count = st.size;
+      int status = 200;
+      switch (http_range(h->range, st.size, &first, &count)) {
+         case -1:
+            snprintf(extra + len, sizeof(extra) - len, "Content-Range: bytes */%zu\r\n", st.size);
+            return http_reply(s, 416, extra);
+         case 1:
+            status = 206;
+            len += snprintf(extra + len, sizeof(extra) - len, "Content-Range: bytes %zu-%zu/%zu\r\n",
+               first, first + count - 1, st.size);
+            break;
+      }
+      snprintf(extra + len, sizeof(extra) - len,
+         "Accept-Ranges: bytes\r\nContent-Type: application/octet-stream\r\n");
+
+      size_t start = s->out_len;
+      if (http_head(s, status, count, extra) < 0)
+         return -1;
+      if (h->method == HTTP_HEAD || !count)
+         return 0;
+
+      // the head announced the stated size, so a changed content is read again
+      char *buf = vtp_out_reserve(s, count);
+      if (!buf)
+         return -1;
+      unsigned long version;
+      size_t read = vfs_read_range(node, buf, first, count, &version);
+      if (read == count && version == st.version) {
+         s->out_len += count;
+         return 0;
+      }
+      s->out_len = start;
+   }
+   return http_reply(s, 503, "Retry-After: 1\r\n");
+}
+
+/*
+ * Answers with the names of the children of dir, one per line. Names of
+ * directories end with a slash.
+ */
+static int http_list(vtp_session_t *s, vfsn_t *dir)
+{
+   struct http *h = s->http;
+   char etag[32], extra[128];
+   http_etag(etag, sizeof(etag), vfs_version(dir));
+   snprintf(extra, sizeof(extra), "ETag: %s\r\nContent-Type: text/plain\r\n", etag);
+   if (*h->if_none_match && http_match(h->if_none_match, etag))
+      return http_head(s, 304, 0, extra);
+
+   size_t start = s->out_len;
+   int failed = 0;
+   vfsn_t *it = vfs_open(dir);
+   vfs_child(&it);
+   while (it && !failed) {
+      int name_size = vfs_name_size(it);
+      char name[name_size+1];
+      memset(name, 0, sizeof(name));
+      vfs_name(it, name, name_size);
+      failed = vtp_write(s, "%s%s\n", name, vfs_is_dir(it) ? "/" : "") < 0;
+      vfs_next(&it);
+   }
+   vfs_close(it);
+   if (failed)
+      return -1;
+
+   // the head goes in front of the listing once its length is known
+   size_t len = s->out_len - start;
+   if (h->method == HTTP_HEAD)
+      s->out_len = start;
+   size_t head = s->out_len;
+   if (http_head(s, 200, len, extra) < 0)
+      return -1;
+   if (h->method == HTTP_HEAD)
+      return 0;
+
+   size_t head_len = s->out_len - head;
+   char copy[head_len];
+   memcpy(copy, s->out + head, head_len);
+   memmove(s->out + start + head_len, s->out + start, len);
+   memcpy(s->out + start, copy, head_len);
+   return 0;
+}
+
+static int http_get(vtp_session_t *s)
+{
+   vfsn_t *node = vtp_path(s->cwd, s->http->path);
+   if (!node)
+      return http_reply(s, 404, "");
+   int retval = vfs_is_dir(node) ? http_list(s, node) : http_file(s, node);
+   vfs_close(node);
+   return retval;
+}
+
+/*
+ * Stores body as content of the file at the path of the request, which gets
+ * created if needed. If-Match and If-None-Match make it conditional.
+ */
+static int http_put(vtp_session_t *s, char *body, size_t len)
+{
+   struct http *h = s->http;
+   size_t path_len = strlen(h->path);
+   if (h->path[path_len - 1] == '/')
+      return http_reply(s, 409, "");
+
+   char path[path_len + 1], size[32], number[32], etag[32];
+   snprintf(size, sizeof(size), "%zu", len);
+   int status = 0;
+
+   // the file may get created or deleted in between, which is tried again
+   for (int attempt = 0; attempt < 2 && !status; attempt++) {
+      strcpy(path, h->path);
+      vfsn_t *node = vtp_path(s->cwd, path);
+      int dir = node && vfs_is_dir(node);
+      unsigned long version = node ? vfs_version(node) : 0;
+      if (node)
+         http_etag(etag, sizeof(etag), version);
+      vfs_close(node);
+
+      if (dir) {
+         status = 409;
+         break;
+      }
+      if ((*h->if_match && (!node || !http_match(h->if_match, etag)))
+            || (*h->if_none_match && node && http_match(h->if_none_match, etag))) {
+         status = 412;
+         break;
+      }
+
+      char *msg;
+      strcpy(path, h->path);
+      if (node) {
+         // the update only succeeds on the version which was matched
+         snprintf(number, sizeof(number), "%lu", version);
+         int cond = *h->if_match && strcmp(h->if_match, "*");
+         char cmd[] = "update", arg[] = "if-version";
+         char *argv[] = { cmd, path, size, cond ? arg : NULL, number, NULL };
+         msg = vtp_call(s, argv, body, len);
+         status = http_status(msg);
+         if (status == 404)
+            status = *h->if_match ? 412 : 0;
+         continue;
+      }
+
+      // a missing parent would fall back to the working directory
+      char parent[path_len + 1];
+      strcpy(parent, h->path);
+      *strrchr(parent, '/') = '\0';
+      vfsn_t *dir_node = vtp_path(s->cwd, parent);
+      int found = dir_node && vfs_is_dir(dir_node);
+      vfs_close(dir_node);
+      if (!found) {
+         status = 409;
+         break;
+      }
+
+      char cmd[] = "create";
+      char *argv[] = { cmd, path, size, NULL };
+      msg = vtp_call(s, argv, body, len);
+      status = http_status(msg);
+      if (status == 409 && msg && strncmp(msg, "FILEEXISTS", 10) == 0)
+         status = *h->if_none_match ? 412 : 0;
+   }
+   return http_reply(s, status ? status : 409, "");
+}
+
+static int http_delete(vtp_session_t *s)
+{
+   struct http *h = s->http;
+   char path[strlen(h->path) + 1], etag[32];
+   strcpy(path, h->path);
+   vfsn_t *node = vtp_path(s->cwd, path);
+   if (!node)
+      return http_reply(s, 404, "");
+
+   // the root of the tenant stays
+   int root = node == s->cwd;
+   http_etag(etag, sizeof(etag), vfs_version(node));
+   vfs_close(node);
+   if (root)
+      return http_reply(s, 405, "Allow: GET, HEAD\r\n");
+   if (*h->if_match && !http_match(h->if_match, etag))
+      return http_reply(s, 412, "");
+
+   strcpy(path, h->path);
+   char cmd[] = "rm";
+   char *argv[] = { cmd, path, NULL };
+   return http_reply(s, http_status(vtp_call(s, argv, NULL, 0)), "");
+}
+
+/*
+ * Answers a complete request with body of len bytes. The connection gets
+ * closed on memory shortage.
+ */
+static void http_answer(vtp_session_t *s, char *body, size_t len)
+{
+   struct http *h = s->http;
+   __atomic_add_fetch(&http_requests, 1, __ATOMIC_RELAXED);
+   log_dbg("http request %i %s", h->method, h->path);
+
+   int retval;
+   size_t start = s->out_len;
+   switch (h->method) {
+      case HTTP_GET:
+      case HTTP_HEAD:
+         retval = http_get(s);
+         break;
+      case HTTP_PUT:
+         retval = http_put(s, body, len);
+         break;
+      case HTTP_DELETE:
+         retval = http_delete(s);
+         break;
+      default:
+         retval = http_reply(s, 405, "Allow: GET, HEAD, PUT, DELETE\r\n");
+         break;
+   }
+   if (retval < 0) {
+      s->out_len = start;
+      s->closed = 1;
+   }
+   vtp_charge(s, 1, len + s->out_len - start);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+struct http* http_new(void)
+{
+   pthread_once(&http_once, http_setup);
+   struct http *h = calloc(1, sizeof(struct http));
+   if (h)
+      h->length = -1;
+   return h;
+}
+
+void http_free(struct http *h)
+{
+   if (h)
+      free(h->path);
+   free(h);
+}
+
+void http_feed(vtp_session_t *s)
+{
+   struct http *h = s->http;
+   size_t pos = 0;
+   while (!s->closed) {
+      char *req = s->in + pos;
+      size_t avail = s->in_len - pos;
+
+      if (!h->parsed) {
+         // empty lines between requests are ignored
+         size_t blank = 0;
+         while (blank < avail && (req[blank] == '\r' || req[blank] == '\n'))
+            blank++;
+         pos += blank;
+         req += blank;
+         avail -= blank;
+
+         size_t head = http_head_len(req, avail);
+         if (!head || head > HTTP_HEAD_MAX) {
+            if (head > HTTP_HEAD_MAX || avail > HTTP_HEAD_MAX)
+               http_fail(s, 431);
+            break;
+         }
+         int status = http_parse(h, req, head);
+         h->parsed = 1;
+         h->head = head;
+         if (!status && h->length > HTTP_BODY_MAX)
+            status = 413;
+         if (!status && h->method == HTTP_PUT && h->length < 0 && !h->chunked)
+            status = 411;
+         if (status) {
+            http_fail(s, status);
+            break;
+         }
+      }
+
+      // wait for the whole body
+      size_t len = h->length > 0 ? h->length : 0;
+      int done = avail - h->head >= len;
+      if (h->chunked) {
+         done = http_dechunk(h, req, avail);
+         len = h->decoded;
+      }
+      if (done < 0) {
+         http_fail(s, done == -2 ? 413 : 400);
+         break;
+      }
+      if (!done) {
+         if (h->expect && !h->continued)
+            vtp_write(s, "HTTP/1.1 100 Continue\r\n\r\n");
+         h->continued = 1;
+         break;
+      }
+      if (vtp_yield(s))
+         break;
+
+      http_answer(s, req + h->head, len);
+      pos += h->chunked ? h->raw : h->head + len;
+      if (!h->keepalive)
+         s->closed = 1;
+      http_reset(h);
+   }
+
+   // keep incomplete data for the next call
+   memmove(s->in, s->in + pos, s->in_len - pos);
+   s->in_len -= pos;
+}
@@ -0,0 +1,35 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef HTTP
+#define HTTP
+
+#include "vtp.h"
+
+// answer of a full server, sent before the connection gets closed
+#define HTTP_BUSY "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+// largest request head and body
+#define HTTP_HEAD_MAX (16 << 10)
+#define HTTP_BODY_MAX (256 << 20)
+
+/*
+ * Allocates the request state of an http session. Returns NULL on memory
+ * shortage.
+ */
+struct http* http_new(void);
+
+/*
+ * Frees the request state.
+ */
+void http_free(struct http *h);
+
+/*
+ * Answers all complete requests of the input buffer of s in order. GET and
+ * HEAD read files and list directories, PUT creates or overwrites files and
+ * DELETE removes nodes. Responses are buffered until vtp_flush gets called.
+ */
+void http_feed(vtp_session_t *s);
+
+#endif
@@ -6,15 +6,42 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <string.h>
 
 #include "log.h"
 #include "vts.h"
+#include "vtl.h"
+#include "vfsspill.h"
+#include "vfsfind.h"
+#include "repl.h"
+#include "fair.h"
 
 static vts_socket_t socket;
 
 static void print_usage(void)
 {
-   puts("usage: fileserver -p port [-c maxclients] [-l trace|debug|info|warn|error]");
+   puts("usage: fileserver -p port|-u path|-H http port [-b address] [-B backlog] [-s shards]\n"
+        "                  [-C cpus] [-c maxclients] [-q queue depth] [-t queue timeout ms]\n"
+        "                  [-e threads|epoll|uring] [-l trace|debug|info|warn|error]\n"
+        "                  [-M memory budget[K|M|G]] [-S spill directory] [-I]\n"
+        "                  [-P replication port | -F primary host:port]\n"
+        "                  [-r commands/s] [-w bytes/s[K|M|G]] per connection");
+}
+
+/*
+ * Parses a size with an optional K, M or G suffix. Returns 0 if invalid.
+ */
+static size_t parse_size(const char *str)
+{
+   char *end;
+   size_t size = strtoull(str, &end, 10);
+   // larger units fall through to the smaller ones
+   switch (*end) {
+      case 'G': case 'g': size <<= 10;
+      case 'M': case 'm': size <<= 10;
+      case 'K': case 'k': size <<= 10; end++;
+   }
+   return *end ? 0 : size;
 }
 
 static void signal_handler(int signal)
@@ -24,16 +51,56 @@ static void signal_handler(int signal)
 
 int main(int argc, char* argv[])
 {
-   int port = -1, maxclients = 50;
+   vts_config_t config = VTS_CONFIG_INIT;
+   size_t budget = 0;
+   char *spill_dir = NULL;
+   char *primary = NULL;
+   int repl_port = -1;
+   long long ops_rate = 0;
+   size_t bytes_rate = 0;
 
    // setup logger
    log_set(STDOUT_FILENO);
 
    int c;
-   while((c = getopt(argc, argv, "p:c:l:")) != -1) {
+   while((c = getopt(argc, argv, "p:u:H:b:B:s:C:c:q:t:e:l:M:S:IP:F:r:w:")) != -1) {
       switch(c) {
-         case 'p': port = atoi(optarg); break;
-         case 'c': maxclients = atoi(optarg); break;
+         case 'p': config.port = atoi(optarg); break;
+         case 'u': config.unix_path = optarg; break;
+         case 'H': config.http_port = atoi(optarg); break;
+         case 'b': config.address = optarg; break;
+         case 'B': config.backlog = atoi(optarg); break;
+         case 's': config.shards = atoi(optarg); break;
+         case 'C': config.cpus = optarg; break;
+         case 'c': config.max_clients = atoi(optarg); break;
+         case 'q': config.queue_depth = atoi(optarg); break;
+         case 't': config.queue_timeout = atoi(optarg); break;
+         case 'M':
+            if (!(budget = parse_size(optarg))) {
+               print_usage();
+               return 1;
+            }
+            break;
+         case 'S': spill_dir = optarg; break;
+         case 'I': vfs_find_index(); break;
+         case 'P': repl_port = atoi(optarg); break;
+         case 'F': primary = optarg; break;
+         case 'r': ops_rate = atoll(optarg); break;
+         case 'w':
+            if (!(bytes_rate = parse_size(optarg))) {
+               print_usage();
+               return 1;
+            }
+            break;
+         case 'e':
+            if (strcmp("threads", optarg) == 0) config.backend = VTL_THREADS;
+            else if (strcmp("epoll", optarg) == 0) config.backend = VTL_EPOLL;
+            else if (strcmp("uring", optarg) == 0) config.backend = VTL_URING;
+            else {
+               print_usage();
+               return 1;
+            }
+            break;
          case 'l':
             if (strcmp("trace", optarg) == 0) log_level_set(LOG_TRACE);
             else if (strcmp("debug", optarg) == 0) log_level_set(LOG_DBG);
@@ -45,13 +112,33 @@ int main(int argc, char* argv[])
    }
    
    // parse args
-   if (port < 0) {
+   if ((config.port < 0 && !config.unix_path && config.http_port < 0) || (repl_port >= 0 && primary)
+         || ops_rate < 0) {
       print_usage();
       return 1;
    }
 
+   // file contents beyond the budget go to disk
+   if (budget && vfs_spill_init(budget, spill_dir)) {
+      return 1;
+   }
+
+   // fall back to the best backend of the running kernel
+   config.backend = vtl_detect(config.backend);
+   log_info("using %s backend", vtl_name(config.backend));
+
+   // sessions take turns and are limited to the given rates
+   fair_init(ops_rate, bytes_rate);
+
    // init socket
-   if (vts_init(&socket, port, maxclients)) {
+   if (vts_init(&socket, &config)) {
+      return 1;
+   }
+
+   // replicas follow the tree of a primary
+   if ((repl_port >= 0 && repl_primary(config.address, repl_port, socket.root))
+         || (primary && repl_replica(primary, socket.root))) {
+      vts_release(&socket);
       return 1;
    }
 
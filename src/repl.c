@@ -0,0 +1,752 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "repl.h"
+#include "vtp.h"
+#include "vfssnap.h"
+#include "log.h"
+#include "stats.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define REPL_NONE    0
+#define REPL_PRIMARY 1
+#define REPL_REPLICA 2
+
+#define REPL_PATH 4096
+#define REPL_DEPTH 256        // components of a path which get ordered one by one
+#define REPL_HEARTBEAT 1000   // ms until an idle primary sends its head
+#define REPL_RETRY 1          // s between connection attempts of a replica
+#define REPL_SEND_TIMEOUT 10  // s a replica may stall the stream
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+// replica connected to the primary, guarded by the log mutex
+struct repl_peer {
+   int fd, wakeup;
+   repl_record_t snap;  // sent first, the log collects in out meanwhile
+   repl_record_t out;   // stream waiting to be sent
+   int dropped;
+   unsigned long long acked;
+   struct repl_peer *next;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static int repl_mode = REPL_NONE;
+static vfsn_t *repl_root = NULL;
+
+// primary, changes hold the gate shared and the stripes of their paths,
+// a replica holds the gate exclusively while its snapshot gets cut
+static pthread_rwlock_t repl_gate;
+static pthread_rwlock_t repl_stripes[REPL_STRIPES];
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;   // log and peers
+static unsigned long long repl_seq = 0;
+static struct repl_peer *repl_peers = NULL;
+static int repl_listenfd = -1;
+
+// replica
+static char repl_host[256], repl_port[16];
+static unsigned long long repl_applied = 0, repl_head = 0;
+static long long repl_connected = 0, repl_snapshots = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static int repl_reserve(repl_record_t *rec, size_t size)
+{
+   if (rec->len + size <= rec->size)
+      return 0;
+
+   size_t newsize = rec->size ? rec->size : 256;
+   while (newsize < rec->len + size)
+      newsize *= 2;
+   char *data = realloc(rec->data, newsize);
+   if (!data)
+      return 1;
+   rec->data = data;
+   rec->size = newsize;
+   return 0;
+}
+
+static int repl_append(repl_record_t *rec, const void *data, size_t size)
+{
+   if (repl_reserve(rec, size))
+      return 1;
+
+   // commands without a payload pass no data at all
+   if (size)
+      memcpy(rec->data + rec->len, data, size);
+   rec->len += size;
+   return 0;
+}
+
+static int repl_printf(repl_record_t *rec, const char *fmt, ...)
+{
+   char line[128];
+   va_list ap;
+   va_start(ap, fmt);
+   int len = vsnprintf(line, sizeof(line), fmt, ap);
+   va_end(ap);
+   return repl_append(rec, line, len);
+}
+
+static int repl_send(int fd, const char *data, size_t size)
+{
+   while (size > 0) {
+      ssize_t len = send(fd, data, size, MSG_NOSIGNAL);
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len <= 0)
+         return 1;
+      data += len;
+      size -= len;
+   }
+   return 0;
+}
+
+static void repl_rwlock_init(pthread_rwlock_t *lock)
+{
+   // waiting writers block new readers, so exclusive changes do not starve
+   pthread_rwlockattr_t attr;
+   pthread_rwlockattr_init(&attr);
+   pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+   pthread_rwlock_init(lock, &attr);
+   pthread_rwlockattr_destroy(&attr);
+}
+
+static void repl_order_set(uint64_t *stripes, uint64_t hash)
+{
+   int stripe = hash % REPL_STRIPES;
+   stripes[stripe / 64] |= 1ull << (stripe % 64);
+}
+
+/*
+ * Appends mkdir and create commands rebuilding the subtree of dir as seen at
+ * epoch, whose path of length len is in path, to rec. Changes may go on
+ * meanwhile, they are not seen.
+ */
+static int repl_snapshot(repl_record_t *rec, vfsn_t *dir, unsigned long epoch, char *path, size_t len)
+{
+   // snapshots are views of the tree, not part of it, and left out
+   vfs_snap_child_t *children;
+   int count = vfs_snap_children(dir, epoch, &children);
+   if (count < 0)
+      return 1;
+
+   int failed = 0;
+   for (int i = 0; i < count && !failed; i++) {
+      vfs_snap_child_t *child = &children[i];
+      size_t size = strlen(child->name);
+      if (len + size + 2 > REPL_PATH) {
+         log_err("path too long for snapshot");
+         failed = 1;
+         continue;
+      }
+      path[len] = '/';
+      memcpy(path + len + 1, child->name, size + 1);
+
+      if (child->flags & VFS_DIR) {
+         char *argv[] = { "mkdir", path };
+         failed = repl_record_cmd(rec, argv, 2, NULL, 0)
+            || repl_snapshot(rec, child->node, epoch, path, len + 1 + size);
+      } else {
+         char *data = malloc(child->size + 1), number[32];
+         size_t content = data ? vfs_snap_read(child->node, epoch, data, 0, child->size) : 0;
+         snprintf(number, sizeof(number), "%zu", content);
+         char *argv[] = { "create", path, number };
+         failed = !data || repl_record_cmd(rec, argv, 3, data, content);
+         free(data);
+      }
+   }
+   vfs_snap_children_free(children, count);
+   path[len] = '\0';
+   return failed;
+}
+
+static void repl_peer_remove(struct repl_peer *peer)
+{
+   pthread_mutex_lock(&repl_mutex);
+   for (struct repl_peer **it = &repl_peers; *it; it = &(*it)->next) {
+      if (*it == peer) {
+         *it = peer->next;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&repl_mutex);
+}
+
+static void repl_peer_free(struct repl_peer *peer)
+{
+   close(peer->fd);
+   if (peer->wakeup >= 0)
+      close(peer->wakeup);
+   repl_record_free(&peer->snap);
+   repl_record_free(&peer->out);
+   free(peer);
+}
+
+/*
+ * Streams the log to a replica and collects its acknowledgements. An idle
+ * primary sends its head, so the replica knows its lag.
+ */
+static void* repl_peer_run(void *arg)
+{
+   struct repl_peer *peer = arg;
+   char in[256];
+   size_t in_len = 0;
+
+   // the snapshot comes before the log which collected while it was built
+   int failed = repl_send(peer->fd, peer->snap.data, peer->snap.len);
+   repl_record_free(&peer->snap);
+   while (!failed) {
+      struct pollfd fds[2] = { { peer->fd, POLLIN, 0 }, { peer->wakeup, POLLIN, 0 } };
+      int ready = poll(fds, 2, REPL_HEARTBEAT);
+      if (ready < 0 && errno != EINTR)
+         break;
+
+      if (ready > 0 && fds[0].revents) {
+         ssize_t len = recv(peer->fd, in + in_len, sizeof(in) - in_len - 1, 0);
+         if (len <= 0)
+            break;
+         in_len += len;
+         in[in_len] = '\0';
+
+         char *line = in, *end;
+         while ((end = strchr(line, '\n'))) {
+            unsigned long long seq;
+            if (sscanf(line, "ACK %llu", &seq) == 1)
+               __atomic_store_n(&peer->acked, seq, __ATOMIC_RELAXED);
+            line = end + 1;
+         }
+         in_len -= line - in;
+         memmove(in, line, in_len);
+         if (in_len == sizeof(in) - 1)
+            break;
+      }
+      if (ready > 0 && fds[1].revents) {
+         eventfd_t value;
+         eventfd_read(peer->wakeup, &value);
+      }
+
+      // take the pending stream and send it without the lock
+      pthread_mutex_lock(&repl_mutex);
+      repl_record_t out = peer->out;
+      memset(&peer->out, 0, sizeof(peer->out));
+      unsigned long long head = repl_seq;
+      failed = peer->dropped;
+      pthread_mutex_unlock(&repl_mutex);
+
+      if (!out.len && ready == 0)
+         failed = repl_printf(&out, "HEAD %llu\n", head);
+      if (!failed && out.len)
+         failed = repl_send(peer->fd, out.data, out.len);
+      repl_record_free(&out);
+   }
+
+   repl_peer_remove(peer);
+   log_info("replica disconnected");
+   repl_peer_free(peer);
+   return NULL;
+}
+
+/*
+ * Registers a new replica, which starts with a snapshot taken at the current
+ * position of the log. Changes only stop while the position is taken, the
+ * snapshot is built from the state at that point while they go on.
+ */
+static void repl_peer_start(int fd)
+{
+   struct repl_peer *peer = calloc(1, sizeof(struct repl_peer));
+   if (!peer) {
+      close(fd);
+      return;
+   }
+   peer->fd = fd;
+   peer->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+   // a stalled replica must not block its thread forever
+   struct timeval timeout = { REPL_SEND_TIMEOUT, 0 };
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+   // no logged change runs, so the epoch sees exactly the changes up to seq
+   pthread_rwlock_wrlock(&repl_gate);
+   unsigned long epoch = peer->wakeup < 0 ? 0 : vfs_snap_register();
+   pthread_mutex_lock(&repl_mutex);
+   unsigned long long seq = repl_seq;
+   if (epoch) {
+      peer->acked = seq;
+      peer->next = repl_peers;
+      repl_peers = peer;
+   }
+   pthread_mutex_unlock(&repl_mutex);
+   pthread_rwlock_unlock(&repl_gate);
+
+   repl_record_t snap = { };
+   char path[REPL_PATH] = "";
+   int failed = !epoch || repl_snapshot(&snap, repl_root, epoch, path, 0)
+      || repl_printf(&peer->snap, "SNAPSHOT %llu %zu\n", seq, snap.len)
+      || repl_append(&peer->snap, snap.data, snap.len);
+   repl_record_free(&snap);
+   if (epoch) {
+      vfs_snap_unregister(epoch);
+      vfs_snap_gc();
+   }
+
+   pthread_t thread;
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (failed || pthread_create(&thread, &attr, repl_peer_run, peer)) {
+      if (epoch)
+         repl_peer_remove(peer);
+      log_err("cannot start replica");
+      repl_peer_free(peer);
+   } else {
+      log_info("replica connected at %llu", seq);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+static void* repl_accept(void *arg)
+{
+   while (1) {
+      int fd = accept(repl_listenfd, NULL, NULL);
+      if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+         continue;
+      if (fd < 0) {
+         log_err("accepting replicas failed: %s", strerror(errno));
+         break;
+      }
+      repl_peer_start(fd);
+   }
+   return NULL;
+}
+
+static void repl_primary_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   unsigned long long seq, lag = 0;
+   long long count = 0;
+   pthread_mutex_lock(&repl_mutex);
+   seq = repl_seq;
+   for (struct repl_peer *peer = repl_peers; peer; peer = peer->next) {
+      unsigned long long acked = __atomic_load_n(&peer->acked, __ATOMIC_RELAXED);
+      if (seq - acked > lag)
+         lag = seq - acked;
+      count++;
+   }
+   pthread_mutex_unlock(&repl_mutex);
+   emit(ctx, "repl.seq", seq);
+   emit(ctx, "repl.replicas", count);
+   emit(ctx, "repl.lag", lag);
+}
+
+static int repl_connect(void)
+{
+   struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = AI_NUMERICSERV
+   }, *addr;
+   if (getaddrinfo(repl_host, repl_port, &hints, &addr) != 0)
+      return -1;
+
+   int fd = -1;
+   for (struct addrinfo *it = addr; it && fd < 0; it = it->ai_next) {
+      fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+      if (fd >= 0 && connect(fd, it->ai_addr, it->ai_addrlen) != 0) {
+         close(fd);
+         fd = -1;
+      }
+   }
+   freeaddrinfo(addr);
+   return fd;
+}
+
+/*
+ * Drops the whole tree before a snapshot gets applied.
+ */
+static void repl_reset(vtp_session_t *s)
+{
+   vfsn_t **nodes;
+   int count = vfs_glob(repl_root, "*", &nodes);
+   if (count > 0) {
+      vfs_delete_all(repl_root, nodes, count, NULL);
+      for (int i = 0; i < count; i++)
+         vfs_close(nodes[i]);
+      free(nodes);
+   }
+   vfs_close(s->cwd);
+   s->cwd = vfs_open(repl_root);
+}
+
+/*
+ * Executes the commands of a record like a client would, but without
+ * responses.
+ */
+static int repl_apply(vtp_session_t *s, const char *data, size_t size)
+{
+   // snapshots of an empty tree are empty
+   if (!size)
+      return 0;
+
+   char *in = vtp_reserve(s, size);
+   if (!in)
+      return 1;
+   memcpy(in, data, size);
+   s->in_len += size;
+   vtp_feed(s);
+   s->out_len = 0;
+   return 0;
+}
+
+/*
+ * Applies all complete messages of the primary in in. Returns 0 as long as
+ * the connection is fine.
+ */
+static int repl_receive(int fd, repl_record_t *in, vtp_session_t *s)
+{
+   if (repl_reserve(in, 65536))
+      return 1;
+   ssize_t len = recv(fd, in->data + in->len, in->size - in->len, 0);
+   if (len < 0 && errno == EINTR)
+      return 0;
+   if (len <= 0)
+      return 1;
+   in->len += len;
+
+   size_t pos = 0;
+   unsigned long long applied = repl_applied;
+   while (pos < in->len) {
+      char *line = in->data + pos;
+      char *end = memchr(line, '\n', in->len - pos);
+      if (!end)
+         break;
+
+      char kind[16];
+      unsigned long long seq;
+      size_t size = 0, body = end - in->data + 1;
+      *end = '\0';
+      int fields = sscanf(line, "%15s %llu %zu", kind, &seq, &size);
+      *end = '\n';
+      if (fields == 2 && strcmp("HEAD", kind) == 0) {
+         __atomic_store_n(&repl_head, seq, __ATOMIC_RELAXED);
+         pos = body;
+         continue;
+      }
+      if (fields != 3 || (strcmp("LOG", kind) && strcmp("SNAPSHOT", kind))) {
+         log_err("invalid message of primary");
+         return 1;
+      }
+      if (in->len - body < size)
+         break;
+
+      if (strcmp("SNAPSHOT", kind) == 0) {
+         log_info("applying snapshot at %llu", seq);
+         repl_reset(s);
+         __atomic_add_fetch(&repl_snapshots, 1, __ATOMIC_RELAXED);
+      }
+      if (repl_apply(s, in->data + body, size))
+         return 1;
+      applied = seq;
+      __atomic_store_n(&repl_applied, seq, __ATOMIC_RELAXED);
+      if (seq > __atomic_load_n(&repl_head, __ATOMIC_RELAXED))
+         __atomic_store_n(&repl_head, seq, __ATOMIC_RELAXED);
+      pos = body + size;
+   }
+   memmove(in->data, in->data + pos, in->len - pos);
+   in->len -= pos;
+
+   if (pos == 0)
+      return 0;
+   char ack[32];
+   int ack_len = snprintf(ack, sizeof(ack), "ACK %llu\n", applied);
+   return repl_send(fd, ack, ack_len);
+}
+
+static void* repl_follow(void *arg)
+{
+   vtp_session_t *s = arg;
+   repl_record_t in = { };
+   while (1) {
+      int fd = repl_connect();
+      if (fd < 0) {
+         sleep(REPL_RETRY);
+         continue;
+      }
+
+      log_info("following primary %s:%s", repl_host, repl_port);
+      __atomic_store_n(&repl_connected, 1, __ATOMIC_RELAXED);
+      while (!repl_receive(fd, &in, s)) { }
+      __atomic_store_n(&repl_connected, 0, __ATOMIC_RELAXED);
+      close(fd);
+      in.len = 0;
+
+      log_warn("lost primary %s:%s, reconnecting", repl_host, repl_port);
+      sleep(REPL_RETRY);
+   }
+   return NULL;
+}
+
+static void repl_replica_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   unsigned long long head = __atomic_load_n(&repl_head, __ATOMIC_RELAXED);
+   unsigned long long applied = __atomic_load_n(&repl_applied, __ATOMIC_RELAXED);
+   emit(ctx, "repl.connected", __atomic_load_n(&repl_connected, __ATOMIC_RELAXED));
+   emit(ctx, "repl.head", head);
+   emit(ctx, "repl.applied", applied);
+   emit(ctx, "repl.lag", head > applied ? head - applied : 0);
+   emit(ctx, "repl.snapshots", __atomic_load_n(&repl_snapshots, __ATOMIC_RELAXED));
+}
+
+static int repl_start(void* (*run)(void*), void *arg)
+{
+   pthread_t thread;
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   int retval = pthread_create(&thread, &attr, run, arg);
+   pthread_attr_destroy(&attr);
+   return retval;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+int repl_primary(const char *address, int port, vfsn_t *root)
+{
+   struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = AI_PASSIVE | AI_NUMERICSERV
+   }, *addr;
+   char service[16];
+   snprintf(service, sizeof(service), "%i", port);
+   if (getaddrinfo(address, service, &hints, &addr) != 0) {
+      log_err("cannot resolve address '%s'", address);
+      return 1;
+   }
+
+   int optvalue = 1;
+   repl_listenfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+   if (repl_listenfd >= 0)
+      setsockopt(repl_listenfd, SOL_SOCKET, SO_REUSEADDR, &optvalue, sizeof(optvalue));
+   int failed = repl_listenfd < 0 || bind(repl_listenfd, addr->ai_addr, addr->ai_addrlen)
+      || listen(repl_listenfd, 16);
+   freeaddrinfo(addr);
+   if (failed) {
+      log_err("cannot listen for replicas on %s:%i", address, port);
+      return 1;
+   }
+
+   repl_rwlock_init(&repl_gate);
+   for (int i = 0; i < REPL_STRIPES; i++)
+      repl_rwlock_init(&repl_stripes[i]);
+   repl_root = root;
+   repl_mode = REPL_PRIMARY;
+   if (repl_start(repl_accept, NULL)) {
+      return 1;
+   }
+   stats_register(repl_primary_stats, NULL);
+   log_info("accepting replicas on %s:%i", address, port);
+   return 0;
+}
+
+int repl_replica(const char *primary, vfsn_t *root)
+{
+   const char *colon = strrchr(primary, ':');
+   if (!colon || colon == primary || (size_t)(colon - primary) >= sizeof(repl_host)
+         || strlen(colon + 1) >= sizeof(repl_port)) {
+      log_err("invalid primary '%s'", primary);
+      return 1;
+   }
+   snprintf(repl_host, sizeof(repl_host), "%.*s", (int)(colon - primary), primary);
+   snprintf(repl_port, sizeof(repl_port), "%s", colon + 1);
+
+   // changes of the primary run through a session of their own
+   vtp_session_t *s = malloc(sizeof(vtp_session_t));
+   if (!s || vtp_session_init(s, -1, vfs_open(root))) {
+      free(s);
+      return 1;
+   }
+   s->apply = 1;
+   s->out_len = 0;
+
+   repl_root = root;
+   repl_mode = REPL_REPLICA;
+   if (repl_start(repl_follow, s)) {
+      return 1;
+   }
+   stats_register(repl_replica_stats, NULL);
+   return 0;
+}
+
+int repl_is_primary(void)
+{
+   return repl_mode == REPL_PRIMARY;
+}
+
+int repl_is_replica(void)
+{
+   return repl_mode == REPL_REPLICA;
+}
+
+void repl_order_add(repl_order_t *order, const char *path, int exclusive)
+{
+   // hashes of the path up to each component, dot-dot drops the last one
+   uint64_t hashes[REPL_DEPTH + 1];
+   int depth = 0;
+   hashes[0] = 14695981039346656037ull;
+   for (const char *c = path; *c; ) {
+      size_t len = strcspn(c, "/");
+      if (!len || (len == 1 && c[0] == '.')) {
+         // empty or current directory
+      } else if (len == 2 && c[0] == '.' && c[1] == '.') {
+         if (depth > 0)
+            depth--;
+      } else if (depth == REPL_DEPTH) {
+         // too deep to tell apart, ordered against everything
+         repl_order_set(order->exclusive, hashes[0]);
+         return;
+      } else {
+         uint64_t hash = (hashes[depth] ^ '/') * 1099511628211ull;
+         for (size_t i = 0; i < len; i++)
+            hash = (hash ^ (unsigned char)c[i]) * 1099511628211ull;
+         hashes[++depth] = hash;
+      }
+      c += len + (c[len] == '/');
+   }
+
+   for (int i = 0; i < depth; i++)
+      repl_order_set(order->shared, hashes[i]);
+   repl_order_set(exclusive ? order->exclusive : order->shared, hashes[depth]);
+}
+
+void repl_lock(repl_order_t *order)
+{
+   // stripes are taken in ascending order, so changes never wait in a cycle
+   pthread_rwlock_rdlock(&repl_gate);
+   for (int i = 0; i < REPL_STRIPES; i++) {
+      uint64_t bit = 1ull << (i % 64);
+      if (order->exclusive[i / 64] & bit)
+         pthread_rwlock_wrlock(&repl_stripes[i]);
+      else if (order->shared[i / 64] & bit)
+         pthread_rwlock_rdlock(&repl_stripes[i]);
+   }
+}
+
+void repl_unlock(repl_order_t *order)
+{
+   for (int i = 0; i < REPL_STRIPES; i++) {
+      if ((order->exclusive[i / 64] | order->shared[i / 64]) & (1ull << (i % 64)))
+         pthread_rwlock_unlock(&repl_stripes[i]);
+   }
+   pthread_rwlock_unlock(&repl_gate);
+}
+
+void repl_log(repl_record_t *rec)
+{
+   pthread_mutex_lock(&repl_mutex);
+   repl_seq++;
+   for (struct repl_peer *peer = repl_peers; peer; peer = peer->next) {
+      if (peer->dropped)
+         continue;
+
+      // the replica bootstraps again after it reconnects
+      if (peer->out.len + rec->len > REPL_BACKLOG
+            || repl_printf(&peer->out, "LOG %llu %zu\n", repl_seq, rec->len)
+            || repl_append(&peer->out, rec->data, rec->len)) {
+         log_warn("dropping replica which fell behind");
+         peer->dropped = 1;
+      }
+      eventfd_write(peer->wakeup, 1);
+   }
+   pthread_mutex_unlock(&repl_mutex);
+}
+
+int repl_record_cmd(repl_record_t *rec, char **argv, int argc, const char *payload, size_t size)
+{
+   for (int i = 0; i < argc; i++) {
+      // everything is literal in single quotes, a quote itself becomes '\''
+      if (repl_reserve(rec, strlen(argv[i]) * 4 + 3))
+         return 1;
+      char *out = rec->data + rec->len;
+      if (i)
+         *out++ = ' ';
+      *out++ = '\'';
+      for (const char *c = argv[i]; *c; c++) {
+         if (*c == '\'') {
+            memcpy(out, "'\\''", 4);
+            out += 4;
+         } else {
+            *out++ = *c;
+         }
+      }
+      *out++ = '\'';
+      rec->len = out - rec->data;
+   }
+   return repl_append(rec, "\n", 1) || repl_append(rec, payload, size);
+}
+
+void repl_record_free(repl_record_t *rec)
+{
+   free(rec->data);
+   memset(rec, 0, sizeof(*rec));
+}
+
+int repl_path(vfsn_t *node, char *buf, size_t size)
+{
+   // built backwards from node up to the root
+   size_t pos = size - 1;
+   buf[pos] = '\0';
+
+   int failed = 0;
+   vfsn_t *it = vfs_open(node);
+   while (it && !failed) {
+      vfsn_t *parent = vfs_open(it);
+      vfs_parent(&parent);
+      failed = vfs_is_deleted(it) || (!parent && it != repl_root);
+
+      size_t len = vfs_name_size(it);
+      if (parent && !failed && len + 2 > pos) {
+         failed = 1;
+      } else if (parent && !failed) {
+         char name[len + 1];
+         memset(name, 0, sizeof(name));
+         vfs_name(it, name, len);
+         len = strlen(name);
+         pos -= len;
+         memcpy(buf + pos, name, len);
+         buf[--pos] = '/';
+      }
+      vfs_close(it);
+      it = parent;
+   }
+   vfs_close(it);
+   if (failed)
+      return 1;
+
+   if (pos == size - 1)
+      buf[--pos] = '/';
+   memmove(buf, buf + pos, size - pos);
+   return 0;
+}
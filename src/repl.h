@@ -0,0 +1,90 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef REPL
+#define REPL
+
+#include "vfs.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// a replica whose stream falls this far behind gets dropped and bootstraps again
+#define REPL_BACKLOG (64 << 20)
+
+// locks which order the changes of the primary by the hashes of their paths
+#define REPL_STRIPES 256
+
+typedef struct repl_record {
+   char *data;
+   size_t len, size;
+} repl_record_t;
+
+/*
+ * Paths a change touches. Changes whose paths overlap, because one is an
+ * ancestor of the other, are applied and logged in the same order, all
+ * others run in parallel.
+ */
+typedef struct repl_order {
+   uint64_t shared[REPL_STRIPES / 64], exclusive[REPL_STRIPES / 64];
+} repl_order_t;
+
+/*
+ * Makes this process a primary which accepts replicas on address:port. A
+ * replica first receives a snapshot of root and then every logged change.
+ * Returns 0 on success.
+ */
+int repl_primary(const char *address, int port, vfsn_t *root);
+
+/*
+ * Makes this process a read-only replica of the primary at host:port, which
+ * is followed into root. Connection losses are retried. Returns 0 on success.
+ */
+int repl_replica(const char *primary, vfsn_t *root);
+
+/*
+ * Return whether the process runs as primary or replica.
+ */
+int repl_is_primary(void);
+int repl_is_replica(void);
+
+/*
+ * Adds the absolute path to order. With exclusive, the node at path and its
+ * descendants get changed, otherwise path must only stay where it is. The
+ * ancestors of path must stay where they are in both cases. Dot components
+ * are resolved.
+ */
+void repl_order_add(repl_order_t *order, const char *path, int exclusive);
+
+/*
+ * Orders changes on the primary. Every change which gets logged has to be
+ * applied and logged while holding the locks of its paths, so replicas see
+ * overlapping changes in the same order.
+ */
+void repl_lock(repl_order_t *order);
+void repl_unlock(repl_order_t *order);
+
+/*
+ * Appends a record to the log of the primary. Called with the locks of the
+ * change held.
+ */
+void repl_log(repl_record_t *rec);
+
+/*
+ * Appends the command argv of argc words, quoted for the command parser, and its
+ * payload to rec. Returns 0 on success.
+ */
+int repl_record_cmd(repl_record_t *rec, char **argv, int argc, const char *payload, size_t size);
+
+/*
+ * Frees the data of rec.
+ */
+void repl_record_free(repl_record_t *rec);
+
+/*
+ * Writes the absolute path of node into buf. Returns 0 on success or 1 if
+ * node is deleted or the path does not fit.
+ */
+int repl_path(vfsn_t *node, char *buf, size_t size);
+
+#endif
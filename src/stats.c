@@ -0,0 +1,67 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "stats.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct stats_provider {
+   stats_fn_t fn;
+   void *arg;
+   struct stats_provider *next;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static struct stats_provider *providers = NULL;
+static pthread_mutex_t providers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+int stats_register(stats_fn_t fn, void *arg)
+{
+   struct stats_provider *provider = malloc(sizeof(struct stats_provider));
+   if (!provider)
+      return 1;
+
+   provider->fn = fn;
+   provider->arg = arg;
+
+   // append to keep the order of registration
+   pthread_mutex_lock(&providers_lock);
+   struct stats_provider **it = &providers;
+   while (*it)
+      it = &(*it)->next;
+   provider->next = NULL;
+   *it = provider;
+   pthread_mutex_unlock(&providers_lock);
+   return 0;
+}
+
+void stats_unregister(stats_fn_t fn, void *arg)
+{
+   pthread_mutex_lock(&providers_lock);
+   for (struct stats_provider **it = &providers; *it; it = &(*it)->next) {
+      if ((*it)->fn == fn && (*it)->arg == arg) {
+         struct stats_provider *provider = *it;
+         *it = provider->next;
+         free(provider);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&providers_lock);
+}
+
+void stats_collect(stats_emit_t emit, void *ctx)
+{
+   pthread_mutex_lock(&providers_lock);
+   for (struct stats_provider *it = providers; it; it = it->next)
+      it->fn(it->arg, emit, ctx);
+   pthread_mutex_unlock(&providers_lock);
+}
@@ -0,0 +1,33 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef STATS
+#define STATS
+
+/*
+ * Callback receiving a single statistic value.
+ */
+typedef void (*stats_emit_t)(void *ctx, const char *name, long long value);
+
+/*
+ * Callback of a statistic provider, has to report its values via emit.
+ */
+typedef void (*stats_fn_t)(void *arg, stats_emit_t emit, void *ctx);
+
+/*
+ * Registers provider. Returns 0 on success.
+ */
+int stats_register(stats_fn_t fn, void *arg);
+
+/*
+ * Unregisters provider with the same function and argument.
+ */
+void stats_unregister(stats_fn_t fn, void *arg);
+
+/*
+ * Reports values of all registered providers via emit.
+ */
+void stats_collect(stats_emit_t emit, void *ctx);
+
+#endif
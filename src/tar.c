@@ -0,0 +1,786 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "tar.h"
+#include "vfsspill.h"
+#include "log.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define TAR_BLOCK 512
+
+// size of a content padded to whole blocks
+#define TAR_PAD(size) (((size) + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1))
+
+// longest name taken from an extended header
+#define TAR_NAME_MAX (64 << 10)
+
+// states of an import
+#define TAR_HEADER  0   // waiting for the next header
+#define TAR_CONTENT 1   // content of a file
+#define TAR_NAME    2   // long name of the next entry
+#define TAR_SKIP    3   // data of an entry which is not imported
+#define TAR_END     4   // end of archive, the rest is ignored
+
+#define MSG_EXPORTED "EXPORTED Archive exported"
+#define MSG_IMPORTED "IMPORTED Archive imported"
+#define ERR_NOSUCHDIR "NOSUCHDIR No such directory"
+#define ERR_NOMEMORY "NOMEMORY Out of memory"
+#define ERR_BADARCHIVE "BADARCHIVE Malformed archive"
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+// ustar header, also understood by GNU tar
+struct tar_header {
+   char name[100], mode[8], uid[8], gid[8], size[12], mtime[12], chksum[8], type;
+   char linkname[100], magic[6], version[2], uname[32], gname[32];
+   char devmajor[8], devminor[8], prefix[155], pad[12];
+};
+
+// directory being walked by an export
+struct tar_level {
+   vfsn_t *dir;
+   size_t len;          // length of the path naming dir, its children follow
+};
+
+struct tar {
+   // export walks depth first in name order, path holds the last entry,
+   // after which the walk continues, so deleted nodes do not disturb it
+   struct tar_level *levels;
+   int depth, levels_size;
+   char *path;
+   size_t path_len, path_size;
+   int skip_snapshots;
+   time_t mtime;
+
+   // headers of the next entry and the file whose content is sent
+   char *head;
+   size_t head_len, head_size;
+   vfsn_t *file;
+   size_t size, off;
+
+   // import
+   vfsn_t *dir;
+   size_t left;         // archive bytes still to come
+   int state;
+   char type;
+   size_t skip;
+   char *name;          // path of the next entry
+   char *parent;        // directory which was known to exist last
+   size_t parent_len;
+   char *error;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static pthread_once_t tar_once = PTHREAD_ONCE_INIT;
+static long long tar_exports = 0, tar_imports = 0, tar_entries = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void tar_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "tar.exports", __atomic_load_n(&tar_exports, __ATOMIC_RELAXED));
+   emit(ctx, "tar.imports", __atomic_load_n(&tar_imports, __ATOMIC_RELAXED));
+   emit(ctx, "tar.entries", __atomic_load_n(&tar_entries, __ATOMIC_RELAXED));
+}
+
+static void tar_setup(void)
+{
+   stats_register(tar_stats, NULL);
+}
+
+static struct tar* tar_new(void)
+{
+   pthread_once(&tar_once, tar_setup);
+   return calloc(1, sizeof(struct tar));
+}
+
+/*
+ * Makes sure that size bytes can be appended to buf. Returns pointer to the
+ * free space or NULL on memory shortage.
+ */
+static char* tar_reserve(char **buf, size_t len, size_t *bufsize, size_t size)
+{
+   if (len + size > *bufsize) {
+      size_t newsize = *bufsize ? *bufsize : 256;
+      while (newsize < len + size)
+         newsize *= 2;
+      char *newbuf = realloc(*buf, newsize);
+      if (!newbuf)
+         return NULL;
+      *buf = newbuf;
+      *bufsize = newsize;
+   }
+   return *buf + len;
+}
+
+static void tar_octal(char *field, size_t width, unsigned long long value)
+{
+   snprintf(field, width, "%0*llo", (int)width - 1, value);
+}
+
+static unsigned long long tar_number(const char *field, size_t width)
+{
+   // GNU tar stores large numbers in base 256, flagged by the high bit
+   unsigned long long value = 0;
+   if ((unsigned char)field[0] & 0x80) {
+      for (size_t i = 0; i < width; i++)
+         value = (value << 8) | (unsigned char)(i ? field[i] : field[i] & 0x7f);
+      return value;
+   }
+   for (size_t i = 0; i < width && field[i]; i++) {
+      if (field[i] >= '0' && field[i] <= '7')
+         value = value * 8 + field[i] - '0';
+   }
+   return value;
+}
+
+static unsigned tar_checksum(const struct tar_header *h, int sign)
+{
+   const unsigned char *block = (const unsigned char*)h;
+   unsigned sum = 0;
+   for (size_t i = 0; i < TAR_BLOCK; i++) {
+      if (i >= offsetof(struct tar_header, chksum) && i < offsetof(struct tar_header, type))
+         sum += ' ';
+      else
+         sum += sign ? (unsigned)(signed char)block[i] : block[i];
+   }
+   return sum;
+}
+
+/*
+ * Appends a header block for an entry of given type and size to the headers
+ * of the next entry.
+ */
+static int tar_block(struct tar *t, const char *name, size_t name_len, const char *prefix,
+   size_t prefix_len, char type, size_t size)
+{
+   struct tar_header *h = (struct tar_header*)tar_reserve(&t->head, t->head_len, &t->head_size, TAR_BLOCK);
+   if (!h)
+      return -1;
+   memset(h, 0, TAR_BLOCK);
+   memcpy(h->name, name, name_len < sizeof(h->name) ? name_len : sizeof(h->name));
+   memcpy(h->prefix, prefix, prefix_len);
+   tar_octal(h->mode, sizeof(h->mode), type == '5' ? 0755 : 0644);
+   tar_octal(h->uid, sizeof(h->uid), 0);
+   tar_octal(h->gid, sizeof(h->gid), 0);
+   tar_octal(h->size, sizeof(h->size), size);
+   tar_octal(h->mtime, sizeof(h->mtime), t->mtime);
+   h->type = type;
+   memcpy(h->magic, "ustar", 6);
+   memcpy(h->version, "00", 2);
+   snprintf(h->chksum, sizeof(h->chksum), "%06o", tar_checksum(h, 0));
+   h->chksum[7] = ' ';
+   t->head_len += TAR_BLOCK;
+   return 0;
+}
+
+/*
+ * Writes the headers of the entry at the path of the walk. Paths which do not
+ * fit into name and prefix get a pax header in front.
+ */
+static int tar_entry(struct tar *t, char type, size_t size)
+{
+   const char *path = t->path;
+   size_t len = t->path_len;
+   __atomic_add_fetch(&tar_entries, 1, __ATOMIC_RELAXED);
+   if (len <= sizeof(((struct tar_header*)0)->name))
+      return tar_block(t, path, len, "", 0, type, size);
+
+   // split at a slash, the name keeps at least one character
+   for (size_t i = len > 101 ? len - 101 : 0; i < len - 1 && i <= 155; i++) {
+      if (path[i] == '/' && path[i + 1] != '/' && len - i - 1 <= 100)
+         return tar_block(t, path + i + 1, len - i - 1, path, i, type, size);
+   }
+
+   // the record length counts its own digits
+   size_t record = len + 7;
+   while (record != len + 7 + snprintf(NULL, 0, "%zu", record))
+      record = len + 7 + snprintf(NULL, 0, "%zu", record);
+   if (tar_block(t, "././@PaxHeader", 14, "", 0, 'x', record))
+      return -1;
+   char *data = tar_reserve(&t->head, t->head_len, &t->head_size, TAR_PAD(record) + 1);
+   if (!data)
+      return -1;
+   memset(data, 0, TAR_PAD(record));
+   int digits = snprintf(data, record + 1, "%zu path=", record);
+   memcpy(data + digits, path, len);
+   data[record - 1] = '\n';
+   t->head_len += TAR_PAD(record);
+   return tar_block(t, path, len, "", 0, type, size);
+}
+
+/*
+ * Moves the walk to the next node and writes its headers. Returns 1 for an
+ * entry, 0 once the walk is complete and -1 on memory shortage.
+ */
+static int tar_next(struct tar *t)
+{
+   while (t->depth) {
+      struct tar_level *level = &t->levels[t->depth - 1];
+
+      // continue after the last entry of the directory
+      size_t after_len = t->path_len - level->len;
+      if (after_len && t->path[t->path_len - 1] == '/')
+         after_len--;
+      char after[after_len + 1];
+      memcpy(after, t->path + level->len, after_len);
+      after[after_len] = '\0';
+
+      vfsn_t *child = vfs_open(level->dir);
+      vfs_child_after(&child, after_len ? after : NULL);
+      if (!child) {
+         vfs_close(level->dir);
+         t->path_len = level->len;
+         t->depth--;
+         continue;
+      }
+
+      int name_size = vfs_name_size(child);
+      char *name = tar_reserve(&t->path, level->len, &t->path_size, name_size + 2);
+      if (!name) {
+         vfs_close(child);
+         return -1;
+      }
+      memset(name, 0, name_size + 1);
+      vfs_name(child, name, name_size);
+      t->path_len = level->len + strlen(name);
+
+      // snapshots would repeat the tree
+      if (t->skip_snapshots && t->depth == 1 && strcmp(name, VFS_SNAPSHOTS) == 0) {
+         vfs_close(child);
+         continue;
+      }
+
+      vfs_stat_t st;
+      vfs_stat(child, &st);
+      if (!(st.flags & VFS_DIR)) {
+         t->file = child;
+         t->size = st.size;
+         t->off = 0;
+         return tar_entry(t, '0', st.size) ? -1 : 1;
+      }
+
+      t->path[t->path_len++] = '/';
+      if (t->depth == t->levels_size) {
+         int size = t->levels_size * 2;
+         struct tar_level *levels = realloc(t->levels, size * sizeof(struct tar_level));
+         if (!levels) {
+            vfs_close(child);
+            return -1;
+         }
+         t->levels = levels;
+         t->levels_size = size;
+      }
+      t->levels[t->depth].dir = child;
+      t->levels[t->depth++].len = t->path_len;
+      return tar_entry(t, '5', 0) ? -1 : 1;
+   }
+   return 0;
+}
+
+/*
+ * Sends len bytes of the backing file at off to the socket fd.
+ */
+static int tar_sendfile(int fd, long long off, size_t len)
+{
+   // unlike send, sendfile has no flag against SIGPIPE
+   sigset_t pipe, old;
+   sigemptyset(&pipe);
+   sigaddset(&pipe, SIGPIPE);
+   pthread_sigmask(SIG_BLOCK, &pipe, &old);
+
+   off_t pos = off;
+   int retval = 0;
+   while (len) {
+      ssize_t sent = sendfile(fd, vfs_spill_fd(), &pos, len);
+      if (sent < 0 && errno == EINTR)
+         continue;
+      if (sent <= 0) {
+         if (errno == EPIPE) {
+            struct timespec zero = { 0, 0 };
+            sigtimedwait(&pipe, NULL, &zero);
+         }
+         retval = -1;
+         break;
+      }
+      len -= sent;
+   }
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   return retval;
+}
+
+/*
+ * Writes the headers of the next entry and a piece of the content of the
+ * current file as one CHUNK frame. Spilled contents are sent straight from
+ * the backing file if the session may send while feeding, all others are
+ * copied once into the output.
+ */
+static int tar_frame(vtp_session_t *s, struct tar *t, size_t piece)
+{
+   char line[32];
+   int line_len = snprintf(line, sizeof(line), "CHUNK %zu\n", t->head_len + piece);
+   char *out = vtp_out_reserve(s, line_len + t->head_len + piece + 1);
+   if (!out)
+      return -1;
+   memcpy(out, line, line_len);
+   memcpy(out + line_len, t->head, t->head_len);
+   out += line_len + t->head_len;
+
+   long long spilled = -1;
+   size_t data = t->off < t->size ? t->size - t->off : 0;
+   size_t read = 0;
+   if (data)
+      read = vfs_read_stream(t->file, out, t->off, data < piece ? data : piece, &spilled);
+
+   if (read && spilled >= 0 && s->direct) {
+      s->out_len += line_len + t->head_len;
+      if (vtp_flush(s) || tar_sendfile(s->fd, spilled, read)) {
+         s->closed = 1;
+         return 0;
+      }
+      out = s->out;
+   } else {
+      if (read && spilled >= 0)
+         read = vfs_spill_pread(spilled, out, read);
+      s->out_len += line_len + t->head_len + read;
+      out += read;
+   }
+
+   // a file which shrunk in between is filled up with zeros
+   memset(out, 0, piece - read);
+   out[piece - read] = '\n';
+   s->out_len += piece - read + 1;
+   return 0;
+}
+
+/*
+ * Normalizes the path of an archive entry in place. Leading slashes, empty
+ * and . components are dropped. Returns the length or -1 for paths leaving
+ * the directory of the import.
+ */
+static long tar_clean(char *path)
+{
+   size_t len = 0;
+   char *saveptr, *part = strtok_r(path, "/", &saveptr);
+   for (; part; part = strtok_r(NULL, "/", &saveptr)) {
+      if (strcmp(part, ".") == 0)
+         continue;
+      if (strcmp(part, "..") == 0)
+         return -1;
+      if (len)
+         path[len++] = '/';
+      size_t part_len = strlen(part);
+      memmove(path + len, part, part_len);
+      len += part_len;
+   }
+   path[len] = '\0';
+   return len;
+}
+
+/*
+ * Makes sure that the directory at the first len bytes of path exists in the
+ * directory of the import, creating missing ones. Returns NULL on success,
+ * otherwise the error.
+ */
+static char* tar_dir(vtp_session_t *s, struct tar *t, const char *path, size_t len)
+{
+   if (!len || (t->parent && t->parent_len == len && memcmp(t->parent, path, len) == 0))
+      return NULL;
+
+   char copy[len + 1];
+   memcpy(copy, path, len);
+   copy[len] = '\0';
+   vfsn_t *node = vtp_path(t->dir, copy);
+   int found = node && vfs_is_dir(node);
+   vfs_close(node);
+
+   // a missing parent would fall back to the working directory, so the
+   // directories get created from the top
+   for (size_t i = 1; !found && i <= len; i++) {
+      if (i < len && path[i] != '/')
+         continue;
+      memcpy(copy, path, i);
+      copy[i] = '\0';
+      char cmd[] = "mkdir";
+      char *argv[] = { cmd, copy, NULL };
+      char *msg = vtp_call(s, argv, NULL, 0);
+      if (msg && strncmp(msg, "DIRCREATED", 10) && strncmp(msg, "FILEEXISTS", 10))
+         return msg;
+      if (i == len) {
+         memcpy(copy, path, len);
+         copy[len] = '\0';
+         node = vtp_path(t->dir, copy);
+         if (!node || !vfs_is_dir(node)) {
+            vfs_close(node);
+            return ERR_NOSUCHDIR;
+         }
+         vfs_close(node);
+      }
+   }
+
+   char *parent = realloc(t->parent, len);
+   if (parent) {
+      memcpy(parent, path, len);
+      t->parent = parent;
+      t->parent_len = len;
+   }
+   return NULL;
+}
+
+/*
+ * Creates or overwrites the file at path with size bytes of content.
+ */
+static char* tar_file(vtp_session_t *s, struct tar *t, char *path, size_t len, char *content, size_t size)
+{
+   char *slash = strrchr(path, '/');
+   char *msg = tar_dir(s, t, path, slash ? (size_t)(slash - path) : 0);
+   if (msg)
+      return msg;
+
+   char copy[len + 1], number[32];
+   snprintf(number, sizeof(number), "%zu", size);
+   strcpy(copy, path);
+   char cmd[] = "create";
+   char *argv[] = { cmd, copy, number, NULL };
+   msg = vtp_call(s, argv, content, size);
+   if (msg && strncmp(msg, "FILEEXISTS", 10) == 0) {
+      strcpy(copy, path);
+      char update[] = "update";
+      argv[0] = update;
+      msg = vtp_call(s, argv, content, size);
+      if (msg && strncmp(msg, "UPDATED", 7))
+         return msg;
+   } else if (msg && strncmp(msg, "FILECREATED", 11)) {
+      return msg;
+   }
+   return NULL;
+}
+
+/*
+ * Takes the path of a GNU long name or a pax header of size bytes at data
+ * for the next entry.
+ */
+static int tar_name(struct tar *t, char *data, size_t size)
+{
+   char *name = NULL;
+   if (t->type == 'L') {
+      name = strndup(data, size);
+   }
+
+   // pax records are "length key=value\n"
+   for (size_t pos = 0; t->type == 'x' && pos < size; ) {
+      char *end;
+      unsigned long len = strtoul(data + pos, &end, 10);
+      char *key = end + 1;
+
+      // the length covers its own digits, the blank and the newline
+      if (end == data + pos || *end != ' ' || len < (size_t)(end - (data + pos)) + 2
+            || len > size - pos || data[pos + len - 1] != '\n' || key >= data + pos + len) {
+         free(name);
+         return -1;
+      }
+      char *value = memchr(key, '=', data + pos + len - key);
+      if (value && value - key == 4 && strncmp(key, "path", 4) == 0) {
+         free(name);
+         name = strndup(value + 1, data + pos + len - 1 - (value + 1));
+      }
+      pos += len;
+   }
+   if (!name)
+      return t->type == 'L' ? -1 : 0;
+   free(t->name);
+   t->name = name;
+   return 0;
+}
+
+/*
+ * Parses the header block at data and applies directory entries.
+ */
+static void tar_header(vtp_session_t *s, struct tar *t, char *data)
+{
+   struct tar_header *h = (struct tar_header*)data;
+
+   // the archive ends with zero blocks
+   size_t zero = 0;
+   while (zero < TAR_BLOCK && !data[zero])
+      zero++;
+   if (zero == TAR_BLOCK) {
+      t->state = TAR_END;
+      return;
+   }
+
+   unsigned sum = tar_number(h->chksum, sizeof(h->chksum));
+   if (sum != tar_checksum(h, 0) && sum != tar_checksum(h, 1)) {
+      t->error = t->error ? t->error : ERR_BADARCHIVE;
+      t->state = TAR_END;
+      return;
+   }
+
+   t->type = h->type;
+   t->size = tar_number(h->size, sizeof(h->size));
+   t->skip = TAR_PAD(t->size);
+   t->state = t->skip ? TAR_SKIP : TAR_HEADER;
+   if ((t->type == 'L' || t->type == 'x') && t->size) {
+      t->state = t->size <= TAR_NAME_MAX ? TAR_NAME : TAR_END;
+      if (t->state == TAR_END)
+         t->error = t->error ? t->error : ERR_BADARCHIVE;
+      return;
+   }
+
+   // path of a long name or of the header, ustar splits it in two
+   char *name = t->name;
+   t->name = NULL;
+   if (!name) {
+      int prefix = memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0];
+      if (asprintf(&name, "%.*s%s%.*s", prefix ? (int)sizeof(h->prefix) : 0, h->prefix,
+            prefix ? "/" : "", (int)sizeof(h->name), h->name) < 0) {
+         t->error = t->error ? t->error : ERR_NOMEMORY;
+         t->state = TAR_END;
+         return;
+      }
+   }
+
+   // old archives mark directories with a slash only
+   size_t name_len = strlen(name);
+   int dir = t->type == '5' || ((t->type == '0' || !t->type) && name_len && name[name_len - 1] == '/');
+   int file = !dir && (t->type == '0' || t->type == '7' || !t->type);
+   long len = tar_clean(name);
+   if (len < 0 || (file && !len) || (file && t->size > INT_MAX)) {
+      t->error = t->error ? t->error : ERR_BADARCHIVE;
+   } else if (dir && !t->error) {
+      __atomic_add_fetch(&tar_entries, 1, __ATOMIC_RELAXED);
+      t->error = tar_dir(s, t, name, len);
+   } else if (file && t->size) {
+      // the content is applied once it arrived completely
+      t->state = TAR_CONTENT;
+      t->name = name;
+      return;
+   } else if (file && !t->error) {
+      __atomic_add_fetch(&tar_entries, 1, __ATOMIC_RELAXED);
+      t->error = tar_file(s, t, name, len, data, 0);
+   }
+   free(name);
+}
+
+static size_t tar_consume(vtp_session_t *s, struct tar *t, char *data, size_t len)
+{
+   int last = len == t->left;
+   size_t need;
+   switch (t->state) {
+      case TAR_HEADER:
+         if (len < TAR_BLOCK)
+            break;
+         tar_header(s, t, data);
+         return TAR_BLOCK;
+
+      case TAR_CONTENT:
+      case TAR_NAME:
+         need = TAR_PAD(t->size);
+         if (len < need)
+            break;
+         if (t->state == TAR_NAME && tar_name(t, data, t->size)) {
+            t->error = t->error ? t->error : ERR_BADARCHIVE;
+            t->state = TAR_END;
+            return need;
+         }
+         if (t->state == TAR_CONTENT && !t->error) {
+            __atomic_add_fetch(&tar_entries, 1, __ATOMIC_RELAXED);
+            t->error = tar_file(s, t, t->name, strlen(t->name), data, t->size);
+         }
+         if (t->state == TAR_CONTENT) {
+            free(t->name);
+            t->name = NULL;
+         }
+         t->state = TAR_HEADER;
+         return need;
+
+      case TAR_SKIP:
+         need = len < t->skip ? len : t->skip;
+         if ((t->skip -= need) == 0)
+            t->state = TAR_HEADER;
+         return need;
+
+      case TAR_END:
+         return len;
+   }
+
+   // the archive ends inside of a record
+   if (last) {
+      t->error = t->error ? t->error : ERR_BADARCHIVE;
+      t->state = TAR_END;
+      return len;
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+struct tar* tar_export(vfsn_t *node)
+{
+   struct tar *t = tar_new();
+   if (!t) {
+      vfs_close(node);
+      return NULL;
+   }
+   __atomic_add_fetch(&tar_exports, 1, __ATOMIC_RELAXED);
+   t->mtime = time(NULL);
+
+   // a file is archived alone under its name
+   if (!vfs_is_dir(node)) {
+      int name_size = vfs_name_size(node);
+      if (!(t->path = calloc(1, name_size + 1))) {
+         vfs_close(node);
+         free(t);
+         return NULL;
+      }
+      vfs_name(node, t->path, name_size);
+      t->path_len = strlen(t->path);
+      t->path_size = name_size + 1;
+
+      vfs_stat_t st;
+      vfs_stat(node, &st);
+      t->file = node;
+      t->size = st.size;
+      if (tar_entry(t, '0', st.size)) {
+         tar_free(t);
+         return NULL;
+      }
+      return t;
+   }
+
+   t->levels = malloc(16 * sizeof(struct tar_level));
+   if (!t->levels) {
+      vfs_close(node);
+      free(t);
+      return NULL;
+   }
+   t->levels_size = 16;
+   t->levels[0].dir = node;
+   t->levels[0].len = 0;
+   t->depth = 1;
+
+   vfsn_t *root = vfs_open(node);
+   t->skip_snapshots = vfs_root(&root) == node;
+   vfs_close(root);
+   return t;
+}
+
+size_t tar_export_step(vtp_session_t *s, struct tar *t, char **msg)
+{
+   size_t written = 0;
+   while (written < TAR_STEP && !s->closed) {
+      if (!t->file && !t->head_len) {
+         int retval = tar_next(t);
+         if (retval < 0) {
+            *msg = ERR_NOMEMORY;
+            break;
+         }
+
+         // end of archive are two zero blocks
+         if (!retval) {
+            size_t len = 2 * TAR_BLOCK;
+            int line_len = vtp_write(s, "CHUNK %zu\n", len);
+            char *out = vtp_out_reserve(s, len + 1);
+            if (line_len < 0 || !out) {
+               *msg = ERR_NOMEMORY;
+               break;
+            }
+            memset(out, 0, len);
+            out[len] = '\n';
+            s->out_len += len + 1;
+            written += len;
+            *msg = MSG_EXPORTED;
+            break;
+         }
+      }
+
+      size_t piece = t->file ? TAR_PAD(t->size) - t->off : 0;
+      if (piece > TAR_STEP)
+         piece = TAR_STEP;
+      if (tar_frame(s, t, piece)) {
+         *msg = ERR_NOMEMORY;
+         break;
+      }
+      written += t->head_len + piece;
+      t->head_len = 0;
+      t->off += piece;
+      if (t->file && t->off == TAR_PAD(t->size)) {
+         vfs_close(t->file);
+         t->file = NULL;
+      }
+   }
+   return written;
+}
+
+struct tar* tar_import(vfsn_t *dir, size_t size, char *error)
+{
+   struct tar *t = tar_new();
+   if (!t) {
+      vfs_close(dir);
+      return NULL;
+   }
+   __atomic_add_fetch(&tar_imports, 1, __ATOMIC_RELAXED);
+   t->dir = dir;
+   t->left = size;
+   t->error = error;
+   if (error)
+      t->state = TAR_END;
+   return t;
+}
+
+size_t tar_import_step(vtp_session_t *s, struct tar *t, char *data, size_t len)
+{
+   // entries are created relative to the directory of the import
+   vfsn_t *cwd = s->cwd;
+   if (t->dir)
+      s->cwd = t->dir;
+   size_t used = tar_consume(s, t, data, len);
+   s->cwd = cwd;
+   t->left -= used;
+   return used;
+}
+
+char* tar_import_result(struct tar *t)
+{
+   if (!t->error && t->state != TAR_HEADER && t->state != TAR_END)
+      return ERR_BADARCHIVE;
+   return t->error ? t->error : MSG_IMPORTED;
+}
+
+void tar_free(struct tar *t)
+{
+   if (!t)
+      return;
+   for (int i = 0; i < t->depth; i++)
+      vfs_close(t->levels[i].dir);
+   vfs_close(t->file);
+   vfs_close(t->dir);
+   free(t->levels);
+   free(t->path);
+   free(t->head);
+   free(t->name);
+   free(t->parent);
+   free(t);
+}
@@ -0,0 +1,56 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef TAR
+#define TAR
+
+#include "vtp.h"
+
+// archive data an export produces in one step
+#define TAR_STEP (64 << 10)
+
+/*
+ * Starts the export of node as a tar archive. Directories are archived with
+ * their whole subtree, entries are named relative to node. The export takes
+ * over the handle of node, also on failure. Returns NULL on memory shortage.
+ */
+struct tar* tar_export(vfsn_t *node);
+
+/*
+ * Writes the next part of the archive as CHUNK frames to the output of s,
+ * about TAR_STEP bytes of it. The tree is walked while the archive is sent,
+ * so memory stays constant and a file changed in between may show up mixed,
+ * like with tar on a live file system. Exports of snapshots are consistent.
+ * Returns the number of archive bytes written and stores the response in msg
+ * once the archive is complete.
+ */
+size_t tar_export_step(vtp_session_t *s, struct tar *t, char **msg);
+
+/*
+ * Starts the import of an archive of size bytes into the directory dir.
+ * With error set, the archive is only consumed and error becomes the
+ * response. The import takes over the handle of dir, also on failure.
+ * Returns NULL on memory shortage.
+ */
+struct tar* tar_import(vfsn_t *dir, size_t size, char *error);
+
+/*
+ * Applies the archive data at data of len bytes as far as possible. Entries
+ * are created with the commands of s, so they are checked and replicated
+ * like sent ones, and contents are passed in place. Returns the number of
+ * bytes consumed, the rest has to be passed again with more data.
+ */
+size_t tar_import_step(vtp_session_t *s, struct tar *t, char *data, size_t len);
+
+/*
+ * Returns the response of an import whose archive was consumed completely.
+ */
+char* tar_import_result(struct tar *t);
+
+/*
+ * Frees an export or import and closes its nodes.
+ */
+void tar_free(struct tar *t);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "tenant.h"
+#include "stats.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+// registry of tenants in order of creation, only taken by use and drop
+static pthread_mutex_t tenant_lock = PTHREAD_MUTEX_INITIALIZER;
+static tenant_t *tenants = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void tenant_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   tenant_t *t = arg;
+   vfs_usage_t usage;
+   vfs_usage(t->root, &usage);
+
+   char name[TENANT_NAME_MAX + 32];
+   snprintf(name, sizeof(name), "tenant.%s.bytes", t->name);
+   emit(ctx, name, usage.bytes);
+   snprintf(name, sizeof(name), "tenant.%s.nodes", t->name);
+   emit(ctx, name, usage.files + usage.dirs);
+   snprintf(name, sizeof(name), "tenant.%s.quota", t->name);
+   emit(ctx, name, __atomic_load_n(&t->quota, __ATOMIC_RELAXED));
+   snprintf(name, sizeof(name), "tenant.%s.sessions", t->name);
+   emit(ctx, name, __atomic_load_n(&t->refs, __ATOMIC_RELAXED) - 1);
+   snprintf(name, sizeof(name), "tenant.%s.ops", t->name);
+   emit(ctx, name, __atomic_load_n(&t->ops, __ATOMIC_RELAXED));
+   snprintf(name, sizeof(name), "tenant.%s.rejected", t->name);
+   emit(ctx, name, __atomic_load_n(&t->rejected, __ATOMIC_RELAXED));
+   snprintf(name, sizeof(name), "tenant.%s.weight", t->name);
+   emit(ctx, name, __atomic_load_n(&t->weight, __ATOMIC_RELAXED));
+   snprintf(name, sizeof(name), "tenant.%s.cost", t->name);
+   emit(ctx, name, __atomic_load_n(&t->cost, __ATOMIC_RELAXED));
+}
+
+/*
+ * Creates tenant for root and takes over its handle. Returns NULL on memory
+ * shortage.
+ */
+static tenant_t* tenant_new(const char *name, vfsn_t *root)
+{
+   tenant_t *t = calloc(1, sizeof(tenant_t));
+   if (!t || !(t->name = strdup(name)) || stats_register(tenant_stats, t)) {
+      if (t)
+         free(t->name);
+      free(t);
+      return NULL;
+   }
+   t->root = root;
+   t->refs = 1;
+   t->weight = 1;
+   return t;
+}
+
+/*
+ * Appends t to the registry. Called with the registry lock held.
+ */
+static void tenant_link(tenant_t *t)
+{
+   tenant_t **it = &tenants;
+   while (*it)
+      it = &(*it)->next;
+   *it = t;
+}
+
+static tenant_t* tenant_find(const char *name)
+{
+   for (tenant_t *t = tenants; t; t = t->next) {
+      if (strcmp(t->name, name) == 0)
+         return t;
+   }
+   return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+int tenant_init(vfsn_t *root)
+{
+   tenant_t *t = tenant_new(TENANT_DEFAULT, vfs_open(root));
+   if (!t) {
+      vfs_close(root);
+      return 1;
+   }
+
+   pthread_mutex_lock(&tenant_lock);
+   tenant_link(t);
+   pthread_mutex_unlock(&tenant_lock);
+   return 0;
+}
+
+void tenant_release(void)
+{
+   pthread_mutex_lock(&tenant_lock);
+   tenant_t *list = tenants;
+   tenants = NULL;
+   pthread_mutex_unlock(&tenant_lock);
+
+   // the tree of the default tenant belongs to the caller of tenant_init
+   while (list) {
+      tenant_t *t = list;
+      list = t->next;
+      stats_unregister(tenant_stats, t);
+      if (strcmp(t->name, TENANT_DEFAULT))
+         vfs_delete(t->root);
+      tenant_put(t);
+   }
+}
+
+int tenant_valid(const char *name)
+{
+   size_t len = strlen(name);
+   if (len == 0 || len > TENANT_NAME_MAX)
+      return 0;
+   for (size_t i = 0; i < len; i++) {
+      if (!isalnum((unsigned char)name[i]) && !strchr("._-", name[i]))
+         return 0;
+   }
+   return 1;
+}
+
+tenant_t* tenant_get(const char *name, int create)
+{
+   pthread_mutex_lock(&tenant_lock);
+   tenant_t *t = tenant_find(name);
+   if (!t && create) {
+      // every tenant gets a root of its own, so no lock is shared
+      vfsn_t *root = vfs_create(NULL, "/", VFS_DIR);
+      t = root ? tenant_new(name, root) : NULL;
+      if (t) {
+         tenant_link(t);
+         log_info("created tenant %s", name);
+      } else if (root) {
+         vfs_delete(root);
+         vfs_close(root);
+      }
+   }
+   if (t)
+      __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&tenant_lock);
+   return t;
+}
+
+void tenant_put(tenant_t *t)
+{
+   if (!t || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL))
+      return;
+
+   vfs_close(t->root);
+   free(t->name);
+   free(t);
+}
+
+int tenant_drop(const char *name)
+{
+   if (strcmp(name, TENANT_DEFAULT) == 0)
+      return 2;
+
+   pthread_mutex_lock(&tenant_lock);
+   tenant_t **it = &tenants;
+   while (*it && strcmp((*it)->name, name))
+      it = &(*it)->next;
+   tenant_t *t = *it;
+   if (t)
+      *it = t->next;
+   pthread_mutex_unlock(&tenant_lock);
+   if (!t)
+      return 1;
+
+   // sessions of the tenant keep it until they leave, but find its tree
+   // deleted, which only gets detached here
+   stats_unregister(tenant_stats, t);
+   vfs_delete(t->root);
+   tenant_put(t);
+   log_info("dropped tenant %s", name);
+   return 0;
+}
+
+int tenant_admit(tenant_t *t, size_t size)
+{
+   long long quota = __atomic_load_n(&t->quota, __ATOMIC_RELAXED);
+   if (!quota)
+      return 1;
+
+   vfs_usage_t usage;
+   vfs_usage(t->root, &usage);
+   if (usage.bytes + (long long)size <= quota)
+      return 1;
+   __atomic_add_fetch(&t->rejected, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+void tenant_list(tenant_each_t each, void *ctx)
+{
+   pthread_mutex_lock(&tenant_lock);
+   for (tenant_t *t = tenants; t; t = t->next)
+      each(ctx, t);
+   pthread_mutex_unlock(&tenant_lock);
+}
@@ -0,0 +1,83 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef TENANT
+#define TENANT
+
+#include "vfs.h"
+#include <stddef.h>
+
+#define TENANT_DEFAULT "default"
+#define TENANT_NAME_MAX 64
+
+/*
+ * Isolated namespace with a tree of its own. Nodes of different tenants
+ * share no locks, so a busy tenant does not block the others.
+ */
+typedef struct tenant {
+   char *name;
+   vfsn_t *root;
+   long long quota;      // bytes of file contents, 0 for no limit
+   int refs;             // held by the registry and every session
+   int weight;           // share of the server against other tenants
+
+   // statistics
+   long long ops, rejected, cost;
+
+   struct tenant *next;
+} tenant_t;
+
+/*
+ * Registers the default tenant which serves the existing tree of root.
+ * Returns 0 on success.
+ */
+int tenant_init(vfsn_t *root);
+
+/*
+ * Drops all tenants and releases the default tenant.
+ */
+void tenant_release(void);
+
+/*
+ * Returns whether name is usable as tenant name: letters, digits, '.', '_'
+ * and '-' up to TENANT_NAME_MAX characters.
+ */
+int tenant_valid(const char *name);
+
+/*
+ * Returns the tenant with given name or NULL if there is none. With create,
+ * a missing tenant gets created, NULL is returned on memory shortage only.
+ * The caller has to release the tenant with tenant_put.
+ */
+tenant_t* tenant_get(const char *name, int create);
+
+/*
+ * Releases a tenant of tenant_get. The last release frees the tenant.
+ */
+void tenant_put(tenant_t *t);
+
+/*
+ * Removes the tenant with given name. Its tree gets detached right away and
+ * reclaimed in the background. Returns 0 on success, 1 if there is no such
+ * tenant and 2 for the default tenant.
+ */
+int tenant_drop(const char *name);
+
+/*
+ * Returns whether size more bytes fit into the quota of t. Rejections are
+ * counted.
+ */
+int tenant_admit(tenant_t *t, size_t size);
+
+/*
+ * Callback of tenant_list.
+ */
+typedef void (*tenant_each_t)(void *ctx, tenant_t *t);
+
+/*
+ * Reports all tenants in order of creation via each.
+ */
+void tenant_list(tenant_each_t each, void *ctx);
+
+#endif
@@ -3,8 +3,15 @@
 * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
 */
 #include "vfs.h"
+#include "vfslock.h"
+#include "vfsspill.h"
+#include "vfsfind.h"
+#include "vfssnap.h"
 #include "log.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <fnmatch.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // DEFINES / MACROS
@@ -17,12 +24,72 @@
    { __VA_ARGS__; } \
    if (node) pthread_rwlock_unlock(&(node)->lock);
 
+// versions come from a global generation, so a recreated node never reuses
+// the version of its predecessor. Bumps of a node are done under its lock.
+#define VFS_BUMP(node) __atomic_store_n(&(node)->version, \
+   __atomic_add_fetch(&vfs_generation, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED)
+
 #define VFS_SAFE_READ(node, ...) VFS_SAFE(VFS_READ, node, __VA_ARGS__)
 #define VFS_SAFE_WRITE(node, ...) VFS_SAFE(VFS_WRITE, node, __VA_ARGS__)
 #define VFS_SAFE2(lock, node1, node2, ...) VFS_SAFE(lock, node1, VFS_SAFE(lock, node2, __VA_ARGS__))
 #define VFS_SAFE3(lock, node1, node2, node3, ...) VFS_SAFE(lock, node1, VFS_SAFE2(lock, node2, node3, __VA_ARGS__))
 #define VFS_SAFE4(lock, node1, node2, node3, node4, ...) VFS_SAFE(lock, node1, VFS_SAFE3(lock, node2, node3, node4, __VA_ARGS__))
 
+#define VFS_NOTIFY(event, node) \
+   if (vfs_listener) vfs_listener(event, node, NULL, NULL);
+#define VFS_NOTIFY_AT(event, node, parent, name) \
+   if (vfs_listener) vfs_listener(event, node, parent, name);
+
+// number of bytes of a content of total bytes readable at off
+#define VFS_RANGE(total, off, size) \
+   ((off) < (total) ? ((size) < (total) - (off) ? (size) : (total) - (off)) : 0)
+
+// node created by a transaction which is not committed yet
+#define VFS_STAGED 0x40
+
+#define VFS_TXN_NONE   0
+#define VFS_TXN_CREATE 1
+#define VFS_TXN_WRITE  2
+#define VFS_TXN_DELETE 3
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct vfs_txn_op {
+   int type;
+   vfsn_t *node, *parent;
+   void *data;
+   size_t size;
+   int check;
+   unsigned long version;
+   vfs_usage_t usage;   // change of the usage above node, applied after commit
+};
+
+struct vfs_txn {
+   struct vfs_txn_op *ops;
+   int nops, size;
+};
+
+// deleted subtree waiting for the reclaimer
+struct vfs_reclaim {
+   vfsn_t *node, *parent;
+   struct vfs_reclaim *next;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static vfs_listener_t vfs_listener = NULL;
+static unsigned long vfs_generation = 0;
+
+// queue of the reclaimer thread, started by the first delete
+static pthread_once_t vfs_reclaim_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t vfs_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vfs_reclaim_cond = PTHREAD_COND_INITIALIZER;
+static struct vfs_reclaim *vfs_reclaim_head = NULL, **vfs_reclaim_tail = &vfs_reclaim_head;
+static int vfs_reclaim_started = 0;
+static long long vfs_reclaim_queue = 0, vfs_reclaimed = 0;
+
 ///////////////////////////////////////////////////////////////////////////////
 // LOCAL FUNCTIONS
 ///////////////////////////////////////////////////////////////////////////////
@@ -33,9 +100,229 @@ static int vfs_flag_checked(vfsn_t *node, char flag)
    return retval;
 }
 
-static void vfs_flag_set(vfsn_t *node, char flag)
+static void vfs_usage_load(vfsn_t *node, vfs_usage_t *usage)
+{
+   usage->bytes = __atomic_load_n(&node->usage.bytes, __ATOMIC_RELAXED);
+   usage->files = __atomic_load_n(&node->usage.files, __ATOMIC_RELAXED);
+   usage->dirs = __atomic_load_n(&node->usage.dirs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds sign times usage to node and all its ancestors. Each node is updated
+ * and left for its parent under its own lock, so a concurrent move or delete
+ * either carries the change along or the change follows the new parent.
+ * Deleted nodes stop the propagation. The caller must hold no locks.
+ */
+static void vfs_usage_add(vfsn_t *node, const vfs_usage_t *usage, int sign)
+{
+   if (!usage->bytes && !usage->files && !usage->dirs)
+      return;
+
+   vfsn_t *it = vfs_open(node);
+   while (it) {
+      vfsn_t *parent = NULL;
+      VFS_SAFE_READ(it,
+         if (!(it->flags & VFS_DEL)) {
+            __atomic_add_fetch(&it->usage.bytes, sign * usage->bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&it->usage.files, sign * usage->files, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&it->usage.dirs, sign * usage->dirs, __ATOMIC_RELAXED);
+            parent = vfs_open(it->parent);
+         }
+      );
+      vfs_close(it);
+      it = parent;
+   }
+}
+
+/*
+ * Returns the usage of a single new node with given flags.
+ */
+static vfs_usage_t vfs_usage_own(char flags)
+{
+   vfs_usage_t usage = { 0, (flags & VFS_FILE) ? 1 : 0, (flags & VFS_FILE) ? 0 : 1 };
+   return usage;
+}
+
+static unsigned vfs_index_prio(vfsn_t *node)
+{
+   // priorities only need to be well distributed
+   uint64_t x = (uintptr_t)node;
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdull;
+   x ^= x >> 33;
+   return (unsigned)x;
+}
+
+static vfsn_t* vfs_index_merge(vfsn_t *left, vfsn_t *right)
+{
+   if (!left || !right)
+      return left ? left : right;
+
+   if (left->idx_prio > right->idx_prio) {
+      left->idx_right = vfs_index_merge(left->idx_right, right);
+      return left;
+   }
+   right->idx_left = vfs_index_merge(left, right->idx_left);
+   return right;
+}
+
+/*
+ * Splits index into nodes sorting before name and the others.
+ */
+static void vfs_index_split(vfsn_t *index, const char *name, vfsn_t **left, vfsn_t **right)
+{
+   if (!index) {
+      *left = *right = NULL;
+   } else if (strcmp(index->name, name) < 0) {
+      vfs_index_split(index->idx_right, name, &index->idx_right, right);
+      *left = index;
+   } else {
+      vfs_index_split(index->idx_left, name, left, &index->idx_left);
+      *right = index;
+   }
+}
+
+static void vfs_index_insert(vfsn_t **index, vfsn_t *node)
 {
-   VFS_SAFE_WRITE(node, node->flags |= flag);
+   vfsn_t *left, *right;
+   node->idx_left = node->idx_right = NULL;
+   node->idx_prio = vfs_index_prio(node);
+   vfs_index_split(*index, node->name, &left, &right);
+   *index = vfs_index_merge(vfs_index_merge(left, node), right);
+}
+
+static void vfs_index_remove(vfsn_t **index, vfsn_t *node)
+{
+   while (*index && *index != node) {
+      index = strcmp(node->name, (*index)->name) < 0 ? &(*index)->idx_left : &(*index)->idx_right;
+   }
+   if (*index) {
+      *index = vfs_index_merge(node->idx_left, node->idx_right);
+      node->idx_left = node->idx_right = NULL;
+   }
+}
+
+static vfsn_t* vfs_index_find(vfsn_t *index, const char *name)
+{
+   while (index) {
+      int cmp = strcmp(name, index->name);
+      if (cmp == 0)
+         break;
+      index = cmp < 0 ? index->idx_left : index->idx_right;
+   }
+   return index;
+}
+
+/*
+ * Returns the last node sorting before name or NULL.
+ */
+static vfsn_t* vfs_index_before(vfsn_t *index, const char *name)
+{
+   vfsn_t *found = NULL;
+   while (index) {
+      if (strcmp(index->name, name) < 0) {
+         found = index;
+         index = index->idx_right;
+      } else {
+         index = index->idx_left;
+      }
+   }
+   return found;
+}
+
+/*
+ * Returns the first node sorting after name or NULL.
+ */
+static vfsn_t* vfs_index_after(vfsn_t *index, const char *name)
+{
+   vfsn_t *found = NULL;
+   while (index) {
+      if (strcmp(index->name, name) > 0) {
+         found = index;
+         index = index->idx_left;
+      } else {
+         index = index->idx_right;
+      }
+   }
+   return found;
+}
+
+/*
+ * Allocates an opened node which is not attached to any parent.
+ */
+static vfsn_t* vfs_node_new(char *name, char flags)
+{
+   vfsn_t *node = malloc(sizeof(vfsn_t));
+   if (node) {
+      memset(node, 0, sizeof(vfsn_t));
+      pthread_rwlock_init(&node->openlk, NULL);
+      pthread_rwlock_init(&node->lock, NULL);
+      node->name = strdup(name);
+      node->flags = flags;
+      node->snap_mod = vfs_snap_epoch();
+      VFS_BUMP(node);
+      vfs_open(node);
+
+      // snapshots share their structure, so they neither count nor get found
+      if (!(flags & VFS_SNAP)) {
+         node->usage = vfs_usage_own(flags);
+         vfs_find_add(node, node->name);
+      }
+   }
+   return node;
+}
+
+/*
+ * Links child between prev and next into parent. The caller must hold the
+ * locks of all four nodes.
+ */
+static void vfs_link(vfsn_t *parent, vfsn_t *child, vfsn_t *prev, vfsn_t *next)
+{
+   vfs_snap_preserve(parent);
+   child->root = parent->root;
+   child->parent = parent;
+   child->sil_prev = prev;
+   child->sil_next = next;
+   if (prev) {
+      prev->sil_next = child;
+   } else {
+      parent->child = child;
+   }
+   if (next) {
+      next->sil_prev = child;
+   }
+   vfs_index_insert(&parent->index, child);
+   VFS_BUMP(parent);
+}
+
+/*
+ * Unlinks node from its siblings and the index of parent, but keeps its
+ * parent pointer. The caller must hold the locks of parent, node and its
+ * siblings.
+ */
+static void vfs_unlink(vfsn_t *parent, vfsn_t *node)
+{
+   vfsn_t *prev = node->sil_prev, *next = node->sil_next;
+   if (parent)
+      vfs_snap_preserve(parent);
+
+   // link prev or parent to next
+   if (prev) {
+      prev->sil_next = next;
+   } else if (parent && parent->child == node) {
+      parent->child = next;
+   }
+
+   // link next to prev
+   if (next) {
+      next->sil_prev = prev;
+   }
+   node->sil_prev = node->sil_next = NULL;
+
+   if (parent) {
+      vfs_index_remove(&parent->index, node);
+      VFS_BUMP(parent);
+   }
 }
 
 static int vfs_attach(vfsn_t *parent, vfsn_t *child)
@@ -52,178 +339,986 @@ static int vfs_attach(vfsn_t *parent, vfsn_t *child)
       return 1;
 
    int retval = 0;
+   vfs_snap_enter();
    VFS_SAFE_WRITE(parent,
-      child->root = parent->root;
-
-      if (!parent->child) {
-         child->sil_next = NULL;
-         parent->child = child;
+      // deleted directories take no new children, the reclaimer relies on it,
+      // snapshots only take their own nodes
+      if (parent->flags & VFS_DEL) {
+         retval = 1;
+      } else if ((parent->flags & VFS_SNAP) && !(child->flags & VFS_SNAP)) {
+         retval = 1;
+      } else if (vfs_index_find(parent->index, child->name)
+            || (!parent->parent && !(child->flags & VFS_SNAP) && !strcmp(child->name, VFS_SNAPSHOTS))) {
+         retval = 2;
       } else {
-         vfsn_t *it = vfs_open(parent->child);
-         vfsn_t *prev = NULL;
-         while (it) {
-            if (prev) {
-               pthread_rwlock_unlock(&prev->lock);
-               vfs_close(prev);
-            }
-            prev = it;
-            pthread_rwlock_wrlock(&it->lock);
-            if (strcmp(it->name, child->name) == 0) {
-               retval = 2;
-            }
-            it = vfs_open(it->sil_next);
-         }
+         // link behind the last smaller sibling to keep the siblings sorted
+         vfsn_t *prev = vfs_index_before(parent->index, child->name);
+         vfsn_t *next = prev ? prev->sil_next : parent->child;
+
+         // lock in order prev, node, next to prevent dead locks!
+         VFS_SAFE3(VFS_WRITE, prev, child, next,
+            vfs_link(parent, child, prev, next);
+         );
+      }
+   )
+   vfs_snap_exit();
+   return retval;
+}
+
+/*
+ * Unlinks node from its parent. With keep, node keeps its parent pointer and
+ * the opened parent is returned, otherwise NULL.
+ */
+static vfsn_t* vfs_detach(vfsn_t* node, int keep)
+{
+   vfs_snap_enter();
+   vfsn_t *parent = vfs_open(node);
+   vfs_parent(&parent);
+
+   // siblings only change while their parent is write locked
+   VFS_SAFE_WRITE(parent,
+      if (node->parent == parent) {
+         vfsn_t *prev = node->sil_prev, *next = node->sil_next;
+
+         // lock in order parent, prev, node, next to prevent dead locks!
+         VFS_SAFE3(VFS_WRITE, prev, node, next,
+            vfs_unlink(parent, node);
+            if (!keep)
+               node->root = node->parent = NULL;
+         );
+      }
+   );
 
-         if (retval == 0) {
-            prev->sil_next = child;
-            child->sil_prev = prev;
+   if (!keep) {
+      vfs_close(parent);
+      parent = NULL;
+   }
+   vfs_snap_exit();
+   return parent;
+}
+
+/*
+ * Replaces the content of node by data, which is owned by the node from now
+ * on. The caller must hold the lock of node and pass the returned change of
+ * bytes to vfs_usage_add once the lock is released.
+ */
+static vfs_usage_t vfs_store(vfsn_t *node, void *data, size_t size)
+{
+   vfs_usage_t delta = { (long long)size - (long long)node->data_size, 0, 0 };
+   vfs_snap_preserve(node);
+   vfs_spill_untrack(node);
+   free(node->data);
+   node->data = data;
+   node->data_size = size;
+   vfs_spill_track(node);
+   VFS_BUMP(node);
+   return delta;
+}
+
+/*
+ * Overwrites the content of node. With check, only writes if node still has
+ * the given version.
+ */
+static int vfs_write_checked(vfsn_t *node, void *data, size_t size, int check, unsigned long version)
+{
+   int retval = 1;
+   vfs_usage_t delta;
+   vfs_snap_enter();
+   VFS_SAFE_WRITE(node,
+      if (node->flags & VFS_SNAP) {
+         retval = VFS_READONLY;
+      } else if (check && node->version != version) {
+         retval = VFS_CONFLICT;
+      } else if (node->flags & VFS_FILE) {
+         void *copy = malloc(size);
+         if (copy) {
+            memcpy(copy, data, size);
+            delta = vfs_store(node, copy, size);
+            retval = 0;
+         } else {
+            retval = 2;
          }
-         pthread_rwlock_unlock(&prev->lock);
-         vfs_close(prev);
       }
-      if (!retval) {
-         child->parent = parent;
+   );
+   vfs_snap_exit();
+   if (retval == 0) {
+      vfs_usage_add(node, &delta, 1);
+      vfs_spill_balance();
+      VFS_NOTIFY(VFS_EV_UPDATE, node);
+   }
+   return retval;
+}
+
+static struct vfs_txn_op* vfs_txn_add(vfs_txn_t *txn, int type, vfsn_t *node, vfsn_t *parent)
+{
+   if (txn->nops == txn->size) {
+      int size = txn->size ? txn->size * 2 : 16;
+      struct vfs_txn_op *ops = realloc(txn->ops, size * sizeof(struct vfs_txn_op));
+      if (!ops)
+         return NULL;
+      txn->ops = ops;
+      txn->size = size;
+   }
+
+   struct vfs_txn_op *op = &txn->ops[txn->nops++];
+   memset(op, 0, sizeof(*op));
+   op->type = type;
+   op->node = vfs_open(node);
+   op->parent = vfs_open(parent);
+   return op;
+}
+
+static int vfs_txn_deleting(vfs_txn_t *txn, vfsn_t *node)
+{
+   for (int i = 0; i < txn->nops; i++) {
+      if (txn->ops[i].type == VFS_TXN_DELETE && txn->ops[i].node == node)
+         return 1;
+   }
+   return 0;
+}
+
+/*
+ * Collects every existing node a commit has to write lock. Siblings are read
+ * without their parent locked, so the set gets checked again once locked.
+ */
+static int vfs_txn_lockset(vfs_txn_t *txn, vfs_lockset_t *set)
+{
+   int retval = 0;
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      if (op->type == VFS_TXN_CREATE && !vfs_flag_checked(op->parent, VFS_STAGED)) {
+         retval |= vfs_lockset_add(set, op->parent);
+         VFS_SAFE_READ(op->parent,
+            vfsn_t *prev = vfs_index_before(op->parent->index, op->node->name);
+            retval |= vfs_lockset_add(set, prev);
+            retval |= vfs_lockset_add(set, prev ? prev->sil_next : op->parent->child);
+         );
+      } else if (op->type == VFS_TXN_WRITE) {
+         retval |= vfs_lockset_add(set, op->node);
+      } else if (op->type == VFS_TXN_DELETE) {
+         retval |= vfs_lockset_add(set, op->parent);
+         retval |= vfs_lockset_add(set, op->node);
+         VFS_SAFE_READ(op->parent,
+            if (op->node->parent == op->parent) {
+               retval |= vfs_lockset_add(set, op->node->sil_prev);
+               retval |= vfs_lockset_add(set, op->node->sil_next);
+            }
+         );
       }
-   )
+   }
    return retval;
 }
 
-static void vfs_detach(vfsn_t* node)
+/*
+ * Checks all changes against the locked tree. Returns 0 if they can be
+ * applied, -1 if the lock set is incomplete or the result of the failed
+ * change.
+ */
+static int vfs_txn_validate(vfs_txn_t *txn, vfs_lockset_t *set, int *failed)
 {
-   // open handles
-   vfsn_t *prev = vfs_open(node), *next = vfs_open(node), *parent = NULL;
-   vfs_prev(&prev);
-   vfs_next(&next);
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      vfsn_t *parent = op->parent, *node = op->node;
+      *failed = i;
+
+      if (op->type == VFS_TXN_CREATE && !(parent->flags & VFS_STAGED)) {
+         if (node->flags & VFS_DEL)
+            continue;
+         if (parent->flags & (VFS_DEL | VFS_FILE))
+            return VFS_NOENT;
+         if (parent->flags & VFS_SNAP)
+            return VFS_READONLY;
 
-   if (!prev) {
-      parent = vfs_open(node);
-      vfs_parent(&parent);
+         vfsn_t *found = vfs_index_find(parent->index, node->name);
+         if ((found && !vfs_txn_deleting(txn, found))
+               || (!parent->parent && !strcmp(node->name, VFS_SNAPSHOTS)))
+            return VFS_EXISTS;
+
+         vfsn_t *prev = vfs_index_before(parent->index, node->name);
+         vfsn_t *next = prev ? prev->sil_next : parent->child;
+         if (!vfs_lockset_held(set, prev) || !vfs_lockset_held(set, next))
+            return -1;
+      } else if (op->type == VFS_TXN_WRITE) {
+         if (node->flags & VFS_DEL)
+            return VFS_NOENT;
+         if (node->flags & VFS_SNAP)
+            return VFS_READONLY;
+         if (!(node->flags & VFS_FILE))
+            return 1;
+         if (op->check && node->version != op->version)
+            return VFS_CONFLICT;
+      } else if (op->type == VFS_TXN_DELETE) {
+         if ((node->flags & VFS_DEL) || node->parent != parent)
+            return VFS_NOENT;
+         if (node->flags & VFS_SNAP)
+            return VFS_READONLY;
+         if (!vfs_lockset_held(set, node->sil_prev) || !vfs_lockset_held(set, node->sil_next))
+            return -1;
+      }
    }
+   return 0;
+}
 
-   // lock in order parent, prev, node, next to prevent dead locks!
-   VFS_SAFE4(VFS_WRITE, parent, prev, node, next,
+/*
+ * Applies all changes while the complete lock set is held. Deleted nodes are
+ * only unlinked here, their subtrees get removed after the locks are gone.
+ */
+static void vfs_txn_apply(vfs_txn_t *txn)
+{
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      if (op->type == VFS_TXN_WRITE) {
+         op->usage = vfs_store(op->node, op->data, op->size);
+         op->data = NULL;
+      }
+   }
 
-      // link prev or parent to next
-      if (prev) {
-         prev->sil_next = next;
-      } else if (parent) {
-         parent->child = next;
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      if (op->type == VFS_TXN_DELETE) {
+         op->node->flags |= VFS_DEL;
+         vfs_usage_load(op->node, &op->usage);
+         vfs_unlink(op->parent, op->node);
       }
-      
-      // link next to prev
-      if (next) {
-         next->sil_prev = prev;
+   }
+
+   // staged nodes come after their staged parents
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      vfsn_t *parent = op->parent, *node = op->node;
+      if (op->type != VFS_TXN_CREATE || (node->flags & VFS_DEL))
+         continue;
+
+      // nodes below staged parents are linked and counted already
+      if (node->parent) {
+         node->root = parent->root;
+      } else {
+         vfsn_t *prev = vfs_index_before(parent->index, node->name);
+         vfsn_t *next = prev ? prev->sil_next : parent->child;
+         vfs_link(parent, node, prev, next);
+         vfs_usage_load(node, &op->usage);
+      }
+      node->flags &= ~VFS_STAGED;
+   }
+}
+
+/*
+ * Reports the applied changes and removes the subtrees of deleted nodes.
+ */
+static void vfs_txn_finish(vfs_txn_t *txn)
+{
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      if (op->type == VFS_TXN_WRITE)
+         vfs_usage_add(op->node, &op->usage, 1);
+      else if (op->type == VFS_TXN_CREATE)
+         vfs_usage_add(op->parent, &op->usage, 1);
+      else if (op->type == VFS_TXN_DELETE)
+         vfs_usage_add(op->parent, &op->usage, -1);
+   }
+   vfs_spill_balance();
+
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+      if (op->type == VFS_TXN_CREATE && !vfs_is_deleted(op->node)) {
+         VFS_NOTIFY(VFS_EV_CREATE, op->node);
+      } else if (op->type == VFS_TXN_WRITE) {
+         VFS_NOTIFY(VFS_EV_UPDATE, op->node);
+      }
+   }
+
+   for (int i = 0; i < txn->nops; i++) {
+      if (txn->ops[i].type == VFS_TXN_DELETE)
+         vfs_delete(txn->ops[i].node);
+   }
+}
+
+static void vfs_txn_free(vfs_txn_t *txn, int committed)
+{
+   for (int i = 0; i < txn->nops; i++) {
+      struct vfs_txn_op *op = &txn->ops[i];
+
+      // staged trees are dropped at their top
+      if (!committed && op->type == VFS_TXN_CREATE && !vfs_flag_checked(op->parent, VFS_STAGED)
+            && !vfs_is_deleted(op->node))
+         vfs_delete(op->node);
+   }
+   for (int i = 0; i < txn->nops; i++) {
+      vfs_close(txn->ops[i].node);
+      vfs_close(txn->ops[i].parent);
+      free(txn->ops[i].data);
+   }
+   free(txn->ops);
+   free(txn);
+}
+
+/*
+ * Returns whether node is it or one of its ancestors.
+ */
+static int vfs_is_ancestor(vfsn_t *node, vfsn_t *it)
+{
+   int found = 0;
+   it = vfs_open(it);
+   while (it && !found) {
+      found = it == node;
+      vfs_parent(&it);
+   }
+   vfs_close(it);
+   return found;
+}
+
+/*
+ * Collects the nodes a move of node from parent into newparent touches. The
+ * siblings are only read while node is still below parent.
+ */
+static int vfs_move_lockset(vfsn_t *node, vfsn_t *parent, vfsn_t *newparent,
+   const char *name, vfs_lockset_t *set)
+{
+   int retval = vfs_lockset_add(set, parent);
+   retval |= vfs_lockset_add(set, node);
+   retval |= vfs_lockset_add(set, newparent);
+   VFS_SAFE_READ(parent,
+      if (node->parent == parent) {
+         retval |= vfs_lockset_add(set, node->sil_prev);
+         retval |= vfs_lockset_add(set, node->sil_next);
       }
-   
-      node->root = node->parent = node->sil_prev = node->sil_next = NULL;
    );
+   VFS_SAFE_READ(newparent,
+      vfsn_t *prev = vfs_index_before(newparent->index, name);
+      retval |= vfs_lockset_add(set, prev);
+      retval |= vfs_lockset_add(set, prev ? prev->sil_next : newparent->child);
+
+      // the replaced node and its siblings
+      vfsn_t *found = vfs_index_find(newparent->index, name);
+      if (found) {
+         retval |= vfs_lockset_add(set, found);
+         retval |= vfs_lockset_add(set, found->sil_prev);
+         retval |= vfs_lockset_add(set, found->sil_next);
+      }
+   );
+   return retval;
+}
+
+/*
+ * Checks the move against the locked tree. Returns 0 if it can be applied,
+ * -1 if the lock set is incomplete, -2 if node changed its parent in between
+ * or the result of the failed move.
+ */
+static int vfs_move_validate(vfsn_t *node, vfsn_t *parent, vfsn_t *newparent,
+   const char *name, int replace, vfs_lockset_t *set)
+{
+   if (node->flags & VFS_DEL)
+      return VFS_NOENT;
+   if (node->parent != parent)
+      return -2;
+   if (newparent->flags & (VFS_DEL | VFS_FILE))
+      return VFS_NOENT;
+   if ((node->flags | parent->flags | newparent->flags) & VFS_SNAP)
+      return VFS_READONLY;
+   if (!newparent->parent && !strcmp(name, VFS_SNAPSHOTS))
+      return VFS_EXISTS;
+   if (!vfs_lockset_held(set, node->sil_prev) || !vfs_lockset_held(set, node->sil_next))
+      return -1;
+
+   vfsn_t *prev = vfs_index_before(newparent->index, name);
+   vfsn_t *next = prev ? prev->sil_next : newparent->child;
+   if (!vfs_lockset_held(set, prev) || !vfs_lockset_held(set, next))
+      return -1;
+
+   vfsn_t *found = vfs_index_find(newparent->index, name);
+   if (!found || found == node)
+      return 0;
+   if (!vfs_lockset_held(set, found) || !vfs_lockset_held(set, found->sil_prev)
+         || !vfs_lockset_held(set, found->sil_next))
+      return -1;
+
+   // only files replace files and directories replace empty directories
+   if (!replace || (found->flags & VFS_FILE) != (node->flags & VFS_FILE) || found->child)
+      return VFS_EXISTS;
+   return 0;
+}
+
+/*
+ * Moves node while the complete lock set is held and returns the replaced
+ * node, which is only unlinked here. Takes ownership of name and stores the
+ * old name in oldname.
+ */
+static vfsn_t* vfs_move_apply(vfsn_t *node, vfsn_t *parent, vfsn_t *newparent,
+   char *name, char **oldname, vfs_usage_t *moved, vfs_usage_t *replaced)
+{
+   vfsn_t *found = vfs_index_find(newparent->index, name);
+   if (found == node) {
+      *oldname = name;
+      return NULL;
+   }
+   if (found) {
+      found->flags |= VFS_DEL;
+      vfs_usage_load(found, replaced);
+      vfs_unlink(newparent, found);
+      vfs_open(found);
+   }
+
+   vfs_usage_load(node, moved);
+   vfs_unlink(parent, node);
+   *oldname = node->name;
+   node->name = name;
+   vfs_find_remove(node, *oldname);
+   vfs_find_add(node, name);
+   VFS_BUMP(node);
+
+   vfsn_t *prev = vfs_index_before(newparent->index, name);
+   vfsn_t *next = prev ? prev->sil_next : newparent->child;
+   vfs_link(newparent, node, prev, next);
+   return found;
+}
+
+/*
+ * Moves node below its current parent under the rename lock of the move.
+ * Returns -2 if node changed its parent and the move has to start over.
+ */
+static int vfs_move_locked(vfsn_t *node, vfsn_t *parent, vfsn_t *newparent,
+   char *name, int replace)
+{
+   vfs_lockset_t set;
+   vfs_lockset_init(&set);
+
+   vfsn_t *found = NULL;
+   char *oldname = NULL;
+   vfs_usage_t moved, replaced;
+   int retval;
+   do {
+      retval = vfs_move_lockset(node, parent, newparent, name, &set) ? 2 : vfs_lockset_acquire(&set);
+      if (retval == 2)
+         break;
+      if (retval == 0) {
+         retval = vfs_move_validate(node, parent, newparent, name, replace, &set);
+         if (retval == 0)
+            found = vfs_move_apply(node, parent, newparent, name, &oldname, &moved, &replaced);
+      } else {
+         retval = -1;
+      }
+      vfs_lockset_release(&set);
+   } while (retval == -1);
+   vfs_lockset_free(&set);
+
+   if (retval == 0 && oldname != name) {
+      if (parent != newparent) {
+         vfs_usage_add(parent, &moved, -1);
+         vfs_usage_add(newparent, &moved, 1);
+      }
+      if (found) {
+         vfs_usage_add(newparent, &replaced, -1);
+         vfs_delete(found);
+         vfs_close(found);
+      }
+      VFS_NOTIFY_AT(VFS_EV_MOVEFROM, node, parent, oldname);
+      VFS_NOTIFY(VFS_EV_MOVETO, node);
+      free(oldname);
+   } else if (retval == 0) {
+      free(name);
+   }
+   return retval;
+}
+
+/*
+ * Moves node until it stays below the same parent while the move runs.
+ */
+static int vfs_move_node(vfsn_t *node, vfsn_t *newparent, char* name, int replace)
+{
+   int retval;
+   do {
+      vfsn_t *parent = vfs_open(node);
+      if (!vfs_parent(&parent))
+         return VFS_NOENT;
+      char *newname = strdup(name);
+      if (!newname) {
+         vfs_close(parent);
+         return 2;
+      }
 
-   // close handles
+      // moves into other directories are serialized below the lowest common
+      // ancestor of both parents, which makes the loop check below stable
+      vfsn_t *ancestor = NULL;
+      while (parent != newparent && !ancestor) {
+         ancestor = vfs_common_ancestor(parent, newparent);
+         if (!ancestor)
+            break;
+         vfs_rename_lock(ancestor);
+         vfsn_t *check = vfs_common_ancestor(parent, newparent);
+         vfs_close(check);
+         if (check != ancestor) {
+            vfs_rename_unlock(ancestor);
+            vfs_close(ancestor);
+            ancestor = NULL;
+         }
+      }
+
+      if (parent != newparent && !ancestor) {
+         retval = VFS_NOENT;
+         free(newname);
+      } else if (ancestor && vfs_is_ancestor(node, newparent)) {
+         retval = VFS_LOOP;
+         free(newname);
+      } else {
+         retval = vfs_move_locked(node, parent, newparent, newname, replace);
+         if (retval != 0)
+            free(newname);
+      }
+
+      if (ancestor) {
+         vfs_rename_unlock(ancestor);
+         vfs_close(ancestor);
+      }
+      vfs_close(parent);
+   } while (retval == -2);
+   return retval;
+}
+
+/*
+ * Flags and removes all descendants of a deleted node, deepest first. The
+ * node gets no new children once flagged, so the loop ends.
+ */
+static void vfs_reclaim_tree(vfsn_t *node)
+{
+   vfsn_t *child;
+   for (;;) {
+      VFS_SAFE_READ(node, child = vfs_open(node->child));
+      if (!child)
+         break;
+
+      // children moved away in between are not ours anymore, children
+      // deleted in between are only unlinked
+      int linked, mine;
+      VFS_SAFE_WRITE(child,
+         linked = child->parent == node;
+         mine = linked && !(child->flags & VFS_DEL);
+         if (mine)
+            child->flags |= VFS_DEL;
+      );
+      if (mine) {
+         vfs_reclaim_tree(child);
+         VFS_NOTIFY(VFS_EV_DELETE, child);
+         __atomic_add_fetch(&vfs_reclaimed, 1, __ATOMIC_RELAXED);
+      }
+      if (linked)
+         vfs_detach(child, 0);
+      vfs_close(child);
+   }
+}
+
+/*
+ * Removes the subtree of node and closes the handles of node and parent.
+ */
+static void vfs_reclaim_node(vfsn_t *node, vfsn_t *parent)
+{
+   vfs_reclaim_tree(node);
+
+   // the old location was only kept for reporting the subtree
+   VFS_SAFE_WRITE(node,
+      if (node->parent == parent)
+         node->root = node->parent = NULL;
+   );
+   __atomic_add_fetch(&vfs_reclaimed, 1, __ATOMIC_RELAXED);
    vfs_close(parent);
-   vfs_close(prev);
-   vfs_close(next);
+   vfs_close(node);
+}
+
+static void* vfs_reclaimer(void *arg)
+{
+   for (;;) {
+      pthread_mutex_lock(&vfs_reclaim_lock);
+      while (!vfs_reclaim_head)
+         pthread_cond_wait(&vfs_reclaim_cond, &vfs_reclaim_lock);
+      struct vfs_reclaim *item = vfs_reclaim_head;
+      vfs_reclaim_head = item->next;
+      if (!vfs_reclaim_head)
+         vfs_reclaim_tail = &vfs_reclaim_head;
+      pthread_mutex_unlock(&vfs_reclaim_lock);
+
+      // items without node come from released snapshots
+      if (item->node)
+         vfs_reclaim_node(item->node, item->parent);
+      else
+         vfs_snap_gc();
+      __atomic_sub_fetch(&vfs_reclaim_queue, 1, __ATOMIC_RELAXED);
+      free(item);
+   }
+   return NULL;
+}
+
+static void vfs_reclaim_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "vfs.reclaim_queue", __atomic_load_n(&vfs_reclaim_queue, __ATOMIC_RELAXED));
+   emit(ctx, "vfs.reclaimed", __atomic_load_n(&vfs_reclaimed, __ATOMIC_RELAXED));
+}
+
+static void vfs_reclaim_setup(void)
+{
+   pthread_t thread;
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   vfs_reclaim_started = pthread_create(&thread, &attr, vfs_reclaimer, NULL) == 0;
+   pthread_attr_destroy(&attr);
+   stats_register(vfs_reclaim_stats, NULL);
+}
+
+/*
+ * Hands the unlinked subtree of node over to the reclaimer, which owns the
+ * handles of node and parent from now on. Without reclaimer, the subtree is
+ * removed right away. Without node, the reclaimer releases the states kept
+ * for snapshots, which is left to the next release if it fails.
+ */
+static void vfs_reclaim(vfsn_t *node, vfsn_t *parent)
+{
+   pthread_once(&vfs_reclaim_once, vfs_reclaim_setup);
+   struct vfs_reclaim *item = vfs_reclaim_started ? malloc(sizeof(struct vfs_reclaim)) : NULL;
+   if (!item) {
+      if (node)
+         vfs_reclaim_node(node, parent);
+      return;
+   }
+   item->node = node;
+   item->parent = parent;
+   item->next = NULL;
+
+   pthread_mutex_lock(&vfs_reclaim_lock);
+   *vfs_reclaim_tail = item;
+   vfs_reclaim_tail = &item->next;
+   __atomic_add_fetch(&vfs_reclaim_queue, 1, __ATOMIC_RELAXED);
+   pthread_cond_signal(&vfs_reclaim_cond);
+   pthread_mutex_unlock(&vfs_reclaim_lock);
+}
+
+/*
+ * Creates the children of a directory of a snapshot on first access. They
+ * are built from the state of the live directory at the epoch of the
+ * snapshot and added all at once, or not at all on memory shortage.
+ */
+static void vfs_snap_fault(vfsn_t *dir)
+{
+   // set once while the directory is created, so no lock is needed
+   if (!dir->snap_epoch)
+      return;
+
+   vfsn_t *src;
+   VFS_SAFE_READ(dir, src = vfs_open(dir->snap_src));
+   if (!src)
+      return;
+
+   vfs_snap_child_t *children;
+   int count = vfs_snap_children(src, dir->snap_epoch, &children);
+   vfs_close(src);
+   if (count < 0)
+      return;
+
+   vfsn_t *nodes[count ? count : 1];
+   int built = 0;
+   for (; built < count; built++) {
+      vfs_snap_child_t *child = &children[built];
+      vfsn_t *node = vfs_node_new(child->name, child->flags | VFS_SNAP);
+      if (!node || !node->name) {
+         if (node) {
+            node->flags |= VFS_DEL;
+            vfs_close(node);
+         }
+         break;
+      }
+      node->snap_src = child->node;
+      node->snap_epoch = dir->snap_epoch;
+      node->data_size = child->size;
+      node->version = child->version;
+      child->node = NULL;
+      nodes[built] = node;
+   }
+   vfs_snap_children_free(children, count);
+
+   // another reader may have been faster, the source is dropped once done
+   int linked = 0;
+   src = NULL;
+   if (built == count) {
+      VFS_SAFE_WRITE(dir,
+         if (dir->snap_src && !(dir->flags & VFS_DEL)) {
+            vfsn_t *prev = NULL;
+            for (int i = 0; i < count; i++) {
+               vfs_link(dir, nodes[i], prev, NULL);
+               prev = nodes[i];
+            }
+            src = dir->snap_src;
+            dir->snap_src = NULL;
+            linked = 1;
+         }
+      );
+   }
+   for (int i = 0; i < built; i++) {
+      if (!linked)
+         nodes[i]->flags |= VFS_DEL;
+      vfs_close(nodes[i]);
+   }
+   vfs_close(src);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // GLOBAL FUNCTIONS
 ///////////////////////////////////////////////////////////////////////////////
+void vfs_set_listener(vfs_listener_t listener)
+{
+   vfs_listener = listener;
+}
+
 vfsn_t* vfs_open(vfsn_t *node)
 {
    if (!node)
       return NULL;
 
-   VFS_SAFE_READ(node, log_trace("Opening node '%s'", node->name));
+   // no data lock here, callers may hold the lock of a child
+   log_trace("Opening node %p", (void*)node);
    pthread_rwlock_rdlock(&node->openlk);
    return node;
 }
 
 vfsn_t* vfs_create(vfsn_t *parent, char* name, char flags)
 {
-   vfsn_t *node = malloc(sizeof(vfsn_t));
+   vfsn_t *node = vfs_node_new(name, flags);
    if (node) {
-      memset(node, 0, sizeof(vfsn_t));
-      pthread_rwlock_init(&node->openlk, NULL);
-      pthread_rwlock_init(&node->lock, NULL);
-      node->name = strdup(name);
-      vfs_flag_set(node, flags); 
-      vfs_open(node);
       if (vfs_attach(parent, node)) {
          vfs_delete(node);
          vfs_close(node);
          return NULL;
       }
+      vfs_usage_t usage = vfs_usage_own(flags);
+      vfs_usage_add(parent, &usage, 1);
+      VFS_NOTIFY(VFS_EV_CREATE, node);
    }
    return node;
 }
 
-void vfs_delete(vfsn_t *node)
+int vfs_delete(vfsn_t *node)
 {
    if (!node)
+      return VFS_NOENT;
+
+   // nodes deleted by moves and transactions are uncounted already
+   int first, readonly;
+   vfs_usage_t usage;
+   VFS_SAFE_WRITE(node,
+      log_dbg("Delete node '%s'", node->name);
+      readonly = (node->flags & (VFS_SNAP | VFS_SNAPROOT)) == VFS_SNAP;
+      first = !(node->flags & VFS_DEL);
+      if (!readonly)
+         node->flags |= VFS_DEL;
+      vfs_usage_load(node, &usage);
+   );
+   if (readonly)
+      return VFS_READONLY;
+   VFS_NOTIFY(VFS_EV_DELETE, node);
+
+   // only the top gets unlinked here, the reclaimer removes the rest
+   vfsn_t *parent = vfs_detach(node, 1);
+   if (first)
+      vfs_usage_add(parent, &usage, -1);
+   vfs_reclaim(vfs_open(node), parent);
+   return 0;
+}
+
+void vfs_delete_all(vfsn_t *dir, vfsn_t **nodes, int count, int *results)
+{
+   if (count < 1)
       return;
 
-   VFS_SAFE_READ(node, log_dbg("Delete node '%s'", node->name));
-   vfs_flag_set(node, VFS_DEL);
-   vfsn_t *it = vfs_open(node);
-   vfs_child(&it);
-   vfsn_t *prev = vfs_open(it);
-   while (it) {
-      vfs_next(&it);
-      vfs_delete(prev);
-      vfs_close(prev);
-      prev = vfs_open(it);
+   // unlinked here or not, because the node left dir in between, got deleted
+   // by someone else or is part of a snapshot
+   char unlinked[count], readonly[count];
+   vfs_usage_t total = { 0, 0, 0 };
+   vfs_snap_enter();
+   VFS_SAFE_WRITE(dir,
+      for (int i = 0; i < count; i++) {
+         vfsn_t *node = nodes[i];
+         unlinked[i] = readonly[i] = 0;
+         if (node->parent != dir)
+            continue;
+
+         // lock in order parent, prev, node, next to prevent dead locks!
+         vfsn_t *prev = node->sil_prev, *next = node->sil_next;
+         VFS_SAFE3(VFS_WRITE, prev, node, next,
+            log_dbg("Delete node '%s'", node->name);
+            readonly[i] = (node->flags & (VFS_SNAP | VFS_SNAPROOT)) == VFS_SNAP;
+            unlinked[i] = !(node->flags & VFS_DEL) && !readonly[i];
+            if (unlinked[i]) {
+               vfs_usage_t usage;
+               node->flags |= VFS_DEL;
+               vfs_usage_load(node, &usage);
+               total.bytes += usage.bytes;
+               total.files += usage.files;
+               total.dirs += usage.dirs;
+               vfs_unlink(dir, node);
+            }
+         );
+      }
+   );
+   vfs_snap_exit();
+
+   // ancestors are updated once for all nodes
+   vfs_usage_add(dir, &total, -1);
+   for (int i = 0; i < count; i++) {
+      int retval = 0;
+      if (unlinked[i]) {
+         VFS_NOTIFY(VFS_EV_DELETE, nodes[i]);
+         vfs_reclaim(vfs_open(nodes[i]), vfs_open(dir));
+      } else {
+         retval = readonly[i] ? VFS_READONLY : VFS_NOENT;
+      }
+      if (results)
+         results[i] = retval;
    }
-   vfs_delete(prev);
-   vfs_close(prev);
-   vfs_detach(node);
 }
 
 
-void vfs_move(vfsn_t *node, vfsn_t *newparent, char* name)
+int vfs_move(vfsn_t *node, vfsn_t *newparent, char* name, int replace)
 {
    if (!node || !newparent)
-      return;
-   
-   // deattach node
-   vfs_detach(node);
+      return VFS_NOENT;
 
-   // change name
-   VFS_SAFE_WRITE(node,
-      free(node->name);
-      node->name = strdup(name);
-   );
+   // entered before any rename lock, a new epoch may wait for running moves
+   vfs_snap_enter();
+   int retval = vfs_move_node(node, newparent, name, replace);
+   vfs_snap_exit();
+   return retval;
+}
+
+int vfs_snapshot(vfsn_t *node, char *name)
+{
+   if (!node)
+      return VFS_NOENT;
+   char flags;
+   VFS_SAFE_READ(node, flags = node->flags);
+   if (flags & VFS_SNAP)
+      return VFS_READONLY;
+   if (flags & VFS_DEL)
+      return VFS_NOENT;
+
+   // the reserved directory is created by the first snapshot of a tree
+   vfsn_t *root = vfs_open(node), *dir = NULL;
+   vfs_root(&root);
+   while (root && !dir) {
+      VFS_SAFE_READ(root, dir = vfs_open(vfs_index_find(root->index, VFS_SNAPSHOTS)));
+      if (dir)
+         break;
+      dir = vfs_node_new(VFS_SNAPSHOTS, VFS_DIR | VFS_SNAP | VFS_SNAPROOT);
+      if (!dir)
+         break;
+      int retval = vfs_attach(root, dir);
+      if (retval) {
+         vfs_delete(dir);
+         vfs_close(dir);
+         dir = NULL;
+         if (retval != 2)
+            break;
+      }
+   }
+   vfs_close(root);
+   if (!dir)
+      return root ? 2 : VFS_NOENT;
+   if (!vfs_is_readonly(dir)) {
+      vfs_close(dir);
+      return VFS_EXISTS;
+   }
 
-   // attach
-   vfs_attach(newparent, node);
+   vfsn_t *snap = vfs_node_new(name, (flags & (VFS_FILE | VFS_DIR)) | VFS_SNAP | VFS_SNAPROOT);
+   unsigned long epoch = snap ? vfs_snap_register() : 0;
+   if (!epoch) {
+      if (snap) {
+         snap->flags |= VFS_DEL;
+         vfs_close(snap);
+      }
+      vfs_close(dir);
+      return 2;
+   }
+   snap->snap_src = vfs_open(node);
+   snap->snap_epoch = epoch;
+   if (flags & VFS_FILE)
+      vfs_snap_stat(node, epoch, &snap->data_size, &snap->version);
+
+   int retval = vfs_attach(dir, snap);
+   if (retval)
+      vfs_delete(snap);
+   vfs_close(snap);
+   vfs_close(dir);
+   return retval == 2 ? VFS_EXISTS : retval ? VFS_NOENT : 0;
 }
 
 size_t vfs_read(vfsn_t *node, void *data, size_t size) {
+   unsigned long version;
+   return vfs_read_version(node, data, size, &version);
+}
+
+size_t vfs_read_version(vfsn_t *node, void *data, size_t size, unsigned long *version) {
+   return vfs_read_range(node, data, 0, size, version);
+}
+
+size_t vfs_read_range(vfsn_t *node, void *data, size_t off, size_t size, unsigned long *version) {
+   // files of snapshots read the kept state of their live node
+   if (node->snap_epoch && vfs_is_file(node)) {
+      *version = vfs_version(node);
+      return vfs_snap_read(node->snap_src, node->snap_epoch, data, off, size);
+   }
+
    size_t read = 0;
+   int spilled = 0;
    VFS_SAFE_READ(node,
-      if (node->flags & VFS_FILE) {
-         read = (size < node->data_size) ? size : node->data_size;
-         memcpy(data, node->data, read);
+      if (node->flags & VFS_SPILLED) {
+         spilled = 1;
+      } else if (node->flags & VFS_FILE) {
+         read = VFS_RANGE(node->data_size, off, size);
+         if (read)
+            memcpy(data, (char*)node->data + off, read);
+         vfs_spill_touch(node);
       }
+      *version = vfs_version(node);
    );
+
+   // evicted content is faulted back in, which needs the write lock
+   if (spilled) {
+      VFS_SAFE_WRITE(node,
+         read = VFS_RANGE(node->data_size, off, size);
+         if (vfs_spill_load(node) == 0) {
+            if (read)
+               memcpy(data, (char*)node->data + off, read);
+         } else if (read) {
+            read = vfs_spill_pread(node->spill_off + off, data, read);
+         }
+         *version = vfs_version(node);
+      );
+      vfs_spill_balance();
+   }
    return read;
 }
 
-int vfs_write(vfsn_t *node, void *data, size_t size) {
-   int retval = 1;
-   VFS_SAFE_WRITE(node,
+size_t vfs_read_stream(vfsn_t *node, void *data, size_t off, size_t size, long long *spilled) {
+   *spilled = -1;
+   if (node->snap_epoch && vfs_is_file(node)) {
+      return vfs_snap_read(node->snap_src, node->snap_epoch, data, off, size);
+   }
+
+   size_t read = 0;
+   VFS_SAFE_READ(node,
       if (node->flags & VFS_FILE) {
-         free(node->data);
-         node->data = malloc(size);
-         if (node->data) {
-            memcpy(node->data, data, size);
-            node->data_size = size;
-            retval = 0;
-         } else {
-            retval = 2;
-         }
-         
+         read = VFS_RANGE(node->data_size, off, size);
+         if (node->flags & VFS_SPILLED)
+            *spilled = node->spill_off + off;
+         else if (read)
+            memcpy(data, (char*)node->data + off, read);
       }
    );
-   return retval;
+   return read;
+}
+
+int vfs_write(vfsn_t *node, void *data, size_t size) {
+   return vfs_write_checked(node, data, size, 0, 0);
+}
+
+int vfs_write_if(vfsn_t *node, void *data, size_t size, unsigned long version) {
+   return vfs_write_checked(node, data, size, 1, version);
 }
 
 void vfs_close(vfsn_t *node)
@@ -236,6 +1331,17 @@ void vfs_close(vfsn_t *node)
    pthread_rwlock_unlock(&node->openlk);
 
    if (deleted && pthread_rwlock_trywrlock(&node->openlk) == 0) {
+      vfs_spill_untrack(node);
+      vfs_snap_free(node);
+      if (!(node->flags & VFS_SNAP))
+         vfs_find_remove(node, node->name);
+      vfs_close(node->snap_src);
+
+      // states kept for a released snapshot are dropped in the background
+      if ((node->flags & VFS_SNAPROOT) && node->snap_epoch) {
+         vfs_snap_unregister(node->snap_epoch);
+         vfs_reclaim(NULL, NULL);
+      }
       pthread_rwlock_destroy(&node->openlk);
       pthread_rwlock_destroy(&node->lock);
       free(node->name);
@@ -266,10 +1372,20 @@ int vfs_is_dir(vfsn_t* node)
    return !vfs_is_file(node);
 }
 
+int vfs_is_readonly(vfsn_t *node)
+{
+   return vfs_flag_checked(node, VFS_SNAP);
+}
+
 int vfs_is_deleted(vfsn_t *node) {
    return vfs_flag_checked(node, VFS_DEL);
 }
 
+void vfs_usage(vfsn_t *node, vfs_usage_t *usage)
+{
+   vfs_usage_load(node, usage);
+}
+
 int vfs_size(vfsn_t *node)
 {
    int size;
@@ -277,6 +1393,19 @@ int vfs_size(vfsn_t *node)
    return size;
 }
 
+unsigned long vfs_version(vfsn_t *node)
+{
+   return __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+}
+
+void vfs_stat(vfsn_t *node, vfs_stat_t *st)
+{
+   VFS_SAFE_READ(node,
+      st->flags = node->flags;
+      st->size = node->data_size;
+      st->version = vfs_version(node);
+   );
+}
 
 vfsn_t* vfs_parent(vfsn_t **node)
 {
@@ -301,11 +1430,78 @@ vfsn_t* vfs_child(vfsn_t **node)
    }
 
    vfsn_t *current = *node;
+   vfs_snap_fault(current);
    VFS_SAFE_READ(current, *node = vfs_open(current->child));
    vfs_close(current);
    return *node;
 }
 
+vfsn_t* vfs_lookup(vfsn_t **node, const char *name)
+{
+   if (!node || !*node)
+      return NULL;
+
+   vfsn_t *current = *node;
+   vfs_snap_fault(current);
+   VFS_SAFE_READ(current, *node = vfs_open(vfs_index_find(current->index, name)));
+   vfs_close(current);
+   return *node;
+}
+
+vfsn_t* vfs_child_after(vfsn_t **node, const char *after)
+{
+   if (!after)
+      return vfs_child(node);
+   if (!node || !*node)
+      return NULL;
+
+   vfsn_t *current = *node;
+   vfs_snap_fault(current);
+   VFS_SAFE_READ(current, *node = vfs_open(vfs_index_after(current->index, after)));
+   vfs_close(current);
+   return *node;
+}
+
+int vfs_glob(vfsn_t *dir, const char *pattern, vfsn_t ***nodes)
+{
+   // names outside of the literal prefix of pattern cannot match
+   size_t len = strcspn(pattern, "*?[\\");
+   char prefix[len + 1];
+   memcpy(prefix, pattern, len);
+   prefix[len] = '\0';
+
+   int count = 0, size = 0, failed = 0;
+   vfsn_t **found = NULL;
+   vfs_snap_fault(dir);
+   VFS_SAFE_READ(dir,
+      vfsn_t *it = len ? vfs_index_before(dir->index, prefix) : NULL;
+      it = it ? it->sil_next : dir->child;
+      for (; it && !failed && strncmp(it->name, prefix, len) == 0; it = it->sil_next) {
+         if (vfs_flag_checked(it, VFS_DEL) || fnmatch(pattern, it->name, 0))
+            continue;
+         if (count == size) {
+            size = size ? size * 2 : 16;
+            vfsn_t **grown = realloc(found, size * sizeof(vfsn_t*));
+            if (!grown) {
+               failed = 1;
+               continue;
+            }
+            found = grown;
+         }
+         found[count++] = vfs_open(it);
+      }
+   );
+
+   if (failed) {
+      for (int i = 0; i < count; i++)
+         vfs_close(found[i]);
+      free(found);
+      return -1;
+   }
+   *nodes = found;
+   return count;
+}
+
 vfsn_t* vfs_prev(vfsn_t **node)
 {
    if (!node || !*node)
@@ -338,3 +1534,172 @@ vfsn_t* vfs_root(vfsn_t **node)
    vfs_close(current);
    return *node;
 }
+
+vfs_txn_t* vfs_txn_begin(void)
+{
+   return calloc(1, sizeof(vfs_txn_t));
+}
+
+vfsn_t* vfs_txn_lookup(vfs_txn_t *txn, vfsn_t **node, const char *name)
+{
+   if (!node || !*node)
+      return NULL;
+
+   // nodes staged below existing directories are not linked yet
+   vfsn_t *current = *node;
+   if (!vfs_flag_checked(current, VFS_STAGED)) {
+      for (int i = txn->nops - 1; i >= 0; i--) {
+         struct vfs_txn_op *op = &txn->ops[i];
+         if (op->type == VFS_TXN_CREATE && op->parent == current
+               && !vfs_is_deleted(op->node) && strcmp(op->node->name, name) == 0) {
+            *node = vfs_open(op->node);
+            vfs_close(current);
+            return *node;
+         }
+      }
+   }
+
+   vfs_lookup(node, name);
+   if (*node && vfs_txn_deleting(txn, *node)) {
+      vfs_close(*node);
+      *node = NULL;
+   }
+   return *node;
+}
+
+int vfs_txn_create(vfs_txn_t *txn, vfsn_t *parent, char *name, char flags, void *data, size_t size)
+{
+   if (!parent || vfs_is_file(parent))
+      return VFS_NOENT;
+   if (vfs_flag_checked(parent, VFS_SNAP))
+      return VFS_READONLY;
+
+   vfsn_t *found = vfs_open(parent);
+   if (vfs_txn_lookup(txn, &found, name)) {
+      vfs_close(found);
+      return VFS_EXISTS;
+   }
+
+   void *copy = NULL;
+   if (size > 0) {
+      if (!(copy = malloc(size)))
+         return 2;
+      memcpy(copy, data, size);
+   }
+
+   vfsn_t *node = vfs_node_new(name, flags | VFS_STAGED);
+   if (!node || !vfs_txn_add(txn, VFS_TXN_CREATE, node, parent)) {
+      free(copy);
+      vfs_delete(node);
+      vfs_close(node);
+      return 2;
+   }
+   // staged nodes are private, the lock only keeps the evictor out
+   vfs_usage_t delta = { 0, 0, 0 };
+   if (copy) {
+      VFS_SAFE_WRITE(node, delta = vfs_store(node, copy, size));
+   }
+
+   // staged parents are private to the transaction
+   if (vfs_flag_checked(parent, VFS_STAGED)) {
+      vfsn_t *prev = vfs_index_before(parent->index, name);
+      vfs_link(parent, node, prev, prev ? prev->sil_next : parent->child);
+      vfs_usage_t usage = vfs_usage_own(flags);
+      vfs_usage_add(parent, &usage, 1);
+   }
+   vfs_usage_add(node, &delta, 1);
+   vfs_close(node);
+   return 0;
+}
+
+int vfs_txn_write(vfs_txn_t *txn, vfsn_t *node, void *data, size_t size, int check, unsigned long version)
+{
+   if (!vfs_is_file(node))
+      return 1;
+   if (vfs_flag_checked(node, VFS_SNAP))
+      return VFS_READONLY;
+   if (check && vfs_version(node) != version)
+      return VFS_CONFLICT;
+
+   void *copy = malloc(size ? size : 1);
+   struct vfs_txn_op *op;
+   int staged = vfs_flag_checked(node, VFS_STAGED);
+   if (!copy || !(op = vfs_txn_add(txn, staged ? VFS_TXN_NONE : VFS_TXN_WRITE, node, NULL))) {
+      free(copy);
+      return 2;
+   }
+   memcpy(copy, data, size);
+
+   if (staged) {
+      vfs_usage_t delta;
+      VFS_SAFE_WRITE(node, delta = vfs_store(node, copy, size));
+      vfs_usage_add(node, &delta, 1);
+      vfs_spill_balance();
+   } else {
+      op->data = copy;
+      op->size = size;
+      op->check = check;
+      op->version = version;
+   }
+   return 0;
+}
+
+int vfs_txn_delete(vfs_txn_t *txn, vfsn_t *node)
+{
+   if (vfs_flag_checked(node, VFS_SNAP))
+      return VFS_READONLY;
+
+   vfsn_t *parent = vfs_open(node);
+   vfs_parent(&parent);
+   int staged = vfs_flag_checked(node, VFS_STAGED);
+   if (!parent && !staged)
+      return VFS_NOENT;
+
+   struct vfs_txn_op *op = vfs_txn_add(txn, staged ? VFS_TXN_NONE : VFS_TXN_DELETE, node, parent);
+   vfs_close(parent);
+   if (!op)
+      return 2;
+
+   if (staged)
+      vfs_delete(node);
+   return 0;
+}
+
+int vfs_txn_commit(vfs_txn_t *txn, int *failed)
+{
+   vfs_lockset_t set;
+   vfs_lockset_init(&set);
+
+   int retval;
+   vfs_snap_enter();
+   do {
+      retval = vfs_txn_lockset(txn, &set) ? 2 : vfs_lockset_acquire(&set);
+      if (retval == 2) {
+         *failed = -1;
+         break;
+      }
+      if (retval == 0) {
+         retval = vfs_txn_validate(txn, &set, failed);
+         if (retval == 0)
+            vfs_txn_apply(txn);
+      } else {
+         retval = -1;
+      }
+      vfs_lockset_release(&set);
+   } while (retval < 0);
+   vfs_snap_exit();
+   vfs_lockset_free(&set);
+
+   if (retval == 0) {
+      *failed = -1;
+      vfs_txn_finish(txn);
+   }
+   vfs_txn_free(txn, retval == 0);
+   return retval;
+}
+
+void vfs_txn_abort(vfs_txn_t *txn)
+{
+   if (txn)
+      vfs_txn_free(txn, 0);
+}
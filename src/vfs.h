@@ -12,14 +12,86 @@
 #define VFS_FILE  0x01
 #define VFS_DIR   0x02
 
+// results of vfs_write_if and transactions
+#define VFS_CONFLICT 3
+#define VFS_EXISTS   4
+#define VFS_NOENT    5
+#define VFS_LOOP     6
+#define VFS_READONLY 7
+
+// reserved directory in every root which holds the snapshots
+#define VFS_SNAPSHOTS ".snapshots"
+
+#define VFS_EV_CREATE   1
+#define VFS_EV_UPDATE   2
+#define VFS_EV_DELETE   3
+#define VFS_EV_MOVEFROM 4
+#define VFS_EV_MOVETO   5
+
+struct watch;
+struct vfs_snap_rec;
+
+typedef struct vfs_usage {
+   long long bytes, files, dirs;
+} vfs_usage_t;
+
 typedef struct vfsn {
    pthread_rwlock_t openlk, lock;
    char *name, flags;
    void *data;
    size_t data_size;
+   unsigned long version;
    struct vfsn *root, *parent, *child, *sil_prev, *sil_next;
+
+   // children of a directory are indexed by name in a treap, siblings are
+   // linked in the same order
+   struct vfsn *index, *idx_left, *idx_right;
+   unsigned idx_prio;
+
+   // subscriptions on this node, owned by the listener
+   struct watch *watches;
+
+   // totals of the subtree including the node itself, propagated upwards
+   // with atomic adds on every change
+   vfs_usage_t usage;
+
+   // resident contents are evicted in clock order under a memory budget
+   struct vfsn *lru_prev, *lru_next;
+   int lru_ref;
+   long long spill_off;
+
+   // snapshots see the state a node had at their epoch, snap_mod is the
+   // epoch of its last change and older states are kept in snap_hist
+   unsigned long snap_mod;
+   struct vfs_snap_rec *snap_hist;
+   struct vfsn *snap_prev, *snap_next;
+
+   // nodes of a snapshot show snap_src as seen at snap_epoch
+   struct vfsn *snap_src;
+   unsigned long snap_epoch;
 } vfsn_t;
 
+typedef struct vfs_txn vfs_txn_t;
+
+typedef struct vfs_stat {
+   char flags;
+   size_t size;
+   unsigned long version;
+} vfs_stat_t;
+
+/*
+ * Listener of changes, called after the change while the node is still
+ * attached, except for VFS_EV_DELETE which is reported before the node gets
+ * detached. VFS_EV_MOVEFROM is reported after the move together with the old
+ * parent and name of the node, all other events pass NULL for both.
+ */
+typedef void (*vfs_listener_t)(int event, vfsn_t *node, vfsn_t *parent, const char *name);
+
+/*
+ * Sets the listener for changes of all nodes, NULL disables notifications.
+ */
+void vfs_set_listener(vfs_listener_t listener);
+
 /*
  * Opens given node.
  */
@@ -36,14 +108,40 @@ vfsn_t* vfs_create(vfsn_t *parent, char *name, char flags);
 /*
  * Deletes given node. Memory of the node gets freed after the last user closes
  * handle via vfs_close. Node is still valid after this operations and must be
- * closed manually.
+ * closed manually. Only node itself gets unlinked right away, its descendants
+ * are removed by a background reclaimer. Returns 0 on success, VFS_NOENT if
+ * node is null and VFS_READONLY for nodes inside of a snapshot.
+ */
+int vfs_delete(vfsn_t *node);
+
+/*
+ * Deletes count children of dir like vfs_delete, but unlinks all of them under
+ * a single lock of dir and updates the usage of the ancestors once. Nodes
+ * which left dir in between are not deleted at their new place. The handles
+ * stay owned by the caller. Unless results is NULL, it receives the result of
+ * every node: 0, VFS_NOENT if it left dir or was deleted by someone else, or
+ * VFS_READONLY.
+ */
+void vfs_delete_all(vfsn_t *dir, vfsn_t **nodes, int count, int *results);
+
+/*
+ * Moves node to a new parent with an different name in one step. An existing
+ * node of that name is replaced if replace is set and both are files or the
+ * replaced directory is empty. Returns 0 on success, VFS_NOENT if a node is
+ * gone, VFS_EXISTS if the name is taken, VFS_LOOP if newparent is inside
+ * of node and VFS_READONLY if a snapshot is involved.
  */
-void vfs_delete(vfsn_t *node);
+int vfs_move(vfsn_t *node, vfsn_t *newparent, char* name, int replace);
 
 /*
- * Moves node to a new parent with an different name.
+ * Takes a snapshot of node, which shows up as VFS_SNAPSHOTS/name in the root
+ * of node. The snapshot shares all contents with the live tree and is created
+ * in constant time, only nodes changed later keep their old state. Deleting
+ * the snapshot releases it. Returns 0 on success, VFS_EXISTS if the name is
+ * taken, VFS_NOENT if node is gone, VFS_READONLY if node is a snapshot itself
+ * and 2 on memory shortage.
  */
-void vfs_move(vfsn_t *node, vfsn_t *newparent, char* name);
+int vfs_snapshot(vfsn_t *node, char *name);
 
 /*
  * Reads number of bytes specified by size or less from node into data. Returns
@@ -51,12 +149,37 @@ void vfs_move(vfsn_t *node, vfsn_t *newparent, char* name);
  */
 size_t vfs_read(vfsn_t *node, void *data, size_t size);
 
+/*
+ * Like vfs_read, but also stores the version of the read content in version.
+ */
+size_t vfs_read_version(vfsn_t *node, void *data, size_t size, unsigned long *version);
+
+/*
+ * Like vfs_read_version, but reads from byte off of the content on.
+ */
+size_t vfs_read_range(vfsn_t *node, void *data, size_t off, size_t size, unsigned long *version);
+
+/*
+ * Like vfs_read_range, but leaves evicted content in the backing file of
+ * vfsspill and touches no recency, so a walk over many files does not evict
+ * the contents in use. If the range is evicted, nothing gets copied and its
+ * offset in the backing file is stored in spilled, otherwise spilled is -1.
+ */
+size_t vfs_read_stream(vfsn_t *node, void *data, size_t off, size_t size, long long *spilled);
+
 /*
  * Writes number of bytes specified by size into node from data. The current
- * value of the node gets overwritten.
+ * value of the node gets overwritten. Returns VFS_READONLY for nodes inside of
+ * a snapshot.
  */
 int vfs_write(vfsn_t *node, void *data, size_t size);
 
+/*
+ * Like vfs_write, but only writes if node still has the given version.
+ * Returns VFS_CONFLICT if the node changed in between.
+ */
+int vfs_write_if(vfsn_t *node, void *data, size_t size, unsigned long version);
+
 /*
  * Closes handle to node.
  */ 
@@ -82,6 +205,12 @@ int vfs_is_file(vfsn_t *node);
  */
 int vfs_is_dir(vfsn_t *node);
 
+/*
+ * Returns 1 if the node belongs to a snapshot and can not be changed,
+ * otherwise 0.
+ */
+int vfs_is_readonly(vfsn_t *node);
+
 /*
  * Returns 1 if the node is marked as deleted, otherwise 1.
  */
@@ -92,6 +221,23 @@ int vfs_is_deleted(vfsn_t *node);
  */
 int vfs_size(vfsn_t *node);
 
+/*
+ * Returns the version of the node. It increases with every write, rename and
+ * attached or detached child and is never reused by another node.
+ */
+unsigned long vfs_version(vfsn_t *node);
+
+/*
+ * Reads flags, size and version of node into st without touching its data.
+ */
+void vfs_stat(vfsn_t *node, vfs_stat_t *st);
+
+/*
+ * Stores the bytes, files and directories of the subtree of node, including
+ * node itself, in usage.
+ */
+void vfs_usage(vfsn_t *node, vfs_usage_t *usage);
+
 /*
  * Changes node pointer from current to parent node. Only the given pointer must be closed manually-
  */
@@ -102,6 +248,27 @@ vfsn_t* vfs_parent(vfsn_t **node);
  */
 vfsn_t* vfs_child(vfsn_t **node);
 
+/*
+ * Changes node pointer from current to the child with given name in O(log n).
+ * Only the given pointer must be closed manually-
+ */
+vfsn_t* vfs_lookup(vfsn_t **node, const char *name);
+
+/*
+ * Changes node pointer from current to the first child whose name sorts after
+ * the given one, or to the first child if after is NULL. Children are sorted
+ * by strcmp. Only the given pointer must be closed manually-
+ */
+vfsn_t* vfs_child_after(vfsn_t **node, const char *after);
+
+/*
+ * Opens all children of dir whose names match the glob pattern in name order,
+ * scanned under a single lock of dir. Stores them in nodes, which the caller
+ * frees after closing each of them. Returns the count or -1 on memory
+ * shortage.
+ */
+int vfs_glob(vfsn_t *dir, const char *pattern, vfsn_t ***nodes);
+
 /*
  * Changes node pointer from current to previous silbling node. Only the given pointer must be closed manually-
  */
@@ -117,4 +284,47 @@ vfsn_t* vfs_next(vfsn_t **node);
  */
 vfsn_t* vfs_root(vfsn_t **node);
 
+/*
+ * Starts an empty transaction. Changes are staged in the transaction and
+ * become visible all at once on vfs_txn_commit. Returns NULL on memory
+ * shortage.
+ */
+vfs_txn_t* vfs_txn_begin(void);
+
+/*
+ * Like vfs_lookup, but sees the changes staged in txn.
+ */
+vfsn_t* vfs_txn_lookup(vfs_txn_t *txn, vfsn_t **node, const char *name);
+
+/*
+ * Stages creation of a node with the given content in parent, which may be
+ * staged itself. Returns 0 on success, VFS_EXISTS if the name is taken,
+ * VFS_NOENT if parent is no directory and VFS_READONLY inside of a snapshot.
+ */
+int vfs_txn_create(vfs_txn_t *txn, vfsn_t *parent, char *name, char flags, void *data, size_t size);
+
+/*
+ * Stages overwriting the content of node. With check, the write only commits
+ * if node still has the given version. Returns 0 on success.
+ */
+int vfs_txn_write(vfs_txn_t *txn, vfsn_t *node, void *data, size_t size, int check, unsigned long version);
+
+/*
+ * Stages deletion of node and all its children. Returns 0 on success.
+ */
+int vfs_txn_delete(vfs_txn_t *txn, vfsn_t *node);
+
+/*
+ * Validates and applies all staged changes under a single acquisition of
+ * every needed lock, or applies none of them. Returns 0 on success, otherwise
+ * the failed result and the index of the failed change in failed, which is -1
+ * on memory shortage. The transaction is freed in any case.
+ */
+int vfs_txn_commit(vfs_txn_t *txn, int *failed);
+
+/*
+ * Discards all staged changes and frees the transaction.
+ */
+void vfs_txn_abort(vfs_txn_t *txn);
+
 #endif
@@ -0,0 +1,410 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "vfsfind.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define FIND_BUCKETS 4096
+#define FIND_PATH 4096
+
+// removed slot of a posting set
+#define FIND_TOMB ((vfsn_t*)1)
+
+#define FIND_TRIGRAM(s) ((uint32_t)(unsigned char)(s)[0] << 16 | \
+   (uint32_t)(unsigned char)(s)[1] << 8 | (unsigned char)(s)[2])
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+// nodes whose names contain the trigram, open addressed by node pointer
+struct find_trigram {
+   uint32_t key;
+   struct find_trigram *next;
+   vfsn_t **nodes;
+   size_t size, used, count;
+};
+
+struct find_bucket {
+   pthread_mutex_t lock;
+   struct find_trigram *trigrams;
+};
+
+struct find_query {
+   const char *pattern;
+   char flags;
+   vfs_found_t found;
+   void *ctx;
+   int count, stop;
+   char path[FIND_PATH];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+// NULL while the index is disabled
+static struct find_bucket *find_buckets = NULL;
+// set once a posting got lost on memory shortage, lookups would miss it
+static int find_degraded = 0;
+static long long find_trigrams = 0, find_postings = 0, find_lookups = 0, find_walks = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static size_t find_hash(vfsn_t *node, size_t size)
+{
+   uint64_t x = (uintptr_t)node;
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdull;
+   x ^= x >> 33;
+   return x & (size - 1);
+}
+
+static struct find_bucket* find_bucket(uint32_t key)
+{
+   return &find_buckets[(key * 2654435761u >> 8) % FIND_BUCKETS];
+}
+
+/*
+ * Returns the trigram of key in bucket, which has to be locked, or NULL.
+ */
+static struct find_trigram* find_get(struct find_bucket *bucket, uint32_t key)
+{
+   struct find_trigram *it = bucket->trigrams;
+   while (it && it->key != key)
+      it = it->next;
+   return it;
+}
+
+/*
+ * Rehashes the nodes of trigram into size slots, a power of two.
+ */
+static int find_resize(struct find_trigram *trigram, size_t size)
+{
+   vfsn_t **nodes = calloc(size, sizeof(vfsn_t*));
+   if (!nodes)
+      return 1;
+   for (size_t i = 0; i < trigram->size; i++) {
+      vfsn_t *node = trigram->nodes[i];
+      if (node && node != FIND_TOMB) {
+         size_t pos = find_hash(node, size);
+         while (nodes[pos])
+            pos = (pos + 1) & (size - 1);
+         nodes[pos] = node;
+      }
+   }
+   free(trigram->nodes);
+   trigram->nodes = nodes;
+   trigram->size = size;
+   trigram->used = trigram->count;
+   return 0;
+}
+
+static void find_insert(uint32_t key, vfsn_t *node)
+{
+   struct find_bucket *bucket = find_bucket(key);
+   pthread_mutex_lock(&bucket->lock);
+   struct find_trigram *trigram = find_get(bucket, key);
+   if (!trigram && (trigram = calloc(1, sizeof(struct find_trigram)))) {
+      trigram->key = key;
+      trigram->next = bucket->trigrams;
+      bucket->trigrams = trigram;
+      __atomic_add_fetch(&find_trigrams, 1, __ATOMIC_RELAXED);
+   }
+
+   // keep a quarter of the slots free
+   if (trigram && (trigram->used + 1) * 4 > trigram->size * 3) {
+      size_t size = 8;
+      while (size < (trigram->count + 1) * 2)
+         size <<= 1;
+      find_resize(trigram, size);
+   }
+   if (trigram && (trigram->used + 1) * 4 <= trigram->size * 3) {
+      size_t pos = find_hash(node, trigram->size);
+      while (trigram->nodes[pos] && trigram->nodes[pos] != node)
+         pos = (pos + 1) & (trigram->size - 1);
+
+      // names can contain a trigram twice
+      if (!trigram->nodes[pos]) {
+         trigram->nodes[pos] = node;
+         trigram->used++;
+         trigram->count++;
+         __atomic_add_fetch(&find_postings, 1, __ATOMIC_RELAXED);
+      }
+   } else {
+      __atomic_store_n(&find_degraded, 1, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&bucket->lock);
+}
+
+static void find_erase(uint32_t key, vfsn_t *node)
+{
+   struct find_bucket *bucket = find_bucket(key);
+   pthread_mutex_lock(&bucket->lock);
+   struct find_trigram **it = &bucket->trigrams;
+   while (*it && (*it)->key != key)
+      it = &(*it)->next;
+
+   struct find_trigram *trigram = *it;
+   if (trigram) {
+      size_t pos = find_hash(node, trigram->size);
+      while (trigram->nodes[pos] && trigram->nodes[pos] != node)
+         pos = (pos + 1) & (trigram->size - 1);
+      if (trigram->nodes[pos]) {
+         trigram->nodes[pos] = FIND_TOMB;
+         trigram->count--;
+         __atomic_sub_fetch(&find_postings, 1, __ATOMIC_RELAXED);
+      }
+      if (trigram->count == 0) {
+         *it = trigram->next;
+         free(trigram->nodes);
+         free(trigram);
+         __atomic_sub_fetch(&find_trigrams, 1, __ATOMIC_RELAXED);
+      }
+   }
+   pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Picks the trigram of the literal runs of pattern with the fewest nodes.
+ * Returns 0 if the pattern has no trigram.
+ */
+static int find_best(const char *pattern, uint32_t *best)
+{
+   char run[3] = { 0 };
+   int len = 0, found = 0;
+   size_t fewest = 0;
+   for (const char *c = pattern; *c; c++) {
+      // wildcards and bracket expressions end a literal run
+      if (*c == '*' || *c == '?' || *c == '[') {
+         len = 0;
+         if (*c == '[') {
+            const char *end = c + 1;
+            if (*end == '!' || *end == '^')
+               end++;
+            if (*end == ']')
+               end++;
+            while (*end && *end != ']')
+               end++;
+            if (*end)
+               c = end;
+         }
+         continue;
+      }
+      if (*c == '\\' && c[1])
+         c++;
+
+      run[0] = run[1];
+      run[1] = run[2];
+      run[2] = *c;
+      if (++len < 3)
+         continue;
+
+      uint32_t key = FIND_TRIGRAM(run);
+      struct find_bucket *bucket = find_bucket(key);
+      pthread_mutex_lock(&bucket->lock);
+      struct find_trigram *trigram = find_get(bucket, key);
+      size_t count = trigram ? trigram->count : 0;
+      pthread_mutex_unlock(&bucket->lock);
+
+      if (!found || count < fewest) {
+         *best = key;
+         fewest = count;
+         found = 1;
+      }
+   }
+   return found;
+}
+
+/*
+ * Prepends name of node to the path which starts at pos. Returns the new
+ * start or -1 if the path gets too long.
+ */
+static int find_prepend(struct find_query *q, vfsn_t *node, int pos)
+{
+   int size = vfs_name_size(node);
+   if (size + 1 > pos)
+      return -1;
+   char name[size + 1];
+   memset(name, 0, sizeof(name));
+   vfs_name(node, name, size);
+
+   // the name might have become shorter in between
+   size = strlen(name);
+   if (pos < FIND_PATH - 1)
+      q->path[--pos] = '/';
+   pos -= size;
+   memcpy(q->path + pos, name, size);
+   return pos;
+}
+
+/*
+ * Reports node if it matches the query and lives below dir.
+ */
+static void find_check(struct find_query *q, vfsn_t *dir, vfsn_t *node)
+{
+   int size = vfs_name_size(node);
+   char name[size + 1];
+   memset(name, 0, sizeof(name));
+   vfs_name(node, name, size);
+
+   vfs_stat_t st;
+   vfs_stat(node, &st);
+   if ((st.flags & VFS_DEL) || !(st.flags & q->flags) || fnmatch(q->pattern, name, 0))
+      return;
+
+   // build the path on the way up, deleted ancestors hide the node
+   int pos = FIND_PATH - 1;
+   q->path[pos] = '\0';
+   vfsn_t *it = vfs_open(node);
+   while (it && it != dir && pos >= 0 && !vfs_is_deleted(it)) {
+      pos = find_prepend(q, it, pos);
+      vfs_parent(&it);
+   }
+   if (it == dir && pos >= 0) {
+      q->count++;
+      q->stop = q->found(q->ctx, node, q->path + pos);
+   }
+   vfs_close(it);
+}
+
+static void find_lookup(struct find_query *q, vfsn_t *dir, uint32_t key)
+{
+   __atomic_add_fetch(&find_lookups, 1, __ATOMIC_RELAXED);
+
+   // collect opened candidates, nodes which are being freed are skipped
+   struct find_bucket *bucket = find_bucket(key);
+   pthread_mutex_lock(&bucket->lock);
+   struct find_trigram *trigram = find_get(bucket, key);
+   size_t count = 0;
+   vfsn_t **nodes = trigram ? malloc(trigram->count * sizeof(vfsn_t*)) : NULL;
+   for (size_t i = 0; nodes && i < trigram->size; i++) {
+      vfsn_t *node = trigram->nodes[i];
+      if (node && node != FIND_TOMB && pthread_rwlock_tryrdlock(&node->openlk) == 0)
+         nodes[count++] = node;
+   }
+   pthread_mutex_unlock(&bucket->lock);
+
+   if (trigram && !nodes) {
+      q->count = -1;
+      return;
+   }
+   for (size_t i = 0; i < count; i++) {
+      if (!q->stop)
+         find_check(q, dir, nodes[i]);
+      vfs_close(nodes[i]);
+   }
+   free(nodes);
+}
+
+/*
+ * Walks the subtree of dir, len is the length of the path of dir.
+ */
+static void find_walk(struct find_query *q, vfsn_t *dir, int len)
+{
+   vfsn_t *it = vfs_open(dir);
+   vfs_child(&it);
+   while (it && !q->stop) {
+      int size = vfs_name_size(it);
+      if (len + size + 2 < FIND_PATH) {
+         char *name = q->path + len + (len ? 1 : 0);
+         if (len)
+            q->path[len] = '/';
+         memset(name, 0, size + 1);
+         vfs_name(it, name, size);
+         int end = name - q->path + strlen(name);
+
+         vfs_stat_t st;
+         vfs_stat(it, &st);
+         if ((st.flags & q->flags) && fnmatch(q->pattern, name, 0) == 0) {
+            q->count++;
+            q->stop = q->found(q->ctx, it, q->path);
+         }
+         if ((st.flags & VFS_DIR) && !q->stop)
+            find_walk(q, it, end);
+         q->path[len] = '\0';
+      }
+
+      // continue behind an entry which got deleted in between
+      vfsn_t *next = vfs_open(it);
+      vfs_next(&next);
+      if (!next && vfs_is_deleted(it)) {
+         char name[size + 1];
+         memset(name, 0, sizeof(name));
+         vfs_name(it, name, size);
+         next = vfs_open(dir);
+         vfs_child_after(&next, name);
+      }
+      vfs_close(it);
+      it = next;
+   }
+   vfs_close(it);
+}
+
+static void find_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "find.trigrams", __atomic_load_n(&find_trigrams, __ATOMIC_RELAXED));
+   emit(ctx, "find.postings", __atomic_load_n(&find_postings, __ATOMIC_RELAXED));
+   emit(ctx, "find.lookups", __atomic_load_n(&find_lookups, __ATOMIC_RELAXED));
+   emit(ctx, "find.walks", __atomic_load_n(&find_walks, __ATOMIC_RELAXED));
+   emit(ctx, "find.degraded", __atomic_load_n(&find_degraded, __ATOMIC_RELAXED));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+void vfs_find_index(void)
+{
+   struct find_bucket *buckets = calloc(FIND_BUCKETS, sizeof(struct find_bucket));
+   if (!buckets)
+      return;
+   for (int i = 0; i < FIND_BUCKETS; i++)
+      pthread_mutex_init(&buckets[i].lock, NULL);
+   find_buckets = buckets;
+   stats_register(find_stats, NULL);
+}
+
+void vfs_find_add(vfsn_t *node, const char *name)
+{
+   for (size_t i = 0; find_buckets && name && name[i] && name[i+1] && name[i+2]; i++)
+      find_insert(FIND_TRIGRAM(name + i), node);
+}
+
+void vfs_find_remove(vfsn_t *node, const char *name)
+{
+   for (size_t i = 0; find_buckets && name && name[i] && name[i+1] && name[i+2]; i++)
+      find_erase(FIND_TRIGRAM(name + i), node);
+}
+
+int vfs_find(vfsn_t *dir, const char *pattern, char flags, vfs_found_t found, void *ctx)
+{
+   struct find_query *q = malloc(sizeof(struct find_query));
+   if (!q)
+      return -1;
+   q->pattern = pattern;
+   q->flags = flags;
+   q->found = found;
+   q->ctx = ctx;
+   q->count = q->stop = 0;
+   q->path[0] = '\0';
+
+   uint32_t key = 0;
+   int indexed = find_buckets && !__atomic_load_n(&find_degraded, __ATOMIC_RELAXED);
+   if (indexed && find_best(pattern, &key)) {
+      find_lookup(q, dir, key);
+   } else {
+      __atomic_add_fetch(&find_walks, 1, __ATOMIC_RELAXED);
+      find_walk(q, dir, 0);
+   }
+
+   int count = q->count;
+   free(q);
+   return count;
+}
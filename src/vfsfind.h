@@ -0,0 +1,39 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef VFSFIND
+#define VFSFIND
+
+#include "vfs.h"
+
+/*
+ * Callback of vfs_find, path is relative to the searched directory. Returns
+ * non zero to stop the search.
+ */
+typedef int (*vfs_found_t)(void *ctx, vfsn_t *node, const char *path);
+
+/*
+ * Enables the trigram index over all node names, which lets vfs_find look up
+ * patterns instead of walking the tree. Must be called before any node is
+ * created.
+ */
+void vfs_find_index(void);
+
+/*
+ * Adds and removes name of node to and from the index. Called by vfs while
+ * the name of node cannot change.
+ */
+void vfs_find_add(vfsn_t *node, const char *name);
+void vfs_find_remove(vfsn_t *node, const char *name);
+
+/*
+ * Reports every node below dir whose name matches the glob pattern and whose
+ * type is in flags via found. Patterns with a literal run of three or more
+ * characters are looked up in the index, if enabled, all others walk the
+ * subtree. So does every search once the index lost a name on memory
+ * shortage. Returns the number of reported nodes or -1 on memory shortage.
+ */
+int vfs_find(vfsn_t *dir, const char *pattern, char flags, vfs_found_t found, void *ctx);
+
+#endif
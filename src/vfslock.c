@@ -0,0 +1,202 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "vfslock.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define VFS_RENAME_LOCKS 256
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+// striped by node, a rename only ever holds one of them
+static pthread_mutex_t vfs_rename_locks[VFS_RENAME_LOCKS];
+static pthread_once_t vfs_rename_once = PTHREAD_ONCE_INIT;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static int vfs_ptr_cmp(const void *a, const void *b)
+{
+   uintptr_t x = (uintptr_t)*(vfsn_t**)a, y = (uintptr_t)*(vfsn_t**)b;
+   return (x > y) - (x < y);
+}
+
+static int vfs_lock_cmp(const void *a, const void *b)
+{
+   const struct vfs_lock *x = a, *y = b;
+   if (x->depth != y->depth)
+      return x->depth - y->depth;
+   if (x->parent != y->parent)
+      return ((uintptr_t)x->parent > (uintptr_t)y->parent) ? 1 : -1;
+   return strcmp(x->name, y->name);
+}
+
+static int vfs_depth(vfsn_t *node)
+{
+   int depth = 0;
+   vfsn_t *it = vfs_open(node);
+   while (vfs_parent(&it))
+      depth++;
+   return depth;
+}
+
+static void vfs_lockset_unlock(vfs_lockset_t *set, int count)
+{
+   for (int i = count - 1; i >= 0; i--)
+      pthread_rwlock_unlock(&set->locks[i].node->lock);
+}
+
+static void vfs_rename_setup(void)
+{
+   for (int i = 0; i < VFS_RENAME_LOCKS; i++)
+      pthread_mutex_init(&vfs_rename_locks[i], NULL);
+}
+
+static pthread_mutex_t* vfs_rename_stripe(vfsn_t *node)
+{
+   pthread_once(&vfs_rename_once, vfs_rename_setup);
+   uint64_t x = (uintptr_t)node;
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdull;
+   x ^= x >> 33;
+   return &vfs_rename_locks[x % VFS_RENAME_LOCKS];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+void vfs_lockset_init(vfs_lockset_t *set)
+{
+   memset(set, 0, sizeof(*set));
+}
+
+int vfs_lockset_add(vfs_lockset_t *set, vfsn_t *node)
+{
+   if (!node)
+      return 0;
+
+   if (set->count == set->size) {
+      int size = set->size ? set->size * 2 : 16;
+      vfsn_t **nodes = realloc(set->nodes, size * sizeof(vfsn_t*));
+      if (!nodes)
+         return 1;
+      set->nodes = nodes;
+      set->size = size;
+   }
+   // the set keeps nodes alive until it gets released
+   set->nodes[set->count++] = vfs_open(node);
+   return 0;
+}
+
+int vfs_lockset_acquire(vfs_lockset_t *set)
+{
+   // every node gets locked once
+   qsort(set->nodes, set->count, sizeof(vfsn_t*), vfs_ptr_cmp);
+   int unique = 0;
+   for (int i = 0; i < set->count; i++) {
+      if (unique == 0 || set->nodes[unique - 1] != set->nodes[i])
+         set->nodes[unique++] = set->nodes[i];
+      else
+         vfs_close(set->nodes[i]);
+   }
+   set->count = unique;
+
+   free(set->locks);
+   set->locks = calloc(unique ? unique : 1, sizeof(struct vfs_lock));
+   if (!set->locks)
+      return 2;
+   for (int i = 0; i < unique; i++) {
+      vfsn_t *node = set->nodes[i];
+      set->locks[i].node = node;
+      set->locks[i].depth = vfs_depth(node);
+      pthread_rwlock_rdlock(&node->lock);
+      set->locks[i].parent = node->parent;
+      set->locks[i].name = strdup(node->name ? node->name : "");
+      pthread_rwlock_unlock(&node->lock);
+      if (!set->locks[i].name)
+         return 2;
+   }
+   qsort(set->locks, unique, sizeof(struct vfs_lock), vfs_lock_cmp);
+
+   for (int i = 0; i < unique; i++) {
+      pthread_rwlock_t *lock = &set->locks[i].node->lock;
+      if (i == 0) {
+         pthread_rwlock_wrlock(lock);
+      } else if (pthread_rwlock_trywrlock(lock)) {
+         vfs_lockset_unlock(set, i);
+
+         // wait for the owner before trying again
+         pthread_rwlock_wrlock(lock);
+         pthread_rwlock_unlock(lock);
+         return 1;
+      }
+   }
+   set->held = 1;
+   return 0;
+}
+
+int vfs_lockset_held(vfs_lockset_t *set, vfsn_t *node)
+{
+   return !node || bsearch(&node, set->nodes, set->count, sizeof(vfsn_t*), vfs_ptr_cmp);
+}
+
+void vfs_lockset_release(vfs_lockset_t *set)
+{
+   if (set->held)
+      vfs_lockset_unlock(set, set->count);
+   for (int i = 0; set->locks && i < set->count; i++)
+      free(set->locks[i].name);
+   for (int i = 0; i < set->count; i++)
+      vfs_close(set->nodes[i]);
+   free(set->locks);
+   set->locks = NULL;
+   set->count = set->held = 0;
+}
+
+void vfs_lockset_free(vfs_lockset_t *set)
+{
+   vfs_lockset_release(set);
+   free(set->nodes);
+   set->nodes = NULL;
+   set->size = 0;
+}
+
+vfsn_t* vfs_common_ancestor(vfsn_t *a, vfsn_t *b)
+{
+   int da = vfs_depth(a), db = vfs_depth(b);
+   a = vfs_open(a);
+   b = vfs_open(b);
+
+   // climb to the same depth, then in lockstep
+   for (; da > db; da--)
+      vfs_parent(&a);
+   for (; db > da; db--)
+      vfs_parent(&b);
+   while (a && b && a != b) {
+      vfs_parent(&a);
+      vfs_parent(&b);
+   }
+
+   if (a != b) {
+      vfs_close(a);
+      a = NULL;
+   }
+   vfs_close(b);
+   return a;
+}
+
+void vfs_rename_lock(vfsn_t *ancestor)
+{
+   pthread_mutex_lock(vfs_rename_stripe(ancestor));
+}
+
+void vfs_rename_unlock(vfsn_t *ancestor)
+{
+   pthread_mutex_unlock(vfs_rename_stripe(ancestor));
+}
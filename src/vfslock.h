@@ -0,0 +1,75 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef VFSLOCK
+#define VFSLOCK
+
+#include "vfs.h"
+
+struct vfs_lock {
+   vfsn_t *node, *parent;
+   int depth;
+   char *name;
+};
+
+/*
+ * Set of nodes which get write locked together. The set is acquired in the
+ * order of the tree: parents before their children and siblings in list
+ * order, which extends the order of vfs_attach and vfs_detach.
+ */
+typedef struct vfs_lockset {
+   struct vfs_lock *locks;
+   vfsn_t **nodes;   // sorted by address once acquired
+   int count, size, held;
+} vfs_lockset_t;
+
+/*
+ * Inits an empty lock set.
+ */
+void vfs_lockset_init(vfs_lockset_t *set);
+
+/*
+ * Adds node to the set and keeps it open, NULL and duplicates are ignored.
+ * Returns 0 on success.
+ */
+int vfs_lockset_add(vfs_lockset_t *set, vfsn_t *node);
+
+/*
+ * Write locks all nodes of the set. The tree can change while the set gets
+ * collected, so only the first lock is waited for while none is held. Returns
+ * 0 if all locks are held, 1 if the set has to be collected again and 2 on
+ * memory shortage.
+ */
+int vfs_lockset_acquire(vfs_lockset_t *set);
+
+/*
+ * Returns whether node is held by the set. NULL counts as held.
+ */
+int vfs_lockset_held(vfs_lockset_t *set, vfsn_t *node);
+
+/*
+ * Releases all locks, closes the nodes and empties the set for reuse.
+ */
+void vfs_lockset_release(vfs_lockset_t *set);
+
+/*
+ * Frees the memory of the set.
+ */
+void vfs_lockset_free(vfs_lockset_t *set);
+
+/*
+ * Returns the lowest common ancestor of a and b as opened node or NULL if
+ * they are in different trees.
+ */
+vfsn_t* vfs_common_ancestor(vfsn_t *a, vfsn_t *b);
+
+/*
+ * Renames which change the ancestors of a node are serialized by the rename
+ * lock of the lowest common ancestor of the old and new parent. Renames in
+ * disjoint subtrees take different locks and run in parallel.
+ */
+void vfs_rename_lock(vfsn_t *ancestor);
+void vfs_rename_unlock(vfsn_t *ancestor);
+
+#endif
@@ -0,0 +1,449 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "vfssnap.h"
+#include "vfsspill.h"
+#include "stats.h"
+#include "log.h"
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+// state of a node seen by the snapshots with from < epoch <= to
+struct vfs_snap_rec {
+   unsigned long from, to;
+   unsigned long version;
+
+   // content of a file, in memory or at spill_off of the backing file
+   void *data;
+   size_t size;
+   int spilled;
+   long long spill_off;
+
+   // children of a directory, only name and node are set
+   vfs_snap_child_t *children;
+   int count;
+
+   struct vfs_snap_rec *next;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static pthread_once_t snap_once = PTHREAD_ONCE_INIT;
+
+// changes count themselves per epoch parity, a new epoch is ready once the
+// changes of the previous one are gone
+static unsigned long snap_current = 1, snap_ready = 1;
+static long long snap_active[2];
+static __thread int snap_depth;
+static __thread unsigned long snap_op;
+
+// epochs of live snapshots in ascending order, snap_latest is the last one
+static pthread_mutex_t snap_register_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long *snap_live = NULL, snap_latest = 0;
+static int snap_nlive = 0, snap_size = 0;
+
+// nodes which keep older states
+static pthread_mutex_t snap_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static vfsn_t *snap_list = NULL;
+static long long snap_nodes = 0, snap_records = 0, snap_bytes = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void snap_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   pthread_mutex_lock(&snap_lock);
+   int live = snap_nlive;
+   pthread_mutex_unlock(&snap_lock);
+
+   emit(ctx, "snap.snapshots", live);
+   emit(ctx, "snap.epoch", __atomic_load_n(&snap_current, __ATOMIC_RELAXED));
+   emit(ctx, "snap.nodes", __atomic_load_n(&snap_nodes, __ATOMIC_RELAXED));
+   emit(ctx, "snap.records", __atomic_load_n(&snap_records, __ATOMIC_RELAXED));
+   emit(ctx, "snap.bytes", __atomic_load_n(&snap_bytes, __ATOMIC_RELAXED));
+}
+
+static void snap_setup(void)
+{
+   stats_register(snap_stats, NULL);
+}
+
+/*
+ * Links node into the list of nodes with kept states. Called with the lock
+ * of node held.
+ */
+static void snap_list_insert(vfsn_t *node)
+{
+   pthread_mutex_lock(&snap_list_lock);
+   node->snap_prev = NULL;
+   node->snap_next = snap_list;
+   if (snap_list)
+      snap_list->snap_prev = node;
+   snap_list = node;
+   snap_nodes++;
+   pthread_mutex_unlock(&snap_list_lock);
+}
+
+static void snap_list_remove(vfsn_t *node)
+{
+   pthread_mutex_lock(&snap_list_lock);
+   if (node->snap_prev)
+      node->snap_prev->snap_next = node->snap_next;
+   else
+      snap_list = node->snap_next;
+   if (node->snap_next)
+      node->snap_next->snap_prev = node->snap_prev;
+   node->snap_prev = node->snap_next = NULL;
+   snap_nodes--;
+   pthread_mutex_unlock(&snap_list_lock);
+}
+
+static void snap_rec_free(struct vfs_snap_rec *rec)
+{
+   if (rec->data)
+      __atomic_sub_fetch(&snap_bytes, rec->size, __ATOMIC_RELAXED);
+   __atomic_sub_fetch(&snap_records, 1, __ATOMIC_RELAXED);
+   vfs_snap_children_free(rec->children, rec->count);
+   free(rec->data);
+   free(rec);
+}
+
+/*
+ * Returns the kept state of node seen at epoch. Sets current instead if the
+ * snapshot sees the current state. Neither means node did not exist yet.
+ * Called with the lock of node held.
+ */
+static struct vfs_snap_rec* snap_find(vfsn_t *node, unsigned long epoch, int *current)
+{
+   *current = node->snap_mod < epoch;
+   if (*current)
+      return NULL;
+
+   struct vfs_snap_rec *rec = node->snap_hist;
+   while (rec && !(rec->from < epoch && epoch <= rec->to))
+      rec = rec->next;
+   return rec;
+}
+
+/*
+ * Returns whether a live snapshot sees a state kept for from < epoch <= to.
+ */
+static int snap_seen(unsigned long *live, int count, unsigned long from, unsigned long to)
+{
+   // first live epoch after from
+   int lo = 0, hi = count;
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (live[mid] <= from)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return lo < count && live[lo] <= to;
+}
+
+/*
+ * Drops the kept states of node no live snapshot sees. Returns the dropped
+ * states, which the caller frees once the lock of node is released.
+ */
+static struct vfs_snap_rec* snap_prune(vfsn_t *node, unsigned long *live, int count)
+{
+   struct vfs_snap_rec *dropped = NULL, **it = &node->snap_hist;
+   while (*it) {
+      struct vfs_snap_rec *rec = *it;
+      if (snap_seen(live, count, rec->from, rec->to)) {
+         it = &rec->next;
+      } else {
+         *it = rec->next;
+         rec->next = dropped;
+         dropped = rec;
+      }
+   }
+   if (dropped && !node->snap_hist)
+      snap_list_remove(node);
+   return dropped;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+void vfs_snap_enter(void)
+{
+   if (snap_depth++)
+      return;
+
+   unsigned long epoch;
+   for (;;) {
+      epoch = __atomic_load_n(&snap_current, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&snap_active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&snap_current, __ATOMIC_SEQ_CST) == epoch)
+         break;
+      __atomic_sub_fetch(&snap_active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+   }
+
+   // changes of the previous epoch are still running while a snapshot gets
+   // created, the new epoch starts once they are gone
+   while (__atomic_load_n(&snap_ready, __ATOMIC_ACQUIRE) < epoch)
+      sched_yield();
+   snap_op = epoch;
+}
+
+void vfs_snap_exit(void)
+{
+   if (--snap_depth)
+      return;
+   __atomic_sub_fetch(&snap_active[snap_op & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+unsigned long vfs_snap_epoch(void)
+{
+   return snap_depth ? snap_op : __atomic_load_n(&snap_current, __ATOMIC_ACQUIRE);
+}
+
+void vfs_snap_preserve(vfsn_t *node)
+{
+   // snapshots never change
+   if (node->snap_epoch || (node->flags & VFS_SNAP))
+      return;
+
+   unsigned long epoch = vfs_snap_epoch(), mod = node->snap_mod;
+   if (mod >= epoch)
+      return;
+   node->snap_mod = epoch;
+   if (__atomic_load_n(&snap_latest, __ATOMIC_ACQUIRE) <= mod)
+      return;
+
+   struct vfs_snap_rec *rec = calloc(1, sizeof(struct vfs_snap_rec));
+   int count = 0;
+   for (vfsn_t *it = node->child; it; it = it->sil_next)
+      count++;
+   if (rec && count && !(rec->children = calloc(count, sizeof(vfs_snap_child_t)))) {
+      free(rec);
+      rec = NULL;
+   }
+   if (!rec) {
+      log_err("keeping state of '%s' for snapshots failed", node->name);
+      return;
+   }
+
+   rec->from = mod;
+   rec->to = epoch;
+   rec->version = node->version;
+   if (node->flags & VFS_FILE) {
+      // the content is handed over, the caller replaces it right away
+      rec->data = node->data;
+      rec->size = node->data_size;
+      rec->spilled = (node->flags & VFS_SPILLED) != 0;
+      rec->spill_off = node->spill_off;
+      node->data = NULL;
+      if (rec->data)
+         __atomic_add_fetch(&snap_bytes, rec->size, __ATOMIC_RELAXED);
+   }
+   for (vfsn_t *it = node->child; it; it = it->sil_next) {
+      vfs_snap_child_t *child = &rec->children[rec->count];
+      if (!(child->name = strdup(it->name)))
+         continue;
+      child->node = vfs_open(it);
+      rec->count++;
+   }
+
+   if (!node->snap_hist)
+      snap_list_insert(node);
+   rec->next = node->snap_hist;
+   node->snap_hist = rec;
+   __atomic_add_fetch(&snap_records, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long vfs_snap_register(void)
+{
+   pthread_once(&snap_once, snap_setup);
+   pthread_mutex_lock(&snap_register_lock);
+
+   pthread_mutex_lock(&snap_lock);
+   if (snap_nlive == snap_size) {
+      int size = snap_size ? snap_size * 2 : 16;
+      unsigned long *live = realloc(snap_live, size * sizeof(unsigned long));
+      if (!live) {
+         pthread_mutex_unlock(&snap_lock);
+         pthread_mutex_unlock(&snap_register_lock);
+         return 0;
+      }
+      snap_live = live;
+      snap_size = size;
+   }
+   unsigned long epoch = snap_current + 1;
+   snap_live[snap_nlive++] = epoch;
+   __atomic_store_n(&snap_latest, epoch, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&snap_current, epoch, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&snap_lock);
+
+   // the snapshot covers every change which started before
+   while (__atomic_load_n(&snap_active[(epoch - 1) & 1], __ATOMIC_SEQ_CST))
+      sched_yield();
+   __atomic_store_n(&snap_ready, epoch, __ATOMIC_RELEASE);
+
+   pthread_mutex_unlock(&snap_register_lock);
+   return epoch;
+}
+
+void vfs_snap_unregister(unsigned long epoch)
+{
+   pthread_mutex_lock(&snap_lock);
+   for (int i = 0; i < snap_nlive; i++) {
+      if (snap_live[i] == epoch) {
+         memmove(&snap_live[i], &snap_live[i + 1], (snap_nlive - i - 1) * sizeof(unsigned long));
+         snap_nlive--;
+         break;
+      }
+   }
+   __atomic_store_n(&snap_latest, snap_nlive ? snap_live[snap_nlive - 1] : 0, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&snap_lock);
+}
+
+void vfs_snap_gc(void)
+{
+   pthread_mutex_lock(&snap_lock);
+   int count = snap_nlive;
+   unsigned long live[count + 1];
+   memcpy(live, snap_live, count * sizeof(unsigned long));
+   pthread_mutex_unlock(&snap_lock);
+
+   // nodes being freed are skipped, they drop their states themselves
+   pthread_mutex_lock(&snap_list_lock);
+   long long size = snap_nodes, found = 0;
+   vfsn_t **nodes = size ? malloc(size * sizeof(vfsn_t*)) : NULL;
+   for (vfsn_t *it = snap_list; nodes && it && found < size; it = it->snap_next) {
+      if (pthread_rwlock_tryrdlock(&it->openlk) == 0)
+         nodes[found++] = it;
+   }
+   pthread_mutex_unlock(&snap_list_lock);
+
+   for (long long i = 0; i < found; i++) {
+      pthread_rwlock_wrlock(&nodes[i]->lock);
+      struct vfs_snap_rec *dropped = snap_prune(nodes[i], live, count);
+      pthread_rwlock_unlock(&nodes[i]->lock);
+
+      while (dropped) {
+         struct vfs_snap_rec *next = dropped->next;
+         snap_rec_free(dropped);
+         dropped = next;
+      }
+      vfs_close(nodes[i]);
+   }
+   free(nodes);
+}
+
+int vfs_snap_children(vfsn_t *dir, unsigned long epoch, vfs_snap_child_t **children)
+{
+   int count = 0, current, failed = 0;
+   vfs_snap_child_t *result = NULL;
+
+   pthread_rwlock_rdlock(&dir->lock);
+   struct vfs_snap_rec *rec = snap_find(dir, epoch, &current);
+   if (current) {
+      for (vfsn_t *it = dir->child; it; it = it->sil_next)
+         count++;
+   } else if (rec) {
+      count = rec->count;
+   }
+   if (count && !(result = calloc(count, sizeof(vfs_snap_child_t))))
+      failed = 1;
+
+   vfsn_t *it = current ? dir->child : NULL;
+   int found = 0;
+   for (int i = 0; !failed && i < count; i++) {
+      vfsn_t *node = current ? it : rec->children[i].node;
+      const char *name = current ? it->name : rec->children[i].name;
+      if (current)
+         it = it->sil_next;
+
+      // the reserved directory is not part of snapshots
+      pthread_rwlock_rdlock(&node->lock);
+      char flags = node->flags;
+      pthread_rwlock_unlock(&node->lock);
+      if (flags & VFS_SNAP)
+         continue;
+
+      vfs_snap_child_t *child = &result[found];
+      if (!(child->name = strdup(name))) {
+         failed = 1;
+         continue;
+      }
+      child->node = vfs_open(node);
+      child->flags = flags & (VFS_FILE | VFS_DIR);
+      vfs_snap_stat(node, epoch, &child->size, &child->version);
+      found++;
+   }
+   pthread_rwlock_unlock(&dir->lock);
+
+   if (failed) {
+      vfs_snap_children_free(result, found);
+      return -1;
+   }
+   *children = result;
+   return found;
+}
+
+void vfs_snap_children_free(vfs_snap_child_t *children, int count)
+{
+   for (int i = 0; i < count; i++) {
+      free(children[i].name);
+      vfs_close(children[i].node);
+   }
+   free(children);
+}
+
+void vfs_snap_stat(vfsn_t *node, unsigned long epoch, size_t *size, unsigned long *version)
+{
+   int current;
+   pthread_rwlock_rdlock(&node->lock);
+   struct vfs_snap_rec *rec = snap_find(node, epoch, &current);
+   *size = current ? node->data_size : rec ? rec->size : 0;
+   *version = current ? node->version : rec ? rec->version : 0;
+   pthread_rwlock_unlock(&node->lock);
+}
+
+size_t vfs_snap_read(vfsn_t *node, unsigned long epoch, void *data, size_t off, size_t size)
+{
+   int current;
+   size_t read = 0;
+   pthread_rwlock_rdlock(&node->lock);
+   struct vfs_snap_rec *rec = snap_find(node, epoch, &current);
+   if (current) {
+      read = off < node->data_size ? node->data_size - off : 0;
+      read = size < read ? size : read;
+      if (read && (node->flags & VFS_SPILLED))
+         read = vfs_spill_pread(node->spill_off + off, data, read);
+      else if (read)
+         memcpy(data, (char*)node->data + off, read);
+   } else if (rec) {
+      read = off < rec->size ? rec->size - off : 0;
+      read = size < read ? size : read;
+      if (read && rec->spilled)
+         read = vfs_spill_pread(rec->spill_off + off, data, read);
+      else if (read)
+         memcpy(data, (char*)rec->data + off, read);
+   }
+   pthread_rwlock_unlock(&node->lock);
+   return read;
+}
+
+void vfs_snap_free(vfsn_t *node)
+{
+   if (!node->snap_hist)
+      return;
+
+   snap_list_remove(node);
+   while (node->snap_hist) {
+      struct vfs_snap_rec *rec = node->snap_hist;
+      node->snap_hist = rec->next;
+      snap_rec_free(rec);
+   }
+}
@@ -0,0 +1,92 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef VFSSNAP
+#define VFSSNAP
+
+#include "vfs.h"
+#include <stddef.h>
+
+// read-only node of a snapshot
+#define VFS_SNAP     0x10
+// reserved directory or top of a snapshot, which can be deleted
+#define VFS_SNAPROOT 0x08
+
+// child of a directory as seen by a snapshot
+typedef struct vfs_snap_child {
+   char *name;
+   vfsn_t *node;
+   char flags;
+   size_t size;
+   unsigned long version;
+} vfs_snap_child_t;
+
+/*
+ * Brackets a change of the tree. All nodes a change touches are preserved
+ * for the same epoch, so a snapshot sees either all of it or nothing. Calls
+ * nest.
+ */
+void vfs_snap_enter(void);
+void vfs_snap_exit(void);
+
+/*
+ * Returns the epoch for nodes created now.
+ */
+unsigned long vfs_snap_epoch(void);
+
+/*
+ * Keeps the current content or children of node for the snapshots which
+ * still see them, before node gets changed. Called with the lock of node
+ * held for writing.
+ */
+void vfs_snap_preserve(vfsn_t *node);
+
+/*
+ * Starts a new epoch and returns it. Changes still running in the previous
+ * epoch are waited for, changes starting later are preserved for the new
+ * epoch. Writers are never blocked.
+ */
+unsigned long vfs_snap_register(void);
+
+/*
+ * Ends the snapshot of epoch. Preserved states nobody sees anymore are
+ * released by vfs_snap_gc.
+ */
+void vfs_snap_unregister(unsigned long epoch);
+
+/*
+ * Releases preserved states of all nodes which no snapshot sees anymore.
+ * Must be called without any node locks held.
+ */
+void vfs_snap_gc(void);
+
+/*
+ * Collects the children of dir as seen at epoch into children, which holds
+ * opened nodes. Snapshot nodes are left out. Returns the number of children
+ * or -1 on memory shortage.
+ */
+int vfs_snap_children(vfsn_t *dir, unsigned long epoch, vfs_snap_child_t **children);
+
+/*
+ * Frees the result of vfs_snap_children.
+ */
+void vfs_snap_children_free(vfs_snap_child_t *children, int count);
+
+/*
+ * Stores size and version of node as seen at epoch.
+ */
+void vfs_snap_stat(vfsn_t *node, unsigned long epoch, size_t *size, unsigned long *version);
+
+/*
+ * Reads up to size bytes from byte off of the content of node as seen at
+ * epoch on. Returns the number of bytes read.
+ */
+size_t vfs_snap_read(vfsn_t *node, unsigned long epoch, void *data, size_t off, size_t size);
+
+/*
+ * Frees the preserved states of node. Called when node gets freed.
+ */
+void vfs_snap_free(vfsn_t *node);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "vfsspill.h"
+#include "stats.h"
+#include "log.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static size_t spill_budget = 0;
+static int spill_fd = -1;
+
+// resident contents in a clock ring, new and rescued nodes enter at the head
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static vfsn_t *spill_head = NULL;
+static long long spill_count = 0, spill_resident = 0;
+
+// a single thread evicts at a time, the others go on
+static pthread_mutex_t spill_evict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the backing file only grows, rewritten contents leave garbage behind
+static long long spill_end = 0, spill_bytes = 0;
+static long long spill_hits = 0, spill_misses = 0, spill_evictions = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void spill_ring_remove(vfsn_t *node)
+{
+   if (node->lru_next == node) {
+      spill_head = NULL;
+   } else {
+      node->lru_prev->lru_next = node->lru_next;
+      node->lru_next->lru_prev = node->lru_prev;
+      if (spill_head == node)
+         spill_head = node->lru_next;
+   }
+   node->lru_prev = node->lru_next = NULL;
+}
+
+static void spill_ring_insert(vfsn_t *node)
+{
+   if (!spill_head) {
+      node->lru_prev = node->lru_next = node;
+   } else {
+      node->lru_next = spill_head;
+      node->lru_prev = spill_head->lru_prev;
+      spill_head->lru_prev->lru_next = node;
+      spill_head->lru_prev = node;
+   }
+   spill_head = node;
+}
+
+/*
+ * Picks the least recently used content and returns its node opened. Nodes
+ * used since the last pass get a second chance, nodes which are being freed
+ * are skipped.
+ */
+static vfsn_t* spill_victim(void)
+{
+   vfsn_t *victim = NULL;
+   pthread_mutex_lock(&spill_lock);
+   for (long long i = 0; spill_head && i < 2 * spill_count && !victim; i++) {
+      vfsn_t *node = spill_head->lru_prev;
+      if (__atomic_exchange_n(&node->lru_ref, 0, __ATOMIC_RELAXED) == 0
+            && pthread_rwlock_tryrdlock(&node->openlk) == 0) {
+         victim = node;
+      }
+      // the tail becomes the head
+      spill_head = node;
+   }
+   pthread_mutex_unlock(&spill_lock);
+   return victim;
+}
+
+/*
+ * Appends the content of node to the backing file and frees it. Called with
+ * the lock of node held for writing. Returns 0 on success.
+ */
+static int spill_out(vfsn_t *node)
+{
+   // the content might have changed since it was picked
+   if (!node->lru_next || !node->data)
+      return 0;
+
+   size_t size = node->data_size;
+   long long off = __atomic_fetch_add(&spill_end, size, __ATOMIC_RELAXED);
+   for (size_t done = 0; done < size; ) {
+      ssize_t len = pwrite(spill_fd, (char*)node->data + done, size - done, off + done);
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len <= 0) {
+         log_err("spilling %zu bytes failed: %s", size, strerror(errno));
+         return 1;
+      }
+      done += len;
+   }
+
+   vfs_spill_untrack(node);
+   free(node->data);
+   node->data = NULL;
+   node->spill_off = off;
+   node->flags |= VFS_SPILLED;
+   __atomic_add_fetch(&spill_bytes, size, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&spill_evictions, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+static void spill_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "spill.budget", spill_budget);
+   emit(ctx, "spill.resident", __atomic_load_n(&spill_resident, __ATOMIC_RELAXED));
+   emit(ctx, "spill.spilled", __atomic_load_n(&spill_bytes, __ATOMIC_RELAXED));
+   emit(ctx, "spill.file_size", __atomic_load_n(&spill_end, __ATOMIC_RELAXED));
+   emit(ctx, "spill.hits", __atomic_load_n(&spill_hits, __ATOMIC_RELAXED));
+   emit(ctx, "spill.misses", __atomic_load_n(&spill_misses, __ATOMIC_RELAXED));
+   emit(ctx, "spill.evictions", __atomic_load_n(&spill_evictions, __ATOMIC_RELAXED));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+int vfs_spill_init(size_t budget, const char *dir)
+{
+   if (!dir)
+      dir = getenv("TMPDIR");
+   char path[4096];
+   snprintf(path, sizeof(path), "%s/fileserver.spill.XXXXXX", dir ? dir : "/tmp");
+
+   // the backing file is private and vanishes with the process
+   spill_fd = mkstemp(path);
+   if (spill_fd < 0) {
+      log_err("creating backing file %s failed: %s", path, strerror(errno));
+      return 1;
+   }
+   unlink(path);
+
+   spill_budget = budget;
+   stats_register(spill_stats, NULL);
+   log_info("memory budget of %zu bytes, spilling to %s", budget, path);
+   return 0;
+}
+
+void vfs_spill_track(vfsn_t *node)
+{
+   if (!spill_budget || !node->data || !node->data_size || node->lru_next)
+      return;
+
+   pthread_mutex_lock(&spill_lock);
+   spill_ring_insert(node);
+   spill_count++;
+   __atomic_add_fetch(&spill_resident, node->data_size, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&spill_lock);
+}
+
+void vfs_spill_untrack(vfsn_t *node)
+{
+   if (node->flags & VFS_SPILLED) {
+      __atomic_sub_fetch(&spill_bytes, node->data_size, __ATOMIC_RELAXED);
+      node->flags &= ~VFS_SPILLED;
+   }
+   if (!node->lru_next)
+      return;
+
+   pthread_mutex_lock(&spill_lock);
+   spill_ring_remove(node);
+   spill_count--;
+   __atomic_sub_fetch(&spill_resident, node->data_size, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&spill_lock);
+}
+
+void vfs_spill_touch(vfsn_t *node)
+{
+   if (!spill_budget)
+      return;
+
+   // plain flag instead of reordering, readers stay off the global lock
+   if (!__atomic_load_n(&node->lru_ref, __ATOMIC_RELAXED))
+      __atomic_store_n(&node->lru_ref, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&spill_hits, 1, __ATOMIC_RELAXED);
+}
+
+int vfs_spill_load(vfsn_t *node)
+{
+   // loaded by another reader in between
+   if (!(node->flags & VFS_SPILLED))
+      return 0;
+
+   __atomic_add_fetch(&spill_misses, 1, __ATOMIC_RELAXED);
+   void *data = malloc(node->data_size ? node->data_size : 1);
+   if (!data)
+      return 1;
+   if (vfs_spill_read(node, data, node->data_size) != node->data_size) {
+      free(data);
+      return 1;
+   }
+
+   vfs_spill_untrack(node);
+   node->data = data;
+   vfs_spill_track(node);
+   return 0;
+}
+
+size_t vfs_spill_read(vfsn_t *node, void *data, size_t size)
+{
+   if (size > node->data_size)
+      size = node->data_size;
+   return vfs_spill_pread(node->spill_off, data, size);
+}
+
+size_t vfs_spill_pread(long long off, void *data, size_t size)
+{
+   size_t done = 0;
+   while (done < size) {
+      ssize_t len = pread(spill_fd, (char*)data + done, size - done, off + done);
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len <= 0) {
+         log_err("reading spilled content failed: %s", strerror(errno));
+         break;
+      }
+      done += len;
+   }
+   return done;
+}
+
+int vfs_spill_fd(void)
+{
+   return spill_fd;
+}
+
+void vfs_spill_balance(void)
+{
+   if (!spill_budget || __atomic_load_n(&spill_resident, __ATOMIC_RELAXED) <= (long long)spill_budget)
+      return;
+   if (pthread_mutex_trylock(&spill_evict_lock))
+      return;
+
+   while (__atomic_load_n(&spill_resident, __ATOMIC_RELAXED) > (long long)spill_budget) {
+      vfsn_t *victim = spill_victim();
+      if (!victim)
+         break;
+
+      int retval;
+      pthread_rwlock_wrlock(&victim->lock);
+      retval = spill_out(victim);
+      pthread_rwlock_unlock(&victim->lock);
+      vfs_close(victim);
+      if (retval)
+         break;
+   }
+   pthread_mutex_unlock(&spill_evict_lock);
+}
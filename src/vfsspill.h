@@ -0,0 +1,66 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef VFSSPILL
+#define VFSSPILL
+
+#include "vfs.h"
+#include <stddef.h>
+
+// content of the file lives in the backing file
+#define VFS_SPILLED 0x20
+
+/*
+ * Limits the memory of file contents to budget bytes. Once exceeded, the
+ * least recently used contents are appended to a backing file created in
+ * directory dir, or $TMPDIR if NULL. Must be called before any node is
+ * created. Returns 0 on success.
+ */
+int vfs_spill_init(size_t budget, const char *dir);
+
+/*
+ * Starts and stops accounting of the content of node. Called with the lock
+ * of node held, around every change of its data.
+ */
+void vfs_spill_track(vfsn_t *node);
+void vfs_spill_untrack(vfsn_t *node);
+
+/*
+ * Marks the content of node as recently used. Called with the lock of node
+ * held for reading.
+ */
+void vfs_spill_touch(vfsn_t *node);
+
+/*
+ * Faults the content of a spilled node back into memory. Called with the
+ * lock of node held for writing. Returns 0 if the content is resident.
+ */
+int vfs_spill_load(vfsn_t *node);
+
+/*
+ * Reads up to size bytes of a spilled node directly from the backing file.
+ * Returns the number of bytes read.
+ */
+size_t vfs_spill_read(vfsn_t *node, void *data, size_t size);
+
+/*
+ * Reads size bytes at offset off of the backing file, which only grows, so
+ * contents stay readable after their node moved on. Returns the number of
+ * bytes read.
+ */
+size_t vfs_spill_pread(long long off, void *data, size_t size);
+
+/*
+ * Returns the backing file, which may be read from directly at the offsets
+ * of spilled contents, or -1 if contents are never spilled.
+ */
+int vfs_spill_fd(void);
+
+/*
+ * Evicts contents until the budget is met again. Must be called without any
+ * node locks held.
+ */
+void vfs_spill_balance(void);
+
+#endif
@@ -0,0 +1,1062 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "vtl.h"
+#include "vtp.h"
+#include "http.h"
+#include "log.h"
+#include "stats.h"
+#include "fair.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define MSG_BUSY "BUSY Server busy, try again later\n"
+
+#define VTL_EVENTS        256
+#define VTL_READ_SIZE     16384
+#define VTL_OUT_LIMIT     (4 << 20)   // stop reading above this backlog
+#define VTL_IN_LIMIT      (1 << 20)   // input kept while waiting for a turn
+#define VTL_SLICE         500000      // ns of turns between polls of the sockets
+#define VTL_SEND_CHUNK    (256 << 10) // linked sends for large replies
+
+#define URING_ENTRIES     1024
+#define URING_BUFFERS     512         // power of two
+#define URING_BGID        0
+
+// operations encoded in the low bits of user_data
+#define OP_ACCEPT 0
+#define OP_RECV   1
+#define OP_SEND   2
+#define OP_CANCEL 3
+#define OP_STOP   4
+#define OP_WATCH  5
+#define OP_MASK   7
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct vtl_msg {
+   struct msghdr msg;
+   struct iovec iov;
+   union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+   } control;
+   int fd;
+};
+
+struct vtl_conn {
+   vtp_session_t session;
+   int fd;
+   int closing, dirty, paused, watching;
+   uint32_t events;           // registered with epoll
+   struct vtl_conn *prev, *next, *next_dirty;
+
+   // pending io_uring operations referencing this connection
+   int inflight, recv_armed, sending, send_error, watch_cancelled;
+
+   // buffer owned by the kernel while sending, swapped with session output
+   char *sendbuf;
+   size_t sendsize, sent;
+
+   // descriptors passed by the pending sends
+   struct vtl_msg msgs[VTP_PASSFDS];
+   int nmsgs;
+
+   // waiting for the rate limit until resume, else in the run queue if yielded
+   int throttled;
+   uint64_t resume;
+   struct vtl_conn *next_throttled;
+};
+
+struct vtl_loop {
+   struct vts_shard *shard;
+   int backend, stopping, accept_armed;
+   struct vtl_conn *conns, *dirty;
+   int nconns;
+
+   // connections with commands left after their turn
+   fair_queue_t runq;
+   struct vtl_conn *throttled;
+   int nthrottled;
+
+   // epoll
+   int epfd;
+
+   // io_uring
+   int ringfd;
+   void *ring;
+   size_t ringsize;
+   struct io_uring_sqe *sqes;
+   size_t sqesize;
+   unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+   unsigned *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_cqe *cqes;
+   unsigned sq_local, sq_submitted;
+   struct io_uring_buf_ring *br;
+   size_t brsize;
+   char *buffers;
+   uint64_t stopvalue;
+
+   // statistics
+   uint64_t wakeups, syscalls, events, accepted, rejected, turns;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void vtl_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   struct vtl_loop *loop = arg;
+   char name[64];
+   int id = loop->shard->id;
+
+   snprintf(name, sizeof(name), "vtl.shard%i.backend_%s", id, vtl_name(loop->backend));
+   emit(ctx, name, 1);
+   snprintf(name, sizeof(name), "vtl.shard%i.connections", id);
+   emit(ctx, name, loop->nconns);
+   snprintf(name, sizeof(name), "vtl.shard%i.accepted", id);
+   emit(ctx, name, loop->accepted);
+   snprintf(name, sizeof(name), "vtl.shard%i.rejected", id);
+   emit(ctx, name, loop->rejected);
+   snprintf(name, sizeof(name), "vtl.shard%i.wakeups", id);
+   emit(ctx, name, loop->wakeups);
+   snprintf(name, sizeof(name), "vtl.shard%i.syscalls", id);
+   emit(ctx, name, loop->syscalls);
+   snprintf(name, sizeof(name), "vtl.shard%i.events", id);
+   emit(ctx, name, loop->events);
+   snprintf(name, sizeof(name), "vtl.shard%i.turns", id);
+   emit(ctx, name, loop->turns);
+   snprintf(name, sizeof(name), "vtl.shard%i.runnable", id);
+   emit(ctx, name, loop->runq.len);
+   snprintf(name, sizeof(name), "vtl.shard%i.throttled", id);
+   emit(ctx, name, loop->nthrottled);
+}
+
+static void vtl_mark(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   if (!conn->dirty) {
+      conn->dirty = 1;
+      conn->next_dirty = loop->dirty;
+      loop->dirty = conn;
+   }
+}
+
+static struct vtl_conn* vtl_conn_new(struct vtl_loop *loop, int fd)
+{
+   struct vts_shard *shard = loop->shard;
+   pthread_mutex_lock(&shard->lock);
+   shard->accepted++;
+   if (loop->nconns >= shard->max_workers)
+      shard->rejected++;
+   else
+      shard->busy++;
+   pthread_mutex_unlock(&shard->lock);
+
+   if (loop->nconns >= shard->max_workers) {
+      loop->rejected++;
+      char *busy = shard->http ? HTTP_BUSY : MSG_BUSY;
+      send(fd, busy, strlen(busy), MSG_NOSIGNAL|MSG_DONTWAIT);
+      close(fd);
+      log_warn("client can not connect due to all slots are in use");
+      return NULL;
+   }
+
+   struct vtl_conn *conn = calloc(1, sizeof(struct vtl_conn));
+   int (*init)(vtp_session_t*, int, vfsn_t*) = shard->http ? vtp_session_init_http : vtp_session_init;
+   if (!conn || init(&conn->session, fd, vfs_open(shard->sock->root))) {
+      if (conn)
+         vtp_session_release(&conn->session);
+      free(conn);
+      close(fd);
+      pthread_mutex_lock(&shard->lock);
+      shard->busy--;
+      pthread_mutex_unlock(&shard->lock);
+      return NULL;
+   }
+   conn->fd = fd;
+
+   // link into the connections of the loop
+   conn->next = loop->conns;
+   if (loop->conns)
+      loop->conns->prev = conn;
+   loop->conns = conn;
+   loop->nconns++;
+   loop->accepted++;
+   log_info("client connceted");
+   vtl_mark(loop, conn);
+   return conn;
+}
+
+static void vtl_conn_release_msgs(struct vtl_conn *conn)
+{
+   for (int i = 0; i < conn->nmsgs; i++) {
+      close(conn->msgs[i].fd);
+   }
+   conn->nmsgs = 0;
+}
+
+/*
+ * Returns whether conn has commands left which wait for their turn.
+ */
+static int vtl_waiting(struct vtl_conn *conn)
+{
+   return conn->session.sched.index >= 0 || conn->throttled;
+}
+
+static void vtl_unqueue(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   fair_remove(&loop->runq, &conn->session.sched);
+   if (conn->throttled) {
+      struct vtl_conn **it = &loop->throttled;
+      while (*it != conn)
+         it = &(*it)->next_throttled;
+      *it = conn->next_throttled;
+      conn->throttled = 0;
+      loop->nthrottled--;
+   }
+}
+
+static void vtl_conn_free(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   vtl_unqueue(loop, conn);
+   if (conn->prev)
+      conn->prev->next = conn->next;
+   else
+      loop->conns = conn->next;
+   if (conn->next)
+      conn->next->prev = conn->prev;
+   loop->nconns--;
+   pthread_mutex_lock(&loop->shard->lock);
+   loop->shard->busy--;
+   pthread_mutex_unlock(&loop->shard->lock);
+
+   close(conn->fd);
+   vtl_conn_release_msgs(conn);
+   vtp_session_release(&conn->session);
+   free(conn->sendbuf);
+   free(conn);
+   log_info("client disconnceted");
+}
+
+/*
+ * Executes complete commands of conn for one turn. Connections which yielded
+ * wait in the run queue or, if throttled, until their rate limit allows the
+ * next command.
+ */
+static void vtl_turn(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   vtp_session_t *s = &conn->session;
+   s->budget = FAIR_QUANTUM;
+   vtp_feed(s);
+   loop->turns++;
+
+   if (s->closed) {
+      conn->closing = 1;
+   } else if (s->yielded == FAIR_THROTTLED) {
+      conn->throttled = 1;
+      conn->resume = fair_now() + fair_delay(&s->sched);
+      conn->next_throttled = loop->throttled;
+      loop->throttled = conn;
+      loop->nthrottled++;
+   } else if (s->yielded && fair_push(&loop->runq, &s->sched)) {
+      conn->closing = 1;
+   }
+   vtl_mark(loop, conn);
+}
+
+/*
+ * Queues a connection which streams a response for its next turn once its
+ * output got sent.
+ */
+static void vtl_stream(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   if (vtp_streaming(&conn->session) && !vtl_waiting(conn) && !conn->send_error
+         && fair_push(&loop->runq, &conn->session.sched))
+      conn->closing = 1;
+}
+
+/*
+ * Appends received data to the session and executes complete commands,
+ * unless earlier commands still wait for their turn.
+ */
+static void vtl_input(struct vtl_loop *loop, struct vtl_conn *conn, char *data, size_t len)
+{
+   vtp_session_t *s = &conn->session;
+   if (conn->closing)
+      return;
+
+   char *buf = vtp_reserve(s, len);
+   if (!buf) {
+      conn->closing = 1;
+      return;
+   }
+   memcpy(buf, data, len);
+   s->in_len += len;
+   if (vtl_waiting(conn))
+      vtl_mark(loop, conn);
+   else
+      vtl_turn(loop, conn);
+}
+
+/*
+ * Gives turns to waiting connections in order of their virtual time. Returns
+ * the ms until the next throttled connection may continue, 0 if connections
+ * are still runnable or -1 if none waits.
+ */
+static int vtl_schedule(struct vtl_loop *loop)
+{
+   uint64_t now = fair_now(), next = 0;
+   struct vtl_conn **it = &loop->throttled;
+   while (*it) {
+      struct vtl_conn *conn = *it;
+      if (conn->resume > now) {
+         it = &conn->next_throttled;
+         continue;
+      }
+      *it = conn->next_throttled;
+      conn->throttled = 0;
+      loop->nthrottled--;
+      if (fair_push(&loop->runq, &conn->session.sched)) {
+         conn->closing = 1;
+         vtl_mark(loop, conn);
+      }
+   }
+
+   // new input gets polled after a slice, so waiting is bounded by one turn
+   fair_client_t *c;
+   do {
+      if (!(c = fair_pop(&loop->runq)))
+         break;
+      vtl_turn(loop, (struct vtl_conn*)((char*)c - offsetof(struct vtl_conn, session.sched)));
+   } while (fair_now() - now < VTL_SLICE);
+
+   if (loop->runq.len)
+      return 0;
+
+   // turns may have throttled connections again
+   for (struct vtl_conn *conn = loop->throttled; conn; conn = conn->next_throttled) {
+      if (!next || conn->resume < next)
+         next = conn->resume;
+   }
+   now = fair_now();
+   return next ? (next > now ? (next - now + 999999) / 1000000 : 0) : -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EPOLL BACKEND
+///////////////////////////////////////////////////////////////////////////////
+static int vtl_epoll_update(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   struct epoll_event ev = { .data.ptr = conn };
+   if (!conn->paused)
+      ev.events |= EPOLLIN | EPOLLRDHUP;
+   if (conn->session.out_len > conn->sent)
+      ev.events |= EPOLLOUT;
+   if (ev.events == conn->events)
+      return 0;
+   conn->events = ev.events;
+   loop->syscalls++;
+   return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*
+ * Sends buffered output, closes finished connections and applies the
+ * backpressure of connections with a large output backlog.
+ */
+static void vtl_epoll_flush(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   vtp_session_t *s = &conn->session;
+
+   while (s->out_len > conn->sent) {
+      loop->syscalls++;
+      ssize_t len = vtp_send(s, conn->sent, MSG_NOSIGNAL|MSG_DONTWAIT);
+      if (len < 0) {
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            conn->closing = conn->send_error = 1;
+         break;
+      }
+      conn->sent += len;
+   }
+   if (s->out_len == conn->sent) {
+      s->out_len = conn->sent = 0;
+      vtl_stream(loop, conn);
+   }
+
+   // close after everything was executed and sent
+   if (conn->closing && ((s->out_len == 0 && !vtl_waiting(conn)) || conn->send_error)) {
+      vtl_conn_free(loop, conn);
+      return;
+   }
+
+   // wait for watch events, tagged to tell them from the socket
+   if (!conn->watching && vtp_watch_fd(s) >= 0 && s->out_len - conn->sent <= VTL_OUT_LIMIT
+         && !vtp_streaming(s)) {
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = (char*)conn + 1 };
+      loop->syscalls++;
+      conn->watching = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, vtp_watch_fd(s), &ev) == 0;
+   }
+
+   // stop reading while the client does not read its responses or enough
+   // commands wait for their turn
+   conn->paused = s->out_len - conn->sent > VTL_OUT_LIMIT || conn->closing
+      || (vtl_waiting(conn) && s->in_len > VTL_IN_LIMIT);
+   vtl_epoll_update(loop, conn);
+}
+
+static void vtl_epoll_accept(struct vtl_loop *loop)
+{
+   while (1) {
+      loop->syscalls++;
+      int fd = accept4(loop->shard->sockfd, NULL, NULL, SOCK_NONBLOCK);
+      if (fd < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+            return;
+         // listening socket got shut down
+         loop->stopping = 1;
+         return;
+      }
+
+      struct vtl_conn *conn = vtl_conn_new(loop, fd);
+      if (!conn)
+         continue;
+
+      struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLOUT, .data.ptr = conn };
+      conn->events = ev.events;
+      loop->syscalls++;
+      if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+         vtl_conn_free(loop, conn);
+      }
+   }
+}
+
+static void vtl_epoll_read(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   char buf[VTL_READ_SIZE];
+   while (!conn->closing) {
+      loop->syscalls++;
+      ssize_t len = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         break;
+      if (len <= 0) {
+         // client disconnected, answer what was already received
+         conn->closing = 1;
+         vtl_mark(loop, conn);
+         break;
+      }
+      vtl_input(loop, conn, buf, len);
+      if (len < sizeof(buf) || conn->session.out_len > VTL_OUT_LIMIT
+            || (vtl_waiting(conn) && conn->session.in_len > VTL_IN_LIMIT))
+         break;
+   }
+}
+
+static int vtl_epoll_run(struct vtl_loop *loop)
+{
+   loop->epfd = epoll_create1(0);
+   if (loop->epfd < 0)
+      return 1;
+
+   int sockfd = loop->shard->sockfd;
+   fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+   struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+   epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sockfd, &ev);
+   ev.data.ptr = loop;
+   epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->shard->stopfd, &ev);
+
+   struct epoll_event events[VTL_EVENTS];
+   int timeout = -1;
+   while (!loop->stopping) {
+      loop->wakeups++;
+      loop->syscalls++;
+      int count = epoll_wait(loop->epfd, events, VTL_EVENTS, timeout);
+      if (count < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+      loop->events += count;
+
+      for (int i = 0; i < count; i++) {
+         struct vtl_conn *conn = events[i].data.ptr;
+         if (!conn) {
+            vtl_epoll_accept(loop);
+            continue;
+         }
+         if (conn == (void*)loop) {
+            loop->stopping = 1;
+            continue;
+         }
+         if ((uintptr_t)conn & 1) {
+            conn = (struct vtl_conn*)((char*)conn - 1);
+            if (conn->session.out_len - conn->sent > VTL_OUT_LIMIT || vtp_streaming(&conn->session)) {
+               // client does not read or a response is streamed, let the
+               // events queue up until it is done
+               loop->syscalls++;
+               epoll_ctl(loop->epfd, EPOLL_CTL_DEL, vtp_watch_fd(&conn->session), NULL);
+               conn->watching = 0;
+            } else {
+               vtp_events(&conn->session);
+            }
+            vtl_mark(loop, conn);
+            continue;
+         }
+         if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            vtl_epoll_read(loop, conn);
+         if (events[i].events & EPOLLOUT)
+            vtl_mark(loop, conn);
+      }
+      timeout = vtl_schedule(loop);
+
+      // answer all connections which executed commands in this round
+      while (loop->dirty) {
+         struct vtl_conn *conn = loop->dirty;
+         loop->dirty = conn->next_dirty;
+         conn->dirty = 0;
+         vtl_epoll_flush(loop, conn);
+      }
+      if (loop->runq.len)
+         timeout = 0;
+   }
+
+   while (loop->conns)
+      vtl_conn_free(loop, loop->conns);
+   fair_queue_free(&loop->runq);
+   close(loop->epfd);
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IO_URING BACKEND
+///////////////////////////////////////////////////////////////////////////////
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+   return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size)
+{
+   return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned args)
+{
+   return syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+static void uring_release(struct vtl_loop *loop)
+{
+   if (loop->br)
+      munmap(loop->br, loop->brsize);
+   free(loop->buffers);
+   if (loop->sqes)
+      munmap(loop->sqes, loop->sqesize);
+   if (loop->ring)
+      munmap(loop->ring, loop->ringsize);
+   if (loop->ringfd >= 0)
+      close(loop->ringfd);
+}
+
+static int uring_init(struct vtl_loop *loop)
+{
+   struct io_uring_params params;
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+      IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+   params.cq_entries = URING_ENTRIES * 4;
+   loop->ringfd = uring_setup(URING_ENTRIES, &params);
+   if (loop->ringfd < 0 && errno == EINVAL) {
+      // older kernels do not know all flags
+      memset(&params, 0, sizeof(params));
+      params.flags = IORING_SETUP_CQSIZE;
+      params.cq_entries = URING_ENTRIES * 4;
+      loop->ringfd = uring_setup(URING_ENTRIES, &params);
+   }
+   if (loop->ringfd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+      return 1;
+
+   // map submission and completion ring
+   size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   size_t cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   loop->ringsize = sqsize > cqsize ? sqsize : cqsize;
+   loop->ring = mmap(NULL, loop->ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      loop->ringfd, IORING_OFF_SQ_RING);
+   if (loop->ring == MAP_FAILED) {
+      loop->ring = NULL;
+      return 1;
+   }
+   loop->sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+   loop->sqes = mmap(NULL, loop->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      loop->ringfd, IORING_OFF_SQES);
+   if (loop->sqes == MAP_FAILED) {
+      loop->sqes = NULL;
+      return 1;
+   }
+
+   char *ring = loop->ring;
+   loop->sq_head = (unsigned*)(ring + params.sq_off.head);
+   loop->sq_tail = (unsigned*)(ring + params.sq_off.tail);
+   loop->sq_mask = (unsigned*)(ring + params.sq_off.ring_mask);
+   loop->sq_array = (unsigned*)(ring + params.sq_off.array);
+   loop->sq_entries = params.sq_entries;
+   loop->cq_head = (unsigned*)(ring + params.cq_off.head);
+   loop->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+   loop->cq_mask = (unsigned*)(ring + params.cq_off.ring_mask);
+   loop->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+   loop->sq_local = loop->sq_submitted = *loop->sq_tail;
+
+   // register ring of provided receive buffers
+   loop->brsize = URING_BUFFERS * sizeof(struct io_uring_buf);
+   loop->br = mmap(NULL, loop->brsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   loop->buffers = malloc((size_t)URING_BUFFERS * VTL_READ_SIZE);
+   if (loop->br == MAP_FAILED || !loop->buffers) {
+      if (loop->br == MAP_FAILED)
+         loop->br = NULL;
+      return 1;
+   }
+   struct io_uring_buf_reg reg = {
+      .ring_addr = (uintptr_t)loop->br,
+      .ring_entries = URING_BUFFERS,
+      .bgid = URING_BGID
+   };
+   if (uring_register(loop->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1))
+      return 1;
+
+   for (int i = 0; i < URING_BUFFERS; i++) {
+      struct io_uring_buf *buf = &loop->br->bufs[i];
+      buf->addr = (uintptr_t)(loop->buffers + (size_t)i * VTL_READ_SIZE);
+      buf->len = VTL_READ_SIZE;
+      buf->bid = i;
+   }
+   __atomic_store_n(&loop->br->tail, URING_BUFFERS, __ATOMIC_RELEASE);
+   return 0;
+}
+
+static void uring_recycle(struct vtl_loop *loop, unsigned bid)
+{
+   unsigned short tail = loop->br->tail;
+   struct io_uring_buf *buf = &loop->br->bufs[tail & (URING_BUFFERS - 1)];
+   buf->addr = (uintptr_t)(loop->buffers + (size_t)bid * VTL_READ_SIZE);
+   buf->len = VTL_READ_SIZE;
+   buf->bid = bid;
+   __atomic_store_n(&loop->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submits queued entries and waits up to timeout ms for a completion, forever
+ * if timeout is negative.
+ */
+static int uring_submit(struct vtl_loop *loop, int timeout)
+{
+   unsigned submit = loop->sq_local - loop->sq_submitted;
+   __atomic_store_n(loop->sq_tail, loop->sq_local, __ATOMIC_RELEASE);
+   loop->syscalls++;
+   struct __kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000ll };
+   struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&ts };
+   int retval;
+   if (timeout > 0)
+      retval = uring_enter(loop->ringfd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+   else
+      retval = uring_enter(loop->ringfd, submit, !!timeout, timeout ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   if (retval >= 0)
+      loop->sq_submitted += retval;
+   return retval;
+}
+
+static struct io_uring_sqe* uring_sqe(struct vtl_loop *loop, void *conn, int op)
+{
+   // submit pending entries if the queue is full
+   while (loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries) {
+      if (uring_submit(loop, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+         return NULL;
+   }
+
+   unsigned index = loop->sq_local & *loop->sq_mask;
+   struct io_uring_sqe *sqe = &loop->sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->user_data = (uintptr_t)conn | op;
+   loop->sq_array[index] = index;
+   loop->sq_local++;
+   if (conn)
+      ((struct vtl_conn*)conn)->inflight++;
+   return sqe;
+}
+
+static void uring_accept(struct vtl_loop *loop)
+{
+   struct io_uring_sqe *sqe = uring_sqe(loop, NULL, OP_ACCEPT);
+   if (!sqe)
+      return;
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = loop->shard->sockfd;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   loop->accept_armed = 1;
+}
+
+/*
+ * Waits for vts_stop and cancels the accept operation.
+ */
+static void uring_wait_stop(struct vtl_loop *loop)
+{
+   struct io_uring_sqe *sqe = uring_sqe(loop, NULL, OP_STOP);
+   if (!sqe)
+      return;
+   sqe->opcode = IORING_OP_READ;
+   sqe->fd = loop->shard->stopfd;
+   sqe->addr = (uintptr_t)&loop->stopvalue;
+   sqe->len = sizeof(loop->stopvalue);
+}
+
+static void uring_recv(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   struct io_uring_sqe *sqe = uring_sqe(loop, conn, OP_RECV);
+   if (!sqe)
+      return;
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = conn->fd;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BGID;
+   conn->recv_armed = 1;
+}
+
+static void uring_cancel(struct vtl_loop *loop, struct vtl_conn *conn, int op)
+{
+   struct io_uring_sqe *sqe = uring_sqe(loop, conn, OP_CANCEL);
+   if (!sqe)
+      return;
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->addr = (uintptr_t)conn | op;
+}
+
+static void uring_watch(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   struct io_uring_sqe *sqe = uring_sqe(loop, conn, OP_WATCH);
+   if (!sqe)
+      return;
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = vtp_watch_fd(&conn->session);
+   sqe->poll32_events = POLLIN;
+   conn->watching = 1;
+}
+
+/*
+ * Hands the buffered output of the session to the kernel. Large replies are
+ * split into a chain of linked sends, so they are transmitted in order without
+ * returning to user space in between.
+ */
+static void uring_send(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   vtp_session_t *s = &conn->session;
+
+   // swap buffers, the session continues to write into the old send buffer
+   char *buf = s->out;
+   size_t len = s->out_len, size = s->out_size;
+   s->out = conn->sendbuf;
+   s->out_size = conn->sendsize;
+   s->out_len = 0;
+   conn->sendbuf = buf;
+   conn->sendsize = size;
+
+   // take over the passed descriptors of the swapped buffer
+   struct vtp_passfd passfds[VTP_PASSFDS];
+   int npassfds = s->npassfds;
+   memcpy(passfds, s->passfds, sizeof(passfds));
+   s->npassfds = 0;
+
+   for (size_t off = 0, end; off < len; off = end) {
+      end = len - off < VTL_SEND_CHUNK ? len : off + VTL_SEND_CHUNK;
+      int attach = conn->nmsgs < npassfds && passfds[conn->nmsgs].at == off;
+      int next = conn->nmsgs + attach;
+      if (next < npassfds && passfds[next].at < end)
+         end = passfds[next].at;
+
+      struct io_uring_sqe *sqe = uring_sqe(loop, conn, OP_SEND);
+      if (!sqe) {
+         conn->send_error = conn->closing = 1;
+         break;
+      }
+      sqe->fd = conn->fd;
+      sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      if (end < len)
+         sqe->flags = IOSQE_IO_LINK;
+      conn->sending++;
+
+      if (!attach) {
+         sqe->opcode = IORING_OP_SEND;
+         sqe->addr = (uintptr_t)(buf + off);
+         sqe->len = end - off;
+         continue;
+      }
+
+      // attach descriptor to the first byte of its response
+      struct vtl_msg *msg = &conn->msgs[conn->nmsgs++];
+      memset(msg, 0, sizeof(*msg));
+      msg->fd = passfds[next - 1].fd;
+      msg->iov.iov_base = buf + off;
+      msg->iov.iov_len = end - off;
+      msg->msg.msg_iov = &msg->iov;
+      msg->msg.msg_iovlen = 1;
+      msg->msg.msg_control = msg->control.buf;
+      msg->msg.msg_controllen = sizeof(msg->control.buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg->msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &msg->fd, sizeof(int));
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->addr = (uintptr_t)&msg->msg;
+      sqe->len = 1;
+   }
+
+   // descriptors which could not be submitted
+   for (int i = conn->nmsgs; i < npassfds; i++)
+      close(passfds[i].fd);
+}
+
+static void uring_flush(struct vtl_loop *loop, struct vtl_conn *conn)
+{
+   vtp_session_t *s = &conn->session;
+
+   if (!conn->sending && s->out_len > 0 && !conn->send_error)
+      uring_send(loop, conn);
+   if (!s->out_len)
+      vtl_stream(loop, conn);
+
+   if (conn->closing && (!vtl_waiting(conn) || conn->send_error)) {
+      // wait for pending sends, then let the receive operation terminate
+      if (!conn->sending && conn->recv_armed && conn->fd >= 0)
+         shutdown(conn->fd, SHUT_RDWR);
+      if (conn->watching && !conn->watch_cancelled) {
+         conn->watch_cancelled = 1;
+         uring_cancel(loop, conn, OP_WATCH);
+      }
+      if (!conn->inflight)
+         vtl_conn_free(loop, conn);
+      return;
+   }
+
+   // stop reading while the client does not read its responses or enough
+   // commands wait for their turn
+   int full = s->out_len > VTL_OUT_LIMIT || (vtl_waiting(conn) && s->in_len > VTL_IN_LIMIT);
+   if (!conn->paused && full && conn->recv_armed) {
+      conn->paused = 1;
+      uring_cancel(loop, conn, OP_RECV);
+   } else if (conn->paused && !full) {
+      conn->paused = 0;
+   }
+   if (!conn->paused && !conn->recv_armed && !conn->closing)
+      uring_recv(loop, conn);
+   if (!conn->watching && vtp_watch_fd(s) >= 0 && s->out_len <= VTL_OUT_LIMIT && !vtp_streaming(s))
+      uring_watch(loop, conn);
+}
+
+static void uring_complete(struct vtl_loop *loop, struct io_uring_cqe *cqe)
+{
+   int op = cqe->user_data & OP_MASK;
+   struct vtl_conn *conn = (struct vtl_conn*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+   int more = cqe->flags & IORING_CQE_F_MORE;
+
+   if (op == OP_STOP) {
+      if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+         uring_wait_stop(loop);
+         return;
+      }
+      loop->stopping = 1;
+      struct io_uring_sqe *sqe = uring_sqe(loop, NULL, OP_CANCEL);
+      if (sqe) {
+         sqe->opcode = IORING_OP_ASYNC_CANCEL;
+         sqe->addr = OP_ACCEPT;
+      }
+      return;
+   }
+   if (op == OP_CANCEL && !conn) {
+      return;
+   }
+
+   if (op == OP_ACCEPT) {
+      if (cqe->res >= 0)
+         vtl_conn_new(loop, cqe->res);
+      if (!more) {
+         loop->accept_armed = 0;
+         // listening socket got shut down
+         if (cqe->res == -EINVAL || cqe->res == -EBADF)
+            loop->stopping = 1;
+         else if (!loop->stopping)
+            uring_accept(loop);
+      }
+      return;
+   }
+
+   if (!more)
+      conn->inflight--;
+
+   switch (op) {
+      case OP_RECV:
+         if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            // multishot receives drain the socket ahead of the session
+            conn->session.pending = !!(cqe->flags & IORING_CQE_F_SOCK_NONEMPTY);
+            if (cqe->res > 0)
+               vtl_input(loop, conn, loop->buffers + (size_t)bid * VTL_READ_SIZE, cqe->res);
+            conn->session.pending = 0;
+            uring_recycle(loop, bid);
+         }
+         if (!more) {
+            conn->recv_armed = 0;
+            // out of buffers or cancelled gets re-armed on flush
+            if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+               conn->closing = 1;
+         }
+         break;
+
+      case OP_WATCH:
+         conn->watching = 0;
+         if (cqe->res > 0)
+            vtp_events(&conn->session);
+         break;
+
+      case OP_SEND:
+         if (--conn->sending == 0)
+            vtl_conn_release_msgs(conn);
+         if (cqe->res < 0)
+            conn->send_error = conn->closing = 1;
+         break;
+   }
+   vtl_mark(loop, conn);
+}
+
+static int vtl_uring_run(struct vtl_loop *loop)
+{
+   if (uring_init(loop)) {
+      uring_release(loop);
+      return 1;
+   }
+
+   uring_accept(loop);
+   uring_wait_stop(loop);
+   int timeout = -1;
+   while (loop->accept_armed || loop->conns) {
+      // one syscall submits all replies and waits for the next completions
+      loop->wakeups++;
+      if (uring_submit(loop, timeout) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN
+            && errno != ETIME) {
+         log_err("io_uring_enter failed: %i", errno);
+         break;
+      }
+
+      unsigned head = *loop->cq_head;
+      unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++) {
+         uring_complete(loop, &loop->cqes[head & *loop->cq_mask]);
+         loop->events++;
+      }
+      __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+
+      // disconnect all clients on shutdown
+      if (loop->stopping) {
+         for (struct vtl_conn *conn = loop->conns; conn; conn = conn->next) {
+            vtl_unqueue(loop, conn);
+            conn->closing = 1;
+            vtl_mark(loop, conn);
+         }
+      }
+      timeout = vtl_schedule(loop);
+
+      // answer all connections which executed commands in this round
+      while (loop->dirty) {
+         struct vtl_conn *conn = loop->dirty;
+         loop->dirty = conn->next_dirty;
+         conn->dirty = 0;
+         uring_flush(loop, conn);
+      }
+      if (loop->runq.len)
+         timeout = 0;
+   }
+
+   fair_queue_free(&loop->runq);
+   uring_release(loop);
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+int vtl_detect(int backend)
+{
+   if (backend >= VTL_URING) {
+      // multishot receive with provided buffer rings needs linux 6.0
+      struct utsname uts;
+      int major = 0, minor = 0;
+      if (uname(&uts) == 0)
+         sscanf(uts.release, "%i.%i", &major, &minor);
+
+      struct io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      int fd = major >= 6 ? uring_setup(4, &params) : -1;
+      if (fd >= 0) {
+         close(fd);
+         return VTL_URING;
+      }
+      log_warn("io_uring not available, falling back to epoll");
+   }
+
+   if (backend >= VTL_EPOLL) {
+      int fd = epoll_create1(0);
+      if (fd >= 0) {
+         close(fd);
+         return VTL_EPOLL;
+      }
+      log_warn("epoll not available, falling back to threads");
+   }
+   return VTL_THREADS;
+}
+
+char* vtl_name(int backend)
+{
+   switch (backend) {
+      case VTL_URING: return "uring";
+      case VTL_EPOLL: return "epoll";
+      default: return "threads";
+   }
+}
+
+int vtl_run(struct vts_shard *shard, int backend)
+{
+   struct vtl_loop loop;
+   memset(&loop, 0, sizeof(loop));
+   loop.shard = shard;
+   loop.backend = backend;
+   loop.ringfd = -1;
+   stats_register(vtl_stats, &loop);
+
+   int retval = 1;
+   if (backend == VTL_URING) {
+      retval = vtl_uring_run(&loop);
+      if (retval) {
+         log_warn("io_uring setup failed, falling back to epoll");
+         loop.backend = backend = VTL_EPOLL;
+      }
+   }
+   if (backend == VTL_EPOLL) {
+      retval = vtl_epoll_run(&loop);
+   }
+
+   stats_unregister(vtl_stats, &loop);
+   return retval;
+}
@@ -0,0 +1,31 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef VTL
+#define VTL
+
+#include "vts.h"
+
+#define VTL_THREADS 0
+#define VTL_EPOLL   1
+#define VTL_URING   2
+
+/*
+ * Returns the best backend supported by the running kernel which is not
+ * better than the requested one. Threads are always supported.
+ */
+int vtl_detect(int backend);
+
+/*
+ * Returns the name of given backend.
+ */
+char* vtl_name(int backend);
+
+/*
+ * Serves all connections of the shard from an event loop on the calling
+ * thread. Blocks until the listening socket of the shard gets shut down.
+ */
+int vtl_run(struct vts_shard *shard, int backend);
+
+#endif
@@ -2,23 +2,39 @@
 * Copyright (C) 2014 Roger Knecht
 * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "vtp.h"
+#include "http.h"
 #include "log.h"
+#include "stats.h"
+#include "vfsfind.h"
+#include "repl.h"
+#include "tenant.h"
+#include "tar.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdarg.h>
-#include <wordexp.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // DEFINES / MACROS
 ///////////////////////////////////////////////////////////////////////////////
-#define READ_BUFFER_SIZE 512
+#define READ_BUFFER_SIZE 4096
+#define VTP_TXN_CMDS 4096
+#define VTP_WEIGHT_MAX 1000
+#define VTP_STREAM_WINDOW (1 << 20)   // output a streamed response buffers ahead
 
 #define MSG_WELCOME "hello client and welcome to multithreading fileserver"
 #define MSG_LINE_START "> "
@@ -28,19 +44,64 @@
 #define MSG_UPDATED "UPDATED File updated"
 #define MSG_DIRCHANGED "DIRCHANGED Directory changed"
 #define MSG_MOVED "MOVED File/directory moved"
+#define MSG_WATCHING "WATCHING Watching for changes"
+#define MSG_UNWATCHED "UNWATCHED Watch removed"
+#define MSG_NOTMODIFIED "NOTMODIFIED File not modified"
+#define MSG_BEGIN "BEGIN Transaction started"
+#define MSG_QUEUED "QUEUED Command queued"
+#define MSG_ABORTED "ABORTED Transaction aborted"
+#define MSG_USING "USING Tenant selected"
+#define MSG_DROPPED "DROPPED Tenant dropped"
+#define MSG_SNAPSHOTCREATED "SNAPSHOTCREATED Snapshot created"
 #define ERR_NOSUCHFILE "NOSUCHFILE No such file"
 #define ERR_NOSUCHDIR "NOSUCHDIR No such directory"
 #define ERR_NOSUCHCMD "NOSUCHCMD No such command"
 #define ERR_INVALIDCMD "INVALIDCMD Invalid arguments"
 #define ERR_FILEEXISTS "FILEEXISTS File already exists"
+#define ERR_NOMEMORY "NOMEMORY Out of memory"
+#define ERR_NOTSUPPORTED "NOTSUPPORTED Not supported on this connection"
+#define ERR_TOOMANYFDS "TOOMANYFDS Too many descriptors in flight"
+#define ERR_NOSUCHWATCH "NOSUCHWATCH No such watch"
+#define ERR_CONFLICT "CONFLICT File changed in between"
+#define ERR_NOTXN "NOTXN No transaction in progress"
+#define ERR_INTXN "INTXN Not allowed in a transaction"
+#define ERR_TXNFULL "TXNFULL Too many commands in transaction"
+#define ERR_INVALIDMOVE "INVALIDMOVE Directory cannot be moved into itself"
+#define ERR_READONLY "READONLY Replicas are read-only"
+#define ERR_NOSUCHTENANT "NOSUCHTENANT No such tenant"
+#define ERR_DEFAULTTENANT "DEFAULTTENANT Default tenant cannot be dropped"
+#define ERR_ROOTDIR "ROOTDIR Root directory cannot be deleted"
+#define ERR_QUOTA "QUOTA Tenant quota exceeded"
+#define ERR_SNAPREADONLY "READONLY Snapshots are read-only"
 
 ///////////////////////////////////////////////////////////////////////////////
 // LOCAL STRUCTURES 
 ///////////////////////////////////////////////////////////////////////////////
+// directory lookup shared by consecutive items of a batch command
+struct vtp_batch {
+   char *dir;
+   size_t dir_len;
+   vfsn_t *node;
+   int resolved;
+};
+
+// command queued in a transaction
+struct vtp_queued {
+   struct vtp_cmd *cmd;
+   char **argv;
+   char *payload;
+   size_t payload_len;
+};
+
 struct vtp_cmd {
    char* name;
    int args;
-   char* (*func)(int fd, vfsn_t **cwd, char* argv[]);
+   char* (*func)(vtp_session_t *s, char* argv[]);
+   int payload;
+
+   // stages the command in a transaction, returns 0 and the response if it
+   // gets committed or the error
+   int (*stage)(vtp_session_t *s, vfs_txn_t *txn, struct vtp_queued *q, char **msg);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -59,7 +120,7 @@ static char* vtp_split_path(char **path)
    return file;
 }
 
-static void vtp_pathpart(vfsn_t **node, char* path)
+static void vtp_pathpart(vfsn_t **node, char* path, vfs_txn_t *txn)
 {
    if (strcmp(".", path) == 0) {
       return;
@@ -70,18 +131,17 @@ static void vtp_pathpart(vfsn_t **node, char* path)
       return;
    } 
   
-   vfs_child(node); 
-   while (*node) {
-      char name[256];
-      vfs_name(*node, name, 256);
-      if (strcmp(name, path) == 0) { 
-         break;   
-      }
-      vfs_next(node);
+   if (txn) {
+      vfs_txn_lookup(txn, node, path);
+   } else {
+      vfs_lookup(node, path);
    }
 }
 
-static vfsn_t* vtp_path(vfsn_t *cwd, char* path)
+/*
+ * Resolves path like vtp_path, but sees the changes staged in txn.
+ */
+static vfsn_t* vtp_txn_path(vfsn_t *cwd, char* path, vfs_txn_t *txn)
 {
    vfsn_t *node = vfs_open(cwd);
 
@@ -94,95 +154,168 @@ static vfsn_t* vtp_path(vfsn_t *cwd, char* path)
       vfs_root(&node);
    }
 
-   char *pathtok = strtok(path, "/");
+   char *saveptr;
+   char *pathtok = strtok_r(path, "/", &saveptr);
    while (node && pathtok) {
-      vtp_pathpart(&node, pathtok);
-      pathtok = strtok(NULL, "/");
+      vtp_pathpart(&node, pathtok, txn);
+      pathtok = strtok_r(NULL, "/", &saveptr);
    }
 
    return node;
 }
 
+vfsn_t* vtp_path(vfsn_t *cwd, char* path)
+{
+   return vtp_txn_path(cwd, path, NULL);
+}
+
 static int vtp_read_packet(int fd, char *buf, size_t size)
 {
-   int len = 0;
-   while (len <= 0) {
-      if (fcntl(fd, F_GETFL) == -1) 
-         return -1;
-      len = recv(fd, buf, size, MSG_DONTWAIT);
-   }
+   int len;
+   do {
+      len = recv(fd, buf, size, 0);
+   } while (len < 0 && errno == EINTR);
    return len;
 }
 
-static int vtp_read(int fd, char *buf, size_t size)
+static int vtp_drained(int fd)
+{
+   char c;
+   return recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) <= 0;
+}
+
+char* vtp_out_reserve(vtp_session_t *s, size_t size)
 {
-   int total = 0;
-   while (total < size) {
-      if (fcntl(fd, F_GETFL) == -1) 
-         return -1;
-      int len = recv(fd, buf+total, size-total, MSG_DONTWAIT);
-      if (len > 0)
-         total += len;
+   if (s->out_len + size > s->out_size) {
+      size_t newsize = s->out_size ? s->out_size : READ_BUFFER_SIZE;
+      while (newsize < s->out_len + size)
+         newsize *= 2;
+      char *out = realloc(s->out, newsize);
+      if (!out)
+         return NULL;
+      s->out = out;
+      s->out_size = newsize;
    }
-   return total;
+   return s->out + s->out_len;
 }
 
-static int vtp_write(int fd, char *fmt, ...)
+static int vtp_put(vtp_session_t *s, const void *data, size_t size)
+{
+   char *out = vtp_out_reserve(s, size);
+   if (!out)
+      return -1;
+   memcpy(out, data, size);
+   s->out_len += size;
+   return size;
+}
+
+int vtp_write(vtp_session_t *s, char *fmt, ...)
 {
-   int totallen = strlen(fmt);
    va_list ap;
 
    // calculate buffer size
-   char *index = fmt;
-   int format = 0;
    va_start(ap, fmt);
-   while (*index) {
-      char *str;
-      switch (*index) {
-         case '%':
-            format = !format;
-            break;
- 
-         case 'l':
-         case 'i':
-            if (format) {
-               va_arg(ap, int);
-               totallen += 50;
-               format = 0;
-            }
-            break;
- 
-         case 's': 
-            if (format) {
-               str = va_arg(ap, char*);
-               totallen += format ? strlen(str) : 0;
-               format = 0;
-            }
-            break;
-      }
-      index++;
-   }
+   int len = vsnprintf(NULL, 0, fmt, ap);
    va_end(ap);
 
-   // format
-   char buffer[totallen];
-   memset(buffer, 0, sizeof(buffer));
+   // format into output buffer
+   char *out = vtp_out_reserve(s, len + 1);
+   if (len < 0 || !out)
+      return -1;
    va_start(ap, fmt);
-   vsprintf(buffer, fmt, ap);
+   vsnprintf(out, len + 1, fmt, ap);
    va_end(ap);
+   s->out_len += len;
+   return len;
+}
 
-   // send msg
-   return send(fd, buffer, strlen(buffer), MSG_NOSIGNAL|MSG_DONTWAIT);
+/*
+ * Prepends the number of lines written since start as ACK header.
+ */
+static char* vtp_ack(vtp_session_t *s, size_t start, int count)
+{
+   char header[32];
+   int len = snprintf(header, sizeof(header), "ACK %i\n", count);
+   if (!vtp_out_reserve(s, len)) {
+      s->out_len = start;
+      return ERR_NOMEMORY;
+   }
+   memmove(s->out + start + len, s->out + start, s->out_len - start);
+   memcpy(s->out + start, header, len);
+   s->out_len += len;
+   return NULL;
 }
 
-static char* vtp_cmd_create(int fd, vfsn_t **cwd, char* argv[])
+/*
+ * Returns whether the last component of path is a glob pattern. A node named
+ * like the pattern itself is taken literally.
+ */
+static int vtp_is_glob(vtp_session_t *s, const char *path)
 {
-   log_info("create file: %s", argv[1]);
-   int len = atoi(argv[2]);
+   // urls name files literally
+   if (s->http)
+      return 0;
 
-   char data[len+1];
-   memset(data, 0, sizeof(data));
-   vtp_read(fd, data, len);
+   const char *slash = strrchr(path, '/');
+   if (!strpbrk(slash ? slash + 1 : path, "*?["))
+      return 0;
+
+   char copy[strlen(path) + 1];
+   strcpy(copy, path);
+   vfsn_t *node = vtp_path(s->cwd, copy);
+   vfs_close(node);
+   return !node;
+}
+
+/*
+ * Opens the directory of a glob path and its children matching the last
+ * component. Returns the count, -1 if the directory does not exist and -2 on
+ * memory shortage.
+ */
+static int vtp_glob(vtp_session_t *s, char *path, vfsn_t **dir, vfsn_t ***nodes)
+{
+   char *pattern = vtp_split_path(&path);
+
+   // "/pattern" matches in the root
+   if (path && !*path)
+      path = "/";
+
+   *dir = vtp_path(s->cwd, path);
+   if (!*dir)
+      return -1;
+
+   int count = vfs_glob(*dir, pattern, nodes);
+   if (count < 0) {
+      vfs_close(*dir);
+      return -2;
+   }
+   return count;
+}
+
+static void vtp_glob_free(vfsn_t *dir, vfsn_t **nodes, int count)
+{
+   for (int i = 0; i < count; i++)
+      vfs_close(nodes[i]);
+   free(nodes);
+   vfs_close(dir);
+}
+
+/*
+ * Writes the result of a glob entry as code of msg followed by its name.
+ */
+static int vtp_glob_result(vtp_session_t *s, char *msg, vfsn_t *node)
+{
+   int name_size = vfs_name_size(node);
+   char name[name_size+1];
+   memset(name, 0, sizeof(name));
+   vfs_name(node, name, name_size);
+   return vtp_write(s, "%.*s %s\n", (int)strcspn(msg, " "), msg, name);
+}
+
+static char* vtp_cmd_create(vtp_session_t *s, char* argv[])
+{
+   log_info("create file: %s", argv[1]);
+   int len = s->payload_len;
 
    char* path = argv[1];
    char* file = path;
@@ -194,20 +327,21 @@ static char* vtp_cmd_create(int fd, vfsn_t **cwd, char* argv[])
      path = ""; 
    }
 
-   vfsn_t *parent = vtp_path(*cwd, path);
-   vfsn_t *node = vfs_create(parent ? parent : *cwd, file, VFS_FILE);
+   vfsn_t *parent = vtp_path(s->cwd, path);
+   vfsn_t *node = vfs_create(parent ? parent : s->cwd, file, VFS_FILE);
+   int readonly = !node && vfs_is_readonly(parent ? parent : s->cwd);
    vfs_close(parent);
 
    if (!node) {
-      return ERR_FILEEXISTS;
+      return readonly ? ERR_SNAPREADONLY : ERR_FILEEXISTS;
    }
 
-   vfs_write(node, data, len);
+   vfs_write(node, s->payload, len);
    vfs_close(node);
    return MSG_FILECREATED;
 }
 
-static char* vtp_cmd_createdir(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_createdir(vtp_session_t *s, char* argv[])
 {
    log_info("create directory: %s", argv[1]);
    char* path = argv[1];
@@ -220,89 +354,462 @@ static char* vtp_cmd_createdir(int fd, vfsn_t **cwd, char* argv[])
       path = "";
    }
 
-   vfsn_t *parent = vtp_path(*cwd, path);
-   vfsn_t *node = vfs_create(parent ? parent : *cwd, file, VFS_DIR);
+   vfsn_t *parent = vtp_path(s->cwd, path);
+   vfsn_t *node = vfs_create(parent ? parent : s->cwd, file, VFS_DIR);
+   int readonly = !node && vfs_is_readonly(parent ? parent : s->cwd);
    vfs_close(parent);
    if (!node) {
-      return ERR_FILEEXISTS;
+      return readonly ? ERR_SNAPREADONLY : ERR_FILEEXISTS;
    }
 
    vfs_close(node);
    return MSG_DIRCREATED;
 }
 
-static char* vtp_cmd_move(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_move_result(int retval, vfsn_t *newparent)
+{
+   switch (retval) {
+   case 0:
+      return MSG_MOVED;
+   case VFS_EXISTS:
+      return ERR_FILEEXISTS;
+   case VFS_LOOP:
+      return ERR_INVALIDMOVE;
+   case VFS_READONLY:
+      return ERR_SNAPREADONLY;
+   case VFS_NOENT:
+      return vfs_is_dir(newparent) && !vfs_is_deleted(newparent) ? ERR_NOSUCHFILE : ERR_NOSUCHDIR;
+   default:
+      return ERR_NOMEMORY;
+   }
+}
+
+/*
+ * Moves all nodes matching the glob path argv[1] into the directory argv[2]
+ * under their names and reports the result of each.
+ */
+static char* vtp_move_glob(vtp_session_t *s, char* argv[], int replace)
+{
+   vfsn_t *newparent = vtp_path(s->cwd, argv[2]);
+   if (!newparent || !vfs_is_dir(newparent)) {
+      vfs_close(newparent);
+      return ERR_NOSUCHDIR;
+   }
+
+   vfsn_t *dir, **nodes;
+   int count = vtp_glob(s, argv[1], &dir, &nodes);
+   if (count < 0) {
+      vfs_close(newparent);
+      return count == -1 ? ERR_NOSUCHDIR : ERR_NOMEMORY;
+   }
+
+   char *msg = NULL;
+   size_t start = s->out_len;
+   if (vtp_write(s, "BATCH %i\n", count) < 0) {
+      msg = ERR_NOMEMORY;
+   }
+   for (int i = 0; i < count && !msg; i++) {
+      int name_size = vfs_name_size(nodes[i]);
+      char name[name_size+1];
+      memset(name, 0, sizeof(name));
+      vfs_name(nodes[i], name, name_size);
+
+      char *result = vtp_move_result(vfs_move(nodes[i], newparent, name, replace), newparent);
+      if (vtp_write(s, "%.*s %s\n", (int)strcspn(result, " "), result, name) < 0) {
+         s->out_len = start;
+         msg = ERR_NOMEMORY;
+      }
+   }
+
+   vtp_glob_free(dir, nodes, count);
+   vfs_close(newparent);
+   return msg;
+}
+
+/*
+ * Moves the node at argv[1] to the path argv[2]. With replace, an existing
+ * node at the destination is replaced in the same step. A glob pattern moves
+ * all matches into the directory argv[2].
+ */
+static char* vtp_move(vtp_session_t *s, char* argv[], int replace)
 {
    log_info("move %s to %s", argv[1], argv[2]);
-   char *oldpath = argv[1];
-   vfsn_t *oldnode = vtp_path(*cwd, oldpath);
-   if (!oldnode)
-      return ERR_NOSUCHFILE;
+   if (vtp_is_glob(s, argv[1]))
+      return vtp_move_glob(s, argv, replace);
 
    char *newpath = argv[2];
    char *newfile = vtp_split_path(&newpath);
-   vfsn_t *newparent = vtp_path(*cwd, newpath);
+   if (!*newfile)
+      return ERR_INVALIDCMD;
+
+   // "/name" lives in the root
+   if (newpath && !*newpath)
+      newpath = "/";
+
+   vfsn_t *oldnode = vtp_path(s->cwd, argv[1]);
+   if (!oldnode)
+      return ERR_NOSUCHFILE;
+
+   vfsn_t *newparent = vtp_path(s->cwd, newpath);
    if (!newparent) {
       vfs_close(oldnode);
-      return ERR_NOSUCHFILE;
+      return ERR_NOSUCHDIR;
    }
 
-   // move
-   vfs_move(oldnode, newparent, newfile);
+   char *msg = vtp_move_result(vfs_move(oldnode, newparent, newfile, replace), newparent);
    vfs_close(oldnode);
    vfs_close(newparent);
-   return MSG_MOVED;
+   return msg;
+}
+
+static char* vtp_cmd_move(vtp_session_t *s, char* argv[])
+{
+   return vtp_move(s, argv, 0);
+}
+
+static char* vtp_cmd_rename(vtp_session_t *s, char* argv[])
+{
+   return vtp_move(s, argv, 1);
+}
+
+/*
+ * Deletes all nodes matching a glob path at once.
+ */
+static char* vtp_delete_glob(vtp_session_t *s, char *path)
+{
+   vfsn_t *dir, **nodes;
+   int count = vtp_glob(s, path, &dir, &nodes);
+   if (count < 0) {
+      return count == -1 ? ERR_NOSUCHDIR : ERR_NOMEMORY;
+   }
+
+   // snapshots are dropped one by one, their contents stay
+   if (vfs_is_readonly(dir)) {
+      vtp_glob_free(dir, nodes, count);
+      return ERR_SNAPREADONLY;
+   }
+
+   // room for the responses is reserved first, so nothing is deleted
+   // without one
+   size_t size = 32;
+   for (int i = 0; i < count; i++) {
+      size += vfs_name_size(nodes[i]) + sizeof(ERR_NOSUCHFILE);
+   }
+   int *results = calloc(count, sizeof(int));
+   if ((count && !results) || !vtp_out_reserve(s, size)) {
+      free(results);
+      vtp_glob_free(dir, nodes, count);
+      return ERR_NOMEMORY;
+   }
+
+   // entries deleted in between or inside of snapshots are reported as such
+   vfs_delete_all(dir, nodes, count, results);
+   vtp_write(s, "BATCH %i\n", count);
+   for (int i = 0; i < count; i++) {
+      vtp_glob_result(s, results[i] == VFS_READONLY ? ERR_SNAPREADONLY
+         : results[i] ? ERR_NOSUCHFILE : MSG_DELETED, nodes[i]);
+   }
+
+   free(results);
+   vtp_glob_free(dir, nodes, count);
+   return NULL;
 }
 
-static char* vtp_cmd_delete(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_delete(vtp_session_t *s, char* argv[])
 {
    log_info("delete %s", argv[1]);
-   vfsn_t *file = vtp_path(*cwd, argv[1]);
+   if (vtp_is_glob(s, argv[1])) {
+      return vtp_delete_glob(s, argv[1]);
+   }
+
+   vfsn_t *file = vtp_path(s->cwd, argv[1]);
    if (!file) {
       return ERR_NOSUCHFILE;
    }
 
-   vfs_delete(file);
+   // a deleted root takes no children anymore, so it is kept like the
+   // default tenant
+   vfsn_t *parent = vfs_open(file);
+   if (!vfs_parent(&parent)) {
+      int deleted = vfs_is_deleted(file);
+      vfs_close(file);
+      return deleted ? ERR_NOSUCHFILE : ERR_ROOTDIR;
+   }
+   vfs_close(parent);
+
+   int retval = vfs_delete(file);
    vfs_close(file);
-   return MSG_DELETED;
+   return retval == VFS_READONLY ? ERR_SNAPREADONLY : MSG_DELETED;
+}
+
+/*
+ * Parses optional condition "<keyword> <version>" following the path of a
+ * command. Returns 0 if there is none, 1 if it was parsed and -1 on error.
+ */
+static int vtp_condition(char* argv[], int pos, char *keyword, unsigned long *version)
+{
+   if (!argv[pos])
+      return 0;
+   if (strcmp(argv[pos], keyword) != 0 || !argv[pos + 1] || argv[pos + 2])
+      return -1;
+
+   char *end;
+   errno = 0;
+   *version = strtoul(argv[pos + 1], &end, 10);
+   if (errno || end == argv[pos + 1] || *end)
+      return -1;
+   return 1;
+}
+
+/*
+ * Writes a FILECONTENT response with the current content of file.
+ */
+static char* vtp_put_content(vtp_session_t *s, vfsn_t *file)
+{
+   int name_size = vfs_name_size(file);
+   char name[name_size+1];
+   memset(name, 0, sizeof(name));
+   vfs_name(file, name, name_size);
+
+   // reserve space for the largest possible header and content
+   int size = vfs_size(file);
+   if (!vtp_out_reserve(s, name_size + size + 64)) {
+      return ERR_NOMEMORY;
+   }
+
+   // the content might have changed in between, so send what was read
+   unsigned long version;
+   char *content = s->out + s->out_len + name_size + 48;
+   size = vfs_read_version(file, content, size, &version);
+   vtp_write(s, "FILECONTENT %s %i %lu\n", name, size, version);
+   memmove(s->out + s->out_len, content, size);
+   s->out_len += size;
+   vtp_put(s, "\n", 1);
+   return NULL;
+}
+
+/*
+ * Sends the contents of all files matching a glob path.
+ */
+static char* vtp_read_glob(vtp_session_t *s, char *path)
+{
+   vfsn_t *dir, **nodes;
+   int count = vtp_glob(s, path, &dir, &nodes);
+   if (count < 0) {
+      return count == -1 ? ERR_NOSUCHDIR : ERR_NOMEMORY;
+   }
+
+   int files = 0;
+   for (int i = 0; i < count; i++) {
+      files += vfs_is_file(nodes[i]);
+   }
+
+   char *msg = NULL;
+   size_t start = s->out_len;
+   if (vtp_write(s, "BATCH %i\n", files) < 0) {
+      msg = ERR_NOMEMORY;
+   }
+   for (int i = 0; i < count && !msg; i++) {
+      if (vfs_is_file(nodes[i]) && vtp_put_content(s, nodes[i])) {
+         s->out_len = start;
+         msg = ERR_NOMEMORY;
+      }
+   }
+
+   vtp_glob_free(dir, nodes, count);
+   return msg;
 }
 
-static char* vtp_cmd_list(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_read(vtp_session_t *s, char* argv[])
 {
-   log_dbg("list %s", argv[1]);
-   vfsn_t *it = vtp_path(*cwd, argv[1]);
+   log_dbg("read %s", argv[1]);
+   unsigned long known;
+   int cond = vtp_condition(argv, 2, "if-changed", &known);
+   if (cond < 0) {
+      return ERR_INVALIDCMD;
+   }
+
+   if (vtp_is_glob(s, argv[1])) {
+      return cond ? ERR_INVALIDCMD : vtp_read_glob(s, argv[1]);
+   }
 
-   if (!it)
+   vfsn_t *file = vtp_path(s->cwd, argv[1]);
+   if (!file) {
       return ERR_NOSUCHFILE;
+   }
+
+   // client already holds the current content
+   char *msg = MSG_NOTMODIFIED;
+   if (!cond || vfs_version(file) != known) {
+      msg = vtp_put_content(s, file);
+   }
+
+   vfs_close(file);
+   return msg;
+}
+
+/*
+ * Resolves the parent directory of a batch item. Items in the same directory
+ * as their predecessor reuse its lookup. Returns the directory, which stays
+ * owned by the batch, and points file to the last path component.
+ */
+static vfsn_t* vtp_batch_dir(vtp_session_t *s, struct vtp_batch *batch, char *path, char **file)
+{
+   char *slash = strrchr(path, '/');
+   *file = slash ? slash + 1 : path;
+
+   // the directory part including its trailing slash identifies the lookup
+   size_t len = slash ? (size_t)(slash - path) + 1 : 0;
+   if (batch->resolved && len == batch->dir_len && strncmp(path, batch->dir, len) == 0) {
+      return batch->node;
+   }
+
+   vfs_close(batch->node);
+   char dir[len + 1];
+   memcpy(dir, path, len);
+   dir[len] = '\0';
+   batch->node = vtp_path(s->cwd, dir);
+   batch->dir = path;
+   batch->dir_len = len;
+   batch->resolved = 1;
+   return batch->node;
+}
 
-   // count files
+static char* vtp_cmd_mget(vtp_session_t *s, char* argv[])
+{
    int count = 0;
-   vfs_child(&it);
-   vfsn_t *tmp = vfs_open(it);
-   while (tmp) {
+   while (argv[count + 1])
       count++;
-      vfs_next(&tmp);
+   log_dbg("mget %i files", count);
+
+   size_t start = s->out_len;
+   if (vtp_write(s, "BATCH %i\n", count) < 0) {
+      return ERR_NOMEMORY;
    }
 
-   // print
-   vtp_write(fd, "ACK %i\n", count);
-   while (it && count > 0) {
-      int name_size = vfs_name_size(it);
-      char name[name_size+2];
-      memset(name, 0, sizeof(name));
-      name[name_size] = '\n';
-      vfs_name(it, name, name_size);
-      vtp_write(fd, "%s", name);
-      vfs_next(&it);
-      count--;
+   struct vtp_batch batch = { };
+   for (int i = 1; i <= count; i++) {
+      char *name;
+      vfsn_t *file = vtp_batch_dir(s, &batch, argv[i], &name);
+      char *msg = ERR_NOSUCHFILE;
+      if (file) {
+         file = vfs_open(file);
+         vtp_pathpart(&file, name, NULL);
+      }
+      if (file) {
+         msg = vtp_put_content(s, file);
+         vfs_close(file);
+      }
+      if (msg && vtp_write(s, "%s\n", msg) < 0) {
+         vfs_close(batch.node);
+         s->out_len = start;
+         return ERR_NOMEMORY;
+      }
    }
+
+   vfs_close(batch.node);
    return NULL;
 }
 
-static char* vtp_cmd_read(int fd, vfsn_t **cwd, char* argv[])
+/*
+ * Creates or overwrites a single file of a batch.
+ */
+static char* vtp_mput_item(vfsn_t *dir, char *name, char *data, size_t size)
 {
-   log_dbg("read %s", argv[1]);
-   vfsn_t *file = vtp_path(*cwd, argv[1]);
+   if (!dir) {
+      return ERR_NOSUCHDIR;
+   }
+
+   // another client may create the file in between
+   for (int attempt = 0; attempt < 2; attempt++) {
+      vfsn_t *file = vfs_open(dir);
+      vtp_pathpart(&file, name, NULL);
+      if (file) {
+         int retval = vfs_write(file, data, size);
+         vfs_close(file);
+         if (retval == 1) {
+            return ERR_FILEEXISTS;
+         }
+         if (retval == VFS_READONLY) {
+            return ERR_SNAPREADONLY;
+         }
+         return retval ? ERR_NOMEMORY : MSG_UPDATED;
+      }
+      if (vfs_is_readonly(dir)) {
+         return ERR_SNAPREADONLY;
+      }
+
+      file = vfs_create(dir, name, VFS_FILE);
+      if (file) {
+         int retval = vfs_write(file, data, size);
+         vfs_close(file);
+         return retval ? ERR_NOMEMORY : MSG_FILECREATED;
+      }
+   }
+   return ERR_FILEEXISTS;
+}
+
+static char* vtp_cmd_mput(vtp_session_t *s, char* argv[])
+{
+   // mput total path size [path size ...]
+   int count = 0;
+   size_t total = 0;
+   for (char **item = &argv[2]; item[0]; item += 2, count++) {
+      char *end;
+      long size = item[1] ? strtol(item[1], &end, 10) : -1;
+      if (size < 0 || *end) {
+         return ERR_INVALIDCMD;
+      }
+      total += size;
+   }
+   if (total != s->payload_len) {
+      return ERR_INVALIDCMD;
+   }
+   log_info("mput %i files", count);
+
+   size_t start = s->out_len;
+   if (vtp_write(s, "BATCH %i\n", count) < 0) {
+      return ERR_NOMEMORY;
+   }
+
+   struct vtp_batch batch = { };
+   char *data = s->payload;
+   for (char **item = &argv[2]; item[0]; item += 2) {
+      char *name;
+      size_t size = atol(item[1]);
+      vfsn_t *dir = vtp_batch_dir(s, &batch, item[0], &name);
+      char *msg = vtp_mput_item(dir, name, data, size);
+      data += size;
+      if (vtp_write(s, "%s\n", msg) < 0) {
+         vfs_close(batch.node);
+         s->out_len = start;
+         return ERR_NOMEMORY;
+      }
+   }
+
+   vfs_close(batch.node);
+   return NULL;
+}
+
+/*
+ * Copies the file into a sealed memfd which is passed to the client along
+ * with the response, so it can map the content instead of reading it.
+ */
+static char* vtp_cmd_readfd(vtp_session_t *s, char* argv[])
+{
+   log_dbg("readfd %s", argv[1]);
+
+   // descriptors can only be passed over unix domain sockets
+   int domain;
+   socklen_t optlen = sizeof(domain);
+   if (getsockopt(s->fd, SOL_SOCKET, SO_DOMAIN, &domain, &optlen) || domain != AF_UNIX) {
+      return ERR_NOTSUPPORTED;
+   }
+   if (s->npassfds == VTP_PASSFDS) {
+      return ERR_TOOMANYFDS;
+   }
+
+   vfsn_t *file = vtp_path(s->cwd, argv[1]);
    if (!file) {
       return ERR_NOSUCHFILE;
    }
@@ -312,60 +819,81 @@ static char* vtp_cmd_read(int fd, vfsn_t **cwd, char* argv[])
    memset(name, 0, sizeof(name));
    vfs_name(file, name, name_size);
 
+   // copy content into memfd
    int size = vfs_size(file);
-   char content[size+1];
-   memset(content, 0, sizeof(content));
-   vfs_read(file, content, size);
-
-   char format[] = "FILECONTENT %s %i\n%s\n";
-   char msg[strlen(format) + name_size + size + 10];
-   memset(msg, 0, sizeof(msg));
-   sprintf(msg, format, name, size, content);
-   
-   vtp_write(fd, msg);
-
+   int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (fd < 0 || ftruncate(fd, size)) {
+      if (fd >= 0)
+         close(fd);
+      vfs_close(file);
+      return ERR_NOMEMORY;
+   }
+   if (size > 0) {
+      int mapped = size;
+      char *map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED) {
+         close(fd);
+         vfs_close(file);
+         return ERR_NOMEMORY;
+      }
+      size = vfs_read(file, map, size);
+      munmap(map, mapped);
+      ftruncate(fd, size);
+   }
    vfs_close(file);
+
+   // the client gets a read only snapshot
+   fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+   s->passfds[s->npassfds].fd = fd;
+   s->passfds[s->npassfds].at = s->out_len;
+   s->npassfds++;
+   vtp_write(s, "FILEFD %s %i\n", name, size);
    return NULL;
 }
 
-static char* vtp_cmd_update(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_update(vtp_session_t *s, char* argv[])
 {
    log_info("write %s", argv[1]);
-   int len = atoi(argv[2]);
+   int len = s->payload_len;
 
-   char data[len+1];
-   memset(data, 0, sizeof(data));
-   vtp_read(fd, data, len);
+   unsigned long version;
+   int cond = vtp_condition(argv, 3, "if-version", &version);
+   if (cond < 0) {
+      return ERR_INVALIDCMD;
+   }
 
-   vfsn_t *node = vtp_path(*cwd, argv[1]);
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
    if (!node) {
       return ERR_NOSUCHFILE;
    }
    
-   vfs_write(node, data, len);
+   int retval = cond ? vfs_write_if(node, s->payload, len, version)
+                     : vfs_write(node, s->payload, len);
    vfs_close(node);
-   return MSG_UPDATED;
+   if (retval == VFS_READONLY) {
+      return ERR_SNAPREADONLY;
+   }
+   return (retval == VFS_CONFLICT) ? ERR_CONFLICT : MSG_UPDATED;
 }
 
-static char* vtp_cmd_cd(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_cd(vtp_session_t *s, char* argv[])
 {
    log_dbg("change directory %s", argv[1]);
-   vfsn_t *file = vtp_path(*cwd, argv[1]);
-   vfsn_t *next = vtp_path(*cwd, argv[1]);
+   vfsn_t *next = vtp_path(s->cwd, argv[1]);
    if (!next || vfs_is_file(next)) {
       vfs_close(next);
       return ERR_NOSUCHDIR;
    }
 
-   vfs_close(*cwd);
-   *cwd = next;
+   vfs_close(s->cwd);
+   s->cwd = next;
    return MSG_DIRCHANGED;
 }
 
-static char* vtp_cmd_pwd(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_pwd(vtp_session_t *s, char* argv[])
 {
    log_dbg("print working direcotry %s", argv[1]);
-   vfsn_t *file = vtp_path(*cwd, argv[1]);
    int size = 500;
    char pwd[size];
    memset(pwd, 0, sizeof(pwd));
@@ -373,7 +901,7 @@ static char* vtp_cmd_pwd(int fd, vfsn_t **cwd, char* argv[])
    *index = '\n';
    index--;
 
-   vfsn_t *it = vfs_open(*cwd);
+   vfsn_t *it = vfs_open(s->cwd);
    while (it) {
       int name_size = vfs_name_size(it);
       char name[name_size+1];
@@ -396,139 +924,1500 @@ static char* vtp_cmd_pwd(int fd, vfsn_t **cwd, char* argv[])
       index--;
       vfs_parent(&it);
    }
-   vtp_write(fd, index+1);
+   vtp_write(s, "%s", index+1);
 
    return NULL;
 }
 
-static char* vtp_cmd_type(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_cmd_type(vtp_session_t *s, char* argv[])
 {
    log_dbg("type %s", argv[1]);
-   vfsn_t *file = vtp_path(*cwd, argv[1]);
+   vfsn_t *file = vtp_path(s->cwd, argv[1]);
    if (!file) {
       return ERR_NOSUCHFILE;
    }
 
    if (vfs_is_file(file)) {
-      vtp_write(fd, "file\n");
+      vtp_write(s, "file\n");
    } else {
-      vtp_write(fd, "directory\n");
+      vtp_write(s, "directory\n");
    }
 
    vfs_close(file);
    return NULL;
 }
 
-static char* vtp_cmd_exit(int fd, vfsn_t **cwd, char* argv[])
+static char* vtp_type_name(vfs_stat_t *st)
 {
-   log_dbg("exit");
-   close(fd);
-   return NULL;
+   return (st->flags & VFS_FILE) ? "file" : "directory";
 }
 
-static struct vtp_cmd cmds[] = {
-   { "ls", 0, vtp_cmd_list },
-   { "list", 0, vtp_cmd_list },
-   { "create", 2, vtp_cmd_create },
-   { "createdir", 1, vtp_cmd_createdir },
-   { "mkdir", 1, vtp_cmd_createdir },
-   { "mv", 2, vtp_cmd_move },
-   { "delete", 1, vtp_cmd_delete },
-   { "rm", 1, vtp_cmd_delete },
-   { "exit", 0, vtp_cmd_exit },
-   { "read", 1, vtp_cmd_read },
-   { "cat", 1, vtp_cmd_read },
-   { "update", 2, vtp_cmd_update },
-   { "changedir", 1, vtp_cmd_cd },
-   { "cd", 1, vtp_cmd_cd },
-   { "pwd", 0, vtp_cmd_pwd },
-   { "type", 0, vtp_cmd_type },
-   { }
-};
-
-static struct vtp_cmd* vtp_get_cmd(char *name, size_t len)
+static char* vtp_cmd_stat(vtp_session_t *s, char* argv[])
 {
-   // to lower case
-   for (int i = 0; i < len && name[i]; i++) {
-         name[i] = tolower(name[i]);
+   log_dbg("stat %s", argv[1]);
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
+   if (!node) {
+      return ERR_NOSUCHFILE;
    }
 
-   for (struct vtp_cmd *cmd = &cmds[0]; cmd->name; cmd++) {
-      if (strncmp(cmd->name, name, len) == 0)
-         return cmd;
-   }
+   vfs_stat_t st;
+   vfs_stat(node, &st);
+   vtp_write(s, "STAT %s %zu %lu\n", vtp_type_name(&st), st.size, st.version);
+
+   vfs_close(node);
    return NULL;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// GLOBAL FUNCTIONS
-///////////////////////////////////////////////////////////////////////////////
-void vtp_handle(int fd, vfsn_t *cwd)
+static char* vtp_cmd_du(vtp_session_t *s, char* argv[])
 {
-   char buf[READ_BUFFER_SIZE];
-
-   // send welcome
-   vtp_write(fd, "%s\n%s", MSG_WELCOME, MSG_LINE_START);
+   log_dbg("du %s", argv[1]);
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
+   if (!node) {
+      return ERR_NOSUCHFILE;
+   }
 
-   // main protocol loop
-   while (1) {
-      // clear read buffer
-      memset(buf, 0, READ_BUFFER_SIZE);
-      
-      // read command
-      int len = vtp_read_packet(fd, buf, READ_BUFFER_SIZE);
-      if (len == -1) {
-         break;
-      }
-      strtok(buf, "\r\n");
+   vfs_usage_t usage;
+   vfs_usage(node, &usage);
+   vtp_write(s, "USAGE %lld %lld %lld\n", usage.bytes, usage.files, usage.dirs);
 
-      wordexp_t cmdline;
-      if (wordexp(buf, &cmdline, 0) != 0) {
-         log_err("cannot parse '%s'", buf);
-         vtp_write(fd, "%s\n%s", ERR_INVALIDCMD, MSG_LINE_START);
-         wordfree(&cmdline);
-         continue;
-      }
+   vfs_close(node);
+   return NULL;
+}
 
-      int argc = cmdline.we_wordc;
-      char **argv = cmdline.we_wordv;
+/*
+ * Parses [path] [--limit n] [--after cursor] of the list commands.
+ */
+static int vtp_list_args(char* argv[], char **path, char **after, long *limit)
+{
+   *path = *after = NULL;
+   *limit = -1;
+   for (int i = 1; argv[i]; i++) {
+      if (strcmp("--limit", argv[i]) == 0 && argv[i+1]) {
+         char *end;
+         *limit = strtol(argv[++i], &end, 10);
+         if (*end || *limit < 1)
+            return 1;
+      } else if (strcmp("--after", argv[i]) == 0 && argv[i+1]) {
+         *after = argv[++i];
+      } else if (!*path) {
+         *path = argv[i];
+      } else {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static int vtp_list_entry(vtp_session_t *s, vfsn_t *node, char *name, int plus)
+{
+   if (!plus)
+      return vtp_write(s, "%s\n", name);
+
+   vfs_stat_t st;
+   vfs_stat(node, &st);
+   return vtp_write(s, "%s %zu %lu %s\n", vtp_type_name(&st), st.size, st.version, name);
+}
+
+/*
+ * Lists the children matching a glob path, which are collected at once.
+ */
+static char* vtp_list_glob(vtp_session_t *s, char *path, char *after, long limit, int plus)
+{
+   vfsn_t *dir, **nodes;
+   int count = vtp_glob(s, path, &dir, &nodes);
+   if (count < 0) {
+      return count == -1 ? ERR_NOSUCHFILE : ERR_NOMEMORY;
+   }
+
+   int listed = 0;
+   size_t start = s->out_len;
+   for (int i = 0; i < count && (limit < 0 || listed < limit); i++) {
+      int name_size = vfs_name_size(nodes[i]);
+      char name[name_size+1];
+      memset(name, 0, sizeof(name));
+      vfs_name(nodes[i], name, name_size);
+      if (after && strcmp(name, after) <= 0)
+         continue;
+
+      if (vtp_list_entry(s, nodes[i], name, plus) < 0) {
+         vtp_glob_free(dir, nodes, count);
+         s->out_len = start;
+         return ERR_NOMEMORY;
+      }
+      listed++;
+   }
+
+   vtp_glob_free(dir, nodes, count);
+   return vtp_ack(s, start, listed);
+}
+
+/*
+ * Returns whether node is still the child of dir with given name, which has
+ * not been deleted, moved or renamed.
+ */
+static int vtp_child_of(vfsn_t *node, vfsn_t *dir, const char *name)
+{
+   vfsn_t *parent = vfs_open(node);
+   vfs_parent(&parent);
+   int same = parent == dir && !vfs_is_deleted(node);
+   vfs_close(parent);
+   if (!same || !name)
+      return same;
+
+   int name_size = vfs_name_size(node);
+   char current[name_size+1];
+   memset(current, 0, sizeof(current));
+   vfs_name(node, current, name_size);
+   return strcmp(current, name) == 0;
+}
+
+/*
+ * Lists the children of a directory sorted by name. A page starts behind the
+ * cursor and costs O(log n + limit), so it stays stable while entries get
+ * created or deleted concurrently. Fewer entries than the limit mark the last
+ * page. With plus, type, size and version come before the name, so the name
+ * may contain spaces.
+ */
+static char* vtp_list(vtp_session_t *s, char* argv[], int plus)
+{
+   char *path, *after;
+   long limit;
+   if (vtp_list_args(argv, &path, &after, &limit)) {
+      return ERR_INVALIDCMD;
+   }
+
+   log_dbg("list %s", path);
+   if (path && vtp_is_glob(s, path)) {
+      return vtp_list_glob(s, path, after, limit, plus);
+   }
+
+   vfsn_t *dir = vtp_path(s->cwd, path);
+   if (!dir) {
+      return ERR_NOSUCHFILE;
+   }
+
+   int count = 0;
+   size_t start = s->out_len;
+   vfsn_t *it = vfs_open(dir);
+   vfs_child_after(&it, after);
+   while (it && (limit < 0 || count < limit)) {
+      int name_size = vfs_name_size(it);
+      char name[name_size+1];
+      memset(name, 0, sizeof(name));
+      vfs_name(it, name, name_size);
+
+      if (vtp_list_entry(s, it, name, plus) < 0) {
+         vfs_close(it);
+         vfs_close(dir);
+         s->out_len = start;
+         return ERR_NOMEMORY;
+      }
+      count++;
+
+      // continue behind the name of an entry which got deleted, moved or
+      // renamed in between, its siblings are no longer the ones of dir
+      vfsn_t *next = vfs_open(it);
+      vfs_next(&next);
+      if (!vtp_child_of(it, dir, name) || (next && !vtp_child_of(next, dir, NULL))) {
+         vfs_close(next);
+         next = vfs_open(dir);
+         vfs_child_after(&next, name);
+      }
+      vfs_close(it);
+      it = next;
+   }
+   vfs_close(it);
+   vfs_close(dir);
+
+   return vtp_ack(s, start, count);
+}
+
+static char* vtp_cmd_list(vtp_session_t *s, char* argv[])
+{
+   return vtp_list(s, argv, 0);
+}
+
+static char* vtp_cmd_listplus(vtp_session_t *s, char* argv[])
+{
+   return vtp_list(s, argv, 1);
+}
+
+struct vtp_find {
+   vtp_session_t *s;
+   const char *prefix;
+   long limit;
+   int count, failed;
+};
+
+static int vtp_found(void *ctx, vfsn_t *node, const char *path)
+{
+   struct vtp_find *find = ctx;
+   if (vtp_write(find->s, "%s%s\n", find->prefix, path) < 0) {
+      find->failed = 1;
+      return 1;
+   }
+   return ++find->count == find->limit;
+}
+
+/*
+ * Searches the subtree of a directory for names matching a glob pattern, with
+ * the index of -I if the pattern has a literal of three characters. Paths are
+ * printed below the given directory in no particular order.
+ */
+static char* vtp_cmd_find(vtp_session_t *s, char* argv[])
+{
+   char *path = NULL, *pattern = "*";
+   char flags = VFS_FILE | VFS_DIR;
+   long limit = -1;
+   for (int i = 1; argv[i]; i++) {
+      if (strcmp("-name", argv[i]) == 0 && argv[i+1]) {
+         pattern = argv[++i];
+      } else if (strcmp("-type", argv[i]) == 0 && argv[i+1]) {
+         i++;
+         if (strcmp("f", argv[i]) == 0) flags = VFS_FILE;
+         else if (strcmp("d", argv[i]) == 0) flags = VFS_DIR;
+         else return ERR_INVALIDCMD;
+      } else if (strcmp("--limit", argv[i]) == 0 && argv[i+1]) {
+         char *end;
+         limit = strtol(argv[++i], &end, 10);
+         if (*end || limit < 1)
+            return ERR_INVALIDCMD;
+      } else if (!path) {
+         path = argv[i];
+      } else {
+         return ERR_INVALIDCMD;
+      }
+   }
+
+   log_dbg("find %s %s", path, pattern);
+   vfsn_t *dir = vtp_path(s->cwd, path);
+   if (!dir) {
+      return ERR_NOSUCHFILE;
+   }
+   if (!vfs_is_dir(dir)) {
+      vfs_close(dir);
+      return ERR_NOSUCHDIR;
+   }
+
+   // results are relative to the cwd unless a path was given
+   size_t len = path ? strlen(path) : 0;
+   char prefix[len + 2];
+   strcpy(prefix, path ? path : "");
+   if (len && path[len-1] != '/')
+      strcat(prefix, "/");
+
+   struct vtp_find find = { s, prefix, limit, 0, 0 };
+   size_t start = s->out_len;
+   int count = vfs_find(dir, pattern, flags, vtp_found, &find);
+   vfs_close(dir);
+   if (count < 0 || find.failed) {
+      s->out_len = start;
+      return ERR_NOMEMORY;
+   }
+   return vtp_ack(s, start, find.count);
+}
+
+static char* vtp_cmd_watch(vtp_session_t *s, char* argv[])
+{
+   log_dbg("watch %s", argv[1]);
+   int recursive = argv[2] && strcmp("recursive", argv[2]) == 0;
+   if (argv[2] && (!recursive || argv[3])) {
+      return ERR_INVALIDCMD;
+   }
+
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
+   if (!node) {
+      return ERR_NOSUCHFILE;
+   }
+
+   if (!s->watch && !(s->watch = watch_sub_new())) {
+      vfs_close(node);
+      return ERR_NOMEMORY;
+   }
+   int retval = watch_add(s->watch, node, recursive);
+   vfs_close(node);
+   return retval ? ERR_NOSUCHFILE : MSG_WATCHING;
+}
+
+static char* vtp_cmd_unwatch(vtp_session_t *s, char* argv[])
+{
+   log_dbg("unwatch %s", argv[1]);
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
+   if (!node) {
+      return ERR_NOSUCHFILE;
+   }
+
+   int retval = !s->watch || watch_remove(s->watch, node);
+   vfs_close(node);
+   return retval ? ERR_NOSUCHWATCH : MSG_UNWATCHED;
+}
+
+/*
+ * Maps the result of a staged or committed change to its response.
+ */
+static char* vtp_txn_error(int retval, int dir)
+{
+   switch (retval) {
+      case VFS_EXISTS:
+         return ERR_FILEEXISTS;
+      case VFS_CONFLICT:
+         return ERR_CONFLICT;
+      case VFS_READONLY:
+         return ERR_SNAPREADONLY;
+      case VFS_NOENT:
+         return dir ? ERR_NOSUCHDIR : ERR_NOSUCHFILE;
+      case 2:
+         return ERR_NOMEMORY;
+      default:
+         return ERR_NOSUCHFILE;
+   }
+}
+
+static int vtp_stage_node(vtp_session_t *s, vfs_txn_t *txn, struct vtp_queued *q, char flags, char **msg)
+{
+   char root[] = "/";
+   char *path = q->argv[1];
+   char *file = vtp_split_path(&path);
+   vfsn_t *parent = vtp_txn_path(s->cwd, (path && !*path) ? root : path, txn);
+
+   int retval = vfs_txn_create(txn, parent, file, flags, q->payload, q->payload_len);
+   vfs_close(parent);
+   if (retval) {
+      *msg = vtp_txn_error(retval, 1);
+   } else {
+      *msg = (flags & VFS_FILE) ? MSG_FILECREATED : MSG_DIRCREATED;
+   }
+   return retval;
+}
+
+static int vtp_stage_create(vtp_session_t *s, vfs_txn_t *txn, struct vtp_queued *q, char **msg)
+{
+   return vtp_stage_node(s, txn, q, VFS_FILE, msg);
+}
+
+static int vtp_stage_createdir(vtp_session_t *s, vfs_txn_t *txn, struct vtp_queued *q, char **msg)
+{
+   return vtp_stage_node(s, txn, q, VFS_DIR, msg);
+}
+
+static int vtp_stage_update(vtp_session_t *s, vfs_txn_t *txn, struct vtp_queued *q, char **msg)
+{
+   unsigned long version;
+   int cond = vtp_condition(q->argv, 3, "if-version", &version);
+   if (cond < 0) {
+      *msg = ERR_INVALIDCMD;
+      return 1;
+   }
+
+   vfsn_t *node = vtp_txn_path(s->cwd, q->argv[1], txn);
+   int retval = node ? vfs_txn_write(txn, node, q->payload, q->payload_len, cond, version) : VFS_NOENT;
+   vfs_close(node);
+   *msg = retval ? vtp_txn_error(retval, 0) : MSG_UPDATED;
+   return retval;
+}
+
+static int vtp_stage_delete(vtp_session_t *s, vfs_txn_t *txn, struct vtp_queued *q, char **msg)
+{
+   vfsn_t *node = vtp_txn_path(s->cwd, q->argv[1], txn);
+   int retval = node ? vfs_txn_delete(txn, node) : VFS_NOENT;
+   vfs_close(node);
+   *msg = retval ? vtp_txn_error(retval, 0) : MSG_DELETED;
+   return retval;
+}
+
+static void vtp_txn_reset(vtp_session_t *s)
+{
+   for (int i = 0; i < s->nqueued; i++) {
+      struct vtp_queued *q = &s->queued[i];
+      for (char **arg = q->argv; *arg; arg++)
+         free(*arg);
+      free(q->argv);
+      free(q->payload);
+   }
+   free(s->queued);
+   s->queued = NULL;
+   s->nqueued = s->queued_size = 0;
+   s->txn = 0;
+}
+
+/*
+ * Copies the current command into the queue of the transaction.
+ */
+static char* vtp_queue(vtp_session_t *s)
+{
+   if (s->nqueued == VTP_TXN_CMDS) {
+      return ERR_TXNFULL;
+   }
+   if (s->nqueued == s->queued_size) {
+      int size = s->queued_size ? s->queued_size * 2 : 16;
+      struct vtp_queued *queued = realloc(s->queued, size * sizeof(struct vtp_queued));
+      if (!queued) {
+         return ERR_NOMEMORY;
+      }
+      s->queued = queued;
+      s->queued_size = size;
+   }
+
+   int argc = s->argc;
+   struct vtp_queued *q = &s->queued[s->nqueued];
+   q->cmd = s->cmd;
+   q->argv = calloc(argc + 1, sizeof(char*));
+   q->payload = malloc(s->payload_len + 1);
+   q->payload_len = s->payload_len;
+   int failed = !q->argv || !q->payload;
+   for (int i = 0; !failed && i < argc; i++) {
+      failed = !(q->argv[i] = strdup(s->argv[i]));
+   }
+   if (failed) {
+      for (int i = 0; q->argv && q->argv[i]; i++)
+         free(q->argv[i]);
+      free(q->argv);
+      free(q->payload);
+      return ERR_NOMEMORY;
+   }
+
+   memcpy(q->payload, s->payload, s->payload_len);
+   s->nqueued++;
+   return MSG_QUEUED;
+}
+
+static char* vtp_cmd_begin(vtp_session_t *s, char* argv[])
+{
+   log_dbg("begin");
+   if (s->txn) {
+      return ERR_INTXN;
+   }
+   s->txn = 1;
+   return MSG_BEGIN;
+}
+
+static char* vtp_cmd_abort(vtp_session_t *s, char* argv[])
+{
+   log_dbg("abort");
+   if (!s->txn) {
+      return ERR_NOTXN;
+   }
+   vtp_txn_reset(s);
+   return MSG_ABORTED;
+}
+
+/*
+ * Returns whether changes of the session get logged for replicas. Only the
+ * default tenant is replicated.
+ */
+static int vtp_replicated(vtp_session_t *s)
+{
+   return repl_is_primary() && (!s->tenant || strcmp(s->tenant->name, TENANT_DEFAULT) == 0);
+}
+
+/*
+ * Starts a log record with a cd into the working directory, as commands may
+ * use relative paths. Returns 1 if the working directory is deleted or its
+ * path is too long.
+ */
+static int vtp_log_cwd(vtp_session_t *s, repl_record_t *rec)
+{
+   char path[4096];
+   char *argv[] = { "cd", path };
+   return repl_path(s->cwd, path, sizeof(path)) || repl_record_cmd(rec, argv, 2, NULL, 0);
+}
+
+/*
+ * Appends a command to a log record. Conditions of updates are left out, the
+ * command only gets logged if they held.
+ */
+static int vtp_log_cmd(repl_record_t *rec, struct vtp_cmd *cmd, char **argv, char *payload, size_t len)
+{
+   int argc = 0;
+   while (argv[argc])
+      argc++;
+   if (cmd->func == vtp_cmd_update && argc > 3)
+      argc = 3;
+   return repl_record_cmd(rec, argv, argc, payload, len);
+}
+
+/*
+ * Records the queued commands of a transaction as a single log record.
+ * Returns 0 on success.
+ */
+static int vtp_log_txn(vtp_session_t *s, repl_record_t *rec)
+{
+   char *begin[] = { "begin" }, *commit[] = { "commit" };
+   int failed = vtp_log_cwd(s, rec) || repl_record_cmd(rec, begin, 1, NULL, 0);
+   for (int i = 0; i < s->nqueued && !failed; i++) {
+      struct vtp_queued *q = &s->queued[i];
+      failed = vtp_log_cmd(rec, q->cmd, q->argv, q->payload, q->payload_len);
+   }
+   return failed || repl_record_cmd(rec, commit, 1, NULL, 0);
+}
+
+/*
+ * Stages all queued commands and commits them at once. The response holds
+ * one item per command, all of them are aborted if any fails.
+ */
+static char* vtp_cmd_commit(vtp_session_t *s, char* argv[])
+{
+   if (!s->txn) {
+      return ERR_NOTXN;
+   }
+   log_info("commit %i commands", s->nqueued);
+
+   vfs_txn_t *txn = vfs_txn_begin();
+   if (!txn) {
+      vtp_txn_reset(s);
+      return ERR_NOMEMORY;
+   }
+
+   // staging modifies the queued arguments, so the record is built up front
+   repl_record_t rec = { };
+   int logged = vtp_replicated(s);
+   if (logged && vtp_log_txn(s, &rec)) {
+      int deleted = vfs_is_deleted(s->cwd);
+      vfs_txn_abort(txn);
+      vtp_txn_reset(s);
+      repl_record_free(&rec);
+      return deleted ? ERR_NOSUCHDIR : ERR_NOMEMORY;
+   }
+
+   int count = s->nqueued, failed = -1;
+   char *msgs[count + 1];
+   for (int i = 0; i < count && failed < 0; i++) {
+      struct vtp_queued *q = &s->queued[i];
+      if (q->cmd->stage(s, txn, q, &msgs[i])) {
+         failed = i;
+      }
+   }
+
+   if (failed >= 0) {
+      vfs_txn_abort(txn);
+   } else {
+      int retval = vfs_txn_commit(txn, &failed);
+      if (retval && failed < 0) {
+         vtp_txn_reset(s);
+         repl_record_free(&rec);
+         return ERR_NOMEMORY;
+      }
+      if (!retval && logged) {
+         repl_log(&rec);
+      }
+      if (retval) {
+         struct vtp_cmd *cmd = s->queued[failed].cmd;
+         msgs[failed] = vtp_txn_error(retval, cmd->stage == vtp_stage_create
+            || cmd->stage == vtp_stage_createdir);
+      }
+   }
+   vtp_txn_reset(s);
+   repl_record_free(&rec);
+
+   vtp_write(s, "BATCH %i\n", count);
+   for (int i = 0; i < count; i++) {
+      vtp_write(s, "%s\n", (failed < 0 || failed == i) ? msgs[i] : MSG_ABORTED);
+   }
+   return NULL;
+}
+
+static char* vtp_cmd_exit(vtp_session_t *s, char* argv[])
+{
+   log_dbg("exit");
+   s->closed = 1;
+   return NULL;
+}
+
+struct vtp_stats_ctx {
+   vtp_session_t *s;
+   int count;
+};
+
+static void vtp_stats_emit(void *ctx, const char *name, long long value)
+{
+   struct vtp_stats_ctx *stats = ctx;
+   vtp_write(stats->s, "%s %lli\n", name, value);
+   stats->count++;
+}
+
+static char* vtp_cmd_stats(vtp_session_t *s, char* argv[])
+{
+   log_dbg("stats");
+   struct vtp_stats_ctx stats = { s, 0 };
+   size_t start = s->out_len;
+   stats_collect(vtp_stats_emit, &stats);
+
+   return vtp_ack(s, start, stats.count);
+}
+
+static char* vtp_cmd_use(vtp_session_t *s, char* argv[])
+{
+   log_dbg("use %s", argv[1]);
+   long long quota = -1, weight = 0;
+   if (argv[2]) {
+      char *end;
+      quota = strtoll(argv[2], &end, 10);
+      if (*end || end == argv[2] || quota < 0) {
+         return ERR_INVALIDCMD;
+      }
+   }
+   if (argv[2] && argv[3]) {
+      char *end;
+      weight = strtoll(argv[3], &end, 10);
+      if (*end || end == argv[3] || weight < 1 || weight > VTP_WEIGHT_MAX || argv[4]) {
+         return ERR_INVALIDCMD;
+      }
+   }
+   if (!tenant_valid(argv[1])) {
+      return ERR_INVALIDCMD;
+   }
+
+   // replicas only serve the tenants they follow
+   tenant_t *t = tenant_get(argv[1], !repl_is_replica());
+   if (!t) {
+      return repl_is_replica() ? ERR_NOSUCHTENANT : ERR_NOMEMORY;
+   }
+   if (quota >= 0) {
+      __atomic_store_n(&t->quota, quota, __ATOMIC_RELAXED);
+   }
+   if (weight) {
+      __atomic_store_n(&t->weight, weight, __ATOMIC_RELAXED);
+   }
+
+   vfs_close(s->cwd);
+   s->cwd = vfs_open(t->root);
+   tenant_put(s->tenant);
+   s->tenant = t;
+   return MSG_USING;
+}
+
+static char* vtp_cmd_droptenant(vtp_session_t *s, char* argv[])
+{
+   log_dbg("drop tenant %s", argv[1]);
+   switch (tenant_drop(argv[1])) {
+   case 0:
+      return MSG_DROPPED;
+   case 2:
+      return ERR_DEFAULTTENANT;
+   default:
+      return ERR_NOSUCHTENANT;
+   }
+}
+
+static char* vtp_cmd_snapshot(vtp_session_t *s, char* argv[])
+{
+   log_info("snapshot %s as %s", argv[1], argv[2]);
+   char *name = argv[2];
+   if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+      return ERR_INVALIDCMD;
+   }
+
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
+   if (!node) {
+      return ERR_NOSUCHFILE;
+   }
+
+   int retval = vfs_snapshot(node, name);
+   vfs_close(node);
+   switch (retval) {
+   case 0:
+      return MSG_SNAPSHOTCREATED;
+   case VFS_EXISTS:
+      return ERR_FILEEXISTS;
+   case VFS_READONLY:
+      return ERR_SNAPREADONLY;
+   case VFS_NOENT:
+      return ERR_NOSUCHFILE;
+   default:
+      return ERR_NOMEMORY;
+   }
+}
+
+static void vtp_tenant_entry(void *ctx, tenant_t *t)
+{
+   struct vtp_stats_ctx *list = ctx;
+   vfs_usage_t usage;
+   vfs_usage(t->root, &usage);
+   vtp_write(list->s, "%s %lld %lld %i\n", t->name, usage.bytes,
+      __atomic_load_n(&t->quota, __ATOMIC_RELAXED), __atomic_load_n(&t->weight, __ATOMIC_RELAXED));
+   list->count++;
+}
+
+static char* vtp_cmd_tenants(vtp_session_t *s, char* argv[])
+{
+   log_dbg("tenants");
+   struct vtp_stats_ctx list = { s, 0 };
+   size_t start = s->out_len;
+   tenant_list(vtp_tenant_entry, &list);
+
+   return vtp_ack(s, start, list.count);
+}
 
-      if (argc < 1) {
-         vtp_write(fd, "%s\n%s", ERR_INVALIDCMD, MSG_LINE_START);
-         wordfree(&cmdline);
+static char* vtp_cmd_export(vtp_session_t *s, char* argv[])
+{
+   log_info("export: %s", argv[1]);
+   vfsn_t *node = vtp_path(s->cwd, argv[1]);
+   if (!node) {
+      return ERR_NOSUCHFILE;
+   }
+
+   // the archive follows in the next turns
+   s->tar = tar_export(node);
+   return s->tar ? NULL : ERR_NOMEMORY;
+}
+
+static char* vtp_cmd_import(vtp_session_t *s, char* argv[])
+{
+   // entries were applied while the archive arrived
+   return s->tar ? tar_import_result(s->tar) : ERR_NOMEMORY;
+}
+
+static struct vtp_cmd cmds[] = {
+   { "ls", 0, vtp_cmd_list },
+   { "list", 0, vtp_cmd_list },
+   { "create", 2, vtp_cmd_create, 2, vtp_stage_create },
+   { "createdir", 1, vtp_cmd_createdir, 0, vtp_stage_createdir },
+   { "mkdir", 1, vtp_cmd_createdir, 0, vtp_stage_createdir },
+   { "mv", 2, vtp_cmd_move },
+   { "rename", 2, vtp_cmd_rename },
+   { "delete", 1, vtp_cmd_delete, 0, vtp_stage_delete },
+   { "rm", 1, vtp_cmd_delete, 0, vtp_stage_delete },
+   { "exit", 0, vtp_cmd_exit },
+   { "read", 1, vtp_cmd_read },
+   { "cat", 1, vtp_cmd_read },
+   { "readfd", 1, vtp_cmd_readfd },
+   { "mget", 1, vtp_cmd_mget },
+   { "mput", 3, vtp_cmd_mput, 1 },
+   { "update", 2, vtp_cmd_update, 2, vtp_stage_update },
+   { "changedir", 1, vtp_cmd_cd },
+   { "cd", 1, vtp_cmd_cd },
+   { "pwd", 0, vtp_cmd_pwd },
+   { "type", 0, vtp_cmd_type },
+   { "stat", 0, vtp_cmd_stat },
+   { "du", 0, vtp_cmd_du },
+   { "find", 0, vtp_cmd_find },
+   { "lsl", 0, vtp_cmd_listplus },
+   { "readdirplus", 0, vtp_cmd_listplus },
+   { "stats", 0, vtp_cmd_stats },
+   { "watch", 1, vtp_cmd_watch },
+   { "unwatch", 1, vtp_cmd_unwatch },
+   { "begin", 0, vtp_cmd_begin },
+   { "commit", 0, vtp_cmd_commit },
+   { "abort", 0, vtp_cmd_abort },
+   { "use", 1, vtp_cmd_use },
+   { "tenants", 0, vtp_cmd_tenants },
+   { "droptenant", 1, vtp_cmd_droptenant },
+   { "snapshot", 2, vtp_cmd_snapshot },
+   { "export", 1, vtp_cmd_export },
+   { "import", 2, vtp_cmd_import, 2 },
+   { }
+};
+
+static struct vtp_cmd* vtp_get_cmd(char *name)
+{
+   // to lower case
+   for (int i = 0; name[i]; i++) {
+         name[i] = tolower(name[i]);
+   }
+
+   for (struct vtp_cmd *cmd = &cmds[0]; cmd->name; cmd++) {
+      if (strcmp(cmd->name, name) == 0)
+         return cmd;
+   }
+   return NULL;
+}
+
+/*
+ * Returns whether cmd runs right away inside a transaction.
+ */
+static int vtp_txn_control(struct vtp_cmd *cmd)
+{
+   return cmd->func == vtp_cmd_begin || cmd->func == vtp_cmd_commit
+      || cmd->func == vtp_cmd_abort || cmd->func == vtp_cmd_exit;
+}
+
+/*
+ * Returns whether cmd changes the tree.
+ */
+static int vtp_writes(struct vtp_cmd *cmd)
+{
+   return cmd->func == vtp_cmd_create || cmd->func == vtp_cmd_createdir
+      || cmd->func == vtp_cmd_move || cmd->func == vtp_cmd_rename
+      || cmd->func == vtp_cmd_delete || cmd->func == vtp_cmd_mput
+      || cmd->func == vtp_cmd_update || cmd->func == vtp_cmd_commit
+      || cmd->func == vtp_cmd_snapshot;
+}
+
+/*
+ * Adds path, relative to the working directory at cwd, to the paths a change
+ * touches. A glob pattern touches its whole directory.
+ */
+static void vtp_order_path(repl_order_t *order, const char *cwd, const char *path)
+{
+   char full[strlen(cwd) + strlen(path) + 2];
+   sprintf(full, "%s/%s", *path == '/' ? "" : cwd, path);
+   char *name = strrchr(full, '/');
+   if (strpbrk(name + 1, "*?[")) {
+      *name = '\0';
+   }
+   repl_order_add(order, full, 1);
+}
+
+/*
+ * Collects the paths which the command argv changes into order.
+ */
+static void vtp_order_cmd(repl_order_t *order, const char *cwd, struct vtp_cmd *cmd, char **argv)
+{
+   if (cmd->func == vtp_cmd_mput) {
+      for (char **item = &argv[2]; item[0] && item[1]; item += 2) {
+         vtp_order_path(order, cwd, item[0]);
+      }
+   } else if (cmd->func == vtp_cmd_move || cmd->func == vtp_cmd_rename) {
+      vtp_order_path(order, cwd, argv[1]);
+      vtp_order_path(order, cwd, argv[2]);
+   } else if (cmd->func == vtp_cmd_snapshot) {
+      // snapshots show up in the root
+      repl_order_add(order, "/", 1);
+   } else if (argv[1]) {
+      vtp_order_path(order, cwd, argv[1]);
+   }
+}
+
+/*
+ * Locks the paths which the command of s changes, and the working directory,
+ * which must stay where it is until the change got logged. Returns 0 once
+ * locked or 1 if the working directory is gone or its path is too long.
+ */
+static int vtp_log_lock(vtp_session_t *s, char **argv, repl_order_t *order)
+{
+   char cwd[4096], now[4096];
+   if (repl_path(s->cwd, cwd, sizeof(cwd))) {
+      return 1;
+   }
+   while (1) {
+      memset(order, 0, sizeof(*order));
+      repl_order_add(order, cwd, 0);
+      if (s->cmd->func == vtp_cmd_commit) {
+         for (int i = 0; i < s->nqueued; i++) {
+            vtp_order_cmd(order, cwd, s->queued[i].cmd, s->queued[i].argv);
+         }
+      } else {
+         vtp_order_cmd(order, cwd, s->cmd, argv);
+      }
+      repl_lock(order);
+
+      // the working directory moved in between, paths are collected again
+      if (repl_path(s->cwd, now, sizeof(now))) {
+         repl_unlock(order);
+         return 1;
+      }
+      if (strcmp(cwd, now) == 0) {
+         return 0;
+      }
+      repl_unlock(order);
+      strcpy(cwd, now);
+   }
+}
+
+/*
+ * Returns the cost of cmd in simple commands, apart from the bytes it moves.
+ * Walks over many nodes and batches cost more.
+ */
+static int vtp_weight(struct vtp_cmd *cmd)
+{
+   if (cmd->func == vtp_cmd_find || cmd->func == vtp_cmd_snapshot) {
+      return 16;
+   }
+   if (cmd->func == vtp_cmd_mget || cmd->func == vtp_cmd_mput || cmd->func == vtp_cmd_commit) {
+      return 8;
+   }
+   if (cmd->func == vtp_cmd_list || cmd->func == vtp_cmd_listplus || cmd->func == vtp_cmd_du
+         || cmd->func == vtp_cmd_stats || cmd->func == vtp_cmd_tenants) {
+      return 4;
+   }
+   return 1;
+}
+
+/*
+ * Returns whether the response msg carries the status code of reply.
+ */
+static int vtp_status(const char *msg, const char *reply)
+{
+   size_t len = strcspn(reply, " ");
+   return strncmp(msg, reply, len) == 0 && (msg[len] == ' ' || msg[len] == '\0');
+}
+
+/*
+ * Returns whether a command with response msg might have changed the tree.
+ * Batches report per item.
+ */
+static int vtp_changed(char *msg)
+{
+   static const char *changes[] = { ERR_NOMEMORY, MSG_FILECREATED, MSG_DIRCREATED,
+      MSG_MOVED, MSG_DELETED, MSG_UPDATED, MSG_SNAPSHOTCREATED };
+   if (!msg)
+      return 1;
+   for (size_t i = 0; i < sizeof(changes) / sizeof(changes[0]); i++) {
+      if (vtp_status(msg, changes[i]))
+         return 1;
+   }
+   return 0;
+}
+
+/*
+ * Returns the number of content bytes the command might add, which is
+ * checked against the quota of the tenant.
+ */
+static size_t vtp_growth(vtp_session_t *s)
+{
+   if (s->cmd->func != vtp_cmd_commit) {
+      return s->payload_len;
+   }
+   size_t size = 0;
+   for (int i = 0; s->txn && i < s->nqueued; i++) {
+      size += s->queued[i].payload_len;
+   }
+   return size;
+}
+
+/*
+ * Executes the command of the session with arguments argv and returns its
+ * response.
+ */
+static char* vtp_run(vtp_session_t *s, char *argv[])
+{
+   // overlapping changes on the primary are applied and logged in the same
+   // order
+   int logged = vtp_replicated(s) && vtp_writes(s->cmd) && (!s->txn || s->cmd->func == vtp_cmd_commit);
+   repl_record_t rec = { };
+   repl_order_t order;
+   char *msg, *unlogged = NULL;
+   if (logged && vtp_log_lock(s, argv, &order)) {
+      logged = 0;
+      unlogged = vfs_is_deleted(s->cwd) ? ERR_NOSUCHDIR : ERR_NOMEMORY;
+   } else if (logged) {
+      // commands modify their arguments, so the record is built up front,
+      // and a change which cannot be logged must not happen either
+      if (s->cmd->func != vtp_cmd_commit && (vtp_log_cwd(s, &rec)
+            || vtp_log_cmd(&rec, s->cmd, argv, s->payload, s->payload_len))) {
+         unlogged = vfs_is_deleted(s->cwd) ? ERR_NOSUCHDIR : ERR_NOMEMORY;
+      }
+   }
+
+   // execute command, changes inside a transaction wait for the commit
+   if (s->tenant) {
+      __atomic_add_fetch(&s->tenant->ops, 1, __ATOMIC_RELAXED);
+   }
+   if (unlogged) {
+      msg = unlogged;
+   } else if (repl_is_replica() && !s->apply && (vtp_writes(s->cmd) || s->cmd->func == vtp_cmd_begin
+         || s->cmd->func == vtp_cmd_droptenant)) {
+      msg = ERR_READONLY;
+   } else if (s->tenant && vtp_writes(s->cmd) && vfs_is_deleted(s->tenant->root)) {
+      msg = ERR_NOSUCHTENANT;
+   } else if (s->tenant && (!s->txn || s->cmd->func == vtp_cmd_commit) && vtp_writes(s->cmd)
+         && !tenant_admit(s->tenant, vtp_growth(s))) {
+      msg = ERR_QUOTA;
+      if (s->cmd->func == vtp_cmd_commit) {
+         vtp_txn_reset(s);
+      }
+   } else if (!s->txn || vtp_txn_control(s->cmd)) {
+      msg = s->cmd->func(s, argv);
+   } else if (s->cmd->stage) {
+      msg = vtp_queue(s);
+   } else {
+      msg = ERR_INTXN;
+   }
+
+   if (logged) {
+      if (rec.len && !unlogged && vtp_changed(msg))
+         repl_log(&rec);
+      repl_unlock(&order);
+      repl_record_free(&rec);
+   }
+   return msg;
+}
+
+static void vtp_exec(vtp_session_t *s)
+{
+   size_t start = s->out_len;
+   char *msg = vtp_run(s, s->argv);
+   vtp_charge(s, vtp_weight(s->cmd), s->payload_len + s->out_len - start);
+
+   // imports are done with their archive
+   if (s->cmd->func == vtp_cmd_import) {
+      tar_free(s->tar);
+      s->tar = NULL;
+   }
+
+   // print msg
+   if (s->closed) {
+      // no prompt after exit
+   } else if (s->tar) {
+      // the archive of an export comes first
+   } else if (msg) {
+      vtp_write(s, "%s\n%s", msg, MSG_LINE_START);
+   } else {
+      // write line start
+      vtp_write(s, MSG_LINE_START);
+   }
+   free(s->argv);
+   s->argv = NULL;
+   s->cmd = NULL;
+   s->payload = NULL;
+   s->payload_len = 0;
+}
+
+/*
+ * Splits line into words like a shell without any expansion: words are
+ * separated by blanks, a backslash keeps the next character, single quotes
+ * keep everything and double quotes everything but escaped \\, ", $ and `.
+ * Returns a NULL terminated array of argc words allocated together with their
+ * characters, or NULL on unbalanced quotes or memory shortage.
+ */
+static char** vtp_split(const char *line, int *argc)
+{
+   size_t len = strlen(line);
+   char **argv = malloc((len / 2 + 2) * sizeof(char*) + len + 1);
+   if (!argv) {
+      return NULL;
+   }
+
+   char *it = (char*)(argv + len / 2 + 2), quote = 0;
+   int word = 0;
+   *argc = 0;
+   for (const char *c = line; *c; c++) {
+      if (!quote && (*c == ' ' || *c == '\t')) {
+         if (word)
+            *it++ = '\0';
+         word = 0;
          continue;
       }
+      if (!word)
+         argv[(*argc)++] = it;
+      word = 1;
+
+      if (quote && *c == quote) {
+         quote = 0;
+      } else if (!quote && (*c == '\'' || *c == '"')) {
+         quote = *c;
+      } else if (*c == '\\' && quote != '\'' && c[1]
+            && (!quote || strchr("\\\"$`", c[1]))) {
+         *it++ = *++c;
+      } else {
+         *it++ = *c;
+      }
+   }
+   if (quote) {
+      free(argv);
+      return NULL;
+   }
+   *it = '\0';
+   argv[*argc] = NULL;
+   return argv;
+}
 
-      // get command from name
-      struct vtp_cmd *cmd = vtp_get_cmd(argv[0], len-2);
+/*
+ * Returns whether the unterminated line of len bytes starts a command with
+ * payload, whose end cannot be told by the packets of the client.
+ */
+static int vtp_takes_payload(const char *line, size_t len)
+{
+   size_t start = 0, end;
+   while (start < len && (line[start] == ' ' || line[start] == '\t'))
+      start++;
+   for (end = start; end < len && line[end] != ' ' && line[end] != '\t' && line[end] != '\r'; end++)
+      ;
+
+   char name[end - start + 1];
+   memcpy(name, line + start, end - start);
+   name[end - start] = '\0';
+   struct vtp_cmd *cmd = vtp_get_cmd(name);
+   return cmd && cmd->payload;
+}
+
+static void vtp_parse(vtp_session_t *s, char *buf)
+{
+   strtok(buf, "\r");
+
+   // words are taken literally, patterns are left to the commands
+   s->argv = vtp_split(buf, &s->argc);
+   if (!s->argv) {
+      log_err("cannot parse '%s'", buf);
+      vtp_write(s, "%s\n%s", ERR_INVALIDCMD, MSG_LINE_START);
+      return;
+   }
+
+   int argc = s->argc;
+   char **argv = s->argv;
+
+   if (argc < 1) {
+      vtp_write(s, "%s\n%s", ERR_INVALIDCMD, MSG_LINE_START);
+      free(s->argv);
+      s->argv = NULL;
+      return;
+   }
+
+   // get command from name
+   struct vtp_cmd *cmd = vtp_get_cmd(argv[0]);
+
+   // check if command was found
+   if (!cmd) {
+      vtp_write(s, "%s\n%s", ERR_NOSUCHCMD, MSG_LINE_START);
+      free(s->argv);
+      s->argv = NULL;
+      return;
+   }
+
+   // check number of arguments
+   if (cmd->args + 1 > argc || (cmd->payload && atoi(argv[cmd->payload]) < 0)) {
+      vtp_write(s, "%s\n%s", ERR_INVALIDCMD, MSG_LINE_START);
+      free(s->argv);
+      s->argv = NULL;
+      return;
+   }
+
+   // command waits for its payload
+   s->cmd = cmd;
+   s->payload_len = cmd->payload ? atoi(argv[cmd->payload]) : 0;
+
+   // imports apply their archive while it arrives
+   if (cmd->func == vtp_cmd_import) {
+      char path[strlen(argv[1]) + 1];
+      strcpy(path, argv[1]);
+      vfsn_t *dir = vtp_path(s->cwd, path);
+      char *error = s->txn ? ERR_INTXN : !dir || !vfs_is_dir(dir) ? ERR_NOSUCHDIR : NULL;
+      s->tar = tar_import(dir, s->payload_len, error);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+int vtp_session_init(vtp_session_t *s, int fd, vfsn_t *cwd)
+{
+   memset(s, 0, sizeof(*s));
+   s->fd = fd;
+   fair_client_init(&s->sched);
+   s->cwd = cwd;
+   s->tenant = tenant_get(TENANT_DEFAULT, 0);
+
+   // welcome gets sent with the first flush
+   return vtp_write(s, "%s\n%s", MSG_WELCOME, MSG_LINE_START) < 0;
+}
+
+int vtp_session_init_http(vtp_session_t *s, int fd, vfsn_t *cwd)
+{
+   memset(s, 0, sizeof(*s));
+   s->fd = fd;
+   fair_client_init(&s->sched);
+   s->cwd = cwd;
+   s->tenant = tenant_get(TENANT_DEFAULT, 0);
+   s->http = http_new();
+   return s->http == NULL;
+}
 
-      // check if command was found
-      if (!cmd) {
-         vtp_write(fd, "%s\n%s", ERR_NOSUCHCMD, MSG_LINE_START);
-         wordfree(&cmdline);
+void vtp_session_release(vtp_session_t *s)
+{
+   free(s->argv);
+   for (int i = 0; i < s->npassfds; i++) {
+      close(s->passfds[i].fd);
+   }
+   vtp_txn_reset(s);
+   watch_sub_free(s->watch);
+   http_free(s->http);
+   tar_free(s->tar);
+   vfs_close(s->cwd);
+   tenant_put(s->tenant);
+   free(s->in);
+   free(s->out);
+   memset(s, 0, sizeof(*s));
+}
+
+char* vtp_reserve(vtp_session_t *s, size_t size)
+{
+   if (s->in_len + size > s->in_size) {
+      size_t newsize = s->in_size ? s->in_size : READ_BUFFER_SIZE;
+      while (newsize < s->in_len + size)
+         newsize *= 2;
+      char *in = realloc(s->in, newsize);
+      if (!in)
+         return NULL;
+      s->in = in;
+      s->in_size = newsize;
+   }
+   return s->in + s->in_len;
+}
+
+void vtp_feed(vtp_session_t *s)
+{
+   s->yielded = 0;
+   if (s->http) {
+      http_feed(s);
+      return;
+   }
+
+   size_t pos = 0;
+   while (!s->closed) {
+      // an export streams its archive ahead of further commands, as far as
+      // the output window allows
+      if (s->tar && !s->cmd) {
+         if (s->out_len >= VTP_STREAM_WINDOW || vtp_yield(s))
+            break;
+         char *msg = NULL;
+         vtp_charge(s, 1, tar_export_step(s, s->tar, &msg));
+         if (msg) {
+            tar_free(s->tar);
+            s->tar = NULL;
+            vtp_write(s, "%s\n%s", msg, MSG_LINE_START);
+         }
          continue;
       }
 
-      // check number of arguments
-      if (cmd->args + 1 > argc) {
-         vtp_write(fd, "%s\n%s", ERR_INVALIDCMD, MSG_LINE_START);
-         wordfree(&cmdline);
+      // imports apply their archive while it arrives
+      if (s->tar && s->payload_len) {
+         size_t len = s->in_len - pos < s->payload_len ? s->in_len - pos : s->payload_len;
+         if (!len || vtp_yield(s))
+            break;
+         size_t used = tar_import_step(s, s->tar, s->in + pos, len);
+         if (!used)
+            break;
+         pos += used;
+         s->payload_len -= used;
+         vtp_charge(s, 1, used);
          continue;
       }
-    
-      // execute command
-      char *msg = cmd->func(fd, &cwd, argv);
 
-      // print msg
-      if (msg) {
-         vtp_write(fd, "%s\n%s", msg, MSG_LINE_START);
+      // execute pending command as soon as its payload is complete
+      if (s->cmd) {
+         if (s->in_len - pos < s->payload_len || vtp_yield(s))
+            break;
+         s->payload = s->in + pos;
+         pos += s->payload_len;
+         vtp_exec(s);
+         continue;
+      }
+
+      // read command line
+      char *line = s->in + pos;
+      char *end = memchr(line, '\n', s->in_len - pos);
+      if (end) {
+         *end = '\0';
+         pos = end - s->in + 1;
+         s->framed = 1;
+      } else if (pos < s->in_len && !s->framed && !s->pending && vtp_drained(s->fd)
+            && !vtp_takes_payload(line, s->in_len - pos)) {
+         // clients which never sent a newline send one command per packet
+         if (!vtp_reserve(s, 1))
+            break;
+         line = s->in + pos;
+         s->in[s->in_len] = '\0';
+         pos = s->in_len;
       } else {
-         // write line start
-         vtp_write(fd, MSG_LINE_START);
+         break;
+      }
+
+      // the line stays buffered for the next turn
+      if (vtp_yield(s)) {
+         if (end)
+            *end = '\n';
+         pos = line - s->in;
+         break;
+      }
+
+      // rejected lines cost like a command
+      vtp_parse(s, line);
+      if (!s->cmd)
+         vtp_charge(s, 1, 0);
+   }
+
+   // keep incomplete data for the next call
+   memmove(s->in, s->in + pos, s->in_len - pos);
+   s->in_len -= pos;
+}
+
+int vtp_watch_fd(vtp_session_t *s)
+{
+   return s->watch ? watch_sub_fd(s->watch) : -1;
+}
+
+static void vtp_event_emit(void *ctx, const char *event, const char *path)
+{
+   vtp_write(ctx, "EVENT %s %s\n", event, path ? path : "/");
+}
+
+void vtp_events(vtp_session_t *s)
+{
+   if (s->watch && !vtp_streaming(s))
+      watch_drain(s->watch, vtp_event_emit, s);
+}
+
+ssize_t vtp_send(vtp_session_t *s, size_t off, int flags)
+{
+   struct vtp_passfd *passfd = s->npassfds > 0 ? &s->passfds[0] : NULL;
+   if (!passfd || passfd->at != off) {
+      size_t end = passfd && passfd->at > off ? passfd->at : s->out_len;
+      return send(s->fd, s->out + off, end - off, flags);
+   }
+
+   // attach descriptor to the first byte of its response
+   struct iovec iov = {
+      .iov_base = s->out + off,
+      .iov_len = (s->npassfds > 1 ? s->passfds[1].at : s->out_len) - off
+   };
+   union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+   } control;
+   struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf)
+   };
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(cmsg), &passfd->fd, sizeof(int));
+
+   ssize_t len = sendmsg(s->fd, &msg, flags);
+   if (len > 0) {
+      close(passfd->fd);
+      s->npassfds--;
+      memmove(&s->passfds[0], &s->passfds[1], s->npassfds * sizeof(struct vtp_passfd));
+   }
+   return len;
+}
+
+int vtp_streaming(vtp_session_t *s)
+{
+   return s->tar && !s->cmd;
+}
+
+int vtp_flush(vtp_session_t *s)
+{
+   size_t sent = 0;
+   while (sent < s->out_len) {
+      int len = vtp_send(s, sent, MSG_NOSIGNAL);
+      if (len <= 0) {
+         s->closed = 1;
+         break;
       }
-      wordfree(&cmdline);
+      sent += len;
+   }
+   s->out_len = 0;
+   return s->closed;
+}
+
+char* vtp_call(vtp_session_t *s, char *argv[], char *payload, size_t len)
+{
+   struct vtp_cmd *cmd = vtp_get_cmd(argv[0]);
+   if (!cmd) {
+      return ERR_NOSUCHCMD;
+   }
+
+   // a command running on behalf of another one keeps its state
+   struct vtp_cmd *outer = s->cmd;
+   char *outer_payload = s->payload;
+   size_t outer_len = s->payload_len;
+
+   s->cmd = cmd;
+   s->payload = payload;
+   s->payload_len = len;
+   char *msg = vtp_run(s, argv);
+   s->cmd = outer;
+   s->payload = outer_payload;
+   s->payload_len = outer_len;
+   return msg;
+}
+
+int vtp_yield(vtp_session_t *s)
+{
+   if (s->apply) {
+      return 0;
+   }
+   int reason = s->budget <= 0 ? FAIR_YIELD : fair_delay(&s->sched) ? FAIR_THROTTLED : 0;
+   if (reason) {
+      s->yielded = reason;
+      fair_yielded(reason);
+   }
+   return reason;
+}
+
+void vtp_charge(vtp_session_t *s, int weight, size_t bytes)
+{
+   if (s->apply) {
+      return;
+   }
+   long cost = weight + (bytes >> FAIR_BYTE_SHIFT);
+   s->budget -= cost;
+
+   // sessions of a tenant split its share
+   double share = 1;
+   if (s->tenant) {
+      int sessions = __atomic_load_n(&s->tenant->refs, __ATOMIC_RELAXED) - 1;
+      share = (double)__atomic_load_n(&s->tenant->weight, __ATOMIC_RELAXED) / (sessions > 1 ? sessions : 1);
+      __atomic_add_fetch(&s->tenant->cost, cost, __ATOMIC_RELAXED);
+   }
+   fair_charge(&s->sched, share, cost, bytes);
+}
+
+void vtp_handle(int fd, vfsn_t *cwd, int http)
+{
+   vtp_session_t s;
+   if (http) {
+      vtp_session_init_http(&s, fd, cwd);
+   } else {
+      vtp_session_init(&s, fd, cwd);
+   }
+
+   // send welcome
+   s.direct = 1;
+   vtp_flush(&s);
+
+   // main protocol loop
+   while (!s.closed) {
+      // wait for commands and watch events
+      if (s.watch) {
+         struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = vtp_watch_fd(&s), .events = POLLIN }
+         };
+         if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+               continue;
+            break;
+         }
+         if (fds[1].revents & POLLIN) {
+            vtp_events(&s);
+            vtp_flush(&s);
+         }
+         if (!fds[0].revents)
+            continue;
+      }
+
+      // read commands
+      char *buf = vtp_reserve(&s, READ_BUFFER_SIZE);
+      if (!buf) {
+         break;
+      }
+      int len = vtp_read_packet(fd, buf, s.in_size - s.in_len);
+      if (len <= 0) {
+         break;
+      }
+      s.in_len += len;
+
+      // execute and answer all complete commands, the kernel shares the cpu
+      // between the turns of the threads, streamed responses continue once
+      // the socket took their output
+      do {
+         uint64_t delay = fair_delay(&s.sched);
+         if (delay) {
+            struct timespec ts = { delay / 1000000000, delay % 1000000000 };
+            nanosleep(&ts, NULL);
+         }
+         s.budget = FAIR_QUANTUM;
+         vtp_feed(&s);
+         vtp_flush(&s);
+      } while ((s.yielded || vtp_streaming(&s)) && !s.closed);
    }
 
    // cleanup
-   vfs_close(cwd);
+   vtp_session_release(&s);
 }
@@ -6,10 +6,181 @@
 #define VTP
 
 #include "vfs.h"
+#include "watch.h"
+#include "fair.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+#define VTP_PASSFDS 16
+
+struct vtp_cmd;
+struct vtp_queued;
+struct tenant;
+struct http;
+struct tar;
+
+struct vtp_passfd {
+   int fd;
+   size_t at;   // offset of the response in the output buffer
+};
+
+typedef struct vtp_session {
+   int fd, closed;
+   vfsn_t *cwd;
+   struct tenant *tenant;   // namespace selected by use
+
+   // buffered input, commands are terminated by a newline
+   char *in;
+   size_t in_len, in_size;
+   int pending;   // set by event loops which already took more input off the socket
+   int framed;    // set by the first newline, then lines are never cut at packets
+
+   // buffered output, sent by vtp_flush
+   char *out;
+   size_t out_len, out_size;
+
+   // descriptors passed along with their responses over unix sockets
+   struct vtp_passfd passfds[VTP_PASSFDS];
+   int npassfds;
+
+   // subscriber of watch commands
+   watch_sub_t *watch;
+
+   // applies the log of the primary, which is allowed on a replica
+   int apply;
+
+   // request state of clients speaking http instead of vtp
+   struct http *http;
+
+   // archive streamed by export, or applied while import receives it
+   struct tar *tar;
+
+   // output may be sent while feeding, which lets streams send contents
+   // straight from files
+   int direct;
+
+   // changes queued between begin and commit
+   int txn;
+   struct vtp_queued *queued;
+   int nqueued, queued_size;
+
+   // command waiting for its payload
+   struct vtp_cmd *cmd;
+   char **argv;   // NULL terminated words of the command line
+   int argc;
+   char *payload;
+   size_t payload_len;
+
+   // turns given by the scheduler, yielded tells why feeding stopped early
+   fair_client_t sched;
+   long budget;
+   int yielded;
+} vtp_session_t;
+
+/*
+ * Inits session for given file descriptor with cwd as working directory. The
+ * session takes over the handle of cwd. The welcome message is buffered for
+ * the first vtp_flush.
+ */
+int vtp_session_init(vtp_session_t *s, int fd, vfsn_t *cwd);
+
+/*
+ * Inits session like vtp_session_init, but for a client speaking http, which
+ * gets no welcome.
+ */
+int vtp_session_init_http(vtp_session_t *s, int fd, vfsn_t *cwd);
+
+/*
+ * Releases session and closes its working directory.
+ */
+void vtp_session_release(vtp_session_t *s);
+
+/*
+ * Makes sure that at least size bytes can be appended to the input buffer.
+ * Returns pointer to the free space or NULL on memory shortage.
+ */
+char* vtp_reserve(vtp_session_t *s, size_t size);
+
+/*
+ * Executes all complete commands of the input buffer. Responses are buffered
+ * until vtp_flush gets called.
+ */
+void vtp_feed(vtp_session_t *s);
+
+/*
+ * Returns file descriptor which becomes readable when watch events are
+ * pending or -1 if the session watches nothing.
+ */
+int vtp_watch_fd(vtp_session_t *s);
+
+/*
+ * Appends pending watch events to the output buffer. Events are written as
+ * EVENT type path lines between responses, so they wait while a response
+ * is streamed.
+ */
+void vtp_events(vtp_session_t *s);
+
+/*
+ * Sends buffered output starting at offset off, but not past the next passed
+ * descriptor. Descriptors are attached to the first byte of their response
+ * and closed once sent. Returns the result of the send call.
+ */
+ssize_t vtp_send(vtp_session_t *s, size_t off, int flags);
+
+/*
+ * Returns whether the session streams a response, which continues with the
+ * next vtp_feed once the output got sent.
+ */
+int vtp_streaming(vtp_session_t *s);
+
+/*
+ * Sends buffered responses. Returns 0 on success.
+ */
+int vtp_flush(vtp_session_t *s);
+
+/*
+ * Executes a single command with arguments argv and payload like a received
+ * one, including logging and the checks of tenant and replica, and returns
+ * its response instead of writing it. Commands answering with a batch write
+ * it to the output. The arguments may get modified.
+ */
+char* vtp_call(vtp_session_t *s, char *argv[], char *payload, size_t len);
+
+/*
+ * Returns whether the session has to give up its turn before the next
+ * command, because its budget is used up or a rate limit is reached. The
+ * reason is kept in yielded.
+ */
+int vtp_yield(vtp_session_t *s);
+
+/*
+ * Accounts a command of given weight which moved bytes, against the budget
+ * of the session and the share of its tenant.
+ */
+void vtp_charge(vtp_session_t *s, int weight, size_t bytes);
+
+/*
+ * Resolves path relative to cwd. Returns the opened node or NULL if there is
+ * none.
+ */
+vfsn_t* vtp_path(vfsn_t *cwd, char* path);
+
+/*
+ * Makes sure that at least size bytes can be appended to the output buffer.
+ * Returns pointer to the free space or NULL on memory shortage.
+ */
+char* vtp_out_reserve(vtp_session_t *s, size_t size);
+
+/*
+ * Appends formatted output. Returns the number of bytes written or -1 on
+ * memory shortage.
+ */
+int vtp_write(vtp_session_t *s, char *fmt, ...);
 
 /*
- * Handles virtual transfer protocol operation on given file descriptor and vfs node.
+ * Handles virtual transfer protocol operation on given file descriptor and vfs
+ * node. With http, the client speaks http instead.
  */
-void vtp_handle(int fd, vfsn_t *root);
+void vtp_handle(int fd, vfsn_t *root, int http);
 
 #endif
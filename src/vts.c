@@ -4,112 +4,544 @@
 */
 #include "vts.h"
 #include "vtp.h"
+#include "vtl.h"
+#include "http.h"
+#include "watch.h"
+#include "tenant.h"
 #include "log.h"
+#include "stats.h"
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <fcntl.h>
 
+///////////////////////////////////////////////////////////////////////////////
+// DEFINES / MACROS
+///////////////////////////////////////////////////////////////////////////////
+#define MSG_BUSY "BUSY Server busy, try again later\n"
 
 ///////////////////////////////////////////////////////////////////////////////
 // LOCAL FUNCTIONS
 ///////////////////////////////////////////////////////////////////////////////
+static uint64_t vts_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void vts_reject(struct vts_shard *shard, int fd)
+{
+   char *busy = shard->http ? HTTP_BUSY : MSG_BUSY;
+   send(fd, busy, strlen(busy), MSG_NOSIGNAL|MSG_DONTWAIT);
+   close(fd);
+}
+
+/*
+ * Parses cpu list like "0-3,8" into cpus. Returns number of cpus or -1 on
+ * syntax error.
+ */
+static int vts_parse_cpus(char *list, int *cpus, int max)
+{
+   int count = 0;
+   char *it = list;
+   while (*it) {
+      char *end;
+      long first = strtol(it, &end, 10), last = first;
+      if (end == it || first < 0)
+         return -1;
+      if (*end == '-') {
+         it = end + 1;
+         last = strtol(it, &end, 10);
+         if (end == it || last < first)
+            return -1;
+      }
+      for (long cpu = first; cpu <= last && count < max; cpu++)
+         cpus[count++] = cpu;
+      if (*end == ',')
+         end++;
+      else if (*end)
+         return -1;
+      it = end;
+   }
+   return count;
+}
+
+/*
+ * Splits the configured cpus into contiguous blocks, one per shard.
+ */
+static int vts_assign_cpus(vts_socket_t *sock)
+{
+   int cpus[CPU_SETSIZE], count = 0;
+
+   if (sock->config.cpus) {
+      count = vts_parse_cpus(sock->config.cpus, cpus, CPU_SETSIZE);
+      if (count <= 0) {
+         log_err("invalid cpu list '%s'", sock->config.cpus);
+         return 1;
+      }
+   } else if (sock->nshards > 1) {
+      cpu_set_t online;
+      if (sched_getaffinity(0, sizeof(online), &online))
+         return 1;
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+         if (CPU_ISSET(cpu, &online))
+            cpus[count++] = cpu;
+      }
+   } else {
+      // single shard keeps the default scheduling
+      return 0;
+   }
+
+   for (int i = 0; i < sock->nshards; i++) {
+      struct vts_shard *shard = &sock->shards[i];
+      CPU_ZERO(&shard->cpus);
+      if (sock->nshards <= count) {
+         for (int j = i * count / sock->nshards; j < (i + 1) * count / sock->nshards; j++)
+            CPU_SET(cpus[j], &shard->cpus);
+      } else {
+         CPU_SET(cpus[i % count], &shard->cpus);
+      }
+      shard->pinned = 1;
+   }
+   return 0;
+}
+
+static int vts_listen_unix(vts_socket_t *sock, struct vts_shard *shard)
+{
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+   char *path = sock->config.unix_path;
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      log_err("unix socket path '%s' too long", path);
+      return 1;
+   }
+   strcpy(addr.sun_path, path);
+
+   shard->sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (shard->sockfd < 0)
+      return 1;
+
+   // remove stale socket of a previous run, but not the one of a running server
+   struct stat st;
+   if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+         connect(shard->sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      unlink(path);
+   }
+
+   if (bind(shard->sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+         listen(shard->sockfd, sock->config.backlog)) {
+      log_err("cannot listen on %s", path);
+      // keep the path of somebody else
+      close(shard->sockfd);
+      shard->sockfd = -1;
+      return 1;
+   }
+   return 0;
+}
+
+/*
+ * Opens the listening sockets of all tcp shards on port, which serve http if
+ * http is set.
+ */
+static int vts_listen_tcp(vts_socket_t *sock, int number, int http)
+{
+   int tcp = 0;
+   for (int i = 0; i < sock->nshards; i++) {
+      if (!sock->shards[i].local && sock->shards[i].http == http)
+         tcp++;
+   }
+   if (!tcp)
+      return 0;
+
+   struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = AI_PASSIVE | AI_NUMERICSERV
+   }, *addr;
+   char port[16];
+   snprintf(port, sizeof(port), "%i", number);
+   if (getaddrinfo(sock->config.address, port, &hints, &addr) != 0) {
+      log_err("cannot resolve address '%s'", sock->config.address);
+      return 1;
+   }
+
+   // every shard gets its own listening socket on the same port
+   int retval = 0;
+   for (int i = 0; i < sock->nshards && !retval; i++) {
+      struct vts_shard *shard = &sock->shards[i];
+      if (shard->local || shard->http != http)
+         continue;
+      shard->sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+      if (shard->sockfd < 0) {
+         retval = 1;
+         break;
+      }
+
+      // set reuseable address and port
+      int optvalue = 1;
+      setsockopt(shard->sockfd, SOL_SOCKET, SO_REUSEADDR, &optvalue, sizeof(optvalue));
+      if (tcp > 1 &&
+            setsockopt(shard->sockfd, SOL_SOCKET, SO_REUSEPORT, &optvalue, sizeof(optvalue))) {
+         log_err("SO_REUSEPORT not supported");
+         retval = 1;
+         break;
+      }
+
+      // bind socket to address and start listening
+      if (bind(shard->sockfd, addr->ai_addr, addr->ai_addrlen) != 0 ||
+            listen(shard->sockfd, sock->config.backlog)) {
+         log_err("cannot listen on %s:%i", sock->config.address, number);
+         retval = 1;
+      }
+   }
+
+   freeaddrinfo(addr);
+   return retval;
+}
+
+static int vts_listen(vts_socket_t *sock)
+{
+   for (int i = 0; i < sock->nshards; i++) {
+      if (sock->shards[i].local && vts_listen_unix(sock, &sock->shards[i]))
+         return 1;
+   }
+   return vts_listen_tcp(sock, sock->config.port, 0)
+      || vts_listen_tcp(sock, sock->config.http_port, 1);
+}
+
+/*
+ * Takes the oldest connection from the queue which did not time out. Must be
+ * called with the shard lock held.
+ */
+static int vts_dequeue(struct vts_shard *shard)
+{
+   int timeout = shard->sock->config.queue_timeout;
+   while (shard->queue_len > 0) {
+      struct vts_pending *pending = &shard->queue[shard->queue_head];
+      shard->queue_head = (shard->queue_head + 1) % shard->queue_size;
+      shard->queue_len--;
+      pthread_cond_signal(&shard->space);
+
+      uint64_t wait = vts_now() - pending->since;
+      if (wait > timeout * 1000ull) {
+         log_warn("client waited too long for a free slot");
+         shard->expired++;
+         vts_reject(shard, pending->fd);
+         continue;
+      }
+
+      shard->waited++;
+      shard->wait_total += wait;
+      if (wait > shard->wait_max)
+         shard->wait_max = wait;
+      return pending->fd;
+   }
+   return -1;
+}
+
 static void* vts_worker(void* data)
 {
-   log_info("client connceted");
    struct vts_worker *worker = (struct vts_worker*)data;
+   struct vts_shard *shard = worker->shard;
 
-   // handle virtual transfer protocol
-   vtp_handle(worker->fd, worker->root);
+   pthread_mutex_lock(&shard->lock);
+   while (shard->running) {
+      // take next queued client or wait in the free list
+      if (worker->fd < 0) {
+         worker->fd = vts_dequeue(shard);
+      }
+      if (worker->fd < 0) {
+         worker->next_free = shard->free_workers;
+         shard->free_workers = worker;
+         while (shard->running && worker->fd < 0)
+            pthread_cond_wait(&worker->wakeup, &shard->lock);
+         continue;
+      }
+      shard->busy++;
+      pthread_mutex_unlock(&shard->lock);
+
+      // handle virtual transfer protocol
+      log_info("client connceted");
+      vtp_handle(worker->fd, vfs_open(shard->sock->root), shard->http);
+      log_info("client disconnceted");
 
-   // unlock worker
-   pthread_mutex_unlock(&worker->lock);
+      // release slot
+      pthread_mutex_lock(&shard->lock);
+      close(worker->fd);
+      worker->fd = -1;
+      shard->busy--;
+   }
+   pthread_mutex_unlock(&shard->lock);
 
    // exit worker thread
-   log_info("client disconnceted");
    return NULL;
 }
 
+static void* vts_accept(void *data)
+{
+   struct vts_shard *shard = data;
+   int timeout = shard->sock->config.queue_timeout;
+
+   // server loop until the listening socket gets shut down
+   while (1) {
+      // wait for clients
+      int clientfd = accept(shard->sockfd, NULL, 0);
+
+      // server socket closed, shutdown server
+      if (clientfd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         break;
+      }
+
+      pthread_mutex_lock(&shard->lock);
+      shard->accepted++;
+
+      // hand over to an idle worker
+      if (shard->free_workers) {
+         struct vts_worker *worker = shard->free_workers;
+         shard->free_workers = worker->next_free;
+         worker->fd = clientfd;
+         pthread_cond_signal(&worker->wakeup);
+         pthread_mutex_unlock(&shard->lock);
+         continue;
+      }
+
+      // wait for space in the admission queue
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += timeout / 1000;
+      deadline.tv_nsec += (timeout % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+      }
+      while (shard->running && shard->queue_len == shard->queue_size) {
+         if (pthread_cond_timedwait(&shard->space, &shard->lock, &deadline) == ETIMEDOUT)
+            break;
+      }
+
+      // check if queue has space
+      if (!shard->running || shard->queue_len == shard->queue_size) {
+         shard->rejected++;
+         pthread_mutex_unlock(&shard->lock);
+         vts_reject(shard, clientfd);
+         log_warn("client can not connect due to all slots are in use");
+         continue;
+      }
+
+      int tail = (shard->queue_head + shard->queue_len) % shard->queue_size;
+      shard->queue[tail].fd = clientfd;
+      shard->queue[tail].since = vts_now();
+      shard->queue_len++;
+      if (shard->queue_len > shard->queue_peak)
+         shard->queue_peak = shard->queue_len;
+      pthread_mutex_unlock(&shard->lock);
+   }
+
+   // wake up idle workers, disconnect busy ones and drop queued clients
+   pthread_mutex_lock(&shard->lock);
+   shard->running = 0;
+   for (int i = 0; i < shard->max_workers; i++) {
+      pthread_cond_signal(&shard->workers[i].wakeup);
+      if (shard->workers[i].fd >= 0)
+         shutdown(shard->workers[i].fd, SHUT_RDWR);
+   }
+   while (shard->queue_len > 0) {
+      close(shard->queue[shard->queue_head].fd);
+      shard->queue_head = (shard->queue_head + 1) % shard->queue_size;
+      shard->queue_len--;
+   }
+   pthread_mutex_unlock(&shard->lock);
+
+   // wait for all workers to finish
+   for (int i = 0; i < shard->max_workers; i++) {
+      pthread_join(shard->workers[i].thread, NULL);
+   }
+   return NULL;
+}
+
+static void* vts_loop(void *data)
+{
+   struct vts_shard *shard = data;
+   vtl_run(shard, shard->sock->config.backend);
+   return NULL;
+}
+
+static void vts_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   vts_socket_t *sock = arg;
+   struct vts_shard total = { 0 };
+
+   for (int i = 0; i < sock->nshards; i++) {
+      struct vts_shard *shard = &sock->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      total.max_workers += shard->max_workers;
+      total.busy += shard->busy;
+      total.queue_size += shard->queue_size;
+      total.queue_len += shard->queue_len;
+      total.queue_peak += shard->queue_peak;
+      total.accepted += shard->accepted;
+      total.rejected += shard->rejected;
+      total.expired += shard->expired;
+      total.waited += shard->waited;
+      total.wait_total += shard->wait_total;
+      if (shard->wait_max > total.wait_max)
+         total.wait_max = shard->wait_max;
+      pthread_mutex_unlock(&shard->lock);
+   }
+
+   emit(ctx, "vts.shards", sock->nshards);
+   emit(ctx, "vts.workers", total.max_workers);
+   emit(ctx, "vts.workers_busy", total.busy);
+   emit(ctx, "vts.queue_size", total.queue_size);
+   emit(ctx, "vts.queue_depth", total.queue_len);
+   emit(ctx, "vts.queue_peak", total.queue_peak);
+   emit(ctx, "vts.accepted", total.accepted);
+   emit(ctx, "vts.rejected", total.rejected);
+   emit(ctx, "vts.expired", total.expired);
+   emit(ctx, "vts.queue_waited", total.waited);
+   emit(ctx, "vts.queue_wait_avg_us", total.waited ? total.wait_total / total.waited : 0);
+   emit(ctx, "vts.queue_wait_max_us", total.wait_max);
+
+   // distribution of connections among the shards
+   for (int i = 0; sock->nshards > 1 && i < sock->nshards; i++) {
+      char name[64];
+      struct vts_shard *shard = &sock->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      snprintf(name, sizeof(name), "vts.shard%i.accepted", i);
+      emit(ctx, name, shard->accepted);
+      snprintf(name, sizeof(name), "vts.shard%i.workers_busy", i);
+      emit(ctx, name, shard->busy);
+      snprintf(name, sizeof(name), "vts.shard%i.queue_depth", i);
+      emit(ctx, name, shard->queue_len);
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // GLOBAL FUNCTIONS
 ///////////////////////////////////////////////////////////////////////////////
-int vts_init(vts_socket_t *sock, int port, int max_clients)
+int vts_init(vts_socket_t *sock, vts_config_t *config)
 {
    // init socket
    memset(sock, 0, sizeof(*sock));
-   sock->workers = calloc(sizeof(struct vts_worker), max_clients);
-
-   // check memory allocation
-   if (!sock->workers) {
+   sock->config = *config;
+   if (sock->config.max_clients < 1 || sock->config.queue_depth < 1 ||
+         sock->config.shards < 1 || sock->config.backlog < 1 ||
+         (sock->config.port < 0 && !sock->config.unix_path && sock->config.http_port < 0)) {
       return 1;
    }
-   
-   // init workers
-   memset(sock->workers, 0, sizeof(struct vts_worker));
-   sock->max_clients = max_clients;
 
-   // init locks 
-   for (int i = 0; i < max_clients; i++) {
-      pthread_mutex_init(&sock->workers[i].lock, NULL);
+   // tcp shards plus one for the unix domain socket and one for http
+   int local = sock->config.unix_path != NULL;
+   int http = sock->config.http_port >= 0;
+   int tcp = sock->config.port >= 0 ? sock->config.shards : 0;
+   if (tcp + local + http > sock->config.max_clients)
+      tcp = sock->config.max_clients - local - http;
+   if ((sock->config.port >= 0 && tcp < 1) || local + http > sock->config.max_clients) {
+      log_err("not enough clients for all listeners");
+      return 1;
    }
 
-   // setup socket
-   sock->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-   if (sock->sockfd < 0) {
-      vts_release(sock);
+   // each shard gets its share of the workers
+   sock->nshards = tcp + local + http;
+   sock->shards = calloc(sizeof(struct vts_shard), sock->nshards);
+   if (!sock->shards) {
       return 1;
    }
+   for (int i = 0; i < sock->nshards; i++) {
+      sock->shards[i].sockfd = sock->shards[i].stopfd = -1;
+   }
 
-   // set reuseable address
-   int optvalue = 1;
-   setsockopt(sock->sockfd, SOL_SOCKET, SO_REUSEADDR, &optvalue, sizeof(optvalue));
+   for (int i = 0; i < sock->nshards; i++) {
+      struct vts_shard *shard = &sock->shards[i];
+      shard->id = i;
+      shard->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      shard->local = local && i == tcp;
+      shard->http = http && i == tcp + local;
+      shard->sock = sock;
+      shard->max_workers = sock->config.max_clients / sock->nshards +
+         (i < sock->config.max_clients % sock->nshards);
+      shard->queue_size = sock->config.queue_depth;
+      pthread_mutex_init(&shard->lock, NULL);
+      pthread_cond_init(&shard->space, NULL);
+      shard->workers = calloc(sizeof(struct vts_worker), shard->max_workers);
+      shard->queue = calloc(sizeof(struct vts_pending), shard->queue_size);
 
-   // setup socket address
-   struct sockaddr_in serv_addr = {
-      .sin_family = AF_INET,
-      .sin_addr.s_addr = inet_addr("127.0.0.1"),
-      .sin_port = htons(port)
-   };
+      // check memory allocation
+      if (!shard->workers || !shard->queue || shard->stopfd < 0) {
+         vts_release(sock);
+         return 1;
+      }
 
-   // bind socket to address
-   if (bind(sock->sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
-      vts_release(sock);
-      return 1;
+      // init workers
+      for (int j = 0; j < shard->max_workers; j++) {
+         pthread_cond_init(&shard->workers[j].wakeup, NULL);
+         shard->workers[j].fd = -1;
+         shard->workers[j].shard = shard;
+      }
    }
 
-   // start listening
-   if (listen(sock->sockfd, 5)) {
+   // setup sockets
+   if (vts_assign_cpus(sock) || vts_listen(sock)) {
       vts_release(sock);
       return 1;
    }
 
-   // create filesystem
+   // create filesystem, changes get reported to watching sessions
+   watch_init();
    sock->root = vfs_create(NULL, "/", VFS_DIR);
-   if (!sock->root) {
+   if (!sock->root || tenant_init(sock->root)) {
       vts_release(sock);
       return 1;
    }
 
+   stats_register(vts_stats, sock);
    return 0;
 }
 
 void vts_release(vts_socket_t *sock)
 {
-   // close server socket
-   close(sock->sockfd);
+   stats_unregister(vts_stats, sock);
 
-   // release locks 
-   for (int i = 0; i < sock->max_clients; i++) {
-      pthread_mutex_destroy(&sock->workers[i].lock);
-   }
+   for (int i = 0; sock->shards && i < sock->nshards; i++) {
+      struct vts_shard *shard = &sock->shards[i];
 
-   // release memory
-   free(sock->workers);
+      // close server socket
+      if (shard->sockfd >= 0) {
+         close(shard->sockfd);
+         if (shard->local)
+            unlink(sock->config.unix_path);
+      }
+      if (shard->stopfd >= 0)
+         close(shard->stopfd);
+
+      // release locks
+      for (int j = 0; shard->workers && j < shard->max_workers; j++) {
+         pthread_cond_destroy(&shard->workers[j].wakeup);
+      }
+      pthread_cond_destroy(&shard->space);
+      pthread_mutex_destroy(&shard->lock);
+
+      // release memory
+      free(shard->workers);
+      free(shard->queue);
+   }
+   free(sock->shards);
 
    // delete filesystem
+   tenant_release();
    vfs_delete(sock->root);
    vfs_close(sock->root);
 
@@ -118,43 +550,35 @@ void vts_release(vts_socket_t *sock)
 }
 
 int vts_start(vts_socket_t* sock)
-{ 
-   // server loop until filesystem gets deleted
-   while (1) {
-      // wait for clients
-      int clientfd = accept(sock->sockfd, NULL, 0);
-      
-      // server socket closed, shutdown server
-      if (clientfd < 0) {
-         break;
-      }
+{
+   for (int i = 0; i < sock->nshards; i++) {
+      struct vts_shard *shard = &sock->shards[i];
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      if (shard->pinned)
+         pthread_attr_setaffinity_np(&attr, sizeof(shard->cpus), &shard->cpus);
 
-      // find free worker slot
-      struct vts_worker *worker = NULL;
-      for (int i = 0; i < sock->max_clients; i++) {
-         if (pthread_mutex_trylock(&sock->workers[i].lock) == 0) {
-            worker = &sock->workers[i];
-            break;
-         }
+      // event loop backends serve all connections from a single thread
+      shard->running = 1;
+      if (sock->config.backend != VTL_THREADS) {
+         pthread_create(&shard->thread, &attr, vts_loop, shard);
+         pthread_attr_destroy(&attr);
+         continue;
       }
 
-      // check if empty slot was found
-      if (!worker) {
-         close(clientfd);
-         log_warn("client can not connect due to all slots are in use");
-         continue;
+      // prestart worker pool on the cpus of the shard
+      for (int j = 0; j < shard->max_workers; j++) {
+         pthread_create(&shard->workers[j].thread, &attr, vts_worker, &shard->workers[j]);
       }
 
-      // set client data
-      pthread_join(worker->thread, NULL);
-      worker->fd = clientfd;
-      worker->root = vfs_open(sock->root);
-      pthread_create(&worker->thread, NULL, vts_worker, worker);
+      // every shard accepts its connections itself
+      pthread_create(&shard->thread, &attr, vts_accept, shard);
+      pthread_attr_destroy(&attr);
    }
 
-   // wait for all threads to finish
-   for (int i = 0; i < sock->max_clients; i++) {
-      pthread_join(sock->workers[i].thread, NULL);
+   // wait for all shards to finish
+   for (int i = 0; i < sock->nshards; i++) {
+      pthread_join(sock->shards[i].thread, NULL);
    }
 
    return 0;
@@ -167,8 +591,15 @@ void vts_stop(vts_socket_t* sock)
 
    // close all sockets
    log_info("shutdown server");
-   close(sock->sockfd);
-   for (int i = 0; i < sock->max_clients; i++) {
-      close(sock->workers[i].fd);
+   for (int i = 0; i < sock->nshards; i++) {
+      struct vts_shard *shard = &sock->shards[i];
+      uint64_t one = 1;
+      shutdown(shard->sockfd, SHUT_RDWR);
+      write(shard->stopfd, &one, sizeof(one));
+      for (int j = 0; j < shard->max_workers; j++) {
+         int fd = shard->workers[j].fd;
+         if (fd >= 0)
+            shutdown(fd, SHUT_RDWR);
+      }
    }
 }
@@ -5,29 +5,96 @@
 #ifndef VTS
 #define VTS
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "vfs.h"
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
 #define VTS_SOCKET_INIT 0
 
+#define VTS_CONFIG_INIT { \
+   .address = "127.0.0.1", \
+   .port = -1, \
+   .unix_path = NULL, \
+   .http_port = -1, \
+   .backlog = 128, \
+   .shards = 1, \
+   .cpus = NULL, \
+   .max_clients = 50, \
+   .queue_depth = 64, \
+   .queue_timeout = 5000, \
+   .backend = 0, \
+}
+
+typedef struct {
+   char *address;
+   int port;            // tcp port or -1 for unix socket only
+   char *unix_path;     // additional unix domain socket
+   int http_port;       // additional tcp port speaking http or -1
+   int backlog;
+   int shards;          // listeners sharing the port via SO_REUSEPORT
+   char *cpus;          // cpu list like "0-3,8" split among the shards
+   int max_clients;     // workers of all shards
+   int queue_depth;     // accepted connections waiting for a worker per shard
+   int queue_timeout;   // ms a connection may wait for a worker
+   int backend;         // VTL_THREADS, VTL_EPOLL or VTL_URING
+} vts_config_t;
+
 struct vts_worker {
-   pthread_mutex_t lock;
    pthread_t thread;
+   pthread_cond_t wakeup;
    int fd;
-   vfsn_t *root;
+   struct vts_worker *next_free;
+   struct vts_shard *shard;
 };
 
-typedef struct {
-   int sockfd;
-   int max_clients;
+struct vts_pending {
+   int fd;
+   uint64_t since;
+};
+
+struct vts_shard {
+   int id, sockfd;
+   int local;           // listens on the unix domain socket
+   int http;            // listens on the http port
+   int stopfd;          // eventfd signaled by vts_stop
+   int running;
+   pthread_t thread;
+   cpu_set_t cpus;
+   int pinned;
+   struct vts_socket *sock;
+
+   // worker pool, idle workers are kept in a free list
+   pthread_mutex_t lock;
+   pthread_cond_t space;
    struct vts_worker *workers;
+   struct vts_worker *free_workers;
+   int max_workers, busy;
+
+   // bounded admission queue of accepted connections
+   struct vts_pending *queue;
+   int queue_size, queue_head, queue_len, queue_peak;
+
+   // statistics
+   uint64_t accepted, rejected, expired;
+   uint64_t waited, wait_total, wait_max;
+};
+
+typedef struct vts_socket {
+   vts_config_t config;
    vfsn_t *root;
+   struct vts_shard *shards;
+   int nshards;
 } vts_socket_t;
 
 /*
  * Inits vts socket. Must be called before vtp_start.
  */
-int vts_init(vts_socket_t *sock, int port, int max_clients);
+int vts_init(vts_socket_t *sock, vts_config_t *config);
 
 /*
  * Releases vts socket.
@@ -0,0 +1,375 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#include "watch.h"
+#include "stats.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL STRUCTURES
+///////////////////////////////////////////////////////////////////////////////
+struct watch {
+   watch_sub_t *sub;
+   vfsn_t *node;
+   int recursive;
+   struct watch *next_node;   // next watch on the same node
+   struct watch *next_sub;    // next watch of the same subscriber
+};
+
+// path shared by the queues of all subscribers of an event
+struct watch_path {
+   int refs;
+   char str[];
+};
+
+struct watch_event {
+   int type;
+   struct watch_path *path;
+};
+
+struct watch_sub {
+   int fd;
+   struct watch *watches;
+
+   // bounded event queue, writers never wait for the subscriber
+   pthread_mutex_t lock;
+   struct watch_event queue[WATCH_QUEUE];
+   int head, len, overflow;
+   uint64_t seq;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL VARIABLES
+///////////////////////////////////////////////////////////////////////////////
+static char *watch_names[] = { NULL, "create", "update", "delete", "movefrom", "moveto" };
+
+// guards the watch lists of all nodes and subscribers
+static pthread_rwlock_t watch_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int watch_count = 0, watch_subs = 0;
+static uint64_t watch_seq = 0, watch_events = 0, watch_dropped = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+static void watch_path_put(struct watch_path *path)
+{
+   if (__atomic_sub_fetch(&path->refs, 1, __ATOMIC_ACQ_REL) == 0)
+      free(path);
+}
+
+/*
+ * Builds absolute path of node by walking up to the root. A given name gets
+ * appended as last component.
+ */
+static struct watch_path* watch_path_get(vfsn_t *node, const char *name)
+{
+   vfsn_t *nodes[256];
+   int depth = 0;
+   size_t len = 0;
+
+   // collect nodes below the root
+   vfsn_t *it = vfs_open(node);
+   while (it) {
+      vfsn_t *parent = vfs_open(it);
+      vfs_parent(&parent);
+      if (!parent || depth == 256) {
+         vfs_close(parent);
+         break;
+      }
+      len += vfs_name_size(it) + 1;
+      nodes[depth++] = it;
+      it = parent;
+   }
+   vfs_close(it);
+   if (name)
+      len += strlen(name) + 1;
+
+   struct watch_path *path = malloc(sizeof(struct watch_path) + len + 2);
+   if (path) {
+      path->refs = 1;
+      char *pos = path->str;
+      *pos = '/';
+      for (int i = depth - 1; i >= 0; i--) {
+         int size = vfs_name_size(nodes[i]);
+         *pos++ = '/';
+         vfs_name(nodes[i], pos, size);
+         pos += size;
+      }
+      if (name)
+         pos += sprintf(pos, "/%s", name);
+      if (depth == 0 && !name)
+         pos++;
+      *pos = '\0';
+   }
+
+   for (int i = 0; i < depth; i++)
+      vfs_close(nodes[i]);
+   return path;
+}
+
+static void watch_push(watch_sub_t *sub, int type, struct watch_path *path, uint64_t seq)
+{
+   pthread_mutex_lock(&sub->lock);
+
+   // report every event once, even if several watches match
+   if (sub->seq == seq) {
+      pthread_mutex_unlock(&sub->lock);
+      return;
+   }
+   sub->seq = seq;
+
+   int wakeup = sub->len == 0 && !sub->overflow;
+   if (sub->len == WATCH_QUEUE) {
+      // slow subscriber, drop event and report the overflow later
+      sub->overflow = 1;
+      __atomic_add_fetch(&watch_dropped, 1, __ATOMIC_RELAXED);
+   } else {
+      struct watch_event *event = &sub->queue[(sub->head + sub->len) % WATCH_QUEUE];
+      event->type = type;
+      event->path = path;
+      __atomic_add_fetch(&path->refs, 1, __ATOMIC_RELAXED);
+      sub->len++;
+   }
+   pthread_mutex_unlock(&sub->lock);
+
+   if (wakeup) {
+      uint64_t one = 1;
+      write(sub->fd, &one, sizeof(one));
+   }
+}
+
+/*
+ * Unlinks watch from the list of its node. Must be called with the watch lock
+ * held for writing.
+ */
+static void watch_unlink_node(struct watch *watch)
+{
+   struct watch **it = &watch->node->watches;
+   while (*it != watch)
+      it = &(*it)->next_node;
+   *it = watch->next_node;
+   watch_count--;
+}
+
+static void watch_unlink_sub(struct watch *watch)
+{
+   struct watch **it = &watch->sub->watches;
+   while (*it != watch)
+      it = &(*it)->next_sub;
+   *it = watch->next_sub;
+}
+
+/*
+ * Reports event of node to all matching watches. Moved nodes are reported at
+ * their old location given by parent and name.
+ */
+static void watch_notify(int type, vfsn_t *node, vfsn_t *parent, const char *name)
+{
+   // nothing to do without any watch
+   if (__atomic_load_n(&watch_count, __ATOMIC_RELAXED) == 0)
+      return;
+
+   // deleted nodes lose their watches
+   if (type == VFS_EV_DELETE)
+      pthread_rwlock_wrlock(&watch_lock);
+   else
+      pthread_rwlock_rdlock(&watch_lock);
+
+   uint64_t seq = __atomic_add_fetch(&watch_seq, 1, __ATOMIC_RELAXED);
+   struct watch_path *path = NULL;
+
+   // node itself and its parent match every watch, other ancestors only
+   // recursive ones
+   vfsn_t *it = vfs_open(node);
+   for (int depth = 0; it; depth++) {
+      for (struct watch *watch = it->watches; watch; watch = watch->next_node) {
+         if (depth > 1 && !watch->recursive)
+            continue;
+         if (!path && !(path = parent ? watch_path_get(parent, name) : watch_path_get(node, NULL)))
+            break;
+         watch_push(watch->sub, type, path, seq);
+      }
+      if (depth == 0 && parent) {
+         vfs_close(it);
+         it = vfs_open(parent);
+      } else {
+         vfs_parent(&it);
+      }
+   }
+   vfs_close(it);
+
+   struct watch *removed = NULL;
+   if (type == VFS_EV_DELETE) {
+      while (node->watches) {
+         struct watch *watch = node->watches;
+         watch_unlink_node(watch);
+         watch_unlink_sub(watch);
+         watch->next_node = removed;
+         removed = watch;
+      }
+   }
+   pthread_rwlock_unlock(&watch_lock);
+
+   if (path) {
+      __atomic_add_fetch(&watch_events, 1, __ATOMIC_RELAXED);
+      watch_path_put(path);
+   }
+   while (removed) {
+      struct watch *watch = removed;
+      removed = watch->next_node;
+      vfs_close(watch->node);
+      free(watch);
+   }
+}
+
+static void watch_stats(void *arg, stats_emit_t emit, void *ctx)
+{
+   emit(ctx, "watch.subscribers", __atomic_load_n(&watch_subs, __ATOMIC_RELAXED));
+   emit(ctx, "watch.watches", __atomic_load_n(&watch_count, __ATOMIC_RELAXED));
+   emit(ctx, "watch.events", __atomic_load_n(&watch_events, __ATOMIC_RELAXED));
+   emit(ctx, "watch.dropped", __atomic_load_n(&watch_dropped, __ATOMIC_RELAXED));
+}
+
+static void watch_setup(void)
+{
+   vfs_set_listener(watch_notify);
+   stats_register(watch_stats, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLOBAL FUNCTIONS
+///////////////////////////////////////////////////////////////////////////////
+void watch_init(void)
+{
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once(&once, watch_setup);
+}
+
+watch_sub_t* watch_sub_new(void)
+{
+   watch_sub_t *sub = calloc(1, sizeof(watch_sub_t));
+   if (!sub)
+      return NULL;
+
+   sub->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (sub->fd < 0) {
+      free(sub);
+      return NULL;
+   }
+   pthread_mutex_init(&sub->lock, NULL);
+   __atomic_add_fetch(&watch_subs, 1, __ATOMIC_RELAXED);
+   return sub;
+}
+
+void watch_sub_free(watch_sub_t *sub)
+{
+   if (!sub)
+      return;
+
+   // remove all watches
+   pthread_rwlock_wrlock(&watch_lock);
+   struct watch *removed = sub->watches;
+   for (struct watch *watch = removed; watch; watch = watch->next_sub)
+      watch_unlink_node(watch);
+   sub->watches = NULL;
+   pthread_rwlock_unlock(&watch_lock);
+
+   while (removed) {
+      struct watch *watch = removed;
+      removed = watch->next_sub;
+      vfs_close(watch->node);
+      free(watch);
+   }
+
+   // drop queued events
+   for (int i = 0; i < sub->len; i++)
+      watch_path_put(sub->queue[(sub->head + i) % WATCH_QUEUE].path);
+
+   __atomic_sub_fetch(&watch_subs, 1, __ATOMIC_RELAXED);
+   close(sub->fd);
+   pthread_mutex_destroy(&sub->lock);
+   free(sub);
+}
+
+int watch_sub_fd(watch_sub_t *sub)
+{
+   return sub->fd;
+}
+
+int watch_add(watch_sub_t *sub, vfsn_t *node, int recursive)
+{
+   int retval = 0;
+   pthread_rwlock_wrlock(&watch_lock);
+
+   struct watch *watch = node->watches;
+   while (watch && watch->sub != sub)
+      watch = watch->next_node;
+
+   if (watch) {
+      // update existing watch
+      watch->recursive = recursive;
+   } else if (vfs_is_deleted(node) || !(watch = malloc(sizeof(struct watch)))) {
+      retval = 1;
+   } else {
+      // the watch keeps the node open
+      watch->sub = sub;
+      watch->node = vfs_open(node);
+      watch->recursive = recursive;
+      watch->next_node = node->watches;
+      node->watches = watch;
+      watch->next_sub = sub->watches;
+      sub->watches = watch;
+      watch_count++;
+   }
+
+   pthread_rwlock_unlock(&watch_lock);
+   return retval;
+}
+
+int watch_remove(watch_sub_t *sub, vfsn_t *node)
+{
+   pthread_rwlock_wrlock(&watch_lock);
+   struct watch *watch = node->watches;
+   while (watch && watch->sub != sub)
+      watch = watch->next_node;
+   if (watch) {
+      watch_unlink_node(watch);
+      watch_unlink_sub(watch);
+   }
+   pthread_rwlock_unlock(&watch_lock);
+
+   if (!watch)
+      return 1;
+   vfs_close(watch->node);
+   free(watch);
+   return 0;
+}
+
+void watch_drain(watch_sub_t *sub, watch_emit_t emit, void *ctx)
+{
+   // reset wakeup before taking the events, so none gets missed
+   uint64_t value;
+   read(sub->fd, &value, sizeof(value));
+
+   struct watch_event events[WATCH_QUEUE];
+   pthread_mutex_lock(&sub->lock);
+   int len = sub->len, overflow = sub->overflow;
+   for (int i = 0; i < len; i++)
+      events[i] = sub->queue[(sub->head + i) % WATCH_QUEUE];
+   sub->head = sub->len = sub->overflow = 0;
+   pthread_mutex_unlock(&sub->lock);
+
+   for (int i = 0; i < len; i++) {
+      emit(ctx, watch_names[events[i].type], events[i].path->str);
+      watch_path_put(events[i].path);
+   }
+   if (overflow)
+      emit(ctx, "overflow", NULL);
+}
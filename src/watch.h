@@ -0,0 +1,58 @@
+/*
+* Copyright (C) 2014 Roger Knecht
+* License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+*/
+#ifndef WATCH
+#define WATCH
+
+#include "vfs.h"
+
+#define WATCH_QUEUE 1024
+
+typedef struct watch_sub watch_sub_t;
+
+/*
+ * Callback receiving a single event of a subscriber. The overflow event has
+ * no path and means that events got lost.
+ */
+typedef void (*watch_emit_t)(void *ctx, const char *event, const char *path);
+
+/*
+ * Installs the vfs listener. Must be called before the first watch, further
+ * calls have no effect.
+ */
+void watch_init(void);
+
+/*
+ * Creates subscriber with an empty event queue. Returns NULL on memory
+ * shortage.
+ */
+watch_sub_t* watch_sub_new(void);
+
+/*
+ * Removes all watches of the subscriber and frees it.
+ */
+void watch_sub_free(watch_sub_t *sub);
+
+/*
+ * Returns file descriptor which becomes readable when events are queued.
+ */
+int watch_sub_fd(watch_sub_t *sub);
+
+/*
+ * Watches node for changes of itself and of its children. With recursive,
+ * changes of all descendants are reported. Returns 0 on success.
+ */
+int watch_add(watch_sub_t *sub, vfsn_t *node, int recursive);
+
+/*
+ * Removes the watch of the subscriber on node. Returns 0 on success.
+ */
+int watch_remove(watch_sub_t *sub, vfsn_t *node);
+
+/*
+ * Reports and removes all queued events of the subscriber via emit.
+ */
+void watch_drain(watch_sub_t *sub, watch_emit_t emit, void *ctx);
+
+#endif